@@ -0,0 +1,33 @@
+// Helpers for the benchmark programs
+// Author: Max Schwarz <max@x-quadraht.de>
+
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#include <chrono>
+
+class Timer
+{
+public:
+    Timer()
+     : m_start(std::chrono::steady_clock::now())
+    {}
+
+    double elapsedSeconds() const
+    {
+        return std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - m_start
+        ).count();
+    }
+private:
+    std::chrono::steady_clock::time_point m_start;
+};
+
+// Keep the compiler from optimizing away benchmark results
+template<class T>
+inline void doNotOptimize(const T& value)
+{
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+#endif
@@ -0,0 +1,149 @@
+// Wire overhead and speed of the COBS envelope variants
+// Author: Max Schwarz <max@x-quadraht.de>
+
+#include <libucomm/cobs_envelope.h>
+#include <libucomm/checksum.h>
+
+#include "benchmark.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vector>
+
+typedef uc::Fletcher16Generator ChecksumGenerator;
+
+class FrameBuffer
+{
+public:
+    uint8_t* dataPointer()
+    { return m_data; }
+
+    size_t dataSize() const
+    { return sizeof(m_data); }
+
+    void packetComplete(size_t n)
+    { m_size = n; }
+
+    const uint8_t* data() const
+    { return m_data; }
+
+    size_t size() const
+    { return m_size; }
+private:
+    uint8_t m_data[4096];
+    size_t m_size = 0;
+};
+
+struct RawMessage
+{
+    enum { MSG_CODE = 1 };
+
+    const std::vector<uint8_t>* payload;
+
+    template<class Writer>
+    bool serialize(Writer* writer) const
+    { return writer->write(payload->data(), payload->size()); }
+};
+
+struct Discard
+{
+    template<class Reader>
+    bool deserialize(Reader*)
+    { return true; }
+};
+
+template<uc::COBSVariant Variant>
+void run(const char* variant, const char* name, const std::vector<uint8_t>& payload)
+{
+    const int ITERATIONS = 20000;
+
+    FrameBuffer buffer;
+    uc::COBSWriter<ChecksumGenerator, FrameBuffer, Variant> writer(&buffer);
+    uc::COBSReader<ChecksumGenerator, 4096, Variant> reader;
+
+    RawMessage msg;
+    msg.payload = &payload;
+
+    Timer encodeTimer;
+    for(int i = 0; i < ITERATIONS; ++i)
+    {
+        writer.send(msg);
+        doNotOptimize(buffer.data()[0]);
+    }
+    double encodeTime = encodeTimer.elapsedSeconds();
+
+    int received = 0;
+    Timer decodeTimer;
+    for(int i = 0; i < ITERATIONS; ++i)
+    {
+        for(size_t j = 0; j < buffer.size(); ++j)
+        {
+            if(reader.take(buffer.data()[j]) == decltype(reader)::NEW_MESSAGE)
+            {
+                Discard discard;
+                reader.read(&discard);
+                received++;
+            }
+        }
+    }
+    double decodeTime = decodeTimer.elapsedSeconds();
+
+    if(received != ITERATIONS)
+        fprintf(stderr, "%s/%s: decoding failed!\n", variant, name);
+
+    // Wire size minus payload, msg code and checksum
+    long overhead = long(buffer.size()) - long(payload.size()) - 1 - sizeof(ChecksumGenerator::SumType);
+
+    printf("%-12s %-8s %8zu %8zu %9ld %11.1f %11.1f\n",
+        name, variant, payload.size(), buffer.size(), overhead,
+        1e9 * encodeTime / ITERATIONS, 1e9 * decodeTime / ITERATIONS
+    );
+}
+
+void runAll(const char* name, const std::vector<uint8_t>& payload)
+{
+    run<uc::COBS_PLAIN>("COBS", name, payload);
+    run<uc::COBS_REDUCED>("COBS/R", name, payload);
+    run<uc::COBS_ZPE>("COBS/ZPE", name, payload);
+}
+
+int main()
+{
+    srand(1);
+
+    // Small integers in uint16_t / uint32_t fields
+    std::vector<uint8_t> ints;
+    for(int i = 0; i < 64; ++i)
+    {
+        uint32_t v32 = rand() % 1000;
+        uint16_t v16 = rand() % 100;
+        ints.insert(ints.end(), (uint8_t*)&v32, (uint8_t*)&v32 + 4);
+        ints.insert(ints.end(), (uint8_t*)&v16, (uint8_t*)&v16 + 2);
+    }
+
+    // Short status message
+    std::vector<uint8_t> status = {0x01, 0x00, 0x10, 0x27, 0x00, 0x00, 0x05, 0x00};
+
+    // Random binary data
+    std::vector<uint8_t> random(384);
+    for(auto& c : random)
+        c = rand();
+
+    // ASCII text (no zeros)
+    const char* text = "servo 3: position 1200, current 0.42 A, temperature 31.5 C; ";
+    std::vector<uint8_t> ascii;
+    while(ascii.size() < 384)
+        ascii.insert(ascii.end(), text, text + strlen(text));
+
+    printf("%-12s %-8s %8s %8s %9s %11s %11s\n",
+        "payload", "variant", "size", "wire", "overhead", "enc ns/msg", "dec ns/msg");
+
+    runAll("integers", ints);
+    runAll("status", status);
+    runAll("random", random);
+    runAll("text", ascii);
+
+    return 0;
+}
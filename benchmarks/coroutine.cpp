@@ -0,0 +1,198 @@
+// Overhead of the coroutine interface compared to the plain take() loop
+// Author: Max Schwarz <max@x-quadraht.de>
+
+#include <libucomm/coroutine.h>
+#include <libucomm/resumable.h>
+#include <libucomm/cobs_envelope.h>
+#include <libucomm/checksum.h>
+
+#include "benchmark.h"
+
+#include <stdio.h>
+
+#include <vector>
+
+typedef uc::Fletcher16Generator ChecksumGenerator;
+
+class ByteSink
+{
+public:
+    uint8_t* dataPointer()
+    { return m_data; }
+
+    size_t dataSize() const
+    { return sizeof(m_data); }
+
+    void packetComplete(size_t n)
+    { bytes.insert(bytes.end(), m_data, m_data + n); }
+
+    std::vector<uint8_t> bytes;
+private:
+    uint8_t m_data[1024];
+};
+
+//! Output which accepts everything and forgets it
+class NullOutput
+{
+public:
+    uint8_t* dataPointer()
+    { return m_data; }
+
+    size_t dataSize() const
+    { return sizeof(m_data); }
+
+    void packetComplete(size_t n)
+    { doNotOptimize(m_data[0]); bytes += n; }
+
+    size_t bytes = 0;
+private:
+    uint8_t m_data[1024];
+};
+
+struct Sample
+{
+    enum { MSG_CODE = 2 };
+
+    uint8_t data[32];
+
+    template<class Writer>
+    bool serialize(Writer* writer) const
+    { return writer->write(data, sizeof(data)); }
+
+    template<class Reader>
+    bool deserialize(Reader* reader)
+    { return reader->read(data, sizeof(data)); }
+};
+
+typedef uc::COBSWriter<ChecksumGenerator, ByteSink> EnvelopeWriter;
+typedef uc::COBSReader<ChecksumGenerator, 1024> EnvelopeReader;
+typedef uc::ResumableCOBSWriter<ChecksumGenerator, NullOutput> Writer;
+
+const int MESSAGES = 100000;
+const int ROUNDS = 20;
+
+uc::Detached receive(uc::AsyncReader<EnvelopeReader>* input, uint64_t* sum)
+{
+    Sample msg;
+    while(true)
+    {
+        auto next = co_await input->nextMessage();
+        if(!next)
+            break;
+
+        if(next.msgCode() == Sample::MSG_CODE && next.read(&msg))
+            *sum += msg.data[0];
+    }
+}
+
+uc::Detached sendAll(uc::AsyncWriter<Writer>* output, const Sample* msg, int count)
+{
+    for(int i = 0; i < count; ++i)
+        co_await output->send(*msg);
+}
+
+int main()
+{
+    ByteSink sink;
+    EnvelopeWriter writer(&sink);
+
+    Sample msg;
+    for(int i = 0; i < MESSAGES; ++i)
+    {
+        for(size_t j = 0; j < sizeof(msg.data); ++j)
+            msg.data[j] = i + j;
+        writer.send(msg);
+    }
+
+    const std::vector<uint8_t>& bytes = sink.bytes;
+    double total = double(MESSAGES) * ROUNDS;
+
+    printf("%d messages of %zu bytes on the wire, %d rounds\n\n",
+        MESSAGES, bytes.size() / MESSAGES, ROUNDS
+    );
+
+    // Receiving
+    double rawTime;
+    {
+        EnvelopeReader reader;
+        uint64_t sum = 0;
+
+        Timer timer;
+        for(int round = 0; round < ROUNDS; ++round)
+        {
+            for(uint8_t c : bytes)
+            {
+                if(reader.take(c) != EnvelopeReader::NEW_MESSAGE)
+                    continue;
+
+                if(reader.msgCode() == Sample::MSG_CODE && reader.read(&msg))
+                    sum += msg.data[0];
+            }
+        }
+        rawTime = timer.elapsedSeconds();
+        doNotOptimize(sum);
+    }
+
+    double coTime;
+    {
+        EnvelopeReader reader;
+        uc::AsyncReader<EnvelopeReader> input(&reader);
+        uint64_t sum = 0;
+
+        receive(&input, &sum);
+
+        // Typical read() chunk size
+        const size_t CHUNK = 4096;
+
+        Timer timer;
+        for(int round = 0; round < ROUNDS; ++round)
+        {
+            for(size_t pos = 0; pos < bytes.size(); pos += CHUNK)
+            {
+                size_t size = std::min(CHUNK, bytes.size() - pos);
+                input.feed(bytes.data() + pos, size);
+            }
+        }
+        coTime = timer.elapsedSeconds();
+        doNotOptimize(sum);
+
+        input.close();
+    }
+
+    printf("receive   take() loop: %7.2f ns/msg\n", 1e9 * rawTime / total);
+    printf("receive   co_await:    %7.2f ns/msg (%+.2f ns)\n",
+        1e9 * coTime / total, 1e9 * (coTime - rawTime) / total
+    );
+
+    // Sending
+    double rawSendTime;
+    {
+        NullOutput output;
+        Writer writer(&output);
+
+        Timer timer;
+        for(int i = 0; i < MESSAGES * ROUNDS; ++i)
+            writer.send(msg);
+        rawSendTime = timer.elapsedSeconds();
+        doNotOptimize(output.bytes);
+    }
+
+    double coSendTime;
+    {
+        NullOutput output;
+        Writer writer(&output);
+        uc::AsyncWriter<Writer> async(&writer);
+
+        Timer timer;
+        sendAll(&async, &msg, MESSAGES * ROUNDS);
+        coSendTime = timer.elapsedSeconds();
+        doNotOptimize(output.bytes);
+    }
+
+    printf("send      send():      %7.2f ns/msg\n", 1e9 * rawSendTime / total);
+    printf("send      co_await:    %7.2f ns/msg (%+.2f ns)\n",
+        1e9 * coSendTime / total, 1e9 * (coSendTime - rawSendTime) / total
+    );
+
+    return 0;
+}
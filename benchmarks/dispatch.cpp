@@ -0,0 +1,101 @@
+// Throughput of the parallel dispatcher with expensive handlers
+// Author: Max Schwarz <max@x-quadraht.de>
+
+#include <libucomm/dispatch.h>
+
+#include "benchmark.h"
+
+#include <stdio.h>
+
+#include <thread>
+
+typedef uc::Dispatcher<256, 1024> Dispatcher;
+
+const uint32_t ENDPOINTS = 64;
+const uint32_t CODES = 4;
+const uint32_t MESSAGES = 200000;
+
+// Handler cost in iterations of the work loop
+const int WORK = 2000;
+
+static uint32_t work(uint32_t seed)
+{
+    uint32_t x = seed;
+    for(int i = 0; i < WORK; ++i)
+        x = x * 1664525 + 1013904223;
+    return x;
+}
+
+static void handle(uint32_t, uint8_t, Dispatcher::Reader* reader, void* userData)
+{
+    uint32_t seq;
+    reader->read(&seq, sizeof(seq));
+
+    uint32_t result = work(seq);
+    doNotOptimize(result);
+
+    reinterpret_cast<std::atomic<uint64_t>*>(userData)->fetch_add(1, std::memory_order_relaxed);
+}
+
+static double runInline()
+{
+    Timer timer;
+    for(uint32_t i = 0; i < MESSAGES; ++i)
+    {
+        uint32_t result = work(i);
+        doNotOptimize(result);
+    }
+    return timer.elapsedSeconds();
+}
+
+static double run(unsigned int threads, uint64_t* steals)
+{
+    std::atomic<uint64_t> handled(0);
+
+    Dispatcher dispatcher(threads, 4096);
+    for(uint8_t c = 0; c < CODES; ++c)
+        dispatcher.setRawHandler(c, &handle, &handled);
+    dispatcher.start();
+
+    Timer timer;
+    for(uint32_t i = 0; i < MESSAGES; ++i)
+    {
+        uint32_t endpoint = i % ENDPOINTS;
+        uint8_t code = (i / ENDPOINTS) % CODES;
+
+        // Receive thread: never block, but do not lose benchmark messages
+        while(!dispatcher.post(endpoint, code, reinterpret_cast<const uint8_t*>(&i), sizeof(i)))
+            std::this_thread::yield();
+    }
+    dispatcher.drain();
+    double time = timer.elapsedSeconds();
+
+    dispatcher.stop();
+    *steals = dispatcher.statistics().steals;
+
+    return time;
+}
+
+int main()
+{
+    unsigned int cores = std::thread::hardware_concurrency();
+    if(cores == 0)
+        cores = 1;
+
+    printf("%u messages, %u keys, %u cores\n\n", MESSAGES, ENDPOINTS * CODES, cores);
+
+    double inlineTime = runInline();
+    printf("inline:      %9.0f msg/s\n", MESSAGES / inlineTime);
+
+    for(unsigned int threads = 1; threads <= 2*cores; threads *= 2)
+    {
+        uint64_t steals;
+        double time = run(threads, &steals);
+
+        printf("%2u threads:  %9.0f msg/s  speedup %5.2f  steals %llu\n",
+            threads, MESSAGES / time, inlineTime / time, (unsigned long long)steals
+        );
+    }
+
+    return 0;
+}
@@ -0,0 +1,243 @@
+// Latency of urgent messages next to bulk transfers on a slow link
+// Author: Max Schwarz <max@x-quadraht.de>
+
+#include <libucomm/multiplex.h>
+#include <libucomm/cobs_envelope.h>
+#include <libucomm/checksum.h>
+
+#include <stdio.h>
+
+#include <deque>
+#include <random>
+#include <vector>
+
+typedef uc::Fletcher16Generator ChecksumGenerator;
+
+// 115200 baud, 8N1
+const double BYTE_TIME = 10.0 / 115200;
+
+const int TICKS = 4000000;
+const size_t CHUNK_SIZE = 2048;
+
+//! Simulated UART: one byte leaves the TX buffer per tick
+class Wire
+{
+public:
+    uint8_t* dataPointer()
+    { return m_data; }
+
+    size_t dataSize() const
+    { return sizeof(m_data); }
+
+    void packetComplete(size_t n)
+    { bytes.insert(bytes.end(), m_data, m_data + n); }
+
+    std::deque<uint8_t> bytes;
+private:
+    uint8_t m_data[4096];
+};
+
+//! Firmware chunk, sent back to back on the bulk channel
+struct Chunk
+{
+    enum { MSG_CODE = 1 };
+
+    uint8_t data[CHUNK_SIZE];
+
+    template<class Writer>
+    bool serialize(Writer* writer) const
+    { return writer->write(data, sizeof(data)); }
+};
+
+//! Emergency stop, 6 bytes
+struct Stop
+{
+    enum { MSG_CODE = 2 };
+
+    uint8_t data[6];
+
+    template<class Writer>
+    bool serialize(Writer* writer) const
+    { return writer->write(data, sizeof(data)); }
+};
+
+struct Discard
+{
+    template<class Reader>
+    bool deserialize(Reader*)
+    { return true; }
+};
+
+Chunk chunk;
+Stop stop;
+
+//! Messages are sent whole, in call order
+class PlainLink
+{
+public:
+    PlainLink()
+     : m_writer(&wire)
+     , m_stopPending(false)
+    {}
+
+    const char* name() const
+    { return "none"; }
+
+    void requestStop()
+    { m_stopPending = true; }
+
+    void refill()
+    {
+        if(m_stopPending)
+        {
+            m_writer.send(stop);
+            m_stopPending = false;
+        }
+        else
+            m_writer.send(chunk);
+    }
+
+    int take(uint8_t c)
+    {
+        if(m_reader.take(c) != decltype(m_reader)::NEW_MESSAGE)
+            return -1;
+
+        return m_reader.msgCode();
+    }
+
+    Wire wire;
+private:
+    uc::COBSWriter<ChecksumGenerator, Wire> m_writer;
+    uc::COBSReader<ChecksumGenerator, CHUNK_SIZE + 16> m_reader;
+    bool m_stopPending;
+};
+
+//! Stop messages on channel 0, chunks on channel 1
+template<int MTU>
+class MultiplexedLink
+{
+public:
+    typedef uc::COBSWriter<ChecksumGenerator, Wire> EnvelopeWriter;
+    typedef uc::COBSReader<ChecksumGenerator, MTU + 8> EnvelopeReader;
+
+    MultiplexedLink()
+     : m_writer(&wire)
+     , m_output(&m_writer)
+    {
+        snprintf(m_name, sizeof(m_name), "MTU %d", MTU);
+
+        m_output.setBuffer(0, m_txStop, sizeof(m_txStop));
+        m_output.setBuffer(1, m_txChunk, sizeof(m_txChunk));
+        m_input.setBuffer(0, m_rxStop, sizeof(m_rxStop));
+        m_input.setBuffer(1, m_rxChunk, sizeof(m_rxChunk));
+    }
+
+    const char* name() const
+    { return m_name; }
+
+    void requestStop()
+    { m_output.send(0, stop); }
+
+    void refill()
+    {
+        if(m_output.queued(1) == 0)
+            m_output.send(1, chunk);
+
+        m_output.poll();
+    }
+
+    int take(uint8_t c)
+    {
+        if(m_input.take(c) != decltype(m_input)::NEW_MESSAGE)
+            return -1;
+
+        return m_input.msgCode();
+    }
+
+    Wire wire;
+private:
+    char m_name[16];
+
+    EnvelopeWriter m_writer;
+    uc::Multiplexer<EnvelopeWriter, 2, MTU> m_output;
+    uc::Demultiplexer<EnvelopeReader, 2> m_input;
+
+    uint8_t m_txStop[64];
+    uint8_t m_txChunk[CHUNK_SIZE + 8];
+    uint8_t m_rxStop[64];
+    uint8_t m_rxChunk[CHUNK_SIZE];
+};
+
+template<class Link>
+void run()
+{
+    static Link link;
+
+    std::mt19937 rng(1);
+
+    int nextStop = 1000;
+    int stopTime = -1;
+
+    int stops = 0;
+    int chunks = 0;
+    double latencySum = 0;
+    int maxLatency = 0;
+
+    for(int now = 0; now < TICKS; ++now)
+    {
+        if(now == nextStop)
+        {
+            link.requestStop();
+            stopTime = now;
+            nextStop = now + 2000 + rng() % 20000;
+        }
+
+        // Refill the UART when it runs empty, so the next fragment is
+        // chosen as late as possible
+        if(link.wire.bytes.empty())
+            link.refill();
+
+        int code = link.take(link.wire.bytes.front());
+        link.wire.bytes.pop_front();
+
+        if(code == Chunk::MSG_CODE)
+            chunks++;
+        else if(code == Stop::MSG_CODE)
+        {
+            int latency = now + 1 - stopTime;
+            latencySum += latency;
+            if(latency > maxLatency)
+                maxLatency = latency;
+            stops++;
+        }
+    }
+
+    double duration = TICKS * BYTE_TIME;
+
+    printf("%-10s %8d %12.2f %12.2f %14.0f\n",
+        link.name(), stops,
+        1e3 * BYTE_TIME * latencySum / stops,
+        1e3 * BYTE_TIME * maxLatency,
+        chunks * CHUNK_SIZE / duration
+    );
+}
+
+int main()
+{
+    for(size_t i = 0; i < sizeof(chunk.data); ++i)
+        chunk.data[i] = i * 7;
+    for(size_t i = 0; i < sizeof(stop.data); ++i)
+        stop.data[i] = i + 1;
+
+    printf("Emergency stop latency next to 2 KiB chunks at 115200 baud\n");
+    printf("%-10s %8s %12s %12s %14s\n",
+        "fragments", "stops", "mean [ms]", "max [ms]", "bulk [byte/s]");
+
+    run<PlainLink>();
+    run<MultiplexedLink<32>>();
+    run<MultiplexedLink<64>>();
+    run<MultiplexedLink<128>>();
+    run<MultiplexedLink<255>>();
+
+    return 0;
+}
@@ -0,0 +1,167 @@
+// Multi-threaded sending: mutex around a COBSWriter vs. TxFunnel
+// Author: Max Schwarz <max@x-quadraht.de>
+
+#include <libucomm/tx_funnel.h>
+#include <libucomm/checksum.h>
+
+#include "benchmark.h"
+
+#include <stdio.h>
+#include <fcntl.h>
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+typedef uc::Fletcher16Generator ChecksumGenerator;
+typedef uc::TxFunnel<ChecksumGenerator, 1024, 128> Funnel;
+
+const uint32_t MESSAGES = 200000;
+
+struct Sample
+{
+    enum { MSG_CODE = 3 };
+
+    uint32_t producer;
+    uint32_t seq;
+    uint8_t data[48];
+
+    template<class Writer>
+    bool serialize(Writer* writer) const
+    {
+        return writer->write(&producer, sizeof(producer))
+            && writer->write(&seq, sizeof(seq))
+            && writer->write(data, sizeof(data));
+    }
+};
+
+//! BufferedWriter writing each frame to the fd (the usual shared output)
+class FdOutput
+{
+public:
+    explicit FdOutput(int fd)
+     : m_fd(fd)
+    {}
+
+    uint8_t* dataPointer()
+    { return m_data; }
+
+    size_t dataSize() const
+    { return sizeof(m_data); }
+
+    void packetComplete(size_t n)
+    {
+        ssize_t ret = write(m_fd, m_data, n);
+        doNotOptimize(ret);
+    }
+private:
+    int m_fd;
+    uint8_t m_data[128];
+};
+
+static Sample makeSample(uint32_t producer, uint32_t seq)
+{
+    Sample msg;
+    msg.producer = producer;
+    msg.seq = seq;
+    for(size_t i = 0; i < sizeof(msg.data); ++i)
+        msg.data[i] = seq + i;
+    return msg;
+}
+
+static double runMutex(int fd, unsigned int producers)
+{
+    FdOutput output(fd);
+    uc::COBSWriter<ChecksumGenerator, FdOutput> writer(&output);
+    std::mutex mutex;
+
+    Timer timer;
+
+    std::vector<std::thread> threads;
+    for(unsigned int p = 0; p < producers; ++p)
+    {
+        threads.emplace_back([&, p]() {
+            for(uint32_t i = 0; i < MESSAGES / producers; ++i)
+            {
+                Sample msg = makeSample(p, i);
+
+                std::lock_guard<std::mutex> lock(mutex);
+                writer.send(msg);
+            }
+        });
+    }
+
+    for(auto& thread : threads)
+        thread.join();
+
+    return timer.elapsedSeconds();
+}
+
+static double runFunnel(int fd, unsigned int producers, uint64_t* full)
+{
+    Funnel funnel;
+    std::atomic<unsigned int> running(producers);
+
+    Timer timer;
+
+    std::thread consumer([&]() {
+        while(running != 0 || funnel.pending())
+        {
+            if(funnel.drain(fd) == 0)
+                std::this_thread::yield();
+        }
+    });
+
+    std::vector<std::thread> threads;
+    for(unsigned int p = 0; p < producers; ++p)
+    {
+        threads.emplace_back([&, p]() {
+            for(uint32_t i = 0; i < MESSAGES / producers; ++i)
+            {
+                Sample msg = makeSample(p, i);
+                while(!funnel.send(msg))
+                    std::this_thread::yield();
+            }
+            running--;
+        });
+    }
+
+    for(auto& thread : threads)
+        thread.join();
+    consumer.join();
+
+    *full = funnel.statistics().full;
+
+    return timer.elapsedSeconds();
+}
+
+int main()
+{
+    int fd = open("/dev/null", O_WRONLY);
+    if(fd < 0)
+    {
+        perror("Could not open /dev/null");
+        return 1;
+    }
+
+    unsigned int cores = std::thread::hardware_concurrency();
+    printf("%u messages to /dev/null, %u cores\n\n", MESSAGES, cores);
+    printf("producers      mutex msg/s     funnel msg/s   ring full\n");
+
+    for(unsigned int producers = 1; producers <= 16; producers *= 2)
+    {
+        double mutexTime = runMutex(fd, producers);
+
+        uint64_t full;
+        double funnelTime = runFunnel(fd, producers, &full);
+
+        printf("%9u   %14.0f   %14.0f   %9llu\n",
+            producers, MESSAGES / mutexTime, MESSAGES / funnelTime,
+            (unsigned long long)full
+        );
+    }
+
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,583 @@
+// Reliable delivery with selective-repeat ARQ
+// Author: Max Schwarz <max@x-quadraht.de>
+
+#ifndef LIBUCOMM_ARQ_H
+#define LIBUCOMM_ARQ_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "util/error.h"
+#include "util/memory_reader.h"
+#include "util/integers.h"
+
+/*
+ * Optional reliability layer between messages and the envelope. Each message
+ * gets a sequence number and is kept in a send window until the peer
+ * acknowledges it. Unacknowledged messages are retransmitted after a timeout.
+ * The receiver buffers out-of-order messages and delivers them in order,
+ * exactly once.
+ *
+ * Every frame carries the acknowledgement state of the opposite direction,
+ * so acks are piggybacked on regular traffic. Standalone ack frames (message
+ * code ACK_CODE) are only sent if there is no traffic for ackDelay.
+ *
+ * Payload header:
+ *
+ *   flags   | 1 byte: bit 0 set for data frames (seq follows)
+ *   seq     | 1 byte: sequence number of this message (data frames only)
+ *   ack     | 1 byte: next expected sequence number (cumulative ack)
+ *   sack    | (Window+7)/8 bytes: bit i acknowledges sequence ack+1+i
+ *
+ * Both ends need to use the same Window and need to be (re)started
+ * together. Time is given in arbitrary ticks by calling update().
+ *
+ * Usage:
+ * @code
+ *   typedef uc::COBSWriter<uc::Fletcher16Generator, MyBuffer> EnvelopeWriter;
+ *   typedef uc::COBSReader<uc::Fletcher16Generator, 128> EnvelopeReader;
+ *   typedef uc::ARQLink<EnvelopeWriter, EnvelopeReader, 8, 64> Link;
+ *   typedef Proto< uc::IO<Link, uc::IO_W> > WProto;
+ *   typedef Proto< uc::IO<Link, uc::IO_R> > RProto;
+ *
+ *   Link link(&envelopeWriter);
+ *   link.update(millis());
+ *   if(link.canSend())
+ *       link.send(msg);
+ *
+ *   if(link.take(c) == Link::NEW_MESSAGE)
+ *   {
+ *       do
+ *           handle(link.msgCode(), ...);
+ *       while(link.next());
+ *   }
+ * @endcode
+ */
+
+namespace uc
+{
+
+//! Statistics of an ARQLink
+struct ARQStatistics
+{
+    uint32_t sent;          //!< Messages sent (without retransmissions)
+    uint32_t retransmitted; //!< Retransmitted frames
+    uint32_t acksSent;      //!< Standalone ack frames
+    uint32_t received;      //!< Messages received (without duplicates)
+    uint32_t duplicates;    //!< Duplicate frames dropped
+};
+
+/**
+ * @brief Selective-repeat ARQ link
+ *
+ * Wraps an envelope writer (not owned) and an envelope reader (owned). The
+ * envelope reader needs to provide the consume() / remaining() reader
+ * interface (e.g. COBSReader, FECReader).
+ *
+ * Up to @a Window messages (a power of two <= 64) of at most
+ * @a MaxPacketSize bytes can be in flight. Send and receive buffers are
+ * statically allocated, 2 * Window * MaxPacketSize bytes in total.
+ **/
+template<class EnvelopeWriterType, class EnvelopeReaderType, int Window = 8, int MaxPacketSize = 128>
+class ARQLink
+{
+public:
+    static_assert(Window >= 1 && Window <= 64 && (Window & (Window - 1)) == 0,
+        "Window must be a power of two <= 64");
+
+    typedef typename IntForSize<MaxPacketSize>::Type SizeType;
+
+    enum
+    {
+        ACK_CODE = 254,   //!< Message code of standalone ack frames
+        FLAG_DATA = 0x01,
+        SACK_BYTES = (Window + 7) / 8
+    };
+
+    typedef MemoryReader Reader;
+
+    //! Possible take() return codes
+    enum TakeResult
+    {
+        NEW_MESSAGE,    //!< New message available, use msgCode() + read()
+        NEED_MORE_DATA, //!< Message not yet finished
+        ENVELOPE_ERROR, //!< Checksum or framing error in the envelope
+        PROTOCOL_ERROR  //!< Malformed ARQ header
+    };
+
+    explicit ARQLink(EnvelopeWriterType* envelope);
+
+    //! Retransmission timeout in ticks (default: 100)
+    inline void setTimeout(uint32_t timeout)
+    { m_timeout = timeout; }
+
+    //! Maximum delay of standalone acks in ticks (default: 0)
+    inline void setAckDelay(uint32_t delay)
+    { m_ackDelay = delay; }
+
+    /**
+     * Advance the time to @a now. Retransmits timed out messages and sends
+     * pending acks. Call this regularly.
+     **/
+    void update(uint32_t now);
+
+    //! Is there space in the send window?
+    inline bool canSend() const
+    { return inFlight() < Window; }
+
+    //! Number of unacknowledged messages
+    inline unsigned int inFlight() const
+    { return uint8_t(m_txNext - m_txBase); }
+
+    /**
+     * @name IO writer interface
+     *
+     * startEnvelope() fails if the send window is full. Once endEnvelope()
+     * succeeded, the message is delivered eventually, even if the envelope
+     * could not send it right away.
+     **/
+    //@{
+    bool startEnvelope(uint8_t msg_code);
+    bool write(const void* data, size_t size);
+    bool endEnvelope();
+    //@}
+
+    template<class MSG>
+    bool send(const MSG& msg)
+    {
+        RETURN_IF_ERROR(startEnvelope(MSG::MSG_CODE));
+        RETURN_IF_ERROR(msg.serialize(this));
+        RETURN_IF_ERROR(endEnvelope());
+
+        return true;
+    }
+
+    template<class MSG>
+    ARQLink& operator<<(const MSG& msg)
+    {
+        send(msg);
+        return *this;
+    }
+
+    /**
+     * Handle a byte of wire data.
+     *
+     * If NEW_MESSAGE is returned, more messages may be ready since a gap in
+     * the sequence was filled. Call next() until it returns false.
+     **/
+    TakeResult take(uint8_t c);
+
+    //! Release the current message, returns true if another one is ready
+    bool next();
+
+    uint8_t msgCode() const
+    { return m_rx[m_rxHead % Window].code; }
+
+    template<class MSG>
+    bool read(MSG* msg)
+    {
+        const RxSlot& slot = m_rx[m_rxHead % Window];
+        Reader reader(slot.data, slot.size);
+        return msg->deserialize(&reader);
+    }
+
+    template<class MSG>
+    ARQLink& operator>>(MSG& msg)
+    {
+        read(&msg);
+        return *this;
+    }
+
+    inline const ARQStatistics& statistics() const
+    { return m_stats; }
+private:
+    struct TxSlot
+    {
+        uint8_t code;
+        uint8_t seq;
+        bool acked;
+        bool fastRetransmitted;
+        uint32_t sentTime;
+        SizeType size;
+        uint8_t data[MaxPacketSize];
+    };
+
+    struct RxSlot
+    {
+        bool valid;
+        uint8_t code;
+        uint8_t seq;
+        SizeType size;
+        uint8_t data[MaxPacketSize];
+    };
+
+    // Extracts the frame from the envelope reader
+    class Frame
+    {
+    public:
+        explicit Frame(ARQLink* link)
+         : m_link(link)
+        {}
+
+        template<class EnvReader>
+        bool deserialize(EnvReader* input);
+    private:
+        ARQLink* m_link;
+    };
+
+    bool transmit(TxSlot* slot);
+    bool writeHeader(uint8_t flags, uint8_t seq);
+    void sendAck();
+
+    void handleAck(uint8_t ack, const uint8_t* sack);
+    bool handleData(uint8_t seq, uint8_t code, const uint8_t* data, size_t size);
+    void advance();
+    bool ready();
+    void release();
+
+    EnvelopeWriterType* m_envelope;
+    EnvelopeReaderType m_envReader;
+    ARQStatistics m_stats;
+
+    uint32_t m_now;
+    uint32_t m_timeout;
+    uint32_t m_ackDelay;
+
+    // Send window [m_txBase, m_txNext)
+    TxSlot m_tx[Window];
+    uint8_t m_txBase;
+    uint8_t m_txNext;
+
+    // Receive window: [m_rxHead, m_rxExpected) is ready for delivery,
+    // buffered out-of-order messages follow
+    RxSlot m_rx[Window];
+    uint8_t m_rxHead;
+    uint8_t m_rxExpected;
+    bool m_delivering;
+
+    bool m_ackPending;
+    uint32_t m_ackTime;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// IMPLEMENTATION
+
+template<class EnvelopeWriterType, class EnvelopeReaderType, int Window, int MaxPacketSize>
+ARQLink<EnvelopeWriterType, EnvelopeReaderType, Window, MaxPacketSize>::ARQLink(EnvelopeWriterType* envelope)
+ : m_envelope(envelope)
+ , m_now(0)
+ , m_timeout(100)
+ , m_ackDelay(0)
+ , m_txBase(0)
+ , m_txNext(0)
+ , m_rxHead(0)
+ , m_rxExpected(0)
+ , m_delivering(false)
+ , m_ackPending(false)
+ , m_ackTime(0)
+{
+    memset(&m_stats, 0, sizeof(m_stats));
+
+    for(int i = 0; i < Window; ++i)
+        m_rx[i].valid = false;
+}
+
+template<class EnvelopeWriterType, class EnvelopeReaderType, int Window, int MaxPacketSize>
+void ARQLink<EnvelopeWriterType, EnvelopeReaderType, Window, MaxPacketSize>::update(uint32_t now)
+{
+    m_now = now;
+
+    for(uint8_t seq = m_txBase; seq != m_txNext; ++seq)
+    {
+        TxSlot* slot = &m_tx[seq % Window];
+        if(slot->acked || now - slot->sentTime < m_timeout)
+            continue;
+
+        transmit(slot);
+        m_stats.retransmitted++;
+    }
+
+    if(m_ackPending && now - m_ackTime >= m_ackDelay)
+        sendAck();
+}
+
+template<class EnvelopeWriterType, class EnvelopeReaderType, int Window, int MaxPacketSize>
+bool ARQLink<EnvelopeWriterType, EnvelopeReaderType, Window, MaxPacketSize>::startEnvelope(uint8_t msg_code)
+{
+    if(!canSend() || msg_code >= ACK_CODE)
+        return false;
+
+    TxSlot* slot = &m_tx[m_txNext % Window];
+    slot->code = msg_code;
+    slot->size = 0;
+
+    return true;
+}
+
+template<class EnvelopeWriterType, class EnvelopeReaderType, int Window, int MaxPacketSize>
+bool ARQLink<EnvelopeWriterType, EnvelopeReaderType, Window, MaxPacketSize>::write(const void* data, size_t size)
+{
+    TxSlot* slot = &m_tx[m_txNext % Window];
+
+    if(size_t(MaxPacketSize - slot->size) < size)
+        return false;
+
+    memcpy(slot->data + slot->size, data, size);
+    slot->size += size;
+
+    return true;
+}
+
+template<class EnvelopeWriterType, class EnvelopeReaderType, int Window, int MaxPacketSize>
+bool ARQLink<EnvelopeWriterType, EnvelopeReaderType, Window, MaxPacketSize>::endEnvelope()
+{
+    TxSlot* slot = &m_tx[m_txNext % Window];
+    slot->seq = m_txNext;
+    slot->acked = false;
+    slot->fastRetransmitted = false;
+
+    m_txNext++;
+    m_stats.sent++;
+
+    // If this fails, the retransmission timer takes care of it
+    transmit(slot);
+
+    return true;
+}
+
+template<class EnvelopeWriterType, class EnvelopeReaderType, int Window, int MaxPacketSize>
+typename ARQLink<EnvelopeWriterType, EnvelopeReaderType, Window, MaxPacketSize>::TakeResult
+ARQLink<EnvelopeWriterType, EnvelopeReaderType, Window, MaxPacketSize>::take(uint8_t c)
+{
+    // The last delivered message has been handled
+    release();
+
+    typename EnvelopeReaderType::TakeResult ret = m_envReader.take(c);
+
+    if(ret == EnvelopeReaderType::NEED_MORE_DATA)
+        return ready() ? NEW_MESSAGE : NEED_MORE_DATA;
+
+    if(ret != EnvelopeReaderType::NEW_MESSAGE)
+        return ready() ? NEW_MESSAGE : ENVELOPE_ERROR;
+
+    Frame frame(this);
+    if(!m_envReader.read(&frame))
+        return ready() ? NEW_MESSAGE : PROTOCOL_ERROR;
+
+    return ready() ? NEW_MESSAGE : NEED_MORE_DATA;
+}
+
+template<class EnvelopeWriterType, class EnvelopeReaderType, int Window, int MaxPacketSize>
+bool ARQLink<EnvelopeWriterType, EnvelopeReaderType, Window, MaxPacketSize>::next()
+{
+    release();
+    return ready();
+}
+
+template<class EnvelopeWriterType, class EnvelopeReaderType, int Window, int MaxPacketSize>
+bool ARQLink<EnvelopeWriterType, EnvelopeReaderType, Window, MaxPacketSize>::transmit(TxSlot* slot)
+{
+    slot->sentTime = m_now;
+
+    RETURN_IF_ERROR(m_envelope->startEnvelope(slot->code));
+    RETURN_IF_ERROR(writeHeader(FLAG_DATA, slot->seq));
+    RETURN_IF_ERROR(m_envelope->write(slot->data, slot->size));
+    RETURN_IF_ERROR(m_envelope->endEnvelope());
+
+    // The ack went out with the data
+    m_ackPending = false;
+
+    return true;
+}
+
+template<class EnvelopeWriterType, class EnvelopeReaderType, int Window, int MaxPacketSize>
+bool ARQLink<EnvelopeWriterType, EnvelopeReaderType, Window, MaxPacketSize>::writeHeader(uint8_t flags, uint8_t seq)
+{
+    uint8_t header[3 + SACK_BYTES] = {};
+    size_t size = 0;
+
+    header[size++] = flags;
+    if(flags & FLAG_DATA)
+        header[size++] = seq;
+    header[size++] = m_rxExpected;
+
+    // Selective acks for buffered out-of-order messages
+    uint8_t* sack = header + size;
+    for(int i = 0; i < Window; ++i)
+    {
+        uint8_t s = m_rxExpected + 1 + i;
+        if(uint8_t(s - m_rxHead) >= Window)
+            break;
+
+        const RxSlot& slot = m_rx[s % Window];
+        if(slot.valid && slot.seq == s)
+            sack[i / 8] |= (1 << (i % 8));
+    }
+    size += SACK_BYTES;
+
+    return m_envelope->write(header, size);
+}
+
+template<class EnvelopeWriterType, class EnvelopeReaderType, int Window, int MaxPacketSize>
+void ARQLink<EnvelopeWriterType, EnvelopeReaderType, Window, MaxPacketSize>::sendAck()
+{
+    if(!m_envelope->startEnvelope(ACK_CODE))
+        return;
+    if(!writeHeader(0, 0))
+        return;
+    if(!m_envelope->endEnvelope())
+        return;
+
+    m_ackPending = false;
+    m_stats.acksSent++;
+}
+
+template<class EnvelopeWriterType, class EnvelopeReaderType, int Window, int MaxPacketSize>
+template<class EnvReader>
+bool ARQLink<EnvelopeWriterType, EnvelopeReaderType, Window, MaxPacketSize>::Frame::deserialize(EnvReader* input)
+{
+    uint8_t flags;
+    RETURN_IF_ERROR(input->read(&flags, 1));
+
+    uint8_t seq = 0;
+    if(flags & FLAG_DATA)
+        RETURN_IF_ERROR(input->read(&seq, 1));
+
+    uint8_t ack;
+    uint8_t sack[SACK_BYTES];
+    RETURN_IF_ERROR(input->read(&ack, 1));
+    RETURN_IF_ERROR(input->read(sack, SACK_BYTES));
+
+    m_link->handleAck(ack, sack);
+
+    uint8_t code = m_link->m_envReader.msgCode();
+    if(!(flags & FLAG_DATA))
+        return code == ACK_CODE;
+
+    if(code == ACK_CODE)
+        return false;
+
+    size_t size = input->remaining();
+    const uint8_t* data = input->consume(size);
+    if(!data)
+        return false;
+
+    return m_link->handleData(seq, code, data, size);
+}
+
+template<class EnvelopeWriterType, class EnvelopeReaderType, int Window, int MaxPacketSize>
+void ARQLink<EnvelopeWriterType, EnvelopeReaderType, Window, MaxPacketSize>::handleAck(uint8_t ack, const uint8_t* sack)
+{
+    uint8_t outstanding = m_txNext - m_txBase;
+    uint8_t acked = ack - m_txBase;
+
+    // Stale ack from before the current window
+    if(acked > outstanding)
+        return;
+
+    for(uint8_t i = 0; i < acked; ++i)
+        m_tx[(m_txBase + i) % Window].acked = true;
+
+    // Selective acks. Frames before the last selectively acknowledged one
+    // were probably lost, retransmit them once without waiting for the
+    // timeout.
+    int last = -1;
+    for(int i = 0; i < Window; ++i)
+    {
+        if(!(sack[i / 8] & (1 << (i % 8))))
+            continue;
+
+        uint8_t seq = ack + 1 + i;
+        if(uint8_t(seq - m_txBase) >= outstanding)
+            break;
+
+        m_tx[seq % Window].acked = true;
+        last = i;
+    }
+
+    for(int i = -1; i < last; ++i)
+    {
+        TxSlot* slot = &m_tx[uint8_t(ack + 1 + i) % Window];
+        if(slot->acked || slot->fastRetransmitted)
+            continue;
+
+        slot->fastRetransmitted = true;
+        transmit(slot);
+        m_stats.retransmitted++;
+    }
+
+    while(m_txBase != m_txNext && m_tx[m_txBase % Window].acked)
+        m_txBase++;
+}
+
+template<class EnvelopeWriterType, class EnvelopeReaderType, int Window, int MaxPacketSize>
+bool ARQLink<EnvelopeWriterType, EnvelopeReaderType, Window, MaxPacketSize>::handleData(uint8_t seq, uint8_t code, const uint8_t* data, size_t size)
+{
+    if(!m_ackPending)
+    {
+        m_ackPending = true;
+        m_ackTime = m_now;
+    }
+
+    RxSlot* slot = &m_rx[seq % Window];
+
+    // Old duplicates (our ack was lost) and frames we already have are
+    // acknowledged again, but not delivered
+    if(uint8_t(seq - m_rxHead) >= Window || (slot->valid && slot->seq == seq))
+    {
+        m_stats.duplicates++;
+        return true;
+    }
+
+    if(size > MaxPacketSize)
+        return false;
+
+    slot->valid = true;
+    slot->code = code;
+    slot->seq = seq;
+    slot->size = size;
+    memcpy(slot->data, data, size);
+
+    m_stats.received++;
+    advance();
+
+    return true;
+}
+
+template<class EnvelopeWriterType, class EnvelopeReaderType, int Window, int MaxPacketSize>
+void ARQLink<EnvelopeWriterType, EnvelopeReaderType, Window, MaxPacketSize>::advance()
+{
+    while(uint8_t(m_rxExpected - m_rxHead) < Window)
+    {
+        const RxSlot& slot = m_rx[m_rxExpected % Window];
+        if(!slot.valid || slot.seq != m_rxExpected)
+            break;
+
+        m_rxExpected++;
+    }
+}
+
+template<class EnvelopeWriterType, class EnvelopeReaderType, int Window, int MaxPacketSize>
+bool ARQLink<EnvelopeWriterType, EnvelopeReaderType, Window, MaxPacketSize>::ready()
+{
+    m_delivering = (m_rxHead != m_rxExpected);
+    return m_delivering;
+}
+
+template<class EnvelopeWriterType, class EnvelopeReaderType, int Window, int MaxPacketSize>
+void ARQLink<EnvelopeWriterType, EnvelopeReaderType, Window, MaxPacketSize>::release()
+{
+    if(!m_delivering)
+        return;
+
+    m_rx[m_rxHead % Window].valid = false;
+    m_rxHead++;
+    m_delivering = false;
+
+    advance();
+}
+
+}
+
+#endif
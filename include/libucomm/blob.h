@@ -0,0 +1,213 @@
+// Length-prefixed strings and byte blobs
+// Author: Max Schwarz <max@x-quadraht.de>
+
+#ifndef LIBUCOMM_BLOB_H
+#define LIBUCOMM_BLOB_H
+
+#include <string_view>
+
+#include <stdint.h>
+#include <stddef.h>
+
+#if __has_include(<span>)
+#include <span>
+#endif
+
+#include "io.h"
+#include "util/integers.h"
+#include "util/enable_if.h"
+#include "util/error.h"
+#include "util/byteorder.h"
+
+namespace uc
+{
+
+//! Read-only view on a byte range (std::span is not available before C++20)
+class ByteView
+{
+public:
+    ByteView()
+     : m_data(0), m_size(0)
+    {}
+
+    ByteView(const uint8_t* data, size_t size)
+     : m_data(data), m_size(size)
+    {}
+
+    template<size_t N>
+    ByteView(const uint8_t (&data)[N])
+     : m_data(data), m_size(N)
+    {}
+
+    inline const uint8_t* data() const
+    { return m_data; }
+
+    inline size_t size() const
+    { return m_size; }
+
+    inline bool empty() const
+    { return m_size == 0; }
+
+    inline const uint8_t* begin() const
+    { return m_data; }
+
+    inline const uint8_t* end() const
+    { return m_data + m_size; }
+
+    inline uint8_t operator[](size_t i) const
+    { return m_data[i]; }
+private:
+    const uint8_t* m_data;
+    size_t m_size;
+};
+
+template<class Char>
+struct BlobTraits;
+
+template<>
+struct BlobTraits<char>
+{
+    typedef std::string_view View;
+};
+
+template<>
+struct BlobTraits<uint8_t>
+{
+#if defined(__cpp_lib_span)
+    typedef std::span<const uint8_t> View;
+#else
+    typedef ByteView View;
+#endif
+};
+
+/**
+ * @brief Length-prefixed string or byte blob
+ *
+ * @a Size is the maximum length in bytes. Like for List, the length is
+ * transmitted in front of the data using the smallest integer type able to
+ * hold @a Size.
+ *
+ * On the sending side, the data is passed to the envelope with a single
+ * write() call. On the receiving side, no copy is made: view() points directly
+ * into the receive buffer of the envelope reader. It stays valid until the
+ * envelope reader is fed with the next byte. The Reader type of the envelope
+ * has to provide a consume(size) method for this.
+ *
+ * Use the String and Bytes aliases below.
+ **/
+template<class IOI, class Char, int Size=255, class Enable=void>
+class Blob
+{
+public:
+    typedef typename IntForSize<Size>::Type SizeType;
+    typedef typename BlobTraits<Char>::View View;
+    enum { MAX_SIZE = Size };
+
+    View view() const;
+    const Char* data() const;
+    SizeType size() const;
+    void set(const Char* data, size_t size);
+    void set(View view);
+};
+
+template<class IOI, class Char, int Size>
+class Blob<IOI, Char, Size, typename enable_if<IOI::IO::Mode::IsReadable>::Type >
+{
+public:
+    typedef typename IntForSize<Size>::Type SizeType;
+    typedef typename BlobTraits<Char>::View View;
+    enum { MAX_SIZE = Size };
+
+    Blob()
+     : m_data(0)
+     , m_size(0)
+    {}
+
+    bool deserialize(typename IOI::IO::Reader* reader)
+    {
+        RETURN_IF_ERROR(reader->read(&m_size, sizeof(m_size)));
+        m_size = fromWire<IOI::WireOrder>(m_size);
+
+        if(m_size > Size)
+        {
+            m_size = 0;
+            return false;
+        }
+
+        const uint8_t* data = reader->consume(m_size);
+        if(!data)
+        {
+            m_size = 0;
+            return false;
+        }
+
+        m_data = reinterpret_cast<const Char*>(data);
+        return true;
+    }
+
+    inline View view() const
+    { return View(m_data, m_size); }
+
+    inline const Char* data() const
+    { return m_data; }
+
+    inline SizeType size() const
+    { return m_size; }
+private:
+    const Char* m_data;
+    SizeType m_size;
+};
+
+template<class IOI, class Char, int Size>
+class Blob<IOI, Char, Size, typename enable_if<IOI::IO::Mode::IsWritable>::Type >
+{
+public:
+    typedef typename IntForSize<Size>::Type SizeType;
+    typedef typename BlobTraits<Char>::View View;
+    enum { MAX_SIZE = Size };
+
+    Blob()
+     : m_data(0)
+     , m_size(0)
+    {}
+
+    /**
+     * Set the data to be sent. The data is not copied, so it needs to stay
+     * valid until the message has been serialized.
+     **/
+    inline void set(const Char* data, size_t size)
+    {
+        m_data = data;
+        m_size = size;
+    }
+
+    inline void set(View view)
+    { set(view.data(), view.size()); }
+
+    inline View view() const
+    { return View(m_data, m_size); }
+
+    inline bool serialize(typename IOI::IO::Handler* writer) const
+    {
+        if(m_size > Size)
+            return false;
+
+        SizeType size = toWire<IOI::WireOrder>(SizeType(m_size));
+        RETURN_IF_ERROR(writer->write(&size, sizeof(size)));
+
+        return writer->write(m_data, m_size);
+    }
+private:
+    const Char* m_data;
+    size_t m_size;
+};
+
+template<class IOI, int Size=255>
+using String = Blob<IOI, char, Size>;
+
+template<class IOI, int Size=255>
+using Bytes = Blob<IOI, uint8_t, Size>;
+
+}
+
+#endif
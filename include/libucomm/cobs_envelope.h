@@ -12,17 +12,39 @@
 #include "writer.h"
 #include "util/error.h"
 #include "util/integers.h"
+#include "util/byteorder.h"
 
 /*
  * This envelope format uses the COBS algorithm for byte stuffing. See
  * Cheshire, Stuart, and Mary Baker. "Consistent overhead byte stuffing."
  * IEEE/ACM Transactions on Networking (TON) 7.2 (1999): 159-172.
  *
+ * Two variants from the same paper / later work are available:
+ *
+ * COBS/R (reduced): If the last data byte of the packet is greater than or
+ *   equal to the code byte of the final block, it replaces the code byte.
+ *   This saves one byte for about half of the packets.
+ *
+ * COBS/ZPE (zero pair elimination): Code bytes
+ *     0x01 - 0xDF  n-1 data bytes followed by a zero
+ *     0xE0         223 data bytes without a zero
+ *     0xE1 - 0xFF  n-0xE1 data bytes followed by two zeros
+ *   Pairs of zeros (e.g. in the high bytes of small integers) only cost a
+ *   single code byte.
+ *
+ * The variants are not compatible on the wire.
  */
 
 namespace uc
 {
 
+enum COBSVariant
+{
+    COBS_PLAIN,   //!< Plain COBS
+    COBS_REDUCED, //!< COBS/R
+    COBS_ZPE      //!< COBS/ZPE
+};
+
 /**
  * @brief COBS envelope writer
  *
@@ -34,7 +56,7 @@ namespace uc
  * COBS needs to modify the COBS code bytes after the payload bytes have been
  * processed.
  **/
-template<class ChecksumGenerator, class WriterType = BufferedWriter>
+template<class ChecksumGenerator, class WriterType = BufferedWriter, COBSVariant Variant = COBS_PLAIN>
 class COBSWriter
 {
 public:
@@ -66,7 +88,7 @@ public:
      * @note For more options & error checking, use send().
      **/
     template<class MSG>
-    COBSWriter<ChecksumGenerator, WriterType>& operator<< (const MSG& msg);
+    COBSWriter& operator<< (const MSG& msg);
 
     /**
      * @brief Write message
@@ -88,15 +110,19 @@ private:
     //! Finish the current COBS block
     bool finishBlock(uint8_t code);
 
+    //! Finish the last COBS block of the packet
+    bool finishPacket();
+
     WriterType* m_writer;
     ChecksumGenerator m_checksum;
     uint8_t m_code;
+    bool m_pendingZero;
     uint8_t* m_codePtr;
     uint8_t* m_dstPtr;
     uint8_t* m_dstEnd;
 };
 
-template<class ChecksumGenerator, int MaxPacketSize>
+template<class ChecksumGenerator, int MaxPacketSize, COBSVariant Variant = COBS_PLAIN>
 class COBSReader
 {
 public:
@@ -111,6 +137,16 @@ public:
         // Implement IO::Reader interface
         bool read(void* data, size_t size);
         bool skip(size_t size);
+
+        /**
+         * Skip @a size bytes and return a pointer to them inside the receive
+         * buffer (or 0 if not enough data is available). The data is valid
+         * until the next call to COBSReader::take().
+         **/
+        const uint8_t* consume(size_t size);
+
+        //! Number of unread payload bytes
+        size_t remaining() const;
     private:
         COBSReader* m_envReader;
         SizeType m_idx;
@@ -149,7 +185,7 @@ public:
      * @note Better use read() and check the return value.
      **/
     template<class MSG>
-    COBSReader<ChecksumGenerator, MaxPacketSize>& operator>>(MSG& msg)
+    COBSReader& operator>>(MSG& msg)
     {
         Reader reader = makeReader();
         msg.deserialize(&reader);
@@ -180,8 +216,18 @@ private:
     inline Reader makeReader()
     { return Reader(this); }
 
-    //! Check if decoded data is a complete & valid packet
-    TakeResult finish();
+    /**
+     * Check if decoded data is a complete & valid packet
+     *
+     * @param trailingZero Remove the zero introduced by COBS at the end
+     **/
+    TakeResult finish(bool trailingZero = true);
+
+    //! Start a new COBS block with code @a c
+    bool startBlock(uint8_t c);
+
+    //! Append @a count zeros to the buffer
+    bool appendZeros(uint8_t count);
 
     uint8_t m_state;
     uint8_t m_msgCode;
@@ -189,21 +235,38 @@ private:
     SizeType m_idx;
     uint8_t m_cobsCode;
     uint8_t m_cobsLength;
+    uint8_t m_cobsZeros;
 
     ChecksumGenerator m_generator;
 };
 
+//! COBS/R envelope writer (see top of file)
+template<class ChecksumGenerator, class WriterType = BufferedWriter>
+using COBSRWriter = COBSWriter<ChecksumGenerator, WriterType, COBS_REDUCED>;
+
+//! COBS/R envelope reader (see top of file)
+template<class ChecksumGenerator, int MaxPacketSize>
+using COBSRReader = COBSReader<ChecksumGenerator, MaxPacketSize, COBS_REDUCED>;
+
+//! COBS/ZPE envelope writer (see top of file)
+template<class ChecksumGenerator, class WriterType = BufferedWriter>
+using COBSZPEWriter = COBSWriter<ChecksumGenerator, WriterType, COBS_ZPE>;
+
+//! COBS/ZPE envelope reader (see top of file)
+template<class ChecksumGenerator, int MaxPacketSize>
+using COBSZPEReader = COBSReader<ChecksumGenerator, MaxPacketSize, COBS_ZPE>;
+
 ////////////////////////////////////////////////////////////////////////////////
 // IMPLEMENTATION
 
-template<class ChecksumGenerator, class WriterType>
-COBSWriter<ChecksumGenerator, WriterType>::COBSWriter(WriterType* writer)
+template<class ChecksumGenerator, class WriterType, COBSVariant Variant>
+COBSWriter<ChecksumGenerator, WriterType, Variant>::COBSWriter(WriterType* writer)
  : m_writer(writer)
 {
 }
 
-template<class ChecksumGenerator, class WriterType>
-bool COBSWriter<ChecksumGenerator, WriterType>::startEnvelope(uint8_t msg_code)
+template<class ChecksumGenerator, class WriterType, COBSVariant Variant>
+bool COBSWriter<ChecksumGenerator, WriterType, Variant>::startEnvelope(uint8_t msg_code)
 {
     m_dstPtr = m_writer->dataPointer();
     m_dstEnd = m_dstPtr + m_writer->dataSize();
@@ -222,6 +285,7 @@ bool COBSWriter<ChecksumGenerator, WriterType>::startEnvelope(uint8_t msg_code)
 
     // Init COBS (if we get a zero, this is the first code)
     m_code = 0x01;
+    m_pendingZero = false;
 
     // Reserve a byte for the code
     m_codePtr = m_dstPtr++;
@@ -229,46 +293,85 @@ bool COBSWriter<ChecksumGenerator, WriterType>::startEnvelope(uint8_t msg_code)
     return true;
 }
 
-template<class ChecksumGenerator, class WriterType>
-bool COBSWriter<ChecksumGenerator, WriterType>::write(const void* data, size_t size)
+template<class ChecksumGenerator, class WriterType, COBSVariant Variant>
+bool COBSWriter<ChecksumGenerator, WriterType, Variant>::write(const void* data, size_t size)
 {
     const uint8_t* ptr = reinterpret_cast<const uint8_t*>(data);
     const uint8_t* end = ptr + size;
 
-    while(ptr != end)
+    if constexpr(Variant == COBS_ZPE)
     {
-        if(*ptr == 0x00)
+        while(ptr != end)
         {
-            m_checksum.add(0x00);
-            RETURN_IF_ERROR(finishBlock(m_code));
+            if(m_pendingZero)
+            {
+                m_pendingZero = false;
+
+                if(*ptr == 0x00)
+                {
+                    // Zero pair: 0xE1 + number of data bytes
+                    m_checksum.add(0x00);
+                    RETURN_IF_ERROR(finishBlock(0xE0 + m_code));
+                    ptr++;
+                    continue;
+                }
+
+                RETURN_IF_ERROR(finishBlock(m_code));
+            }
+
+            if(*ptr == 0x00)
+            {
+                m_checksum.add(0x00);
+
+                // Wait for a second zero if the block is short enough
+                if(m_code <= 31)
+                    m_pendingZero = true;
+                else
+                    RETURN_IF_ERROR(finishBlock(m_code));
+            }
+            else
+            {
+                RETURN_IF_ERROR(writeAndChecksum(*ptr));
+                if(++m_code == 0xE0)
+                    RETURN_IF_ERROR(finishBlock(m_code));
+            }
+
+            ptr++;
         }
-        else
+    }
+    else
+    {
+        while(ptr != end)
         {
-            RETURN_IF_ERROR(writeAndChecksum(*ptr));
-            if(++m_code == 0xFF)
+            if(*ptr == 0x00)
+            {
+                m_checksum.add(0x00);
                 RETURN_IF_ERROR(finishBlock(m_code));
-        }
+            }
+            else
+            {
+                RETURN_IF_ERROR(writeAndChecksum(*ptr));
+                if(++m_code == 0xFF)
+                    RETURN_IF_ERROR(finishBlock(m_code));
+            }
 
-        ptr++;
+            ptr++;
+        }
     }
 
     return true;
 }
 
-template<class ChecksumGenerator, class WriterType>
-bool COBSWriter<ChecksumGenerator, WriterType>::endEnvelope(bool terminate)
+template<class ChecksumGenerator, class WriterType, COBSVariant Variant>
+bool COBSWriter<ChecksumGenerator, WriterType, Variant>::endEnvelope(bool terminate)
 {
-    typename ChecksumGenerator::SumType sum = m_checksum.value();
+    // The checksum is always transmitted in little endian byte order
+    typename ChecksumGenerator::SumType sum = toWire<BYTE_ORDER_LITTLE>(m_checksum.value());
 
     // Write the checksum
     RETURN_IF_ERROR(write(&sum, sizeof(sum)));
 
-    // Finish the last COBS block
-    RETURN_IF_ERROR(finishBlock(m_code));
-
-    // m_dstPtr points now past the last data byte plus an empty space
-    // where the next COBS code would be.
-    m_dstPtr--;
+    RETURN_IF_ERROR(finishPacket());
 
     // Append a zero (this starts the receive handler immediately)
     if(terminate)
@@ -283,18 +386,18 @@ bool COBSWriter<ChecksumGenerator, WriterType>::endEnvelope(bool terminate)
     return true;
 }
 
-template<class ChecksumGenerator, class WriterType>
+template<class ChecksumGenerator, class WriterType, COBSVariant Variant>
 template<class MSG>
-COBSWriter<ChecksumGenerator, WriterType>&
-COBSWriter<ChecksumGenerator, WriterType>::operator<<(const MSG& msg)
+COBSWriter<ChecksumGenerator, WriterType, Variant>&
+COBSWriter<ChecksumGenerator, WriterType, Variant>::operator<<(const MSG& msg)
 {
     send(msg);
     return *this;
 }
 
-template<class ChecksumGenerator, class WriterType>
+template<class ChecksumGenerator, class WriterType, COBSVariant Variant>
 template<class MSG>
-bool COBSWriter<ChecksumGenerator, WriterType>::send(const MSG& msg, bool terminate)
+bool COBSWriter<ChecksumGenerator, WriterType, Variant>::send(const MSG& msg, bool terminate)
 {
     RETURN_IF_ERROR(startEnvelope(MSG::MSG_CODE));
     RETURN_IF_ERROR(msg.serialize(this));
@@ -303,8 +406,8 @@ bool COBSWriter<ChecksumGenerator, WriterType>::send(const MSG& msg, bool termin
     return true;
 }
 
-template<class ChecksumGenerator, class WriterType>
-bool COBSWriter<ChecksumGenerator, WriterType>::writeAndChecksum(uint8_t c)
+template<class ChecksumGenerator, class WriterType, COBSVariant Variant>
+bool COBSWriter<ChecksumGenerator, WriterType, Variant>::writeAndChecksum(uint8_t c)
 {
     m_checksum.add(c);
 
@@ -315,8 +418,8 @@ bool COBSWriter<ChecksumGenerator, WriterType>::writeAndChecksum(uint8_t c)
     return true;
 }
 
-template<class ChecksumGenerator, class WriterType>
-bool COBSWriter<ChecksumGenerator, WriterType>::finishBlock(uint8_t code)
+template<class ChecksumGenerator, class WriterType, COBSVariant Variant>
+bool COBSWriter<ChecksumGenerator, WriterType, Variant>::finishBlock(uint8_t code)
 {
     *m_codePtr = code;
 
@@ -329,23 +432,66 @@ bool COBSWriter<ChecksumGenerator, WriterType>::finishBlock(uint8_t code)
     return true;
 }
 
+template<class ChecksumGenerator, class WriterType, COBSVariant Variant>
+bool COBSWriter<ChecksumGenerator, WriterType, Variant>::finishPacket()
+{
+    // The block is finished with the implicit zero at the end of the packet,
+    // which is removed by the receiver.
+
+    if constexpr(Variant == COBS_REDUCED)
+    {
+        // If the last data byte is at least as large as the code, it can
+        // replace the code byte. The receiver notices the early end of the
+        // block.
+        if(m_code > 1 && m_dstPtr[-1] >= m_code)
+        {
+            *m_codePtr = m_dstPtr[-1];
+            m_dstPtr--;
+            return true;
+        }
+    }
+
+    if constexpr(Variant == COBS_ZPE)
+    {
+        // A pending zero plus the implicit zero form a zero pair
+        if(m_pendingZero)
+        {
+            m_pendingZero = false;
+            RETURN_IF_ERROR(finishBlock(0xE0 + m_code));
+            m_dstPtr--;
+            return true;
+        }
+    }
+
+    RETURN_IF_ERROR(finishBlock(m_code));
+
+    // m_dstPtr points now past the last data byte plus an empty space
+    // where the next COBS code would be.
+    m_dstPtr--;
+
+    return true;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
-template<class ChecksumGenerator, int MaxPacketSize>
-COBSReader<ChecksumGenerator, MaxPacketSize>::Reader::Reader()
+template<class ChecksumGenerator, int MaxPacketSize, COBSVariant Variant>
+COBSReader<ChecksumGenerator, MaxPacketSize, Variant>::Reader::Reader()
 {
 }
 
-template<class ChecksumGenerator, int MaxPacketSize>
-COBSReader<ChecksumGenerator, MaxPacketSize>::Reader::Reader(COBSReader* envReader)
+template<class ChecksumGenerator, int MaxPacketSize, COBSVariant Variant>
+COBSReader<ChecksumGenerator, MaxPacketSize, Variant>::Reader::Reader(COBSReader* envReader)
  : m_envReader(envReader)
  , m_idx(0)
 {
 }
 
-template<class ChecksumGenerator, int MaxPacketSize>
-bool COBSReader<ChecksumGenerator, MaxPacketSize>::Reader::read(void* data, size_t size)
+template<class ChecksumGenerator, int MaxPacketSize, COBSVariant Variant>
+bool COBSReader<ChecksumGenerator, MaxPacketSize, Variant>::Reader::read(void* data, size_t size)
 {
+    if(size == 0)
+        return true;
+
     if(m_idx + size > m_envReader->m_idx)
         return false;
 
@@ -355,8 +501,8 @@ bool COBSReader<ChecksumGenerator, MaxPacketSize>::Reader::read(void* data, size
     return true;
 }
 
-template<class ChecksumGenerator, int MaxPacketSize>
-bool COBSReader<ChecksumGenerator, MaxPacketSize>::Reader::skip(size_t size)
+template<class ChecksumGenerator, int MaxPacketSize, COBSVariant Variant>
+bool COBSReader<ChecksumGenerator, MaxPacketSize, Variant>::Reader::skip(size_t size)
 {
     if(m_idx + size > m_envReader->m_idx)
         return false;
@@ -366,15 +512,33 @@ bool COBSReader<ChecksumGenerator, MaxPacketSize>::Reader::skip(size_t size)
     return true;
 }
 
-template<class ChecksumGenerator, int MaxPacketSize>
-COBSReader<ChecksumGenerator, MaxPacketSize>::COBSReader()
+template<class ChecksumGenerator, int MaxPacketSize, COBSVariant Variant>
+const uint8_t* COBSReader<ChecksumGenerator, MaxPacketSize, Variant>::Reader::consume(size_t size)
+{
+    if(m_idx + size > m_envReader->m_idx)
+        return 0;
+
+    const uint8_t* data = m_envReader->m_buffer + m_idx;
+    m_idx += size;
+
+    return data;
+}
+
+template<class ChecksumGenerator, int MaxPacketSize, COBSVariant Variant>
+size_t COBSReader<ChecksumGenerator, MaxPacketSize, Variant>::Reader::remaining() const
+{
+    return m_envReader->m_idx - m_idx;
+}
+
+template<class ChecksumGenerator, int MaxPacketSize, COBSVariant Variant>
+COBSReader<ChecksumGenerator, MaxPacketSize, Variant>::COBSReader()
  : m_state(STATE_START)
 {
 }
 
-template<class ChecksumGenerator, int MaxPacketSize>
-typename COBSReader<ChecksumGenerator, MaxPacketSize>::TakeResult
-COBSReader<ChecksumGenerator, MaxPacketSize>::take(uint8_t c)
+template<class ChecksumGenerator, int MaxPacketSize, COBSVariant Variant>
+typename COBSReader<ChecksumGenerator, MaxPacketSize, Variant>::TakeResult
+COBSReader<ChecksumGenerator, MaxPacketSize, Variant>::take(uint8_t c)
 {
     switch(m_state)
     {
@@ -394,26 +558,28 @@ COBSReader<ChecksumGenerator, MaxPacketSize>::take(uint8_t c)
             if(c == 0x00)
                 return finish();
 
-            if(c == 0x01)
+            if(!startBlock(c))
+                m_state = STATE_START;
+            break;
+        case STATE_COBS_DATA:
+            if(c == 0x00)
             {
-                if(m_idx == MaxPacketSize)
+                if constexpr(Variant == COBS_REDUCED)
                 {
-                    m_state = STATE_START;
-                    break;
+                    // The block ended early, so the code byte was the last
+                    // data byte and there is no implicit zero.
+                    if(m_idx == MaxPacketSize)
+                    {
+                        m_state = STATE_MSG_CODE;
+                        return FRAME_ERROR;
+                    }
+
+                    m_buffer[m_idx++] = m_cobsCode;
+                    return finish(false);
                 }
 
-                m_buffer[m_idx++] = 0x00;
-            }
-            else
-            {
-                m_cobsCode = c;
-                m_cobsLength = c - 1;
-                m_state = STATE_COBS_DATA;
-            }
-            break;
-        case STATE_COBS_DATA:
-            if(c == 0x00)
                 return finish();
+            }
 
             if(m_idx == MaxPacketSize)
             {
@@ -425,15 +591,10 @@ COBSReader<ChecksumGenerator, MaxPacketSize>::take(uint8_t c)
 
             if(--m_cobsLength == 0)
             {
-                if(m_cobsCode != 0xFF)
+                if(!appendZeros(m_cobsZeros))
                 {
-                    if(m_idx == MaxPacketSize)
-                    {
-                        m_state = STATE_START;
-                        break;
-                    }
-
-                    m_buffer[m_idx++] = 0x00;
+                    m_state = STATE_START;
+                    break;
                 }
 
                 m_state = STATE_COBS_CODE;
@@ -444,21 +605,70 @@ COBSReader<ChecksumGenerator, MaxPacketSize>::take(uint8_t c)
     return NEED_MORE_DATA;
 }
 
-template<class ChecksumGenerator, int MaxPacketSize>
-typename COBSReader<ChecksumGenerator, MaxPacketSize>::TakeResult
-COBSReader<ChecksumGenerator, MaxPacketSize>::finish()
+template<class ChecksumGenerator, int MaxPacketSize, COBSVariant Variant>
+bool COBSReader<ChecksumGenerator, MaxPacketSize, Variant>::startBlock(uint8_t c)
+{
+    m_cobsCode = c;
+
+    if constexpr(Variant == COBS_ZPE)
+    {
+        if(c < 0xE0)
+        {
+            m_cobsLength = c - 1;
+            m_cobsZeros = 1;
+        }
+        else if(c == 0xE0)
+        {
+            m_cobsLength = c - 1;
+            m_cobsZeros = 0;
+        }
+        else
+        {
+            m_cobsLength = c - 0xE1;
+            m_cobsZeros = 2;
+        }
+    }
+    else
+    {
+        m_cobsLength = c - 1;
+        m_cobsZeros = (c == 0xFF) ? 0 : 1;
+    }
+
+    if(m_cobsLength == 0)
+        return appendZeros(m_cobsZeros);
+
+    m_state = STATE_COBS_DATA;
+    return true;
+}
+
+template<class ChecksumGenerator, int MaxPacketSize, COBSVariant Variant>
+bool COBSReader<ChecksumGenerator, MaxPacketSize, Variant>::appendZeros(uint8_t count)
+{
+    if(MaxPacketSize - m_idx < count)
+        return false;
+
+    for(uint8_t i = 0; i < count; ++i)
+        m_buffer[m_idx++] = 0x00;
+
+    return true;
+}
+
+template<class ChecksumGenerator, int MaxPacketSize, COBSVariant Variant>
+typename COBSReader<ChecksumGenerator, MaxPacketSize, Variant>::TakeResult
+COBSReader<ChecksumGenerator, MaxPacketSize, Variant>::finish(bool trailingZero)
 {
     // Precondition: we just received a 0x00 byte. So the next state
     // *must* be STATE_MSG_CODE.
 
-    if(m_idx < sizeof(typename ChecksumGenerator::SumType) + 1)
+    if(m_idx < sizeof(typename ChecksumGenerator::SumType) + (trailingZero ? 1 : 0))
     {
         m_state = STATE_MSG_CODE;
         return FRAME_ERROR; // Short packet
     }
 
     // Remove the trailing zero introduced by COBS
-    m_idx--;
+    if(trailingZero)
+        m_idx--;
 
     // Check if the checksum matches
     m_generator.reset();
@@ -467,8 +677,9 @@ COBSReader<ChecksumGenerator, MaxPacketSize>::finish()
     for(SizeType i = 0; i < m_idx - sizeof(typename ChecksumGenerator::SumType); ++i)
         m_generator.add(m_buffer[i]);
 
-    typename ChecksumGenerator::SumType sum;
-    std::memcpy(&sum, &m_buffer[m_idx - sizeof(typename ChecksumGenerator::SumType)], sizeof(sum));
+    typename ChecksumGenerator::SumType sum = loadWire<BYTE_ORDER_LITTLE, typename ChecksumGenerator::SumType>(
+        &m_buffer[m_idx - sizeof(typename ChecksumGenerator::SumType)]
+    );
 
     if(m_generator.value() != sum)
     {
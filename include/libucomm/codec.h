@@ -0,0 +1,367 @@
+// List element codecs
+// Author: Max Schwarz <max@x-quadraht.de>
+
+#ifndef LIBUCOMM_CODEC_H
+#define LIBUCOMM_CODEC_H
+
+#include <type_traits>
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "util/error.h"
+#include "util/byteorder.h"
+#include "varint.h"
+
+/*
+ * A codec defines how the elements of a List are represented on the wire.
+ * Codecs may keep state between elements (e.g. the previous value). The
+ * interface is:
+ *
+ *   void reset();
+ *
+ *   // Encode count elements (called with count == 1 in callback mode)
+ *   template<ByteOrder Order, class Writer>
+ *   bool encode(Writer* writer, const T* data, size_t count);
+ *
+ *   // Called after the last element has been encoded
+ *   template<ByteOrder Order, class Writer>
+ *   bool finish(Writer* writer);
+ *
+ *   // Decode one element, remaining counts the elements left in the list
+ *   // (including this one)
+ *   template<ByteOrder Order, class Reader>
+ *   bool decode(Reader* reader, T* dest, size_t remaining);
+ *
+ *   template<ByteOrder Order, class Reader>
+ *   bool skip(Reader* reader, size_t count);
+ */
+
+namespace uc
+{
+
+/**
+ * @brief Default codec: elements are sent as they are
+ *
+ * Arithmetic types are copied in wire byte order, structs use their own
+ * serialize() / deserialize() methods.
+ **/
+template<class T>
+class RawCodec
+{
+public:
+    void reset()
+    {}
+
+    template<ByteOrder Order, class Writer>
+    bool encode(Writer* writer, const T* data, size_t count)
+    {
+        if constexpr(std::is_arithmetic_v<T> && Order == BYTE_ORDER_HOST)
+        {
+            return writer->write(data, sizeof(T)*count);
+        }
+        else if constexpr(std::is_arithmetic_v<T>)
+        {
+            // Swap in small chunks to keep the stack usage bounded
+            enum { CHUNK = 64 / sizeof(T) };
+            T chunk[CHUNK];
+
+            for(size_t i = 0; i < count; i += CHUNK)
+            {
+                size_t n = count - i;
+                if(n > CHUNK)
+                    n = CHUNK;
+
+                byteSwapArray<T>(chunk, data + i, n);
+                RETURN_IF_ERROR(writer->write(chunk, sizeof(T)*n));
+            }
+
+            return true;
+        }
+        else
+        {
+            for(size_t i = 0; i != count; ++i)
+                RETURN_IF_ERROR(data[i].serialize(writer));
+
+            return true;
+        }
+    }
+
+    template<ByteOrder Order, class Writer>
+    bool finish(Writer*)
+    { return true; }
+
+    template<ByteOrder Order, class Reader>
+    bool decode(Reader* reader, T* dest, size_t)
+    {
+        if constexpr(std::is_arithmetic_v<T>)
+        {
+            RETURN_IF_ERROR(reader->read(dest, sizeof(T)));
+            *dest = fromWire<Order>(*dest);
+            return true;
+        }
+        else
+            return dest->deserialize(reader);
+    }
+
+    //! Decode @a count elements at once (see List::next(T*, SizeType))
+    template<ByteOrder Order, class Reader>
+    bool decodeArray(Reader* reader, T* dest, size_t count)
+    {
+        if constexpr(std::is_arithmetic_v<T>)
+        {
+            RETURN_IF_ERROR(reader->read(dest, sizeof(T)*count));
+
+            if constexpr(Order != BYTE_ORDER_HOST)
+            {
+                // byteSwapArray() needs distinct buffers, so swap back from
+                // small chunks
+                enum { CHUNK = 64 / sizeof(T) };
+                T chunk[CHUNK];
+
+                for(size_t i = 0; i < count; i += CHUNK)
+                {
+                    size_t n = count - i;
+                    if(n > CHUNK)
+                        n = CHUNK;
+
+                    memcpy(chunk, dest + i, sizeof(T)*n);
+                    byteSwapArray<T>(dest + i, chunk, n);
+                }
+            }
+
+            return true;
+        }
+        else
+        {
+            for(size_t i = 0; i != count; ++i)
+                RETURN_IF_ERROR(dest[i].deserialize(reader));
+
+            return true;
+        }
+    }
+
+    template<ByteOrder Order, class Reader>
+    bool skip(Reader* reader, size_t count)
+    {
+        if constexpr(std::is_arithmetic_v<T>)
+            return reader->skip(sizeof(T)*count);
+        else
+            return reader->skip(T::POD_SIZE*count);
+    }
+};
+
+/**
+ * @brief Delta codec for slowly varying integer series
+ *
+ * Each element is sent as the zigzag varint encoded difference to the previous
+ * element (the first one relative to zero). Differences wrap around, so all
+ * values of @a T can be represented.
+ **/
+template<class T>
+class DeltaCodec
+{
+public:
+    typedef typename std::make_unsigned<T>::type U;
+    typedef typename std::make_signed<T>::type S;
+
+    void reset()
+    { m_prev = 0; }
+
+    template<ByteOrder Order, class Writer>
+    bool encode(Writer* writer, const T* data, size_t count)
+    {
+        for(size_t i = 0; i != count; ++i)
+        {
+            U value = data[i];
+            RETURN_IF_ERROR(writeZigzag(writer, S(U(value - m_prev))));
+            m_prev = value;
+        }
+
+        return true;
+    }
+
+    template<ByteOrder Order, class Writer>
+    bool finish(Writer*)
+    { return true; }
+
+    template<ByteOrder Order, class Reader>
+    bool decode(Reader* reader, T* dest, size_t)
+    {
+        S delta;
+        RETURN_IF_ERROR(readZigzag(reader, &delta));
+        m_prev = U(m_prev + U(delta));
+        *dest = T(m_prev);
+        return true;
+    }
+
+    template<ByteOrder Order, class Reader>
+    bool skip(Reader* reader, size_t count)
+    {
+        T dummy;
+        for(size_t i = 0; i != count; ++i)
+            RETURN_IF_ERROR(decode<Order>(reader, &dummy, count - i));
+        return true;
+    }
+private:
+    U m_prev;
+};
+
+/**
+ * @brief Delta-of-delta codec for integer series with a steady slope
+ *
+ * Sends the zigzag varint encoded change of the difference between
+ * successive elements, e.g. timestamps or counters increasing at a constant
+ * rate cost one byte per element.
+ **/
+template<class T>
+class DeltaOfDeltaCodec
+{
+public:
+    typedef typename std::make_unsigned<T>::type U;
+    typedef typename std::make_signed<T>::type S;
+
+    void reset()
+    {
+        m_prev = 0;
+        m_prevDelta = 0;
+    }
+
+    template<ByteOrder Order, class Writer>
+    bool encode(Writer* writer, const T* data, size_t count)
+    {
+        for(size_t i = 0; i != count; ++i)
+        {
+            U value = data[i];
+            U delta = value - m_prev;
+            RETURN_IF_ERROR(writeZigzag(writer, S(U(delta - m_prevDelta))));
+            m_prev = value;
+            m_prevDelta = delta;
+        }
+
+        return true;
+    }
+
+    template<ByteOrder Order, class Writer>
+    bool finish(Writer*)
+    { return true; }
+
+    template<ByteOrder Order, class Reader>
+    bool decode(Reader* reader, T* dest, size_t)
+    {
+        S dod;
+        RETURN_IF_ERROR(readZigzag(reader, &dod));
+        m_prevDelta = U(m_prevDelta + U(dod));
+        m_prev = U(m_prev + m_prevDelta);
+        *dest = T(m_prev);
+        return true;
+    }
+
+    template<ByteOrder Order, class Reader>
+    bool skip(Reader* reader, size_t count)
+    {
+        T dummy;
+        for(size_t i = 0; i != count; ++i)
+            RETURN_IF_ERROR(decode<Order>(reader, &dummy, count - i));
+        return true;
+    }
+private:
+    U m_prev;
+    U m_prevDelta;
+};
+
+/**
+ * @brief Run-length codec
+ *
+ * Runs of equal elements are sent as a varint run length followed by the
+ * value in wire byte order.
+ **/
+template<class T>
+class RLECodec
+{
+public:
+    void reset()
+    { m_run = 0; }
+
+    template<ByteOrder Order, class Writer>
+    bool encode(Writer* writer, const T* data, size_t count)
+    {
+        for(size_t i = 0; i != count; ++i)
+        {
+            if(m_run != 0 && memcmp(&data[i], &m_value, sizeof(T)) == 0)
+            {
+                m_run++;
+                continue;
+            }
+
+            RETURN_IF_ERROR(finish<Order>(writer));
+            m_value = data[i];
+            m_run = 1;
+        }
+
+        return true;
+    }
+
+    //! Flush the pending run
+    template<ByteOrder Order, class Writer>
+    bool finish(Writer* writer)
+    {
+        if(m_run == 0)
+            return true;
+
+        RETURN_IF_ERROR(writeVarint(writer, m_run));
+
+        T value = toWire<Order>(m_value);
+        RETURN_IF_ERROR(writer->write(&value, sizeof(T)));
+
+        m_run = 0;
+        return true;
+    }
+
+    template<ByteOrder Order, class Reader>
+    bool decode(Reader* reader, T* dest, size_t remaining)
+    {
+        if(m_run == 0)
+        {
+            // Runs may not extend past the end of the list
+            RETURN_IF_ERROR(readVarint(reader, &m_run));
+            if(m_run == 0 || m_run > remaining)
+            {
+                m_run = 0;
+                return false;
+            }
+
+            RETURN_IF_ERROR(reader->read(&m_value, sizeof(T)));
+            m_value = fromWire<Order>(m_value);
+        }
+
+        m_run--;
+        *dest = m_value;
+        return true;
+    }
+
+    template<ByteOrder Order, class Reader>
+    bool skip(Reader* reader, size_t count)
+    {
+        while(count != 0)
+        {
+            uint32_t run;
+            RETURN_IF_ERROR(readVarint(reader, &run));
+            if(run == 0 || run > count)
+                return false;
+
+            RETURN_IF_ERROR(reader->skip(sizeof(T)));
+            count -= run;
+        }
+
+        return true;
+    }
+private:
+    uint32_t m_run;
+    T m_value;
+};
+
+}
+
+#endif
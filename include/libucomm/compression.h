@@ -0,0 +1,271 @@
+// Compression stage between messages and envelope
+// Author: Max Schwarz <max@x-quadraht.de>
+
+#ifndef LIBUCOMM_COMPRESSION_H
+#define LIBUCOMM_COMPRESSION_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "util/error.h"
+#include "util/memory_reader.h"
+#include "lz77.h"
+
+/*
+ * The compression stage sits between the generated serialize() and the
+ * envelope writer. The serialized message is collected in a buffer and
+ * compressed as a whole. Each payload starts with a header byte telling the
+ * receiver whether the rest is compressed:
+ *
+ *   0x00  | uncompressed payload follows
+ *   0x01  | LZ77 compressed payload follows (see lz77.h)
+ *
+ * Messages that do not get smaller are sent uncompressed, so the overhead is
+ * limited to the header byte.
+ *
+ * Usage:
+ * @code
+ *   typedef uc::COBSWriter<uc::Fletcher16Generator, MyBuffer> Envelope;
+ *   typedef uc::CompressingWriter<uc::LZCompressor<8>, Envelope, 1024> Writer;
+ *   typedef Proto< uc::IO<Writer, uc::IO_W> > WProto;
+ *
+ *   typedef uc::COBSReader<uc::Fletcher16Generator, 1024> EnvelopeReader;
+ *   typedef uc::DecompressingReader<EnvelopeReader, 1024> Reader;
+ *   typedef Proto< uc::IO<Reader, uc::IO_R> > RProto;
+ * @endcode
+ */
+
+namespace uc
+{
+
+enum CompressionHeader
+{
+    COMPRESSION_NONE = 0x00,
+    COMPRESSION_LZ77 = 0x01
+};
+
+/**
+ * @brief Compressing writer stage
+ *
+ * @a Compressor is one of the LZ77 compressors (LZCompressor for small
+ * systems, LZHashCompressor for hosts). @a MaxPacketSize is the maximum
+ * size of a serialized message. The stage needs two buffers of this size.
+ **/
+template<class Compressor, class EnvelopeWriterType, int MaxPacketSize>
+class CompressingWriter
+{
+public:
+    class Reader
+    {
+    };
+
+    CompressingWriter(EnvelopeWriterType* envelope)
+     : m_envelope(envelope)
+     , m_minSize(16)
+    {}
+
+    //! Messages smaller than @a size are never compressed (default: 16)
+    inline void setMinSize(size_t size)
+    { m_minSize = size; }
+
+    bool startEnvelope(uint8_t msg_code, bool compress = true)
+    {
+        m_msgCode = msg_code;
+        m_compress = compress;
+        m_size = 0;
+
+        return true;
+    }
+
+    //! Implement the IO writer interface
+    bool write(const void* data, size_t size)
+    {
+        if(MaxPacketSize - m_size < size)
+            return false;
+
+        memcpy(m_buffer + m_size, data, size);
+        m_size += size;
+
+        return true;
+    }
+
+    bool endEnvelope()
+    {
+        size_t compressed = 0;
+        if(m_compress && m_size != 0 && m_size >= m_minSize)
+        {
+            // Only use the compressed data if it saves at least one byte
+            compressed = m_compressor.compress(m_buffer, m_size, m_output, m_size - 1);
+        }
+
+        RETURN_IF_ERROR(m_envelope->startEnvelope(m_msgCode));
+
+        if(compressed != 0)
+        {
+            uint8_t header = COMPRESSION_LZ77;
+            RETURN_IF_ERROR(m_envelope->write(&header, 1));
+            RETURN_IF_ERROR(m_envelope->write(m_output, compressed));
+        }
+        else
+        {
+            uint8_t header = COMPRESSION_NONE;
+            RETURN_IF_ERROR(m_envelope->write(&header, 1));
+            RETURN_IF_ERROR(m_envelope->write(m_buffer, m_size));
+        }
+
+        return m_envelope->endEnvelope();
+    }
+
+    /**
+     * @brief Write message
+     *
+     * @param compress If false, the message is sent uncompressed.
+     * @return true on success
+     **/
+    template<class MSG>
+    bool send(const MSG& msg, bool compress = true)
+    {
+        RETURN_IF_ERROR(startEnvelope(MSG::MSG_CODE, compress));
+        RETURN_IF_ERROR(msg.serialize(this));
+        RETURN_IF_ERROR(endEnvelope());
+
+        return true;
+    }
+
+    template<class MSG>
+    CompressingWriter& operator<<(const MSG& msg)
+    {
+        send(msg);
+        return *this;
+    }
+private:
+    EnvelopeWriterType* m_envelope;
+    Compressor m_compressor;
+    size_t m_minSize;
+
+    uint8_t m_msgCode;
+    bool m_compress;
+    size_t m_size;
+    uint8_t m_buffer[MaxPacketSize];
+    uint8_t m_output[MaxPacketSize];
+};
+
+/**
+ * @brief Decompressing reader stage
+ *
+ * Wraps an envelope reader (which is owned by this class). Uncompressed
+ * payloads are read directly from the envelope buffer, compressed ones are
+ * decompressed into an internal buffer of @a MaxPacketSize bytes.
+ **/
+template<class EnvelopeReaderType, int MaxPacketSize>
+class DecompressingReader
+{
+public:
+    typedef MemoryReader Reader;
+
+    //! Possible take() return codes
+    enum TakeResult
+    {
+        NEW_MESSAGE,        //!< New message available, use msgCode() + read()
+        NEED_MORE_DATA,     //!< Message not yet finished
+        ENVELOPE_ERROR,     //!< Checksum or framing error in the envelope
+        DECOMPRESSION_ERROR //!< Malformed compressed payload
+    };
+
+    DecompressingReader()
+     : m_data(0)
+     , m_size(0)
+    {}
+
+    TakeResult take(uint8_t c)
+    {
+        typename EnvelopeReaderType::TakeResult ret = m_envelope.take(c);
+
+        if(ret == EnvelopeReaderType::NEED_MORE_DATA)
+            return NEED_MORE_DATA;
+
+        if(ret != EnvelopeReaderType::NEW_MESSAGE)
+            return ENVELOPE_ERROR;
+
+        Payload payload(this);
+        if(!m_envelope.read(&payload))
+            return DECOMPRESSION_ERROR;
+
+        return NEW_MESSAGE;
+    }
+
+    uint8_t msgCode() const
+    { return m_envelope.msgCode(); }
+
+    //! Was the last message sent compressed?
+    bool wasCompressed() const
+    { return m_data == m_buffer; }
+
+    template<class MSG>
+    bool read(MSG* msg)
+    {
+        Reader reader(m_data, m_size);
+        return msg->deserialize(&reader);
+    }
+
+    template<class MSG>
+    DecompressingReader& operator>>(MSG& msg)
+    {
+        read(&msg);
+        return *this;
+    }
+private:
+    // Extracts the payload from the envelope reader
+    class Payload
+    {
+    public:
+        explicit Payload(DecompressingReader* reader)
+         : m_reader(reader)
+        {}
+
+        template<class EnvReader>
+        bool deserialize(EnvReader* input)
+        {
+            m_reader->m_data = 0;
+            m_reader->m_size = 0;
+
+            uint8_t header;
+            RETURN_IF_ERROR(input->read(&header, 1));
+
+            size_t size = input->remaining();
+            const uint8_t* data = input->consume(size);
+            if(!data)
+                return false;
+
+            if(header == COMPRESSION_NONE)
+            {
+                m_reader->m_data = data;
+                m_reader->m_size = size;
+                return true;
+            }
+
+            if(header != COMPRESSION_LZ77)
+                return false;
+
+            RETURN_IF_ERROR(lzDecompress(
+                data, size, m_reader->m_buffer, MaxPacketSize, &m_reader->m_size
+            ));
+            m_reader->m_data = m_reader->m_buffer;
+
+            return true;
+        }
+    private:
+        DecompressingReader* m_reader;
+    };
+
+    EnvelopeReaderType m_envelope;
+
+    const uint8_t* m_data;
+    size_t m_size;
+    uint8_t m_buffer[MaxPacketSize];
+};
+
+}
+
+#endif
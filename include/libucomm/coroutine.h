@@ -0,0 +1,396 @@
+// C++20 coroutine interface for envelope readers and writers
+// Author: Max Schwarz <max@x-quadraht.de>
+
+#ifndef LIBUCOMM_COROUTINE_H
+#define LIBUCOMM_COROUTINE_H
+
+#if !defined(__cpp_impl_coroutine)
+#error "libucomm/coroutine.h needs C++20 coroutine support"
+#endif
+
+#include <coroutine>
+#include <exception>
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Awaitable wrappers around the envelope classes, for use with any coroutine
+ * framework (asio, custom epoll loops, ...). The wrappers do not schedule
+ * anything themselves. The event loop pushes received bytes into AsyncReader
+ * and reports free output space to AsyncWriter, and waiting coroutines are
+ * resumed inline from these calls:
+ *
+ * @code
+ *   uc::AsyncReader<EnvelopeReader> input(&envelopeReader);
+ *   uc::AsyncWriter<Writer> output(&resumableWriter);
+ *
+ *   uc::Detached handle()
+ *   {
+ *       while(true)
+ *       {
+ *           auto msg = co_await input.nextMessage();
+ *           if(!msg)
+ *               break;     // closed
+ *
+ *           if(msg.msgCode() == RProto::Ping::MSG_CODE)
+ *           {
+ *               RProto::Ping ping;
+ *               msg.read(&ping);
+ *               co_await output.send(pong);
+ *           }
+ *       }
+ *   }
+ *
+ *   // Event loop
+ *   input.feed(data, size);   // on EPOLLIN
+ *   output.writable();        // on EPOLLOUT
+ * @endcode
+ *
+ * Awaiting a message which has already been received, or sending into an
+ * output with enough space, does not suspend the coroutine.
+ */
+
+namespace uc
+{
+
+/**
+ * @brief Fire-and-forget coroutine
+ *
+ * Starts running immediately and frees itself when done. Exceptions
+ * terminate the program.
+ **/
+struct Detached
+{
+    struct promise_type
+    {
+        Detached get_return_object() noexcept
+        { return Detached(); }
+
+        std::suspend_never initial_suspend() noexcept
+        { return {}; }
+
+        std::suspend_never final_suspend() noexcept
+        { return {}; }
+
+        void return_void() noexcept
+        {}
+
+        void unhandled_exception() noexcept
+        { std::terminate(); }
+    };
+};
+
+/**
+ * @brief Awaitable message reader
+ *
+ * Wraps an envelope reader (not owned) with the take() / msgCode() / read()
+ * interface. A received message stays in the envelope buffer until the
+ * coroutine awaits nextMessage() again, so it may co_await other things
+ * before reading it. feed() does not process further bytes in the meantime.
+ **/
+template<class EnvelopeReaderType>
+class AsyncReader
+{
+public:
+    //! Result of nextMessage()
+    class Message
+    {
+    public:
+        //! false if the reader was closed
+        explicit operator bool() const
+        { return m_envelope != nullptr; }
+
+        uint8_t msgCode() const
+        { return m_envelope->msgCode(); }
+
+        //! Deserialize the message (until nextMessage() is awaited again)
+        template<class MSG>
+        bool read(MSG* msg) const
+        { return m_envelope->read(msg); }
+
+        //! Raw payload access (envelopes with a Reader class, e.g. COBSReader)
+        typename EnvelopeReaderType::Reader reader() const
+        { return typename EnvelopeReaderType::Reader(m_envelope); }
+    private:
+        friend class AsyncReader;
+
+        explicit Message(EnvelopeReaderType* envelope)
+         : m_envelope(envelope)
+        {}
+
+        EnvelopeReaderType* m_envelope;
+    };
+
+    class MessageAwaitable
+    {
+    public:
+        bool await_ready() noexcept
+        {
+            // The coroutine is done with the previous message
+            m_reader->m_inUse = false;
+            return m_reader->m_pending || m_reader->m_closed;
+        }
+
+        void await_suspend(std::coroutine_handle<> handle) noexcept
+        { m_reader->m_waiter = handle; }
+
+        Message await_resume() noexcept
+        {
+            if(!m_reader->m_pending)
+                return Message(nullptr);
+
+            m_reader->m_pending = false;
+            m_reader->m_inUse = true;
+            return Message(m_reader->m_envelope);
+        }
+    private:
+        friend class AsyncReader;
+
+        explicit MessageAwaitable(AsyncReader* reader)
+         : m_reader(reader)
+        {}
+
+        AsyncReader* m_reader;
+    };
+
+    explicit AsyncReader(EnvelopeReaderType* envelope)
+     : m_envelope(envelope)
+    {}
+
+    AsyncReader(const AsyncReader&) = delete;
+    AsyncReader& operator=(const AsyncReader&) = delete;
+
+    //! Wait for the next valid message
+    MessageAwaitable nextMessage() noexcept
+    { return MessageAwaitable(this); }
+
+    /**
+     * Process received bytes. A waiting coroutine is resumed for each
+     * complete message. If a message completes while no coroutine waits, or
+     * the coroutine suspends on something else before awaiting the next
+     * message, processing stops after it.
+     *
+     * @return number of bytes processed. The rest has to be fed again after
+     *   the coroutine awaited nextMessage() again.
+     **/
+    size_t feed(const uint8_t* data, size_t size);
+
+    /**
+     * Stop reading. A waiting coroutine (and all later nextMessage() calls)
+     * get an invalid Message.
+     **/
+    void close()
+    {
+        m_closed = true;
+        m_pending = false;
+        m_inUse = false;
+        resumeWaiter();
+    }
+
+    //! Is a received message waiting for nextMessage()?
+    inline bool pending() const
+    { return m_pending; }
+
+    //! Number of frames dropped because of checksum or framing errors
+    inline uint32_t errors() const
+    { return m_errors; }
+private:
+    void resumeWaiter()
+    {
+        std::coroutine_handle<> handle = m_waiter;
+        if(!handle)
+            return;
+
+        m_waiter = nullptr;
+        handle.resume();
+    }
+
+    EnvelopeReaderType* m_envelope;
+    std::coroutine_handle<> m_waiter = nullptr;
+    bool m_pending = false;
+    bool m_inUse = false;   // The coroutine still uses the envelope buffer
+    bool m_closed = false;
+    uint32_t m_errors = 0;
+};
+
+/**
+ * @brief Awaitable message writer
+ *
+ * Wraps a ResumableCOBSWriter (not owned), which must not be used directly
+ * while the AsyncWriter exists. Messages from several coroutines are sent
+ * one after another, in the order of the send() calls.
+ **/
+template<class ResumableWriterType>
+class AsyncWriter
+{
+public:
+    template<class MSG>
+    class SendAwaitable
+    {
+    public:
+        bool await_ready() noexcept
+        {
+            // Fast path: nothing queued, try to send right away
+            if(!m_writer->m_head)
+            {
+                m_status = m_writer->m_writer->send(*m_msg);
+                if(m_status != ResumableWriterType::SUSPENDED)
+                    return true;
+
+                m_entry.started = true;
+            }
+
+            m_writer->enqueue(&m_entry);
+            return false;
+        }
+
+        void await_suspend(std::coroutine_handle<> handle) noexcept
+        { m_entry.waiter = handle; }
+
+        //! @return true if the message was sent completely
+        bool await_resume() const noexcept
+        { return m_status == ResumableWriterType::DONE; }
+    private:
+        friend class AsyncWriter;
+
+        SendAwaitable(AsyncWriter* writer, const MSG* msg)
+         : m_writer(writer)
+         , m_msg(msg)
+         , m_status(ResumableWriterType::FAILED)
+        {
+            m_entry.start = &start;
+            m_entry.finish = &finish;
+            m_entry.self = this;
+            m_entry.started = false;
+            m_entry.next = nullptr;
+        }
+
+        static typename ResumableWriterType::Status start(void* self)
+        {
+            SendAwaitable* s = static_cast<SendAwaitable*>(self);
+            return s->m_writer->m_writer->send(*s->m_msg);
+        }
+
+        static void finish(void* self, typename ResumableWriterType::Status status)
+        { static_cast<SendAwaitable*>(self)->m_status = status; }
+
+        AsyncWriter* m_writer;
+        const MSG* m_msg;
+        typename ResumableWriterType::Status m_status;
+        typename AsyncWriter::Entry m_entry;
+    };
+
+    explicit AsyncWriter(ResumableWriterType* writer)
+     : m_writer(writer)
+    {}
+
+    AsyncWriter(const AsyncWriter&) = delete;
+    AsyncWriter& operator=(const AsyncWriter&) = delete;
+
+    /**
+     * Send @a msg. The coroutine is suspended until the frame was passed to
+     * the output completely.
+     **/
+    template<class MSG>
+    SendAwaitable<MSG> send(const MSG& msg) noexcept
+    { return SendAwaitable<MSG>(this, &msg); }
+
+    //! Continue sending after the output has space again
+    void writable();
+
+    //! Are frames waiting for output space?
+    inline bool busy() const
+    { return m_head != nullptr; }
+private:
+    // Waiting send() call, lives in the coroutine frame
+    struct Entry
+    {
+        typename ResumableWriterType::Status (*start)(void* self);
+        void (*finish)(void* self, typename ResumableWriterType::Status status);
+        void* self;
+        bool started;
+        std::coroutine_handle<> waiter;
+        Entry* next;
+    };
+
+    void enqueue(Entry* entry)
+    {
+        if(m_tail)
+            m_tail->next = entry;
+        else
+            m_head = entry;
+        m_tail = entry;
+    }
+
+    ResumableWriterType* m_writer;
+
+    // Waiting send() calls, the head is being sent
+    Entry* m_head = nullptr;
+    Entry* m_tail = nullptr;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// IMPLEMENTATION
+
+template<class EnvelopeReaderType>
+size_t AsyncReader<EnvelopeReaderType>::feed(const uint8_t* data, size_t size)
+{
+    if(m_closed)
+        return size;
+
+    for(size_t i = 0; i < size; ++i)
+    {
+        // The envelope buffer still holds a message nobody picked up or
+        // read yet
+        if(m_pending || m_inUse)
+            return i;
+
+        typename EnvelopeReaderType::TakeResult ret = m_envelope->take(data[i]);
+        if(ret == EnvelopeReaderType::NEW_MESSAGE)
+        {
+            m_pending = true;
+            resumeWaiter();
+
+            if(m_closed)
+                return size;
+        }
+        else if(ret != EnvelopeReaderType::NEED_MORE_DATA)
+            m_errors++;
+    }
+
+    return size;
+}
+
+template<class ResumableWriterType>
+void AsyncWriter<ResumableWriterType>::writable()
+{
+    while(m_head)
+    {
+        Entry* entry = m_head;
+
+        typename ResumableWriterType::Status status;
+        if(entry->started)
+            status = m_writer->resume();
+        else
+        {
+            status = entry->start(entry->self);
+            entry->started = true;
+        }
+
+        if(status == ResumableWriterType::SUSPENDED)
+            return;
+
+        m_head = entry->next;
+        if(!m_head)
+            m_tail = nullptr;
+
+        // The sender may send again right away, entry is invalid afterwards
+        entry->finish(entry->self, status);
+        entry->waiter.resume();
+    }
+}
+
+}
+
+#endif
@@ -0,0 +1,267 @@
+// Delta encoding of successive messages
+// Author: Max Schwarz <max@x-quadraht.de>
+
+#ifndef LIBUCOMM_DELTA_H
+#define LIBUCOMM_DELTA_H
+
+#include <type_traits>
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "util/error.h"
+
+/*
+ * Delta messages (declared with "delta msg" in the protocol definition) are
+ * sent relative to the previous message of the same type. Both sides keep a
+ * copy of the packed wire image of the fixed-size members (DeltaState).
+ *
+ * Wire format of the fixed-size part:
+ *
+ *   header   | 1 byte: bit 7 set for keyframes, bits 0-6 sequence number
+ *   keyframe | POD_SIZE bytes: full wire image
+ *   delta    | presence bitmap (one bit per field, LSB first), followed by
+ *            | the wire bytes of the changed fields
+ *
+ * Fields are the fixed-size members of the message. Elements of fixed-size
+ * arrays count as separate fields, consecutive bit fields as one. Variable
+ * size members (lists, strings, varints) are always sent in full after the
+ * delta block.
+ *
+ * The receiver rejects delta frames if it has missed a frame (sequence number
+ * mismatch) and waits for the next keyframe.
+ */
+
+namespace uc
+{
+
+//! Position of a field in the packed wire image
+struct DeltaField
+{
+    uint16_t offset;
+    uint16_t size;
+};
+
+/**
+ * @brief Reference state for delta encoding of a single message type
+ *
+ * Keep one instance per message type and link on both the sending and
+ * receiving end.
+ **/
+template<int PodSize>
+class DeltaState
+{
+public:
+    enum
+    {
+        KEYFRAME = 0x80,
+        SEQUENCE_MASK = 0x7F
+    };
+
+    /**
+     * @param keyframeInterval Send a full keyframe every @a keyframeInterval
+     *   messages (0: only the first message and on request).
+     **/
+    explicit DeltaState(uint16_t keyframeInterval = 0)
+     : m_valid(false)
+     , m_keyframeRequested(false)
+     , m_sequence(0)
+     , m_keyframeInterval(keyframeInterval)
+     , m_sinceKeyframe(0)
+    {}
+
+    /**
+     * Force a keyframe with the next message. Call this on the sending side
+     * if a message could not be sent after serialization.
+     **/
+    inline void requestKeyframe()
+    { m_keyframeRequested = true; }
+
+    //! Forget the reference state (the next frame needs to be a keyframe)
+    inline void reset()
+    { m_valid = false; }
+
+    inline bool valid() const
+    { return m_valid; }
+
+    //! Wire image of the last sent / received message
+    inline const uint8_t* image() const
+    { return m_image; }
+
+    template<class Writer, size_t NumFields>
+    bool write(Writer* writer, const uint8_t* image, const DeltaField (&fields)[NumFields]);
+
+    template<class Reader, size_t NumFields>
+    bool read(Reader* reader, const DeltaField (&fields)[NumFields]);
+private:
+    uint8_t m_image[PodSize];
+    bool m_valid;
+    bool m_keyframeRequested;
+    uint8_t m_sequence;
+    uint16_t m_keyframeInterval;
+    uint16_t m_sinceKeyframe;
+};
+
+/**
+ * @brief Wrapper for sending / receiving a message in delta mode
+ *
+ * Usage:
+ * @code
+ *   WProto::ServoStatus::DeltaState state(100); // keyframe every 100 msgs
+ *   output.send(uc::deltaFrame(&msg, &state));
+ *
+ *   RProto::ServoStatus::DeltaState rxState;
+ *   auto frame = uc::deltaFrame(&msg, &rxState);
+ *   input.read(&frame);
+ * @endcode
+ **/
+template<class MSG>
+class DeltaFrame
+{
+public:
+    typedef typename std::remove_const<MSG>::type Message;
+    typedef typename Message::DeltaState State;
+
+    enum { MSG_CODE = Message::MSG_CODE };
+
+    DeltaFrame(MSG* msg, State* state)
+     : m_msg(msg)
+     , m_state(state)
+    {}
+
+    //! A failed serialization forces a keyframe next time
+    template<class Writer>
+    inline bool serialize(Writer* writer) const
+    {
+        if(!m_msg->serializeDelta(writer, m_state))
+        {
+            m_state->requestKeyframe();
+            return false;
+        }
+
+        return true;
+    }
+
+    template<class Reader>
+    inline bool deserialize(Reader* reader)
+    { return m_msg->deserializeDelta(reader, m_state); }
+private:
+    MSG* m_msg;
+    State* m_state;
+};
+
+template<class MSG>
+inline DeltaFrame<MSG> deltaFrame(MSG* msg, typename DeltaFrame<MSG>::State* state)
+{
+    return DeltaFrame<MSG>(msg, state);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// IMPLEMENTATION
+
+template<int PodSize>
+template<class Writer, size_t NumFields>
+bool DeltaState<PodSize>::write(Writer* writer, const uint8_t* image, const DeltaField (&fields)[NumFields])
+{
+    bool keyframe = !m_valid || m_keyframeRequested
+        || (m_keyframeInterval != 0 && m_sinceKeyframe >= m_keyframeInterval);
+
+    m_sequence = (m_sequence + 1) & SEQUENCE_MASK;
+
+    // If anything below fails, the receiver may now be out of sync with
+    // m_sequence / m_image: resynchronize with the next frame.
+    m_keyframeRequested = true;
+
+    uint8_t header = m_sequence | (keyframe ? KEYFRAME : 0);
+    RETURN_IF_ERROR(writer->write(&header, 1));
+
+    if(keyframe)
+    {
+        memcpy(m_image, image, PodSize);
+        m_valid = true;
+        m_sinceKeyframe = 1;
+
+        RETURN_IF_ERROR(writer->write(m_image, PodSize));
+
+        m_keyframeRequested = false;
+        return true;
+    }
+
+    uint8_t bitmap[(NumFields + 7) / 8] = {};
+    for(size_t i = 0; i < NumFields; ++i)
+    {
+        const DeltaField& f = fields[i];
+        if(memcmp(m_image + f.offset, image + f.offset, f.size) != 0)
+            bitmap[i / 8] |= (1 << (i % 8));
+    }
+
+    RETURN_IF_ERROR(writer->write(bitmap, sizeof(bitmap)));
+
+    for(size_t i = 0; i < NumFields; ++i)
+    {
+        if(!(bitmap[i / 8] & (1 << (i % 8))))
+            continue;
+
+        const DeltaField& f = fields[i];
+        RETURN_IF_ERROR(writer->write(image + f.offset, f.size));
+        memcpy(m_image + f.offset, image + f.offset, f.size);
+    }
+
+    m_keyframeRequested = false;
+    m_sinceKeyframe++;
+
+    return true;
+}
+
+template<int PodSize>
+template<class Reader, size_t NumFields>
+bool DeltaState<PodSize>::read(Reader* reader, const DeltaField (&fields)[NumFields])
+{
+    uint8_t header;
+    RETURN_IF_ERROR(reader->read(&header, 1));
+
+    uint8_t sequence = header & SEQUENCE_MASK;
+
+    if(header & KEYFRAME)
+    {
+        RETURN_IF_ERROR(reader->read(m_image, PodSize));
+        m_valid = true;
+        m_sequence = sequence;
+        return true;
+    }
+
+    // We need an up-to-date reference
+    if(!m_valid || sequence != ((m_sequence + 1) & SEQUENCE_MASK))
+    {
+        m_valid = false;
+        return false;
+    }
+
+    uint8_t bitmap[(NumFields + 7) / 8];
+    if(!reader->read(bitmap, sizeof(bitmap)))
+    {
+        m_valid = false;
+        return false;
+    }
+
+    for(size_t i = 0; i < NumFields; ++i)
+    {
+        if(!(bitmap[i / 8] & (1 << (i % 8))))
+            continue;
+
+        const DeltaField& f = fields[i];
+        if(!reader->read(m_image + f.offset, f.size))
+        {
+            m_valid = false;
+            return false;
+        }
+    }
+
+    m_sequence = sequence;
+    return true;
+}
+
+}
+
+#endif
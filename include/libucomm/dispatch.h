@@ -0,0 +1,599 @@
+// Parallel dispatch of decoded messages to a work-stealing thread pool
+// Author: Max Schwarz <max@x-quadraht.de>
+
+#ifndef LIBUCOMM_DISPATCH_H
+#define LIBUCOMM_DISPATCH_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "util/memory_reader.h"
+
+/*
+ * Handlers for decoded messages (logging, sensor fusion, forwarding) may take
+ * much longer than decoding. Running them on the receiving thread stalls the
+ * link. Dispatcher copies each decoded message into a buffer from a fixed
+ * frame pool and lets a pool of worker threads run the handlers:
+ *
+ * @code
+ *   typedef uc::Dispatcher<1024> Dispatcher;
+ *   typedef Proto< uc::IO<Dispatcher, uc::IO_R> > DProto;
+ *
+ *   void onSensor(uint32_t endpoint, DProto::SensorData& msg, void* ctx);
+ *
+ *   Dispatcher dispatcher(4);
+ *   dispatcher.setHandler<DProto::SensorData>(&onSensor, ctx);
+ *   dispatcher.start();
+ *
+ *   // receive thread
+ *   if(input.take(c) == EnvelopeReader::NEW_MESSAGE)
+ *       dispatcher.post(endpointId, &input);
+ * @endcode
+ *
+ * Messages with the same (endpoint, msg code) key are handled one after
+ * another in the order they were posted. Each key is mapped to one of
+ * @a Strands queues. A strand with pending messages is scheduled as a single
+ * task, and a worker handles all of its messages before it moves on. Keys
+ * sharing a strand are serialized, which is safe but costs parallelism, so
+ * there should be many more strands than workers.
+ *
+ * Scheduled strands go into per-worker deques. A worker takes tasks from its
+ * own deque and steals from the others when it runs out. Idle workers
+ * sleep on a condition variable.
+ *
+ * The frame pool has a fixed size and is managed with a lock-free free list.
+ * If it is exhausted, post() drops the message and returns false, so the
+ * receiving thread never blocks.
+ */
+
+namespace uc
+{
+
+//! Counters of a Dispatcher
+struct DispatchStatistics
+{
+    uint64_t posted;     //!< Messages accepted by post()
+    uint64_t dropped;    //!< Messages dropped (pool exhausted or too large)
+    uint64_t handled;    //!< Messages passed to a handler
+    uint64_t unhandled;  //!< Messages without a handler
+    uint64_t errors;     //!< Messages that could not be deserialized
+    uint64_t steals;     //!< Strands stolen from another worker
+};
+
+/**
+ * @brief Keyed dispatch to a work-stealing thread pool
+ *
+ * Messages up to @a MaxFrameSize bytes are accepted. Use Dispatcher as the
+ * reader type in the IO template for the messages passed to the handlers.
+ **/
+template<int MaxFrameSize = 1024, int Strands = 256>
+class Dispatcher
+{
+public:
+    //! Reader over a pooled frame (IO::Reader interface)
+    typedef MemoryReader Reader;
+
+    //! Untyped handler, @a reader covers the message payload
+    typedef void (*RawHandler)(uint32_t endpoint, uint8_t msgCode, Reader* reader, void* userData);
+
+    /**
+     * @param threads Number of worker threads, 0 means one per core
+     * @param poolSize Number of frames in the pool
+     **/
+    explicit Dispatcher(unsigned int threads = 0, uint32_t poolSize = 1024);
+    ~Dispatcher();
+
+    Dispatcher(const Dispatcher&) = delete;
+    Dispatcher& operator=(const Dispatcher&) = delete;
+
+    /**
+     * Call @a handler for messages of type @a MSG (only before start()).
+     * The message lives until the handler returns.
+     **/
+    template<class MSG>
+    bool setHandler(void (*handler)(uint32_t endpoint, MSG& msg, void* userData), void* userData = 0)
+    {
+        if(running() || MSG::MSG_CODE > 255)
+            return false;
+
+        HandlerEntry& entry = m_handlers[MSG::MSG_CODE];
+        entry.call = &callTyped<MSG>;
+        entry.function = reinterpret_cast<void (*)()>(handler);
+        entry.userData = userData;
+
+        return true;
+    }
+
+    //! Call @a handler for all messages with @a msgCode (only before start())
+    bool setRawHandler(uint8_t msgCode, RawHandler handler, void* userData = 0)
+    {
+        if(running())
+            return false;
+
+        HandlerEntry& entry = m_handlers[msgCode];
+        entry.call = &callRaw;
+        entry.function = reinterpret_cast<void (*)()>(handler);
+        entry.userData = userData;
+
+        return true;
+    }
+
+    /**
+     * Queue a message received on @a endpoint. Thread-safe.
+     *
+     * @return false if the message was dropped
+     **/
+    bool post(uint32_t endpoint, uint8_t msgCode, const uint8_t* data, size_t size);
+
+    /**
+     * Queue the last message decoded by @a envelope (e.g. a COBSReader after
+     * take() returned NEW_MESSAGE).
+     **/
+    template<class EnvelopeReaderType>
+    bool post(uint32_t endpoint, EnvelopeReaderType* envelope)
+    {
+        typename EnvelopeReaderType::Reader reader(envelope);
+        size_t size = reader.remaining();
+
+        return post(endpoint, envelope->msgCode(), reader.consume(size), size);
+    }
+
+    //! Start the worker threads
+    bool start();
+
+    //! Handle the queued messages, then stop and join the worker threads
+    void stop();
+
+    //! Wait until all posted messages have been handled
+    void drain();
+
+    inline bool running() const
+    { return !m_threads.empty(); }
+
+    inline unsigned int threads() const
+    { return m_workers.size(); }
+
+    //! Frames currently not in the pool
+    inline uint32_t inFlight() const
+    { return m_inFlight.load(std::memory_order_relaxed); }
+
+    DispatchStatistics statistics() const;
+private:
+    enum { NONE = 0xFFFFFFFF };
+
+    struct Frame
+    {
+        std::atomic<uint32_t> freeNext;
+        uint32_t next;
+        uint32_t endpoint;
+        uint32_t size;
+        uint8_t msgCode;
+        uint8_t data[MaxFrameSize];
+    };
+
+    struct HandlerEntry
+    {
+        void (*call)(const HandlerEntry& entry, Frame* frame, Dispatcher* dispatcher);
+        void (*function)();
+        void* userData;
+    };
+
+    // Messages of a group of keys, handled by one worker at a time
+    struct Strand
+    {
+        std::mutex mutex;
+        uint32_t head;
+        uint32_t tail;
+        bool scheduled;
+    };
+
+    // Ring of scheduled strands (each strand is in at most one deque)
+    struct Worker
+    {
+        std::mutex mutex;
+        uint32_t tasks[Strands];
+        uint32_t first;
+        uint32_t count;
+    };
+
+    template<class MSG>
+    static void callTyped(const HandlerEntry& entry, Frame* frame, Dispatcher* dispatcher)
+    {
+        Reader reader(frame->data, frame->size);
+
+        MSG msg;
+        if(!msg.deserialize(&reader))
+        {
+            dispatcher->m_errors.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+
+        typedef void (*Function)(uint32_t, MSG&, void*);
+        reinterpret_cast<Function>(entry.function)(frame->endpoint, msg, entry.userData);
+
+        dispatcher->m_handled.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    static void callRaw(const HandlerEntry& entry, Frame* frame, Dispatcher* dispatcher)
+    {
+        Reader reader(frame->data, frame->size);
+
+        reinterpret_cast<RawHandler>(entry.function)(
+            frame->endpoint, frame->msgCode, &reader, entry.userData
+        );
+
+        dispatcher->m_handled.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    static inline uint32_t strandIndex(uint32_t endpoint, uint8_t msgCode)
+    {
+        uint32_t key = (endpoint << 8) | msgCode;
+        key *= 0x9E3779B1;
+        return (key >> 16) % Strands;
+    }
+
+    // Lock-free frame pool
+    uint32_t allocate();
+    void release(uint32_t idx);
+
+    void schedule(uint32_t strand, unsigned int worker);
+    bool takeTask(unsigned int self, uint32_t* strand);
+    void runStrand(unsigned int self, uint32_t strand);
+    void run(unsigned int self);
+
+    std::vector<Frame> m_frames;
+
+    // Free list head: ABA tag in the upper 32 bits, frame index in the lower
+    std::atomic<uint64_t> m_free;
+
+    Strand m_strands[Strands];
+    std::vector<std::unique_ptr<Worker>> m_workers;
+    std::vector<std::thread> m_threads;
+
+    HandlerEntry m_handlers[256];
+
+    std::atomic<uint32_t> m_nextWorker;
+    std::atomic<uint32_t> m_queued;
+    std::atomic<uint32_t> m_inFlight;
+    std::atomic<uint32_t> m_sleepers;
+    std::atomic<bool> m_stop;
+    std::mutex m_sleepMutex;
+    std::condition_variable m_wakeup;
+
+    std::atomic<uint64_t> m_posted;
+    std::atomic<uint64_t> m_dropped;
+    std::atomic<uint64_t> m_handled;
+    std::atomic<uint64_t> m_unhandled;
+    std::atomic<uint64_t> m_errors;
+    std::atomic<uint64_t> m_steals;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// IMPLEMENTATION
+
+template<int MaxFrameSize, int Strands>
+Dispatcher<MaxFrameSize, Strands>::Dispatcher(unsigned int threads, uint32_t poolSize)
+ : m_frames(poolSize)
+ , m_nextWorker(0)
+ , m_queued(0)
+ , m_inFlight(0)
+ , m_sleepers(0)
+ , m_stop(false)
+ , m_posted(0)
+ , m_dropped(0)
+ , m_handled(0)
+ , m_unhandled(0)
+ , m_errors(0)
+ , m_steals(0)
+{
+    if(threads == 0)
+        threads = std::thread::hardware_concurrency();
+    if(threads == 0)
+        threads = 1;
+
+    for(uint32_t i = 0; i < poolSize; ++i)
+        m_frames[i].freeNext.store(i + 1 < poolSize ? i + 1 : uint32_t(NONE), std::memory_order_relaxed);
+    m_free.store(poolSize ? 0 : uint32_t(NONE));
+
+    for(int i = 0; i < Strands; ++i)
+    {
+        m_strands[i].head = NONE;
+        m_strands[i].tail = NONE;
+        m_strands[i].scheduled = false;
+    }
+
+    for(unsigned int i = 0; i < threads; ++i)
+    {
+        std::unique_ptr<Worker> worker(new Worker);
+        worker->first = 0;
+        worker->count = 0;
+        m_workers.push_back(std::move(worker));
+    }
+
+    for(int i = 0; i < 256; ++i)
+        m_handlers[i].call = 0;
+}
+
+template<int MaxFrameSize, int Strands>
+Dispatcher<MaxFrameSize, Strands>::~Dispatcher()
+{
+    stop();
+}
+
+template<int MaxFrameSize, int Strands>
+uint32_t Dispatcher<MaxFrameSize, Strands>::allocate()
+{
+    uint64_t head = m_free.load(std::memory_order_acquire);
+    while(true)
+    {
+        uint32_t idx = head & 0xFFFFFFFF;
+        if(idx == NONE)
+            return NONE;
+
+        uint32_t next = m_frames[idx].freeNext.load(std::memory_order_relaxed);
+        uint64_t newHead = ((head >> 32) + 1) << 32 | next;
+
+        if(m_free.compare_exchange_weak(head, newHead, std::memory_order_acquire, std::memory_order_acquire))
+            return idx;
+    }
+}
+
+template<int MaxFrameSize, int Strands>
+void Dispatcher<MaxFrameSize, Strands>::release(uint32_t idx)
+{
+    uint64_t head = m_free.load(std::memory_order_relaxed);
+    while(true)
+    {
+        m_frames[idx].freeNext.store(head & 0xFFFFFFFF, std::memory_order_relaxed);
+        uint64_t newHead = ((head >> 32) + 1) << 32 | idx;
+
+        if(m_free.compare_exchange_weak(head, newHead, std::memory_order_release, std::memory_order_relaxed))
+            return;
+    }
+}
+
+template<int MaxFrameSize, int Strands>
+bool Dispatcher<MaxFrameSize, Strands>::post(uint32_t endpoint, uint8_t msgCode, const uint8_t* data, size_t size)
+{
+    if(size > MaxFrameSize || (size != 0 && !data))
+    {
+        m_dropped.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    uint32_t idx = allocate();
+    if(idx == NONE)
+    {
+        m_dropped.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    Frame& frame = m_frames[idx];
+    frame.next = NONE;
+    frame.endpoint = endpoint;
+    frame.msgCode = msgCode;
+    frame.size = size;
+    if(size != 0)
+        memcpy(frame.data, data, size);
+
+    m_inFlight.fetch_add(1, std::memory_order_relaxed);
+    m_posted.fetch_add(1, std::memory_order_relaxed);
+
+    uint32_t strandIdx = strandIndex(endpoint, msgCode);
+    Strand& strand = m_strands[strandIdx];
+
+    bool schedule;
+    {
+        std::lock_guard<std::mutex> lock(strand.mutex);
+
+        if(strand.tail == NONE)
+            strand.head = idx;
+        else
+            m_frames[strand.tail].next = idx;
+        strand.tail = idx;
+
+        schedule = !strand.scheduled;
+        strand.scheduled = true;
+    }
+
+    if(schedule)
+    {
+        unsigned int worker = m_nextWorker.fetch_add(1, std::memory_order_relaxed) % m_workers.size();
+        this->schedule(strandIdx, worker);
+    }
+
+    return true;
+}
+
+template<int MaxFrameSize, int Strands>
+void Dispatcher<MaxFrameSize, Strands>::schedule(uint32_t strand, unsigned int workerIdx)
+{
+    Worker& worker = *m_workers[workerIdx];
+    {
+        std::lock_guard<std::mutex> lock(worker.mutex);
+        worker.tasks[(worker.first + worker.count) % Strands] = strand;
+        worker.count++;
+    }
+
+    m_queued.fetch_add(1);
+
+    // Wake up a sleeping worker (see run() for the ordering)
+    if(m_sleepers.load() != 0)
+    {
+        std::lock_guard<std::mutex> lock(m_sleepMutex);
+        m_wakeup.notify_one();
+    }
+}
+
+template<int MaxFrameSize, int Strands>
+bool Dispatcher<MaxFrameSize, Strands>::takeTask(unsigned int self, uint32_t* strand)
+{
+    // Own deque first (oldest task)
+    {
+        Worker& worker = *m_workers[self];
+        std::lock_guard<std::mutex> lock(worker.mutex);
+        if(worker.count != 0)
+        {
+            *strand = worker.tasks[worker.first];
+            worker.first = (worker.first + 1) % Strands;
+            worker.count--;
+            m_queued.fetch_sub(1);
+            return true;
+        }
+    }
+
+    // Steal the newest task of another worker
+    for(size_t i = 1; i < m_workers.size(); ++i)
+    {
+        Worker& victim = *m_workers[(self + i) % m_workers.size()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if(victim.count != 0)
+        {
+            victim.count--;
+            *strand = victim.tasks[(victim.first + victim.count) % Strands];
+            m_queued.fetch_sub(1);
+            m_steals.fetch_add(1, std::memory_order_relaxed);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+template<int MaxFrameSize, int Strands>
+void Dispatcher<MaxFrameSize, Strands>::runStrand(unsigned int self, uint32_t strandIdx)
+{
+    Strand& strand = m_strands[strandIdx];
+
+    // Take all queued messages of the strand
+    uint32_t idx;
+    {
+        std::lock_guard<std::mutex> lock(strand.mutex);
+        idx = strand.head;
+        strand.head = NONE;
+        strand.tail = NONE;
+    }
+
+    while(idx != NONE)
+    {
+        Frame* frame = &m_frames[idx];
+
+        const HandlerEntry& entry = m_handlers[frame->msgCode];
+        if(entry.call)
+            entry.call(entry, frame, this);
+        else
+            m_unhandled.fetch_add(1, std::memory_order_relaxed);
+
+        uint32_t next = frame->next;
+        release(idx);
+        m_inFlight.fetch_sub(1, std::memory_order_release);
+        idx = next;
+    }
+
+    // Messages posted in the meantime keep the strand scheduled
+    bool reschedule;
+    {
+        std::lock_guard<std::mutex> lock(strand.mutex);
+        reschedule = (strand.head != NONE);
+        strand.scheduled = reschedule;
+    }
+
+    if(reschedule)
+        schedule(strandIdx, self);
+}
+
+template<int MaxFrameSize, int Strands>
+void Dispatcher<MaxFrameSize, Strands>::run(unsigned int self)
+{
+    while(true)
+    {
+        uint32_t strand;
+        if(takeTask(self, &strand))
+        {
+            runStrand(self, strand);
+            continue;
+        }
+
+        // Nothing to do. Registering as sleeper before checking m_queued
+        // pairs with schedule(), which increments m_queued before checking
+        // m_sleepers: one of the two always sees the other.
+        std::unique_lock<std::mutex> lock(m_sleepMutex);
+        m_sleepers.fetch_add(1);
+        m_wakeup.wait(lock, [&]() {
+            return m_queued.load() != 0 || m_stop.load();
+        });
+        m_sleepers.fetch_sub(1);
+
+        if(m_queued.load() == 0 && m_stop.load())
+            return;
+    }
+}
+
+template<int MaxFrameSize, int Strands>
+bool Dispatcher<MaxFrameSize, Strands>::start()
+{
+    if(running())
+        return false;
+
+    m_stop = false;
+    for(unsigned int i = 0; i < m_workers.size(); ++i)
+        m_threads.emplace_back(&Dispatcher::run, this, i);
+
+    return true;
+}
+
+template<int MaxFrameSize, int Strands>
+void Dispatcher<MaxFrameSize, Strands>::stop()
+{
+    if(!running())
+        return;
+
+    drain();
+
+    {
+        std::lock_guard<std::mutex> lock(m_sleepMutex);
+        m_stop = true;
+        m_wakeup.notify_all();
+    }
+
+    for(auto& thread : m_threads)
+        thread.join();
+
+    m_threads.clear();
+}
+
+template<int MaxFrameSize, int Strands>
+void Dispatcher<MaxFrameSize, Strands>::drain()
+{
+    if(!running())
+        return;
+
+    while(m_inFlight.load(std::memory_order_acquire) != 0)
+        std::this_thread::yield();
+}
+
+template<int MaxFrameSize, int Strands>
+DispatchStatistics Dispatcher<MaxFrameSize, Strands>::statistics() const
+{
+    DispatchStatistics stats;
+    stats.posted = m_posted.load(std::memory_order_relaxed);
+    stats.dropped = m_dropped.load(std::memory_order_relaxed);
+    stats.handled = m_handled.load(std::memory_order_relaxed);
+    stats.unhandled = m_unhandled.load(std::memory_order_relaxed);
+    stats.errors = m_errors.load(std::memory_order_relaxed);
+    stats.steals = m_steals.load(std::memory_order_relaxed);
+
+    return stats;
+}
+
+}
+
+#endif
@@ -0,0 +1,460 @@
+// epoll-driven set of COBS endpoints (Linux)
+// Author: Max Schwarz <max@x-quadraht.de>
+
+#ifndef LIBUCOMM_ENDPOINT_SET_H
+#define LIBUCOMM_ENDPOINT_SET_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "cobs_envelope.h"
+
+/*
+ * A gateway talking to many serial devices does not need a thread per
+ * device. EndpointSet owns the file descriptors, each paired with a
+ * COBSReader and a COBSWriter, and drives them from a few worker threads
+ * (typically one per core). Each worker waits on its own epoll instance,
+ * reads whatever is available in one read() call per ready fd, decodes it
+ * and calls the handler of the endpoint for each message:
+ *
+ * @code
+ *   typedef uc::EndpointSet<uc::Fletcher16Generator, 1024> Endpoints;
+ *   typedef Proto< uc::IO<Endpoints::EnvelopeReader, uc::IO_R> > RProto;
+ *   typedef Proto< uc::IO<Endpoints::EnvelopeWriter, uc::IO_W> > WProto;
+ *
+ *   void handle(Endpoints::Endpoint* endpoint, void* device)
+ *   {
+ *       if(endpoint->reader().msgCode() == RProto::Ping::MSG_CODE)
+ *           endpoint->send(pong);
+ *   }
+ *
+ *   Endpoints endpoints(4);      // four worker threads
+ *   for(int i = 0; i < 64; ++i)
+ *       endpoints.add(openSerial(i), &handle, &devices[i]);
+ *
+ *   endpoints.start();
+ *   ...
+ *   endpoints.stop();
+ * @endcode
+ *
+ * Endpoints are assigned to the workers round-robin and stay there, so
+ * the handlers of one endpoint are never called concurrently and may send
+ * on their endpoint without locking. Sending from other threads needs
+ * external synchronization.
+ *
+ * The fds are watched level-triggered and read with a single read() per
+ * wakeup, so they do not need to be non-blocking. Frames are written with
+ * write() as soon as they are complete. An fd which reports end of file or
+ * an error is removed from the loop (see Endpoint::closed()).
+ */
+
+namespace uc
+{
+
+/**
+ * @brief Per-endpoint counters
+ *
+ * Updated by the worker thread (and by senders for writeErrors) without
+ * synchronization. Read them from the handler or after EndpointSet::stop().
+ **/
+struct EndpointStatistics
+{
+    uint32_t reads;         //!< Successful read() calls
+    uint64_t bytes;         //!< Bytes received
+    uint32_t messages;      //!< Messages passed to the handler
+    uint32_t errors;        //!< Frames dropped (checksum / framing)
+    uint32_t writeErrors;   //!< Frames that could not be written
+};
+
+/**
+ * @brief Multi-threaded epoll loop over many COBS endpoints
+ *
+ * @a MaxPacketSize is passed to the COBSReader of each endpoint.
+ **/
+template<class ChecksumGenerator, int MaxPacketSize = 1024>
+class EndpointSet
+{
+public:
+    //! BufferedWriter which writes each frame to the fd
+    class FdWriter
+    {
+    public:
+        typedef size_t SizeType;
+
+        uint8_t* dataPointer()
+        { return m_buffer; }
+
+        SizeType dataSize() const
+        { return sizeof(m_buffer); }
+
+        void packetComplete(SizeType n);
+    private:
+        friend class EndpointSet;
+
+        int m_fd;
+        EndpointStatistics* m_stats;
+        uint8_t m_buffer[MaxPacketSize + MaxPacketSize / 254 + 8];
+    };
+
+    typedef COBSReader<ChecksumGenerator, MaxPacketSize> EnvelopeReader;
+    typedef COBSWriter<ChecksumGenerator, FdWriter> EnvelopeWriter;
+
+    class Endpoint;
+
+    //! Called for each received message (msgCode() / read() on reader())
+    typedef void (*Handler)(Endpoint* endpoint, void* userData);
+
+    class Endpoint
+    {
+    public:
+        inline int fd() const
+        { return m_fd; }
+
+        inline EnvelopeReader& reader()
+        { return m_reader; }
+
+        inline EnvelopeWriter& writer()
+        { return m_writer; }
+
+        template<class MSG>
+        bool send(const MSG& msg)
+        { return m_writer.send(msg); }
+
+        //! Worker thread the endpoint belongs to
+        inline unsigned int shard() const
+        { return m_shard; }
+
+        //! Was the fd removed after EOF or an error? (any thread)
+        inline bool closed() const
+        { return m_closed.load(std::memory_order_acquire); }
+
+        //! Counters, valid in the handler or after stop()
+        inline const EndpointStatistics& statistics() const
+        { return m_stats; }
+    private:
+        friend class EndpointSet;
+
+        Endpoint(int fd, Handler handler, void* userData, unsigned int shard)
+         : m_fd(fd)
+         , m_handler(handler)
+         , m_userData(userData)
+         , m_shard(shard)
+         , m_closed(false)
+         , m_writer(&m_output)
+        {
+            m_stats = EndpointStatistics();
+            m_output.m_fd = fd;
+            m_output.m_stats = &m_stats;
+        }
+
+        int m_fd;
+        Handler m_handler;
+        void* m_userData;
+        unsigned int m_shard;
+        std::atomic<bool> m_closed;
+
+        EndpointStatistics m_stats;
+        EnvelopeReader m_reader;
+        FdWriter m_output;
+        EnvelopeWriter m_writer;
+    };
+
+    /**
+     * @param threads Number of worker threads, 0 means one per core
+     * @param ownFds Close the endpoint fds on destruction
+     **/
+    explicit EndpointSet(unsigned int threads = 0, bool ownFds = true);
+    ~EndpointSet();
+
+    EndpointSet(const EndpointSet&) = delete;
+    EndpointSet& operator=(const EndpointSet&) = delete;
+
+    /**
+     * Add an endpoint (only before start()).
+     *
+     * @return the endpoint, or 0 on failure
+     **/
+    Endpoint* add(int fd, Handler handler, void* userData = 0);
+
+    //! Start the worker threads
+    bool start();
+
+    //! Stop and join the worker threads
+    void stop();
+
+    /**
+     * Handle ready fds of worker @a shard in the calling thread instead of a
+     * worker thread (e.g. with threads = 1 and without start()).
+     *
+     * @param timeout epoll_wait() timeout in ms
+     * @return false on epoll errors
+     **/
+    bool poll(unsigned int shard, int timeout);
+
+    inline unsigned int threads() const
+    { return m_shards.size(); }
+
+    inline size_t size() const
+    { return m_endpoints.size(); }
+
+    inline Endpoint* endpoint(size_t idx)
+    { return m_endpoints[idx].get(); }
+
+    inline bool running() const
+    { return !m_workers.empty(); }
+
+    //! epoll_wait() wakeups of worker @a shard
+    inline uint64_t wakeups(unsigned int shard) const
+    { return m_shards[shard]->wakeups; }
+private:
+    enum { MAX_EVENTS = 64, READ_SIZE = 4096 };
+
+    struct Shard
+    {
+        int epollFd;
+        int wakeFd;
+        uint64_t wakeups;
+        bool stop;
+        uint8_t buffer[READ_SIZE];
+    };
+
+    void run(Shard* shard);
+    bool handleEvents(Shard* shard, int timeout);
+    void receive(Shard* shard, Endpoint* endpoint);
+
+    std::vector<std::unique_ptr<Shard>> m_shards;
+    std::vector<std::unique_ptr<Endpoint>> m_endpoints;
+    std::vector<std::thread> m_workers;
+    bool m_ownFds;
+    bool m_valid;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// IMPLEMENTATION
+
+template<class ChecksumGenerator, int MaxPacketSize>
+void EndpointSet<ChecksumGenerator, MaxPacketSize>::FdWriter::packetComplete(SizeType n)
+{
+    const uint8_t* ptr = m_buffer;
+    while(n != 0)
+    {
+        ssize_t ret = ::write(m_fd, ptr, n);
+        if(ret < 0)
+        {
+            if(errno == EINTR)
+                continue;
+
+            m_stats->writeErrors++;
+            return;
+        }
+
+        ptr += ret;
+        n -= ret;
+    }
+}
+
+template<class ChecksumGenerator, int MaxPacketSize>
+EndpointSet<ChecksumGenerator, MaxPacketSize>::EndpointSet(unsigned int threads, bool ownFds)
+ : m_ownFds(ownFds)
+ , m_valid(true)
+{
+    if(threads == 0)
+        threads = std::thread::hardware_concurrency();
+    if(threads == 0)
+        threads = 1;
+
+    for(unsigned int i = 0; i < threads; ++i)
+    {
+        std::unique_ptr<Shard> shard(new Shard);
+        shard->epollFd = epoll_create1(EPOLL_CLOEXEC);
+        shard->wakeFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        shard->wakeups = 0;
+        shard->stop = false;
+
+        if(shard->epollFd >= 0 && shard->wakeFd >= 0)
+        {
+            // The wake fd has no endpoint (data.ptr == 0)
+            epoll_event ev = {};
+            ev.events = EPOLLIN;
+            ev.data.ptr = 0;
+            if(epoll_ctl(shard->epollFd, EPOLL_CTL_ADD, shard->wakeFd, &ev) != 0)
+                m_valid = false;
+        }
+        else
+            m_valid = false;
+
+        m_shards.push_back(std::move(shard));
+    }
+}
+
+template<class ChecksumGenerator, int MaxPacketSize>
+EndpointSet<ChecksumGenerator, MaxPacketSize>::~EndpointSet()
+{
+    stop();
+
+    for(auto& shard : m_shards)
+    {
+        if(shard->epollFd >= 0)
+            close(shard->epollFd);
+        if(shard->wakeFd >= 0)
+            close(shard->wakeFd);
+    }
+
+    if(m_ownFds)
+    {
+        for(auto& endpoint : m_endpoints)
+            close(endpoint->m_fd);
+    }
+}
+
+template<class ChecksumGenerator, int MaxPacketSize>
+typename EndpointSet<ChecksumGenerator, MaxPacketSize>::Endpoint*
+EndpointSet<ChecksumGenerator, MaxPacketSize>::add(int fd, Handler handler, void* userData)
+{
+    if(!m_valid || running() || fd < 0 || !handler)
+        return 0;
+
+    unsigned int shard = m_endpoints.size() % m_shards.size();
+    std::unique_ptr<Endpoint> endpoint(new Endpoint(fd, handler, userData, shard));
+
+    epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.ptr = endpoint.get();
+    if(epoll_ctl(m_shards[shard]->epollFd, EPOLL_CTL_ADD, fd, &ev) != 0)
+        return 0;
+
+    m_endpoints.push_back(std::move(endpoint));
+    return m_endpoints.back().get();
+}
+
+template<class ChecksumGenerator, int MaxPacketSize>
+bool EndpointSet<ChecksumGenerator, MaxPacketSize>::start()
+{
+    if(!m_valid || running())
+        return false;
+
+    for(auto& shard : m_shards)
+    {
+        shard->stop = false;
+
+        // Clear a stop request from a previous run
+        uint64_t value;
+        while(read(shard->wakeFd, &value, sizeof(value)) > 0)
+            ;
+    }
+
+    for(auto& shard : m_shards)
+        m_workers.emplace_back(&EndpointSet::run, this, shard.get());
+
+    return true;
+}
+
+template<class ChecksumGenerator, int MaxPacketSize>
+void EndpointSet<ChecksumGenerator, MaxPacketSize>::stop()
+{
+    if(!running())
+        return;
+
+    for(auto& shard : m_shards)
+    {
+        uint64_t one = 1;
+        ssize_t ret = write(shard->wakeFd, &one, sizeof(one));
+        (void)ret;
+    }
+
+    for(auto& worker : m_workers)
+        worker.join();
+
+    m_workers.clear();
+}
+
+template<class ChecksumGenerator, int MaxPacketSize>
+bool EndpointSet<ChecksumGenerator, MaxPacketSize>::poll(unsigned int shard, int timeout)
+{
+    if(!m_valid || shard >= m_shards.size())
+        return false;
+
+    return handleEvents(m_shards[shard].get(), timeout);
+}
+
+template<class ChecksumGenerator, int MaxPacketSize>
+void EndpointSet<ChecksumGenerator, MaxPacketSize>::run(Shard* shard)
+{
+    while(!shard->stop)
+    {
+        if(!handleEvents(shard, -1))
+            break;
+    }
+}
+
+template<class ChecksumGenerator, int MaxPacketSize>
+bool EndpointSet<ChecksumGenerator, MaxPacketSize>::handleEvents(Shard* shard, int timeout)
+{
+    epoll_event events[MAX_EVENTS];
+
+    int count = epoll_wait(shard->epollFd, events, MAX_EVENTS, timeout);
+    if(count < 0)
+        return errno == EINTR;
+
+    shard->wakeups++;
+
+    for(int i = 0; i < count; ++i)
+    {
+        Endpoint* endpoint = reinterpret_cast<Endpoint*>(events[i].data.ptr);
+        if(!endpoint)
+        {
+            shard->stop = true;
+            continue;
+        }
+
+        receive(shard, endpoint);
+    }
+
+    return true;
+}
+
+template<class ChecksumGenerator, int MaxPacketSize>
+void EndpointSet<ChecksumGenerator, MaxPacketSize>::receive(Shard* shard, Endpoint* endpoint)
+{
+    ssize_t size = read(endpoint->m_fd, shard->buffer, sizeof(shard->buffer));
+    if(size < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK))
+        return;
+
+    if(size <= 0)
+    {
+        // EOF or error, stop watching the fd
+        epoll_ctl(shard->epollFd, EPOLL_CTL_DEL, endpoint->m_fd, 0);
+        endpoint->m_closed.store(true, std::memory_order_release);
+        return;
+    }
+
+    endpoint->m_stats.reads++;
+    endpoint->m_stats.bytes += size;
+
+    EnvelopeReader& reader = endpoint->m_reader;
+    for(ssize_t i = 0; i < size; ++i)
+    {
+        typename EnvelopeReader::TakeResult ret = reader.take(shard->buffer[i]);
+        if(ret == EnvelopeReader::NEW_MESSAGE)
+        {
+            endpoint->m_stats.messages++;
+            endpoint->m_handler(endpoint, endpoint->m_userData);
+        }
+        else if(ret != EnvelopeReader::NEED_MORE_DATA)
+            endpoint->m_stats.errors++;
+    }
+}
+
+}
+
+#endif
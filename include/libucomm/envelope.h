@@ -126,6 +126,22 @@ public:
 
             return true;
         }
+
+        const uint8_t* consume(size_t size)
+        {
+            if(m_idx + size > m_envReader->m_idx)
+                return 0;
+
+            const uint8_t* data = m_envReader->m_buffer + m_idx;
+            m_idx += size;
+
+            return data;
+        }
+
+        size_t remaining() const
+        {
+            return m_envReader->m_idx - m_idx;
+        }
     private:
         EnvelopeReader* m_envReader;
         SizeType m_idx;
@@ -0,0 +1,411 @@
+// COBS envelope with Reed-Solomon forward error correction
+// Author: Max Schwarz <max@x-quadraht.de>
+
+#ifndef LIBUCOMM_FEC_ENVELOPE_H
+#define LIBUCOMM_FEC_ENVELOPE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "cobs_envelope.h"
+#include "reed_solomon.h"
+#include "util/error.h"
+
+/*
+ * The FEC envelope protects the stuffed COBS frame with a systematic
+ * Reed-Solomon code (see reed_solomon.h). Since the code is computed over the
+ * stuffed bytes, corrupted COBS code bytes are corrected as well.
+ *
+ * Wire format:
+ *
+ *   0x00          | start of frame
+ *   COBS frame    | message code + COBS stuffed payload + checksum, split into
+ *                 | chunks of 255 - Parity bytes
+ *   parity        | Parity bytes for each chunk, COBS stuffed (1 byte overhead)
+ *   0x00          | end of frame
+ *
+ * The receiver derives the number of chunks from the frame length, corrects
+ * up to Parity/2 byte errors per chunk and then verifies the checksum as
+ * usual. Errors turning a byte into 0x00 (or a delimiter into something
+ * else) break the framing and cannot be corrected.
+ *
+ * The total parity size of a frame is limited to 253 bytes, which limits the
+ * frame size to (253 / Parity) * (255 - Parity) bytes.
+ */
+
+namespace uc
+{
+
+//! Frame layout shared by FECWriter and FECReader
+template<int Parity>
+struct FECLayout
+{
+    enum
+    {
+        CHUNK_SIZE = 255 - Parity,
+        MAX_CHUNKS = 253 / Parity,
+        MAX_PARITY = MAX_CHUNKS * Parity,
+        MAX_FRAME = MAX_CHUNKS * CHUNK_SIZE
+    };
+
+    static inline size_t chunks(size_t frameSize)
+    { return (frameSize + CHUNK_SIZE - 1) / CHUNK_SIZE; }
+
+    //! COBS stuff @a size <= 253 bytes, writes exactly size+1 bytes
+    static size_t stuff(const uint8_t* src, size_t size, uint8_t* dst)
+    {
+        uint8_t* codePtr = dst++;
+        uint8_t code = 1;
+
+        for(size_t i = 0; i < size; ++i)
+        {
+            if(src[i] == 0x00)
+            {
+                *codePtr = code;
+                codePtr = dst++;
+                code = 1;
+            }
+            else
+            {
+                *dst++ = src[i];
+                code++;
+            }
+        }
+        *codePtr = code;
+
+        return size + 1;
+    }
+
+    /**
+     * Inverse of stuff(). Corrupted code bytes are tolerated (the result
+     * simply contains errors which are corrected later).
+     **/
+    static void unstuff(const uint8_t* src, size_t size, uint8_t* dst)
+    {
+        const uint8_t* end = src + size;
+
+        while(src != end)
+        {
+            uint8_t code = *src++;
+            for(uint8_t i = 1; i < code && src != end; ++i)
+                *dst++ = *src++;
+
+            if(src != end)
+                *dst++ = 0x00;
+        }
+    }
+};
+
+//! Error correction statistics of a FECReader
+struct FECStatistics
+{
+    uint32_t frames;              //!< Received frames
+    uint32_t correctedFrames;     //!< Frames with corrected errors
+    uint32_t correctedSymbols;    //!< Total number of corrected bytes
+    uint32_t uncorrectableFrames; //!< Frames with too many errors
+};
+
+/**
+ * @brief COBS envelope writer with FEC
+ *
+ * Same interface as COBSWriter. Each Parity bytes can correct Parity/2 byte
+ * errors per chunk of 255 - Parity bytes.
+ **/
+template<class ChecksumGenerator, class WriterType = BufferedWriter, int Parity = 16, COBSVariant Variant = COBS_PLAIN>
+class FECWriter
+{
+public:
+    typedef FECLayout<Parity> Layout;
+
+    class Reader
+    {
+    };
+
+    FECWriter(WriterType* writer)
+     : m_buffer(writer)
+     , m_cobs(&m_buffer)
+    {}
+
+    inline bool startEnvelope(uint8_t msg_code)
+    { return m_cobs.startEnvelope(msg_code); }
+
+    //! Implement the IO writer interface
+    inline bool write(const void* data, size_t size)
+    { return m_cobs.write(data, size); }
+
+    inline bool endEnvelope()
+    { return m_cobs.endEnvelope(false); }
+
+    template<class MSG>
+    bool send(const MSG& msg)
+    {
+        RETURN_IF_ERROR(startEnvelope(MSG::MSG_CODE));
+        RETURN_IF_ERROR(msg.serialize(this));
+        RETURN_IF_ERROR(endEnvelope());
+
+        return true;
+    }
+
+    template<class MSG>
+    FECWriter& operator<<(const MSG& msg)
+    {
+        send(msg);
+        return *this;
+    }
+private:
+    /**
+     * BufferedWriter seen by the COBS writer. Reserves space for the parity
+     * and appends it once the COBS frame is complete.
+     **/
+    class Buffer
+    {
+    public:
+        explicit Buffer(WriterType* writer)
+         : m_writer(writer)
+        {}
+
+        uint8_t* dataPointer()
+        { return m_writer->dataPointer(); }
+
+        size_t dataSize() const
+        {
+            size_t available = m_writer->dataSize();
+            size_t best = 0;
+
+            // Leading zero + c chunks + stuffed parity + terminator
+            for(size_t c = 1; c <= Layout::MAX_CHUNKS; ++c)
+            {
+                size_t overhead = c * Parity + 2;
+                if(available <= overhead)
+                    break;
+
+                size_t cap = available - overhead + 1;
+                if(cap > c * Layout::CHUNK_SIZE + 1)
+                    cap = c * Layout::CHUNK_SIZE + 1;
+                if(cap > best)
+                    best = cap;
+            }
+
+            return best;
+        }
+
+        void packetComplete(size_t n)
+        {
+            uint8_t* data = m_writer->dataPointer();
+
+            // Skip the leading zero written by the COBS writer
+            const uint8_t* frame = data + 1;
+            size_t size = n - 1;
+
+            size_t chunks = Layout::chunks(size);
+            uint8_t parity[Layout::MAX_PARITY];
+
+            for(size_t c = 0; c < chunks; ++c)
+            {
+                size_t offset = c * Layout::CHUNK_SIZE;
+                size_t len = size - offset;
+                if(len > Layout::CHUNK_SIZE)
+                    len = Layout::CHUNK_SIZE;
+
+                ReedSolomon<Parity>::encode(frame + offset, len, parity + c * Parity);
+            }
+
+            uint8_t* dst = data + n;
+            dst += Layout::stuff(parity, chunks * Parity, dst);
+            *dst++ = 0x00;
+
+            m_writer->packetComplete(dst - data);
+        }
+    private:
+        WriterType* m_writer;
+    };
+
+    Buffer m_buffer;
+    COBSWriter<ChecksumGenerator, Buffer, Variant> m_cobs;
+};
+
+/**
+ * @brief COBS envelope reader with FEC
+ *
+ * Same interface as COBSReader. Error statistics are available through
+ * statistics().
+ **/
+template<class ChecksumGenerator, int MaxPacketSize, int Parity = 16, COBSVariant Variant = COBS_PLAIN>
+class FECReader
+{
+public:
+    typedef FECLayout<Parity> Layout;
+    typedef COBSReader<ChecksumGenerator, MaxPacketSize, Variant> EnvelopeReader;
+    typedef typename EnvelopeReader::Reader Reader;
+
+    enum
+    {
+        //! Raw frame buffer: COBS overhead + message code + parity
+        FRAME_SIZE = MaxPacketSize + MaxPacketSize / 128 + 4 + Layout::MAX_PARITY
+    };
+
+    //! Possible take() return codes
+    enum TakeResult
+    {
+        NEW_MESSAGE,      //!< New message available, use msgCode() + read()
+        NEED_MORE_DATA,   //!< Message not yet finished (this is the default)
+        CHECKSUM_ERROR,   //!< Checksum error after error correction
+        FRAME_ERROR,      //!< The current packet was not correctly framed
+        FEC_ERROR         //!< Too many errors to correct
+    };
+
+    FECReader()
+     : m_size(0)
+     , m_synced(false)
+     , m_overflow(false)
+    {
+        resetStatistics();
+    }
+
+    TakeResult take(uint8_t c);
+
+    uint8_t msgCode() const
+    { return m_cobs.msgCode(); }
+
+    template<class MSG>
+    bool read(MSG* msg)
+    { return m_cobs.read(msg); }
+
+    template<class MSG>
+    FECReader& operator>>(MSG& msg)
+    {
+        read(&msg);
+        return *this;
+    }
+
+    inline const FECStatistics& statistics() const
+    { return m_stats; }
+
+    inline void resetStatistics()
+    { memset(&m_stats, 0, sizeof(m_stats)); }
+private:
+    TakeResult decodeFrame();
+
+    EnvelopeReader m_cobs;
+    FECStatistics m_stats;
+
+    uint8_t m_frame[FRAME_SIZE];
+    size_t m_size;
+    bool m_synced;
+    bool m_overflow;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// IMPLEMENTATION
+
+template<class ChecksumGenerator, int MaxPacketSize, int Parity, COBSVariant Variant>
+typename FECReader<ChecksumGenerator, MaxPacketSize, Parity, Variant>::TakeResult
+FECReader<ChecksumGenerator, MaxPacketSize, Parity, Variant>::take(uint8_t c)
+{
+    if(c != 0x00)
+    {
+        // Wait for the first delimiter
+        if(!m_synced)
+            return NEED_MORE_DATA;
+
+        if(m_size == FRAME_SIZE)
+            m_overflow = true;
+        else
+            m_frame[m_size++] = c;
+
+        return NEED_MORE_DATA;
+    }
+
+    m_synced = true;
+
+    // Consecutive delimiters
+    if(m_size == 0 && !m_overflow)
+        return NEED_MORE_DATA;
+
+    TakeResult ret = m_overflow ? FRAME_ERROR : decodeFrame();
+
+    m_size = 0;
+    m_overflow = false;
+
+    return ret;
+}
+
+template<class ChecksumGenerator, int MaxPacketSize, int Parity, COBSVariant Variant>
+typename FECReader<ChecksumGenerator, MaxPacketSize, Parity, Variant>::TakeResult
+FECReader<ChecksumGenerator, MaxPacketSize, Parity, Variant>::decodeFrame()
+{
+    m_stats.frames++;
+
+    // Find the chunk count matching the frame length. The number of chunks
+    // implied by the remaining length decreases strictly, so the solution is
+    // unique.
+    size_t chunks = 0;
+    size_t size = 0;
+    for(size_t c = 1; c <= Layout::MAX_CHUNKS; ++c)
+    {
+        if(m_size < c * Parity + 2)
+            break;
+
+        size_t s = m_size - c * Parity - 1;
+        if(Layout::chunks(s) == c)
+        {
+            chunks = c;
+            size = s;
+            break;
+        }
+    }
+
+    if(chunks == 0)
+        return FRAME_ERROR;
+
+    uint8_t parity[Layout::MAX_PARITY];
+    Layout::unstuff(m_frame + size, chunks * Parity + 1, parity);
+
+    int corrected = 0;
+    for(size_t c = 0; c < chunks; ++c)
+    {
+        size_t offset = c * Layout::CHUNK_SIZE;
+        size_t len = size - offset;
+        if(len > Layout::CHUNK_SIZE)
+            len = Layout::CHUNK_SIZE;
+
+        int ret = ReedSolomon<Parity>::decode(m_frame + offset, len, parity + c * Parity);
+        if(ret < 0)
+        {
+            m_stats.uncorrectableFrames++;
+            return FEC_ERROR;
+        }
+
+        corrected += ret;
+    }
+
+    if(corrected != 0)
+    {
+        m_stats.correctedFrames++;
+        m_stats.correctedSymbols += corrected;
+    }
+
+    // A miscorrection may have introduced a delimiter
+    if(memchr(m_frame, 0x00, size))
+        return FRAME_ERROR;
+
+    // Feed the corrected frame through the COBS decoder
+    m_cobs.take(0x00);
+    for(size_t i = 0; i < size; ++i)
+        m_cobs.take(m_frame[i]);
+
+    switch(m_cobs.take(0x00))
+    {
+        case EnvelopeReader::NEW_MESSAGE:
+            return NEW_MESSAGE;
+        case EnvelopeReader::CHECKSUM_ERROR:
+            return CHECKSUM_ERROR;
+        default:
+            return FRAME_ERROR;
+    }
+}
+
+}
+
+#endif
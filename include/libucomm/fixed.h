@@ -0,0 +1,130 @@
+// Fixed-point quantization of floating point values
+// Author: Max Schwarz <max@x-quadraht.de>
+
+#ifndef LIBUCOMM_FIXED_H
+#define LIBUCOMM_FIXED_H
+
+#include <limits>
+#include <cmath>
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "util/error.h"
+#include "util/byteorder.h"
+
+/*
+ * A fixed-point value with scale Num/Den represents the floating point value
+ * wire * Num / Den. Values are rounded to the nearest step and clamped to the
+ * range of the wire type.
+ *
+ * The conversions are written without branches so that loops over them can
+ * be vectorized by the compiler.
+ */
+
+namespace uc
+{
+
+namespace detail
+{
+
+/*
+ * Largest Float which is not above the maximum of Wire. The maximum is
+ * 2^N-1, which rounds up to 2^N if Float has fewer mantissa bits than N
+ * (e.g. float and int32_t). Then the next smaller Float is used.
+ */
+template<class Wire, class Float>
+constexpr Float quantizeMax()
+{
+    return (Float(std::numeric_limits<Wire>::max())
+        == Float(2) * Float(std::numeric_limits<Wire>::max() / 2 + 1))
+        ? Float(std::numeric_limits<Wire>::max()) * (Float(1) - std::numeric_limits<Float>::epsilon() / 2)
+        : Float(std::numeric_limits<Wire>::max());
+}
+
+}
+
+/**
+ * Convert @a value to the wire representation. Values outside the range of
+ * @a Wire saturate, NaN is mapped to 0.
+ **/
+template<class Wire, long Num, long Den, class Float>
+inline Wire quantize(Float value)
+{
+    constexpr Float invScale = Float(Den) / Float(Num);
+    constexpr Float lo = Float(std::numeric_limits<Wire>::min());
+    constexpr Float hi = detail::quantizeMax<Wire, Float>();
+
+    Float v = value * invScale;
+    v = (v == v) ? v : Float(0);
+    v = (v < lo) ? lo : v;
+    v = (v > hi) ? hi : v;
+
+    // Round half away from zero, the conversion truncates
+    return Wire(v + std::copysign(Float(0.5), v));
+}
+
+template<class Wire, long Num, long Den, class Float>
+inline Float dequantize(Wire value)
+{
+    constexpr Float scale = Float(Num) / Float(Den);
+    return Float(value) * scale;
+}
+
+/**
+ * @brief List codec for fixed-point quantized floating point elements
+ *
+ * Elements are quantized in blocks, which allows the compiler to vectorize the
+ * conversion when whole arrays are sent with List::setData().
+ **/
+template<class Wire, long Num, long Den>
+class FixedCodec
+{
+public:
+    void reset()
+    {}
+
+    template<ByteOrder Order, class Writer, class Float>
+    bool encode(Writer* writer, const Float* data, size_t count)
+    {
+        enum { CHUNK = 64 / sizeof(Wire) };
+        Wire chunk[CHUNK];
+
+        for(size_t i = 0; i < count; i += CHUNK)
+        {
+            size_t n = count - i;
+            if(n > CHUNK)
+                n = CHUNK;
+
+            for(size_t j = 0; j < n; ++j)
+                chunk[j] = toWire<Order>(quantize<Wire, Num, Den>(data[i+j]));
+
+            RETURN_IF_ERROR(writer->write(chunk, sizeof(Wire)*n));
+        }
+
+        return true;
+    }
+
+    template<ByteOrder Order, class Writer>
+    bool finish(Writer*)
+    { return true; }
+
+    template<ByteOrder Order, class Reader, class Float>
+    bool decode(Reader* reader, Float* dest, size_t)
+    {
+        Wire value;
+        RETURN_IF_ERROR(reader->read(&value, sizeof(value)));
+        *dest = dequantize<Wire, Num, Den, Float>(fromWire<Order>(value));
+        return true;
+    }
+
+    template<ByteOrder Order, class Reader>
+    bool skip(Reader* reader, size_t count)
+    {
+        return reader->skip(sizeof(Wire)*count);
+    }
+};
+
+}
+
+#endif
@@ -0,0 +1,617 @@
+// Fragmentation of large messages
+// Author: Max Schwarz <max@x-quadraht.de>
+
+#ifndef LIBUCOMM_FRAGMENT_H
+#define LIBUCOMM_FRAGMENT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "util/error.h"
+#include "util/memory_reader.h"
+
+/*
+ * The fragmentation layer splits serialized messages into envelope frames of
+ * at most MTU payload bytes, so receivers do not need to buffer the largest
+ * message in their envelope reader. Each fragment is sent with the message
+ * code of the original message and starts with a header:
+ *
+ *   msg id  | 1 byte: incremented for each message
+ *   index   | 2 bytes little endian: fragment index, bit 15 marks the last
+ *           | fragment
+ *
+ * The receiver either reassembles the message into a user-supplied buffer,
+ * or delivers the fragments as a stream. In streaming mode, read() is called
+ * on the first fragment. A trailing list member can then be drained with
+ * List::next() after each fragment, so the message is never stored as a
+ * whole:
+ *
+ * @code
+ *   typedef uc::FragmentReader<EnvelopeReader> Reader;
+ *   typedef Proto< uc::IO<Reader, uc::IO_R> > RProto;
+ *
+ *   Reader input;                 // streaming mode
+ *   RProto::SampleBlock msg;
+ *
+ *   switch(input.take(c))
+ *   {
+ *       case Reader::NEW_MESSAGE:  // first fragment
+ *           input.read(&msg);
+ *           // fall through
+ *       case Reader::MORE_DATA:    // next fragment
+ *           while(msg.samples.next(&sample))
+ *               handle(sample);
+ *           break;
+ *   }
+ * @endcode
+ *
+ * Elements may be split across fragments as long as they are fixed-size
+ * (raw list codec) and at most CarrySize bytes large. Lost fragments drop
+ * the whole message.
+ */
+
+namespace uc
+{
+
+enum FragmentHeader
+{
+    FRAGMENT_HEADER_SIZE = 3,
+    FRAGMENT_LAST = 0x8000   //!< Flag in the fragment index
+};
+
+/**
+ * @brief Fragmenting writer stage
+ *
+ * Wraps an envelope writer. Fragments are sent as soon as they are full,
+ * so only one fragment of @a MaxFragmentSize bytes is buffered.
+ **/
+template<class EnvelopeWriterType, int MaxFragmentSize = 64>
+class FragmentWriter
+{
+public:
+    enum { HEADER_SIZE = FRAGMENT_HEADER_SIZE };
+
+    static_assert(MaxFragmentSize > HEADER_SIZE, "fragment size too small");
+
+    class Reader
+    {
+    };
+
+    FragmentWriter(EnvelopeWriterType* envelope)
+     : m_envelope(envelope)
+     , m_mtu(MaxFragmentSize)
+     , m_msgId(0)
+    {}
+
+    /**
+     * Set the maximum envelope payload size of this link (including the
+     * fragment header, HEADER_SIZE < mtu <= MaxFragmentSize)
+     **/
+    bool setMTU(size_t mtu)
+    {
+        if(mtu <= HEADER_SIZE || mtu > MaxFragmentSize)
+            return false;
+
+        m_mtu = mtu;
+        return true;
+    }
+
+    bool startEnvelope(uint8_t msg_code)
+    {
+        m_msgCode = msg_code;
+        m_index = 0;
+        m_size = 0;
+
+        return true;
+    }
+
+    //! Implement the IO writer interface
+    bool write(const void* data, size_t size)
+    {
+        const uint8_t* ptr = reinterpret_cast<const uint8_t*>(data);
+
+        while(size != 0)
+        {
+            if(m_size == m_mtu - HEADER_SIZE)
+                RETURN_IF_ERROR(flush(false));
+
+            size_t chunk = m_mtu - HEADER_SIZE - m_size;
+            if(chunk > size)
+                chunk = size;
+
+            memcpy(m_buffer + m_size, ptr, chunk);
+            m_size += chunk;
+            ptr += chunk;
+            size -= chunk;
+        }
+
+        return true;
+    }
+
+    bool endEnvelope()
+    {
+        RETURN_IF_ERROR(flush(true));
+        m_msgId++;
+
+        return true;
+    }
+
+    template<class MSG>
+    bool send(const MSG& msg)
+    {
+        RETURN_IF_ERROR(startEnvelope(MSG::MSG_CODE));
+        RETURN_IF_ERROR(msg.serialize(this));
+        RETURN_IF_ERROR(endEnvelope());
+
+        return true;
+    }
+
+    template<class MSG>
+    FragmentWriter& operator<<(const MSG& msg)
+    {
+        send(msg);
+        return *this;
+    }
+private:
+    bool flush(bool last)
+    {
+        if(m_index >= FRAGMENT_LAST)
+            return false;
+
+        uint16_t index = m_index | (last ? FRAGMENT_LAST : 0);
+        uint8_t header[HEADER_SIZE] = {
+            m_msgId, uint8_t(index & 0xFF), uint8_t(index >> 8)
+        };
+
+        RETURN_IF_ERROR(m_envelope->startEnvelope(m_msgCode));
+        RETURN_IF_ERROR(m_envelope->write(header, sizeof(header)));
+        RETURN_IF_ERROR(m_envelope->write(m_buffer, m_size));
+        RETURN_IF_ERROR(m_envelope->endEnvelope());
+
+        m_index++;
+        m_size = 0;
+
+        return true;
+    }
+
+    EnvelopeWriterType* m_envelope;
+    size_t m_mtu;
+    uint8_t m_msgId;
+
+    uint8_t m_msgCode;
+    uint16_t m_index;
+    size_t m_size;
+    uint8_t m_buffer[MaxFragmentSize - HEADER_SIZE];
+};
+
+/**
+ * @brief Reassembly state of one fragmented message stream
+ *
+ * Checks the fragment sequence of the incoming messages and, if a buffer is
+ * set, collects the payload in it. Used by FragmentReader and (once per
+ * channel) by Demultiplexer.
+ **/
+class FragmentAssembler
+{
+public:
+    //! Possible handle() return codes
+    enum Result
+    {
+        FIRST_FRAGMENT, //!< Fragment accepted, starts a new message
+        NEXT_FRAGMENT,  //!< Fragment accepted, continues the current message
+        IGNORED,        //!< Fragment of a message that was already reported
+        BROKEN          //!< Missing fragment or buffer overflow
+    };
+
+    FragmentAssembler()
+     : m_buffer(0)
+     , m_capacity(0)
+    {
+        reset();
+    }
+
+    //! Collect messages in @a buffer of @a size bytes (0: do not collect)
+    void setBuffer(uint8_t* buffer, size_t size)
+    {
+        m_buffer = buffer;
+        m_capacity = size;
+        reset();
+    }
+
+    //! Drop the current message
+    void reset()
+    {
+        m_active = false;
+        m_discarding = false;
+        m_complete = false;
+        m_size = 0;
+    }
+
+    //! Drop the rest of the current message (following fragments are BROKEN)
+    inline void abort()
+    { m_active = false; }
+
+    Result handle(uint8_t code, uint8_t id, uint16_t index,
+        const uint8_t* data, size_t size);
+
+    inline const uint8_t* buffer() const
+    { return m_buffer; }
+
+    //! Number of collected bytes
+    inline size_t size() const
+    { return m_size; }
+
+    inline uint8_t msgCode() const
+    { return m_msgCode; }
+
+    //! Has the last fragment of the current message arrived?
+    inline bool complete() const
+    { return m_complete; }
+private:
+    uint8_t* m_buffer;
+    size_t m_capacity;
+    size_t m_size;
+
+    bool m_active;
+    bool m_discarding;
+    bool m_complete;
+    uint8_t m_msgCode;
+    uint8_t m_msgId;
+    uint16_t m_nextIndex;
+};
+
+/**
+ * @brief Reassembling reader stage
+ *
+ * Wraps an envelope reader (owned by this class), which needs to provide the
+ * consume() / remaining() reader interface. Constructed with a buffer, whole
+ * messages are reassembled into it. Without a buffer, fragments are delivered
+ * as a stream (see top of file).
+ *
+ * @a CarrySize bytes are reserved for list elements that are split across
+ * fragments in streaming mode.
+ **/
+template<class EnvelopeReaderType, int CarrySize = 16>
+class FragmentReader
+{
+public:
+    class Reader
+    {
+    public:
+        Reader()
+        {}
+
+        Reader(const uint8_t* data, size_t size)
+         : m_memory(data, size)
+         , m_stream(0)
+        {}
+
+        explicit Reader(FragmentReader* stream)
+         : m_stream(stream)
+        {}
+
+        // Implement IO::Reader interface
+        bool read(void* data, size_t size)
+        {
+            if(m_stream)
+                return m_stream->streamRead(data, size);
+
+            return m_memory.read(data, size);
+        }
+
+        bool skip(size_t size)
+        {
+            if(m_stream)
+                return m_stream->streamRead(0, size);
+
+            return m_memory.skip(size);
+        }
+
+        const uint8_t* consume(size_t size)
+        {
+            if(m_stream)
+                return m_stream->streamConsume(size);
+
+            return m_memory.consume(size);
+        }
+
+        size_t remaining() const
+        {
+            if(m_stream)
+                return m_stream->streamRemaining();
+
+            return m_memory.remaining();
+        }
+    private:
+        MemoryReader m_memory;
+
+        // In streaming mode, all copies share the position in the stream
+        FragmentReader* m_stream;
+    };
+
+    //! Possible take() return codes
+    enum TakeResult
+    {
+        NEW_MESSAGE,    //!< Message complete (streaming: first fragment)
+        MORE_DATA,      //!< Streaming: next fragment of the current message
+        NEED_MORE_DATA, //!< Message not yet finished
+        ENVELOPE_ERROR, //!< Checksum or framing error in the envelope
+        FRAGMENT_ERROR  //!< Missing fragment or buffer overflow
+    };
+
+    //! Streaming mode
+    FragmentReader()
+    {
+        resetStream();
+    }
+
+    //! Reassemble messages into @a buffer of @a size bytes
+    FragmentReader(uint8_t* buffer, size_t size)
+    {
+        m_assembler.setBuffer(buffer, size);
+        resetStream();
+    }
+
+    TakeResult take(uint8_t c);
+
+    uint8_t msgCode() const
+    { return m_assembler.msgCode(); }
+
+    //! Streaming: has the last fragment of the current message arrived?
+    inline bool complete() const
+    { return m_assembler.complete(); }
+
+    template<class MSG>
+    bool read(MSG* msg)
+    {
+        if(m_assembler.buffer())
+        {
+            Reader reader(m_assembler.buffer(), m_assembler.size());
+            return msg->deserialize(&reader);
+        }
+
+        Reader reader(this);
+        return msg->deserialize(&reader);
+    }
+
+    template<class MSG>
+    FragmentReader& operator>>(MSG& msg)
+    {
+        read(&msg);
+        return *this;
+    }
+private:
+    // Extracts the fragment from the envelope reader
+    class Fragment
+    {
+    public:
+        explicit Fragment(FragmentReader* reader)
+         : result(FRAGMENT_ERROR)
+         , m_reader(reader)
+        {}
+
+        template<class EnvReader>
+        bool deserialize(EnvReader* input);
+
+        TakeResult result;
+    private:
+        FragmentReader* m_reader;
+    };
+
+    void resetStream()
+    {
+        m_carrySize = 0;
+        m_fragment = 0;
+        m_fragmentSize = 0;
+        m_fragmentPos = 0;
+    }
+
+    TakeResult handleFragment(uint8_t code, uint8_t id, uint16_t index,
+        const uint8_t* data, size_t size);
+
+    bool streamRead(void* data, size_t size);
+    const uint8_t* streamConsume(size_t size);
+    size_t streamRemaining() const;
+
+    EnvelopeReaderType m_envelope;
+    FragmentAssembler m_assembler;
+
+    // Streaming state. The current fragment lives in the envelope buffer,
+    // unread bytes are moved to the carry buffer before the next one arrives.
+    uint8_t m_carry[CarrySize];
+    size_t m_carrySize;
+    const uint8_t* m_fragment;
+    size_t m_fragmentSize;
+    size_t m_fragmentPos;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// IMPLEMENTATION
+
+inline FragmentAssembler::Result FragmentAssembler::handle(uint8_t code,
+    uint8_t id, uint16_t index, const uint8_t* data, size_t size)
+{
+    bool last = index & FRAGMENT_LAST;
+    index &= ~FRAGMENT_LAST;
+
+    if(index == 0)
+    {
+        // Start of a new message (an unfinished one is dropped)
+        reset();
+        m_active = true;
+        m_msgCode = code;
+        m_msgId = id;
+    }
+    else if(!m_active || id != m_msgId || code != m_msgCode || index != m_nextIndex)
+    {
+        // Report each broken message only once
+        bool reported = m_discarding && id == m_msgId;
+
+        reset();
+        m_discarding = true;
+        m_msgId = id;
+
+        return reported ? IGNORED : BROKEN;
+    }
+
+    m_nextIndex = index + 1;
+
+    if(m_buffer)
+    {
+        if(m_capacity - m_size < size)
+        {
+            reset();
+            m_discarding = true;
+            return BROKEN;
+        }
+
+        memcpy(m_buffer + m_size, data, size);
+        m_size += size;
+    }
+
+    m_complete = last;
+    if(last)
+        m_active = false;
+
+    return (index == 0) ? FIRST_FRAGMENT : NEXT_FRAGMENT;
+}
+
+template<class EnvelopeReaderType, int CarrySize>
+typename FragmentReader<EnvelopeReaderType, CarrySize>::TakeResult
+FragmentReader<EnvelopeReaderType, CarrySize>::take(uint8_t c)
+{
+    // The envelope buffer is about to be overwritten, keep the unread part
+    // of the current fragment
+    if(m_fragment)
+    {
+        size_t rest = m_fragmentSize - m_fragmentPos;
+        if(m_carrySize + rest > CarrySize)
+            m_assembler.abort();
+        else
+        {
+            memcpy(m_carry + m_carrySize, m_fragment + m_fragmentPos, rest);
+            m_carrySize += rest;
+        }
+
+        m_fragment = 0;
+        m_fragmentSize = 0;
+        m_fragmentPos = 0;
+    }
+
+    typename EnvelopeReaderType::TakeResult ret = m_envelope.take(c);
+
+    if(ret == EnvelopeReaderType::NEED_MORE_DATA)
+        return NEED_MORE_DATA;
+
+    if(ret != EnvelopeReaderType::NEW_MESSAGE)
+        return ENVELOPE_ERROR;
+
+    Fragment fragment(this);
+    if(!m_envelope.read(&fragment))
+    {
+        m_assembler.abort();
+        return FRAGMENT_ERROR;
+    }
+
+    return fragment.result;
+}
+
+template<class EnvelopeReaderType, int CarrySize>
+template<class EnvReader>
+bool FragmentReader<EnvelopeReaderType, CarrySize>::Fragment::deserialize(EnvReader* input)
+{
+    uint8_t header[FRAGMENT_HEADER_SIZE];
+    RETURN_IF_ERROR(input->read(header, sizeof(header)));
+
+    uint16_t index = header[1] | (header[2] << 8);
+
+    size_t size = input->remaining();
+    const uint8_t* data = input->consume(size);
+    if(!data)
+        return false;
+
+    result = m_reader->handleFragment(
+        m_reader->m_envelope.msgCode(), header[0], index, data, size
+    );
+
+    return true;
+}
+
+template<class EnvelopeReaderType, int CarrySize>
+typename FragmentReader<EnvelopeReaderType, CarrySize>::TakeResult
+FragmentReader<EnvelopeReaderType, CarrySize>::handleFragment(uint8_t code, uint8_t id, uint16_t index,
+    const uint8_t* data, size_t size)
+{
+    FragmentAssembler::Result ret = m_assembler.handle(code, id, index, data, size);
+
+    // The carried bytes belong to the continued message only
+    if(ret != FragmentAssembler::NEXT_FRAGMENT)
+        resetStream();
+
+    if(ret == FragmentAssembler::IGNORED)
+        return NEED_MORE_DATA;
+    if(ret == FragmentAssembler::BROKEN)
+        return FRAGMENT_ERROR;
+
+    if(m_assembler.buffer())
+        return m_assembler.complete() ? NEW_MESSAGE : NEED_MORE_DATA;
+
+    m_fragment = data;
+    m_fragmentSize = size;
+    m_fragmentPos = 0;
+
+    return (ret == FragmentAssembler::FIRST_FRAGMENT) ? NEW_MESSAGE : MORE_DATA;
+}
+
+template<class EnvelopeReaderType, int CarrySize>
+bool FragmentReader<EnvelopeReaderType, CarrySize>::streamRead(void* data, size_t size)
+{
+    if(streamRemaining() < size)
+        return false;
+
+    uint8_t* dst = reinterpret_cast<uint8_t*>(data);
+
+    size_t carry = (size < m_carrySize) ? size : m_carrySize;
+    if(carry != 0)
+    {
+        if(dst)
+        {
+            memcpy(dst, m_carry, carry);
+            dst += carry;
+        }
+
+        memmove(m_carry, m_carry + carry, m_carrySize - carry);
+        m_carrySize -= carry;
+        size -= carry;
+    }
+
+    if(dst)
+        memcpy(dst, m_fragment + m_fragmentPos, size);
+    m_fragmentPos += size;
+
+    return true;
+}
+
+template<class EnvelopeReaderType, int CarrySize>
+const uint8_t* FragmentReader<EnvelopeReaderType, CarrySize>::streamConsume(size_t size)
+{
+    // Only contiguous data can be returned
+    if(m_carrySize != 0 || m_fragmentSize - m_fragmentPos < size)
+        return 0;
+
+    const uint8_t* data = m_fragment + m_fragmentPos;
+    m_fragmentPos += size;
+
+    return data;
+}
+
+template<class EnvelopeReaderType, int CarrySize>
+size_t FragmentReader<EnvelopeReaderType, CarrySize>::streamRemaining() const
+{
+    return m_carrySize + m_fragmentSize - m_fragmentPos;
+}
+
+}
+
+#endif
@@ -4,6 +4,8 @@
 #ifndef LIBUCOMM_IO_H
 #define LIBUCOMM_IO_H
 
+#include "util/byteorder.h"
+
 namespace uc
 {
 
@@ -19,13 +21,14 @@ public:
     typedef typename Handler::Reader Reader;
 };
 
-template<class _IO, bool _IsLast>
+template<class _IO, bool _IsLast, ByteOrder _WireOrder = BYTE_ORDER_HOST>
 class IOInstance
 {
 public:
     typedef _IO IO;
     typedef typename IO::Reader Reader;
     enum { IsLast = _IsLast };
+    static constexpr ByteOrder WireOrder = _WireOrder;
 };
 
 }
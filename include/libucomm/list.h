@@ -11,27 +11,44 @@
 #include "util/integers.h"
 #include "util/enable_if.h"
 #include "util/error.h"
+#include "util/byteorder.h"
+#include "codec.h"
 
 namespace uc
 {
 
-template<class IOI, class T, int Size=255, class Enable=void>
+/**
+ * @brief List with variable length
+ *
+ * @a Size is the maximum number of elements. The element count is transmitted
+ * in front of the list data, using the smallest integer type able to hold
+ * @a Size (see IntForSize). Lists longer than @a Size are rejected on both
+ * ends.
+ *
+ * The wire representation of the elements is defined by @a Codec (see
+ * codec.h).
+ **/
+template<class IOI, class T, int Size=255, class Codec=RawCodec<T>, class Enable=void>
 class List
 {
 public:
     typedef typename IntForSize<Size>::Type SizeType;
+    enum { MAX_COUNT = Size };
     typedef bool (*Callback)(T* dest, SizeType idx);
 
     bool next(T* dest);
+    bool next(T* dest, SizeType count);
+    template<class Sink> bool deserializeInto(Sink* sink);
     void setData(T* data, SizeType size);
     void setCallback(Callback cb, SizeType size);
 };
 
-template<class IOI, class T, int Size>
-class List<IOI, T, Size, typename enable_if<IOI::IO::Mode::IsReadable>::Type >
+template<class IOI, class T, int Size, class Codec>
+class List<IOI, T, Size, Codec, typename enable_if<IOI::IO::Mode::IsReadable>::Type >
 {
 public:
     typedef typename IntForSize<Size>::Type SizeType;
+    enum { MAX_COUNT = Size };
 
     inline SizeType remaining() const
     { return m_count; }
@@ -39,21 +56,23 @@ public:
     bool deserialize(typename IOI::IO::Reader* reader)
     {
         RETURN_IF_ERROR(reader->read(&m_count, sizeof(m_count)));
+        m_count = fromWire<IOI::WireOrder>(m_count);
+
+        if(m_count > Size)
+        {
+            m_count = 0;
+            return false;
+        }
 
         // Save starting point for element access
         m_reader = *reader;
+        m_codec.reset();
 
         if(!IOI::IsLast)
         {
-            if constexpr(std::is_integral_v<T>)
-            {
-                RETURN_IF_ERROR(reader->skip(sizeof(T)*m_count));
-            }
-            else
-            {
-                for(SizeType i = m_count; i; --i)
-                    RETURN_IF_ERROR(reader->skip(T::POD_SIZE));
-            }
+            Codec codec;
+            codec.reset();
+            RETURN_IF_ERROR(codec.template skip<IOI::WireOrder>(reader, m_count));
         }
 
         return true;
@@ -64,27 +83,71 @@ public:
         if(m_count == 0)
             return false;
 
+        // Only count elements which were decoded completely, so streaming
+        // readers can retry once more data has arrived.
+        RETURN_IF_ERROR(m_codec.template decode<IOI::WireOrder>(&m_reader, dest, m_count));
         m_count--;
 
-        if constexpr(std::is_integral_v<T>)
-            return m_reader.read(dest, sizeof(T));
-        else
-            return dest->deserialize(&m_reader);
+        return true;
+    }
+
+    /**
+     * Decode the next @a count elements into @a dest in one go. Arithmetic
+     * elements are read as a block and byte-swapped in bulk if the wire order
+     * differs from the host order.
+     *
+     * @return false if fewer than @a count elements are left or the data is
+     *   truncated
+     **/
+    bool next(T* dest, SizeType count)
+    {
+        static_assert(std::is_same<Codec, RawCodec<T> >::value,
+            "bulk decoding needs raw elements");
+
+        if(count > m_count)
+            return false;
+
+        RETURN_IF_ERROR(m_codec.template decodeArray<IOI::WireOrder>(&m_reader, dest, count));
+        m_count -= count;
+
+        return true;
+    }
+
+    /**
+     * Decode all remaining elements into @a sink in a single pass. The sink
+     * needs a deserializeElement(Reader*) method, like the structure-of-arrays
+     * containers generated for flat structs (Proto::Struct::SoA<Capacity>).
+     *
+     * @return false if the sink is full or the data is truncated
+     **/
+    template<class Sink>
+    bool deserializeInto(Sink* sink)
+    {
+        static_assert(std::is_same<Codec, RawCodec<T> >::value,
+            "structure-of-arrays decoding needs raw elements");
+
+        for(; m_count != 0; --m_count)
+            RETURN_IF_ERROR(sink->deserializeElement(&m_reader));
+
+        return true;
     }
 private:
     SizeType m_count;
     typename IOI::Reader m_reader;
+    Codec m_codec;
 };
 
-template<class IOI, class T, int Size>
-class List<IOI, T, Size, typename enable_if<IOI::IO::Mode::IsWritable>::Type >
+template<class IOI, class T, int Size, class Codec>
+class List<IOI, T, Size, Codec, typename enable_if<IOI::IO::Mode::IsWritable>::Type >
 {
 public:
     typedef typename IntForSize<Size>::Type SizeType;
     typedef bool (*Callback)(T* dest, SizeType idx);
+    enum { MAX_COUNT = Size };
 
     List()
-     : m_mode(MODE_EMPTY)
+     : m_count(0)
+     , m_mode(MODE_EMPTY)
     {}
 
     inline void setData(T* data, SizeType count)
@@ -103,23 +166,21 @@ public:
 
     inline bool serialize(typename IOI::IO::Handler* writer) const
     {
+        if(m_count > Size)
+            return false;
+
+        SizeType count = toWire<IOI::WireOrder>(m_count);
         RETURN_IF_ERROR(
-            writer->write(&m_count, sizeof(m_count))
+            writer->write(&count, sizeof(count))
         );
 
+        m_codec.reset();
+
         if(m_mode == MODE_DIRECT_DATA)
         {
-            if constexpr (std::is_integral_v<T>)
-            {
-                RETURN_IF_ERROR(
-                    writer->write(m_data, sizeof(T)*m_count)
-                );
-            }
-            else
-            {
-                for(SizeType i = 0; i != m_count; ++i)
-                    RETURN_IF_ERROR(m_data[i].serialize(writer));
-            }
+            RETURN_IF_ERROR(
+                m_codec.template encode<IOI::WireOrder>(writer, m_data, m_count)
+            );
         }
         else if(m_mode == MODE_CALLBACK)
         {
@@ -127,18 +188,14 @@ public:
             for(SizeType i = 0; i != m_count; ++i)
             {
                 RETURN_IF_ERROR(m_callback(&buf, i));
-
-                if constexpr (std::is_integral_v<T>)
-                {
-                    RETURN_IF_ERROR(
-                        writer->write(&buf, sizeof(T))
-                    );
-                }
-                else
-                    RETURN_IF_ERROR(buf.serialize(writer));
+                RETURN_IF_ERROR(
+                    m_codec.template encode<IOI::WireOrder>(writer, &buf, 1)
+                );
             }
         }
 
+        RETURN_IF_ERROR(m_codec.template finish<IOI::WireOrder>(writer));
+
         return true;
     }
 
@@ -151,6 +208,7 @@ private:
 
     SizeType m_count;
     Mode m_mode;
+    mutable Codec m_codec;
 
     union
     {
@@ -0,0 +1,338 @@
+// LZ77 payload compression
+// Author: Max Schwarz <max@x-quadraht.de>
+
+#ifndef LIBUCOMM_LZ77_H
+#define LIBUCOMM_LZ77_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+/*
+ * Block format (similar to LZ4):
+ *
+ *   token         | 1 byte: literal length (high nibble), match length - 4
+ *                 | (low nibble). A nibble of 15 is followed by extension
+ *                 | bytes which are added to the length, until a byte < 255.
+ *   literals      | literal length bytes
+ *   offset        | 2 bytes little endian, distance of the match (>= 1)
+ *   match length  | extension bytes (see above)
+ *
+ * The last sequence has no offset and match. Both compressors below produce
+ * the same format, so the receiver does not need to know which one was used.
+ *
+ * LZCompressor searches the window exhaustively without additional memory and
+ * is meant for small windows on microcontrollers. LZHashCompressor uses hash
+ * chains and is much faster for large windows on hosts.
+ */
+
+namespace uc
+{
+
+namespace lz
+{
+
+enum
+{
+    MIN_MATCH = 4,
+    MAX_OFFSET = 65535
+};
+
+inline bool putLength(uint8_t* dst, size_t* pos, size_t cap, size_t len)
+{
+    for(; len >= 255; len -= 255)
+    {
+        if(*pos == cap)
+            return false;
+        dst[(*pos)++] = 255;
+    }
+
+    if(*pos == cap)
+        return false;
+    dst[(*pos)++] = len;
+
+    return true;
+}
+
+/**
+ * Emit a sequence of @a litLen literals followed by a match. A @a matchLen of
+ * zero emits the final sequence.
+ **/
+inline bool putSequence(uint8_t* dst, size_t* pos, size_t cap,
+    const uint8_t* lit, size_t litLen, size_t offset, size_t matchLen)
+{
+    size_t m = matchLen ? matchLen - MIN_MATCH : 0;
+
+    if(*pos == cap)
+        return false;
+    dst[(*pos)++] = ((litLen < 15 ? litLen : 15) << 4) | (m < 15 ? m : 15);
+
+    if(litLen >= 15 && !putLength(dst, pos, cap, litLen - 15))
+        return false;
+
+    if(cap - *pos < litLen)
+        return false;
+    memcpy(dst + *pos, lit, litLen);
+    *pos += litLen;
+
+    if(!matchLen)
+        return true;
+
+    if(cap - *pos < 2)
+        return false;
+    dst[(*pos)++] = offset & 0xFF;
+    dst[(*pos)++] = offset >> 8;
+
+    if(m >= 15 && !putLength(dst, pos, cap, m - 15))
+        return false;
+
+    return true;
+}
+
+inline size_t matchLength(const uint8_t* a, const uint8_t* b, const uint8_t* end)
+{
+    const uint8_t* start = b;
+    while(b != end && *a == *b)
+    {
+        a++;
+        b++;
+    }
+    return b - start;
+}
+
+inline bool getLength(const uint8_t** src, const uint8_t* end, size_t* len)
+{
+    uint8_t c;
+    do
+    {
+        if(*src == end)
+            return false;
+        c = *(*src)++;
+        *len += c;
+    }
+    while(c == 255);
+
+    return true;
+}
+
+}
+
+/**
+ * @brief LZ77 compressor with exhaustive window search
+ *
+ * Needs no memory besides the input and output buffers. The search time grows
+ * linearly with the window size of 2^@a WindowBits bytes.
+ **/
+template<int WindowBits = 8>
+class LZCompressor
+{
+public:
+    static_assert(WindowBits > 0 && WindowBits <= 16, "invalid window size");
+
+    enum { WINDOW = (1 << WindowBits) - 1 };
+
+    /**
+     * Compress @a size bytes from @a src into @a dst.
+     *
+     * @return compressed size, or 0 if the result does not fit into @a cap
+     *   bytes.
+     **/
+    size_t compress(const uint8_t* src, size_t size, uint8_t* dst, size_t cap)
+    {
+        const uint8_t* end = src + size;
+        size_t pos = 0;
+        size_t anchor = 0;
+        size_t i = 0;
+
+        while(i + lz::MIN_MATCH <= size)
+        {
+            size_t best = 0;
+            size_t bestOffset = 0;
+            size_t start = (i > WINDOW) ? i - WINDOW : 0;
+
+            for(size_t j = i; j-- > start;)
+            {
+                size_t len = lz::matchLength(src + j, src + i, end);
+                if(len > best)
+                {
+                    best = len;
+                    bestOffset = i - j;
+                }
+            }
+
+            if(best < lz::MIN_MATCH)
+            {
+                i++;
+                continue;
+            }
+
+            if(!lz::putSequence(dst, &pos, cap, src + anchor, i - anchor, bestOffset, best))
+                return 0;
+
+            i += best;
+            anchor = i;
+        }
+
+        if(!lz::putSequence(dst, &pos, cap, src + anchor, size - anchor, 0, 0))
+            return 0;
+
+        return pos;
+    }
+};
+
+/**
+ * @brief LZ77 compressor using hash chains
+ *
+ * Keeps a hash table of 2^@a HashBits entries and a chain of 2^@a WindowBits
+ * entries (4 bytes each). At most @a MaxChain candidates are examined per
+ * position.
+ **/
+template<int WindowBits = 12, int HashBits = 12, int MaxChain = 32>
+class LZHashCompressor
+{
+public:
+    static_assert(WindowBits > 0 && WindowBits <= 16, "invalid window size");
+
+    enum
+    {
+        WINDOW = (1 << WindowBits) - 1,
+        CHAIN_SIZE = 1 << WindowBits,
+        HASH_SIZE = 1 << HashBits
+    };
+
+    size_t compress(const uint8_t* src, size_t size, uint8_t* dst, size_t cap)
+    {
+        const uint8_t* end = src + size;
+        size_t pos = 0;
+        size_t anchor = 0;
+        size_t i = 0;
+
+        for(int k = 0; k < HASH_SIZE; ++k)
+            m_head[k] = -1;
+
+        while(i + lz::MIN_MATCH <= size)
+        {
+            size_t best = 0;
+            size_t bestOffset = 0;
+
+            int32_t candidate = m_head[hash(src + i)];
+            for(int chain = 0; chain < MaxChain && candidate >= 0; ++chain)
+            {
+                if(i - candidate > WINDOW)
+                    break;
+
+                size_t len = lz::matchLength(src + candidate, src + i, end);
+                if(len > best)
+                {
+                    best = len;
+                    bestOffset = i - candidate;
+                }
+
+                candidate = m_chain[candidate & (CHAIN_SIZE-1)];
+            }
+
+            if(best < lz::MIN_MATCH)
+            {
+                insert(src, i);
+                i++;
+                continue;
+            }
+
+            if(!lz::putSequence(dst, &pos, cap, src + anchor, i - anchor, bestOffset, best))
+                return 0;
+
+            for(size_t k = i; k < i + best && k + lz::MIN_MATCH <= size; ++k)
+                insert(src, k);
+
+            i += best;
+            anchor = i;
+        }
+
+        if(!lz::putSequence(dst, &pos, cap, src + anchor, size - anchor, 0, 0))
+            return 0;
+
+        return pos;
+    }
+private:
+    static inline uint32_t hash(const uint8_t* p)
+    {
+        uint32_t v;
+        memcpy(&v, p, 4);
+        return (v * 2654435761u) >> (32 - HashBits);
+    }
+
+    inline void insert(const uint8_t* src, size_t i)
+    {
+        uint32_t h = hash(src + i);
+        m_chain[i & (CHAIN_SIZE-1)] = m_head[h];
+        m_head[h] = i;
+    }
+
+    int32_t m_head[HASH_SIZE];
+    int32_t m_chain[CHAIN_SIZE];
+};
+
+/**
+ * @brief Decompress a block produced by one of the compressors above
+ *
+ * @param size Receives the decompressed size
+ * @return false on malformed input or if the output does not fit into @a cap
+ *   bytes.
+ **/
+inline bool lzDecompress(const uint8_t* src, size_t srcSize, uint8_t* dst, size_t cap, size_t* size)
+{
+    const uint8_t* end = src + srcSize;
+    size_t pos = 0;
+
+    while(true)
+    {
+        if(src == end)
+            return false;
+
+        uint8_t token = *src++;
+
+        size_t litLen = token >> 4;
+        if(litLen == 15 && !lz::getLength(&src, end, &litLen))
+            return false;
+
+        if(size_t(end - src) < litLen || cap - pos < litLen)
+            return false;
+
+        memcpy(dst + pos, src, litLen);
+        src += litLen;
+        pos += litLen;
+
+        if(src == end)
+            break;
+
+        if(end - src < 2)
+            return false;
+
+        size_t offset = src[0] | (src[1] << 8);
+        src += 2;
+
+        if(offset == 0 || offset > pos)
+            return false;
+
+        size_t matchLen = token & 0x0F;
+        if(matchLen == 15 && !lz::getLength(&src, end, &matchLen))
+            return false;
+        matchLen += lz::MIN_MATCH;
+
+        if(cap - pos < matchLen)
+            return false;
+
+        // Byte-wise copy, source and destination may overlap
+        const uint8_t* match = dst + pos - offset;
+        for(size_t k = 0; k < matchLen; ++k)
+            dst[pos + k] = match[k];
+        pos += matchLen;
+    }
+
+    *size = pos;
+    return true;
+}
+
+}
+
+#endif
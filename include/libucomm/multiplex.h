@@ -0,0 +1,454 @@
+// Prioritized logical channels over one envelope stream
+// Author: Max Schwarz <max@x-quadraht.de>
+
+#ifndef LIBUCOMM_MULTIPLEX_H
+#define LIBUCOMM_MULTIPLEX_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "fragment.h"
+#include "util/error.h"
+#include "util/memory_reader.h"
+
+/*
+ * The multiplexer carries several logical channels over one envelope stream.
+ * Messages are queued per channel and sent in fragments of at most MTU bytes.
+ * Before each fragment, the channel with the highest priority (lowest channel
+ * number) with queued data is chosen. An urgent message therefore waits for
+ * at most the one fragment already on the wire, not for a whole large
+ * message on another channel:
+ *
+ *   worst-case latency = (MTU + own message + envelope overhead) * byte time
+ *
+ * poll() sends the next fragment. Call it whenever the link can take another
+ * fragment, e.g. when the UART TX buffer runs empty. If fragments are sent
+ * faster than the link drains them, they queue up in the link buffer, where
+ * priorities no longer apply.
+ *
+ * Each fragment is sent with the message code of its message and starts with
+ * a header:
+ *
+ *   channel | 1 byte
+ *   msg id  | 1 byte: incremented for each message on the channel
+ *   index   | 2 bytes little endian: fragment index, bit 15 marks the last
+ *           | fragment (see fragment.h)
+ *
+ * Fragments of different channels are interleaved, so the receiver keeps one
+ * reassembly buffer per channel.
+ */
+
+namespace uc
+{
+
+enum MultiplexHeader
+{
+    MULTIPLEX_HEADER_SIZE = 4
+};
+
+/**
+ * @brief Prioritized multiplexing writer stage
+ *
+ * Wraps an envelope writer. Each channel queues messages in a buffer set with
+ * setBuffer(). Queued messages are stored with a 3 byte header (message code
+ * and size), so a buffer of N bytes holds messages of up to N - 3 bytes.
+ *
+ * Channel 0 has the highest priority. Lower priority channels only get link
+ * time when all higher priority queues are empty.
+ **/
+template<class EnvelopeWriterType, int Channels = 4, int MaxFragmentSize = 64>
+class Multiplexer
+{
+public:
+    enum
+    {
+        HEADER_SIZE = MULTIPLEX_HEADER_SIZE,
+        RECORD_HEADER_SIZE = 3,
+        CHANNELS = Channels
+    };
+
+    static_assert(Channels >= 1 && Channels <= 256, "invalid channel count");
+    static_assert(MaxFragmentSize > HEADER_SIZE, "fragment size too small");
+
+    class Reader
+    {
+    };
+
+    Multiplexer(EnvelopeWriterType* envelope)
+     : m_envelope(envelope)
+     , m_mtu(MaxFragmentSize)
+     , m_writeChannel(0)
+     , m_writing(false)
+     , m_writeFailed(false)
+    {
+        for(int i = 0; i < Channels; ++i)
+        {
+            Channel& ch = m_channels[i];
+            ch.buffer = 0;
+            ch.capacity = 0;
+            ch.size = 0;
+            ch.pos = 0;
+            ch.index = 0;
+            ch.msgId = 0;
+        }
+    }
+
+    //! Set the queue buffer of @a channel. Queued messages are dropped.
+    void setBuffer(uint8_t channel, uint8_t* buffer, size_t size)
+    {
+        if(channel >= Channels)
+            return;
+
+        Channel& ch = m_channels[channel];
+        ch.buffer = buffer;
+        ch.capacity = size;
+        ch.size = 0;
+        ch.pos = 0;
+        ch.index = 0;
+    }
+
+    /**
+     * Set the maximum envelope payload size of this link (including the
+     * fragment header, HEADER_SIZE < mtu <= MaxFragmentSize)
+     **/
+    bool setMTU(size_t mtu)
+    {
+        if(mtu <= HEADER_SIZE || mtu > MaxFragmentSize)
+            return false;
+
+        m_mtu = mtu;
+        return true;
+    }
+
+    //! Start queueing a message on @a channel
+    bool startEnvelope(uint8_t channel, uint8_t msg_code)
+    {
+        if(channel >= Channels)
+            return false;
+
+        Channel& ch = m_channels[channel];
+        if(ch.capacity - ch.size < RECORD_HEADER_SIZE)
+            return false;
+
+        m_writeChannel = channel;
+        m_writing = true;
+        m_writeFailed = false;
+        m_writePos = ch.size + RECORD_HEADER_SIZE;
+
+        ch.buffer[ch.size] = msg_code;
+
+        return true;
+    }
+
+    //! Implement the IO writer interface
+    bool write(const void* data, size_t size)
+    {
+        Channel& ch = m_channels[m_writeChannel];
+
+        if(!m_writing || ch.capacity - m_writePos < size)
+        {
+            m_writeFailed = true;
+            return false;
+        }
+
+        memcpy(ch.buffer + m_writePos, data, size);
+        m_writePos += size;
+
+        return true;
+    }
+
+    //! Commit the message to the channel queue
+    bool endEnvelope()
+    {
+        if(!m_writing)
+            return false;
+
+        m_writing = false;
+
+        Channel& ch = m_channels[m_writeChannel];
+        size_t size = m_writePos - ch.size - RECORD_HEADER_SIZE;
+
+        if(m_writeFailed || size > 0xFFFF)
+            return false;
+
+        ch.buffer[ch.size + 1] = size & 0xFF;
+        ch.buffer[ch.size + 2] = size >> 8;
+        ch.size = m_writePos;
+
+        return true;
+    }
+
+    /**
+     * Queue a message on @a channel.
+     *
+     * @return false if the message does not fit into the channel buffer
+     **/
+    template<class MSG>
+    bool send(uint8_t channel, const MSG& msg)
+    {
+        RETURN_IF_ERROR(startEnvelope(channel, MSG::MSG_CODE));
+
+        if(!msg.serialize(this))
+            m_writeFailed = true;
+
+        return endEnvelope();
+    }
+
+    /**
+     * Send the next fragment of the highest priority channel. Does nothing
+     * if all queues are empty.
+     *
+     * @return false on envelope errors
+     **/
+    bool poll();
+
+    //! Are all channel queues empty?
+    bool idle() const
+    {
+        for(int i = 0; i < Channels; ++i)
+        {
+            if(m_channels[i].size != 0)
+                return false;
+        }
+
+        return true;
+    }
+
+    //! Number of bytes queued on @a channel (including record headers)
+    size_t queued(uint8_t channel) const
+    { return m_channels[channel].size; }
+private:
+    struct Channel
+    {
+        uint8_t* buffer;
+        size_t capacity;
+        size_t size;
+
+        // Progress in the first queued message
+        size_t pos;
+        uint16_t index;
+        uint8_t msgId;
+    };
+
+    EnvelopeWriterType* m_envelope;
+    size_t m_mtu;
+
+    Channel m_channels[Channels];
+
+    uint8_t m_writeChannel;
+    bool m_writing;
+    bool m_writeFailed;
+    size_t m_writePos;
+};
+
+/**
+ * @brief Demultiplexing reader stage
+ *
+ * Wraps an envelope reader (owned by this class), which needs to provide the
+ * consume() / remaining() reader interface. Each channel reassembles its
+ * messages into a buffer set with setBuffer(). Fragments for channels without
+ * a buffer are reported as FRAGMENT_ERROR.
+ **/
+template<class EnvelopeReaderType, int Channels = 4>
+class Demultiplexer
+{
+public:
+    typedef MemoryReader Reader;
+
+    //! Possible take() return codes
+    enum TakeResult
+    {
+        NEW_MESSAGE,    //!< Message complete, see channel()
+        NEED_MORE_DATA, //!< Message not yet finished
+        ENVELOPE_ERROR, //!< Checksum or framing error in the envelope
+        FRAGMENT_ERROR  //!< Missing fragment, unknown channel or overflow
+    };
+
+    Demultiplexer()
+     : m_channel(0)
+    {}
+
+    //! Reassemble messages of @a channel into @a buffer of @a size bytes
+    void setBuffer(uint8_t channel, uint8_t* buffer, size_t size)
+    {
+        if(channel >= Channels)
+            return;
+
+        m_channels[channel].setBuffer(buffer, size);
+    }
+
+    TakeResult take(uint8_t c);
+
+    //! Channel of the last completed message
+    uint8_t channel() const
+    { return m_channel; }
+
+    uint8_t msgCode() const
+    { return m_channels[m_channel].msgCode(); }
+
+    template<class MSG>
+    bool read(MSG* msg)
+    {
+        const FragmentAssembler& ch = m_channels[m_channel];
+
+        Reader reader(ch.buffer(), ch.size());
+        return msg->deserialize(&reader);
+    }
+
+    template<class MSG>
+    Demultiplexer& operator>>(MSG& msg)
+    {
+        read(&msg);
+        return *this;
+    }
+private:
+    // Extracts the fragment from the envelope reader
+    class Fragment
+    {
+    public:
+        explicit Fragment(Demultiplexer* reader)
+         : result(FRAGMENT_ERROR)
+         , m_reader(reader)
+        {}
+
+        template<class EnvReader>
+        bool deserialize(EnvReader* input);
+
+        TakeResult result;
+    private:
+        Demultiplexer* m_reader;
+    };
+
+    TakeResult handleFragment(uint8_t channel, uint8_t code, uint8_t id,
+        uint16_t index, const uint8_t* data, size_t size);
+
+    EnvelopeReaderType m_envelope;
+    FragmentAssembler m_channels[Channels];
+    uint8_t m_channel;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// IMPLEMENTATION
+
+template<class EnvelopeWriterType, int Channels, int MaxFragmentSize>
+bool Multiplexer<EnvelopeWriterType, Channels, MaxFragmentSize>::poll()
+{
+    int channel = 0;
+    while(channel < Channels && m_channels[channel].size == 0)
+        channel++;
+
+    if(channel == Channels)
+        return true;
+
+    Channel& ch = m_channels[channel];
+
+    const uint8_t* record = ch.buffer;
+    size_t size = record[1] | (record[2] << 8);
+
+    size_t chunk = size - ch.pos;
+    if(chunk > m_mtu - HEADER_SIZE)
+        chunk = m_mtu - HEADER_SIZE;
+
+    bool last = (ch.pos + chunk == size);
+
+    if(ch.index >= FRAGMENT_LAST)
+        return false;
+
+    uint16_t index = ch.index | (last ? FRAGMENT_LAST : 0);
+    uint8_t header[HEADER_SIZE] = {
+        uint8_t(channel), ch.msgId, uint8_t(index & 0xFF), uint8_t(index >> 8)
+    };
+
+    RETURN_IF_ERROR(m_envelope->startEnvelope(record[0]));
+    RETURN_IF_ERROR(m_envelope->write(header, sizeof(header)));
+    RETURN_IF_ERROR(m_envelope->write(record + RECORD_HEADER_SIZE + ch.pos, chunk));
+    RETURN_IF_ERROR(m_envelope->endEnvelope());
+
+    ch.pos += chunk;
+    ch.index++;
+
+    if(last)
+    {
+        // Drop the message from the queue
+        size_t recordSize = RECORD_HEADER_SIZE + size;
+        memmove(ch.buffer, ch.buffer + recordSize, ch.size - recordSize);
+        ch.size -= recordSize;
+
+        ch.pos = 0;
+        ch.index = 0;
+        ch.msgId++;
+    }
+
+    return true;
+}
+
+template<class EnvelopeReaderType, int Channels>
+typename Demultiplexer<EnvelopeReaderType, Channels>::TakeResult
+Demultiplexer<EnvelopeReaderType, Channels>::take(uint8_t c)
+{
+    typename EnvelopeReaderType::TakeResult ret = m_envelope.take(c);
+
+    if(ret == EnvelopeReaderType::NEED_MORE_DATA)
+        return NEED_MORE_DATA;
+
+    if(ret != EnvelopeReaderType::NEW_MESSAGE)
+        return ENVELOPE_ERROR;
+
+    Fragment fragment(this);
+    if(!m_envelope.read(&fragment))
+        return FRAGMENT_ERROR;
+
+    return fragment.result;
+}
+
+template<class EnvelopeReaderType, int Channels>
+template<class EnvReader>
+bool Demultiplexer<EnvelopeReaderType, Channels>::Fragment::deserialize(EnvReader* input)
+{
+    uint8_t header[MULTIPLEX_HEADER_SIZE];
+    RETURN_IF_ERROR(input->read(header, sizeof(header)));
+
+    uint16_t index = header[2] | (header[3] << 8);
+
+    size_t size = input->remaining();
+    const uint8_t* data = input->consume(size);
+    if(!data)
+        return false;
+
+    result = m_reader->handleFragment(
+        header[0], m_reader->m_envelope.msgCode(), header[1], index, data, size
+    );
+
+    return true;
+}
+
+template<class EnvelopeReaderType, int Channels>
+typename Demultiplexer<EnvelopeReaderType, Channels>::TakeResult
+Demultiplexer<EnvelopeReaderType, Channels>::handleFragment(uint8_t channel,
+    uint8_t code, uint8_t id, uint16_t index, const uint8_t* data, size_t size)
+{
+    if(channel >= Channels)
+        return FRAGMENT_ERROR;
+
+    FragmentAssembler& ch = m_channels[channel];
+    if(!ch.buffer())
+        return FRAGMENT_ERROR;
+
+    FragmentAssembler::Result ret = ch.handle(code, id, index, data, size);
+    if(ret == FragmentAssembler::IGNORED)
+        return NEED_MORE_DATA;
+    if(ret == FragmentAssembler::BROKEN)
+        return FRAGMENT_ERROR;
+
+    if(!ch.complete())
+        return NEED_MORE_DATA;
+
+    m_channel = channel;
+
+    return NEW_MESSAGE;
+}
+
+}
+
+#endif
@@ -0,0 +1,69 @@
+// Optional message members
+// Author: Max Schwarz <max@x-quadraht.de>
+
+#ifndef LIBUCOMM_OPTIONAL_H
+#define LIBUCOMM_OPTIONAL_H
+
+namespace uc
+{
+
+/**
+ * @brief Value with presence flag, used for "optional" members
+ *
+ * Optional members of a message are announced by a presence bitmap on the
+ * wire and only sent if they are set. Assigning a value marks the member as
+ * present.
+ *
+ * Unlike std::optional, the value is always constructed, so value() can be
+ * accessed (and modified) in place.
+ **/
+template<class T>
+class Optional
+{
+public:
+    Optional()
+     : m_value()
+     , m_present(false)
+    {}
+
+    inline Optional& operator=(const T& value)
+    {
+        set(value);
+        return *this;
+    }
+
+    inline void set(const T& value)
+    {
+        m_value = value;
+        m_present = true;
+    }
+
+    //! Mark as present and return a reference to the value
+    inline T& emplace()
+    {
+        m_present = true;
+        return m_value;
+    }
+
+    inline void clear()
+    { m_present = false; }
+
+    inline bool has() const
+    { return m_present; }
+
+    inline const T& value() const
+    { return m_value; }
+
+    inline T valueOr(const T& fallback) const
+    { return m_present ? m_value : fallback; }
+
+    inline const T* operator->() const
+    { return &m_value; }
+private:
+    T m_value;
+    bool m_present;
+};
+
+}
+
+#endif
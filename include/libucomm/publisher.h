@@ -0,0 +1,464 @@
+// Time-triggered publishing of periodic messages
+// Author: Max Schwarz <max@x-quadraht.de>
+
+#ifndef LIBUCOMM_PUBLISHER_H
+#define LIBUCOMM_PUBLISHER_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * The periodic publisher sends a set of messages at fixed rates. If all
+ * periods start at the same time, the messages are sent in bursts, and the
+ * messages at the end of a burst wait for the whole burst to be sent. The
+ * publisher instead gives each source a phase offset, so that the link load
+ * is spread evenly over the hyperperiod (the least common multiple of all
+ * periods).
+ *
+ * Each source is a message object, a period, a fill callback, which updates
+ * the message right before it is sent, and the expected size of the message
+ * on the wire. Time is given in arbitrary ticks and may wrap around:
+ *
+ * @code
+ *   uc::PeriodicPublisher<EnvelopeWriter> publisher(&envelopeWriter);
+ *   publisher.setLinkRate(11520, 1000000);      // 115200 baud, us ticks
+ *
+ *   WProto::ServoState servo;
+ *   publisher.addSource(&servo, 1000, &fillServo, 24);   // 1 kHz
+ *   publisher.addSource(&status, 100000, &fillStatus, 40); // 10 Hz
+ *
+ *   publisher.schedule();
+ *   publisher.start(micros());
+ *
+ *   while(1)
+ *       publisher.update(micros());
+ * @endcode
+ *
+ * With a link rate set, the publisher models the link as a queue and reports
+ * the resulting latency from the slot time to the end of transmission. Its
+ * jitter is the variation of this latency.
+ */
+
+namespace uc
+{
+
+//! Latency statistics of a publisher source
+struct PublisherStatistics
+{
+    uint32_t published;  //!< Messages sent
+    uint32_t skipped;    //!< Periods without message (fill failed or missed)
+    uint32_t measured;   //!< Messages with latency values (needs setLinkRate())
+    uint32_t minLatency; //!< Shortest time from slot to end of transmission
+    uint32_t maxLatency; //!< Longest time from slot to end of transmission
+
+    inline uint32_t jitter() const
+    { return measured ? (maxLatency - minLatency) : 0; }
+};
+
+/**
+ * @brief Periodic publisher with phase-offset scheduling
+ *
+ * Wraps an envelope writer (not owned), which needs to provide send(msg).
+ * Up to @a MaxSources sources can be added. The hyperperiod is divided into
+ * @a Slots slots for the phase offset computation. schedule() keeps its
+ * per-slot tables on the stack, about 6 * Slots bytes (6 KiB for the
+ * default), so reduce @a Slots on targets with small stacks.
+ **/
+template<class EnvelopeWriterType, int MaxSources = 32, int Slots = 1024>
+class PeriodicPublisher
+{
+public:
+    static_assert(MaxSources >= 1, "invalid source count");
+    static_assert(Slots >= 1 && Slots < 0xFFFF, "invalid slot count");
+
+    explicit PeriodicPublisher(EnvelopeWriterType* envelope)
+     : m_envelope(envelope)
+     , m_count(0)
+     , m_byteTime(0)
+     , m_hyperperiod(0)
+     , m_slotSize(0)
+     , m_peakLoad(0)
+    {
+        start(0);
+    }
+
+    /**
+     * Set the link throughput to model transmission times. Without it,
+     * link load is counted in bytes only.
+     *
+     * @return false if @a bytesPerSecond is 0 or the byte time cannot be
+     *   represented (less than 2^-32 ticks). The previous rate is kept.
+     **/
+    bool setLinkRate(uint32_t bytesPerSecond, uint32_t ticksPerSecond)
+    {
+        if(bytesPerSecond == 0)
+            return false;
+
+        // Ticks per byte in 32.32 fixed point
+        uint64_t byteTime = (uint64_t(ticksPerSecond) << 32) / bytesPerSecond;
+        if(byteTime == 0)
+            return false;
+
+        m_byteTime = byteTime;
+        return true;
+    }
+
+    /**
+     * Add a message source. @a fill is called right before @a msg is sent
+     * and can return false to skip this period. @a wireSize is the expected
+     * size of the message on the wire in bytes.
+     *
+     * @return source index, -1 if there is no space left
+     **/
+    template<class MSG>
+    int addSource(MSG* msg, uint32_t period, bool (*fill)(MSG* msg), size_t wireSize)
+    {
+        if(m_count == MaxSources || period == 0)
+            return -1;
+
+        Source& src = m_sources[m_count];
+        src.msg = msg;
+        src.fill = reinterpret_cast<void (*)()>(fill);
+        src.publish = &publishMessage<MSG>;
+        src.period = period;
+        src.offset = 0;
+        src.wireSize = wireSize;
+
+        return m_count++;
+    }
+
+    /**
+     * Compute phase offsets for all sources, starting with the shortest
+     * periods. Each source gets the offset which minimizes the load already
+     * placed in the slots it occupies, and among those the one furthest away
+     * from other messages. Without calling schedule(), all offsets are 0.
+     *
+     * @return false if the hyperperiod does not fit into 31 bits
+     **/
+    bool schedule();
+
+    //! Restart all periods at @a now (plus their offsets)
+    void start(uint32_t now);
+
+    //! Publish all messages that are due at @a now
+    void update(uint32_t now);
+
+    inline int sourceCount() const
+    { return m_count; }
+
+    inline uint32_t offset(int source) const
+    { return m_sources[source].offset; }
+
+    //! Least common multiple of all periods (after schedule())
+    inline uint32_t hyperperiod() const
+    { return m_hyperperiod; }
+
+    //! Highest planned load of a slot in bytes (after schedule())
+    inline uint32_t peakLoad() const
+    { return m_peakLoad; }
+
+    inline const PublisherStatistics& statistics(int source) const
+    { return m_sources[source].stats; }
+
+    //! Largest jitter of all sources
+    uint32_t maxJitter() const
+    {
+        uint32_t jitter = 0;
+        for(int i = 0; i < m_count; ++i)
+        {
+            if(m_sources[i].stats.jitter() > jitter)
+                jitter = m_sources[i].stats.jitter();
+        }
+
+        return jitter;
+    }
+
+    //! Fraction of time the link was busy since start() (needs setLinkRate())
+    float utilization() const
+    {
+        uint32_t elapsed = m_now - m_startTime;
+        if(elapsed == 0)
+            return 0.0f;
+
+        return float(m_busyTime) / elapsed;
+    }
+
+    void resetStatistics()
+    {
+        for(int i = 0; i < m_count; ++i)
+        {
+            PublisherStatistics& stats = m_sources[i].stats;
+            stats.published = 0;
+            stats.skipped = 0;
+            stats.measured = 0;
+            stats.minLatency = 0xFFFFFFFF;
+            stats.maxLatency = 0;
+        }
+
+        m_startTime = m_now;
+        m_busyTime = 0;
+    }
+private:
+    struct Source
+    {
+        void* msg;
+        void (*fill)();
+        bool (*publish)(EnvelopeWriterType* envelope, Source* src);
+
+        uint32_t period;
+        uint32_t offset;
+        size_t wireSize;
+
+        uint32_t next;
+        PublisherStatistics stats;
+    };
+
+    template<class MSG>
+    static bool publishMessage(EnvelopeWriterType* envelope, Source* src)
+    {
+        MSG* msg = reinterpret_cast<MSG*>(src->msg);
+        bool (*fill)(MSG*) = reinterpret_cast<bool (*)(MSG*)>(src->fill);
+
+        if(fill && !fill(msg))
+            return false;
+
+        return envelope->send(*msg);
+    }
+
+    static bool before(uint32_t a, uint32_t b)
+    { return int32_t(a - b) < 0; }
+
+    //! Transmission time of @a size bytes in ticks (saturating)
+    uint32_t duration(size_t size) const
+    {
+        if(size > (uint64_t(0xFFFFFFFF) << 32) / m_byteTime)
+            return 0xFFFFFFFF;
+
+        return (uint64_t(size) * m_byteTime + 0xFFFFFFFF) >> 32;
+    }
+
+    void publish(Source* src);
+
+    EnvelopeWriterType* m_envelope;
+
+    Source m_sources[MaxSources];
+    int m_count;
+
+    uint64_t m_byteTime;
+    uint32_t m_hyperperiod;
+    uint32_t m_slotSize;
+    uint32_t m_peakLoad;
+
+    uint32_t m_now;
+    uint32_t m_startTime;
+    uint32_t m_linkFree;
+    uint32_t m_busyTime;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// IMPLEMENTATION
+
+template<class EnvelopeWriterType, int MaxSources, int Slots>
+bool PeriodicPublisher<EnvelopeWriterType, MaxSources, Slots>::schedule()
+{
+    if(m_count == 0)
+        return true;
+
+    uint64_t hyperperiod = 1;
+    for(int i = 0; i < m_count; ++i)
+    {
+        uint64_t a = hyperperiod;
+        uint64_t b = m_sources[i].period;
+        while(b != 0)
+        {
+            uint64_t tmp = a % b;
+            a = b;
+            b = tmp;
+        }
+
+        hyperperiod = hyperperiod / a * m_sources[i].period;
+        if(hyperperiod >= (uint64_t(1) << 31))
+            return false;
+    }
+
+    m_hyperperiod = hyperperiod;
+    m_slotSize = (m_hyperperiod + Slots - 1) / Slots;
+    uint32_t slots = (m_hyperperiod + m_slotSize - 1) / m_slotSize;
+
+    uint32_t load[Slots] = {};
+
+    // Place sources with short periods first, they have the fewest choices
+    int order[MaxSources];
+    for(int i = 0; i < m_count; ++i)
+    {
+        int j = i;
+        while(j > 0 && m_sources[order[j-1]].period > m_sources[i].period)
+        {
+            order[j] = order[j-1];
+            --j;
+        }
+        order[j] = i;
+    }
+
+    for(int k = 0; k < m_count; ++k)
+    {
+        Source& src = m_sources[order[k]];
+
+        uint32_t span = 1;
+        if(m_byteTime != 0)
+        {
+            span = (duration(src.wireSize) + m_slotSize - 1) / m_slotSize;
+            if(span == 0)
+                span = 1;
+        }
+
+        // Distance of each slot to the next occupied one (in slots, so
+        // 16 bit are enough)
+        uint16_t dist[Slots];
+        uint16_t d = 0xFFFF;
+        for(uint32_t pass = 0; pass < 2; ++pass)
+        {
+            for(uint32_t i = 0; i < slots; ++i)
+            {
+                d = (load[i] != 0) ? 0 : ((d == 0xFFFF) ? d : d + 1);
+                if(pass == 0 || d < dist[i])
+                    dist[i] = d;
+            }
+        }
+        for(uint32_t pass = 0; pass < 2; ++pass)
+        {
+            for(uint32_t i = slots; i-- != 0;)
+            {
+                d = (load[i] != 0) ? 0 : ((d == 0xFFFF) ? d : d + 1);
+                if(d < dist[i])
+                    dist[i] = d;
+            }
+        }
+
+        // Minimize the overlap, then maximize the gap to other messages
+        uint32_t bestOffset = 0;
+        uint32_t bestCost = 0xFFFFFFFF;
+        uint32_t bestGap = 0;
+
+        for(uint32_t offset = 0; offset < src.period; offset += m_slotSize)
+        {
+            uint32_t cost = 0;
+            uint32_t gap = 0xFFFFFFFF;
+            for(uint32_t t = offset; t < m_hyperperiod; t += src.period)
+            {
+                for(uint32_t s = 0; s < span; ++s)
+                {
+                    uint32_t slot = (t / m_slotSize + s) % slots;
+                    cost += load[slot];
+                    if(dist[slot] < gap)
+                        gap = dist[slot];
+                }
+            }
+
+            if(cost < bestCost || (cost == bestCost && gap > bestGap))
+            {
+                bestCost = cost;
+                bestGap = gap;
+                bestOffset = offset;
+            }
+        }
+
+        src.offset = bestOffset;
+
+        for(uint32_t t = bestOffset; t < m_hyperperiod; t += src.period)
+        {
+            for(uint32_t s = 0; s < span; ++s)
+                load[(t / m_slotSize + s) % slots] += src.wireSize;
+        }
+    }
+
+    m_peakLoad = 0;
+    for(uint32_t i = 0; i < slots; ++i)
+    {
+        if(load[i] > m_peakLoad)
+            m_peakLoad = load[i];
+    }
+
+    return true;
+}
+
+template<class EnvelopeWriterType, int MaxSources, int Slots>
+void PeriodicPublisher<EnvelopeWriterType, MaxSources, Slots>::start(uint32_t now)
+{
+    m_now = now;
+    m_linkFree = now;
+
+    for(int i = 0; i < m_count; ++i)
+        m_sources[i].next = now + m_sources[i].offset;
+
+    resetStatistics();
+}
+
+template<class EnvelopeWriterType, int MaxSources, int Slots>
+void PeriodicPublisher<EnvelopeWriterType, MaxSources, Slots>::update(uint32_t now)
+{
+    m_now = now;
+
+    // Publish due messages in slot order
+    while(true)
+    {
+        Source* due = 0;
+        for(int i = 0; i < m_count; ++i)
+        {
+            Source* src = &m_sources[i];
+            if(before(now, src->next))
+                continue;
+
+            if(!due || before(src->next, due->next))
+                due = src;
+        }
+
+        if(!due)
+            break;
+
+        publish(due);
+    }
+}
+
+template<class EnvelopeWriterType, int MaxSources, int Slots>
+void PeriodicPublisher<EnvelopeWriterType, MaxSources, Slots>::publish(Source* src)
+{
+    uint32_t slot = src->next;
+
+    src->next += src->period;
+
+    // Periods missed completely are skipped
+    while(!before(m_now, src->next))
+    {
+        src->next += src->period;
+        src->stats.skipped++;
+    }
+
+    if(!src->publish(m_envelope, src))
+    {
+        src->stats.skipped++;
+        return;
+    }
+
+    src->stats.published++;
+
+    if(m_byteTime == 0)
+        return;
+
+    // Model the link as a queue
+    uint32_t start = before(m_linkFree, m_now) ? m_now : m_linkFree;
+    uint32_t time = duration(src->wireSize);
+    m_linkFree = start + time;
+    m_busyTime += time;
+
+    uint32_t latency = m_linkFree - slot;
+    src->stats.measured++;
+    if(latency < src->stats.minLatency)
+        src->stats.minLatency = latency;
+    if(latency > src->stats.maxLatency)
+        src->stats.maxLatency = latency;
+}
+
+}
+
+#endif
@@ -0,0 +1,328 @@
+// Shaping of outgoing frames to the link rate
+// Author: Max Schwarz <max@x-quadraht.de>
+
+#ifndef LIBUCOMM_RATE_LIMIT_H
+#define LIBUCOMM_RATE_LIMIT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "writer.h"
+
+/*
+ * Frames written faster than the link can send them pile up in the
+ * operating system (e.g. the tty buffer on Linux). Once they are there, the
+ * application cannot reorder or drop them anymore, and every new frame waits
+ * for the whole backlog.
+ *
+ * RateLimitedWriter sits between the envelope and the actual output. It
+ * models the link throughput with a token bucket and passes frames on only
+ * when the link can send them promptly. Other frames wait in a small queue in
+ * user space. The application asks ready() before sending the next message,
+ * so the TX scheduler, not the kernel, decides what goes next:
+ *
+ * @code
+ *   typedef uc::RateLimitedWriter<SerialPort> Shaper;
+ *   typedef uc::COBSWriter<uc::Fletcher16Generator, Shaper> EnvelopeWriter;
+ *
+ *   Shaper shaper(&serialPort);
+ *   shaper.setBaudRate(115200, 10, 1000000);   // 8N1, us ticks
+ *
+ *   shaper.update(micros());
+ *   while(shaper.ready(MAX_FRAME) && scheduler.poll(micros()))
+ *       ;
+ * @endcode
+ *
+ * The token bucket holds up to setBurst() bytes, which should match the
+ * buffer space of the link that still allows prompt transmission (e.g. the
+ * UART FIFO). A frame is passed on if the bucket holds enough tokens for it,
+ * or if the bucket is full (frames larger than the burst size).
+ */
+
+namespace uc
+{
+
+//! Queueing statistics of a RateLimitedWriter
+struct RateLimitStatistics
+{
+    uint32_t frames;       //!< Frames passed to the output
+    uint32_t bytes;        //!< Bytes passed to the output
+    uint32_t dropped;      //!< Frames that did not fit into the queue
+    uint32_t maxLatency;   //!< Longest time a frame waited in the queue
+    uint64_t totalLatency; //!< Sum of all queueing times
+
+    inline uint32_t meanLatency() const
+    { return frames ? totalLatency / frames : 0; }
+};
+
+namespace detail
+{
+
+// Detects the CharWriter interface
+template<class T>
+class HasWriteChar
+{
+    template<class U>
+    static char test(decltype(&U::writeChar));
+
+    template<class U>
+    static long test(...);
+public:
+    enum { Value = (sizeof(test<T>(0)) == sizeof(char)) };
+};
+
+template<class WriterType, bool CharWriter = HasWriteChar<WriterType>::Value>
+struct FrameOutput
+{
+    // BufferedWriter interface
+    static bool write(WriterType* writer, const uint8_t* data, size_t size)
+    {
+        if(writer->dataSize() < size)
+            return false;
+
+        memcpy(writer->dataPointer(), data, size);
+        writer->packetComplete(size);
+
+        return true;
+    }
+};
+
+template<class WriterType>
+struct FrameOutput<WriterType, true>
+{
+    // CharWriter interface
+    static bool write(WriterType* writer, const uint8_t* data, size_t size)
+    {
+        for(size_t i = 0; i < size; ++i)
+        {
+            if(!writer->writeChar(data[i]))
+                return false;
+        }
+
+        writer->flush();
+        return true;
+    }
+};
+
+}
+
+/**
+ * @brief Token-bucket shaping writer
+ *
+ * Implements the BufferedWriter interface for the envelope writer (e.g.
+ * COBSWriter) and passes frames on to @a WriterType, which can be a
+ * BufferedWriter or a CharWriter. Up to @a QueueSize bytes of frames (plus 6
+ * bytes per frame) are queued.
+ *
+ * Time is given in arbitrary ticks by calling update() and may wrap around.
+ **/
+template<class WriterType = BufferedWriter, int QueueSize = 512>
+class RateLimitedWriter
+{
+public:
+    enum
+    {
+        RECORD_HEADER_SIZE = 6,
+        FRAC_BITS = 32     //!< Fractional bits of rate and bucket fill
+    };
+
+    typedef size_t SizeType;
+
+    explicit RateLimitedWriter(WriterType* writer)
+     : m_writer(writer)
+     , m_rate(0)
+     , m_burst(64)
+     , m_tokens(int64_t(64) << FRAC_BITS)
+     , m_now(0)
+     , m_head(0)
+     , m_size(0)
+    {
+        resetStatistics();
+    }
+
+    /**
+     * Set the link rate. Each byte needs @a bitsPerByte bits on the line
+     * (10 for 8N1). Without a link rate (@a baud = 0), frames are passed on
+     * immediately.
+     *
+     * @return false if the rate is too small to be represented with the
+     *   given tick rate (less than 2^-32 bytes per tick). The previous rate
+     *   is kept in that case.
+     **/
+    bool setBaudRate(uint32_t baud, uint32_t bitsPerByte, uint32_t ticksPerSecond)
+    {
+        // Bytes per tick in 32.32 fixed point
+        uint64_t rate = (uint64_t(baud) << FRAC_BITS) / (uint64_t(bitsPerByte) * ticksPerSecond);
+        if(baud != 0 && rate == 0)
+            return false;
+
+        m_rate = rate;
+        return true;
+    }
+
+    //! Set the token bucket size in bytes (< 2^31)
+    void setBurst(uint32_t bytes)
+    {
+        m_burst = bytes;
+        if(m_tokens > full())
+            m_tokens = full();
+    }
+
+    //! Refill the bucket and pass on queued frames
+    void update(uint32_t now)
+    {
+        if(m_rate != 0)
+        {
+            // Avoid overflows in the refill for long idle times
+            uint32_t elapsed = now - m_now;
+            uint64_t missing = (m_tokens < full()) ? uint64_t(full() - m_tokens) : 0;
+            if(elapsed >= missing / m_rate)
+                m_tokens = full();
+            else
+                m_tokens += int64_t(elapsed * m_rate);
+        }
+
+        m_now = now;
+        flushFrames();
+    }
+
+    /**
+     * Can a frame of @a size bytes be passed on right now? If this is false,
+     * a new frame is queued.
+     **/
+    bool ready(size_t size = 1) const
+    {
+        return m_size == 0 && canSend(size);
+    }
+
+    //! Bytes waiting in the queue (including record headers)
+    inline size_t queued() const
+    { return m_size; }
+
+    inline const RateLimitStatistics& statistics() const
+    { return m_stats; }
+
+    void resetStatistics()
+    {
+        m_stats.frames = 0;
+        m_stats.bytes = 0;
+        m_stats.dropped = 0;
+        m_stats.maxLatency = 0;
+        m_stats.totalLatency = 0;
+    }
+
+    // Implement BufferedWriter interface
+    uint8_t* dataPointer()
+    {
+        // Move queued frames to the front to get contiguous space
+        if(m_head != 0)
+        {
+            memmove(m_buffer, m_buffer + m_head, m_size);
+            m_head = 0;
+        }
+
+        return m_buffer + m_size + RECORD_HEADER_SIZE;
+    }
+
+    SizeType dataSize() const
+    {
+        // Available after dataPointer() moved the queue to the front
+        size_t used = m_size + RECORD_HEADER_SIZE;
+        if(used > sizeof(m_buffer))
+            return 0;
+
+        return sizeof(m_buffer) - used;
+    }
+
+    void packetComplete(SizeType n);
+private:
+    //! Bucket fill level of a full bucket
+    inline int64_t full() const
+    { return int64_t(m_burst) << FRAC_BITS; }
+
+    bool canSend(size_t size) const
+    {
+        if(m_rate == 0)
+            return true;
+
+        return m_tokens >= (int64_t(size) << FRAC_BITS)
+            || m_tokens >= full();
+    }
+
+    void flushFrames();
+
+    WriterType* m_writer;
+
+    uint64_t m_rate;
+    uint32_t m_burst;
+    int64_t m_tokens;
+    uint32_t m_now;
+
+    // Queued frames: 2 bytes size, 4 bytes enqueue time, data
+    uint8_t m_buffer[QueueSize + RECORD_HEADER_SIZE];
+    size_t m_head;
+    size_t m_size;
+
+    RateLimitStatistics m_stats;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// IMPLEMENTATION
+
+template<class WriterType, int QueueSize>
+void RateLimitedWriter<WriterType, QueueSize>::packetComplete(SizeType n)
+{
+    if(m_head != 0 || n > dataSize() || n > 0xFFFF)
+    {
+        m_stats.dropped++;
+        return;
+    }
+
+    uint8_t* record = m_buffer + m_head + m_size;
+    record[0] = n & 0xFF;
+    record[1] = n >> 8;
+    memcpy(record + 2, &m_now, sizeof(m_now));
+
+    m_size += RECORD_HEADER_SIZE + n;
+
+    flushFrames();
+}
+
+template<class WriterType, int QueueSize>
+void RateLimitedWriter<WriterType, QueueSize>::flushFrames()
+{
+    while(m_size != 0)
+    {
+        const uint8_t* record = m_buffer + m_head;
+        size_t size = record[0] | (record[1] << 8);
+
+        if(!canSend(size))
+            return;
+
+        if(!detail::FrameOutput<WriterType>::write(m_writer, record + RECORD_HEADER_SIZE, size))
+            return;
+
+        uint32_t enqueued;
+        memcpy(&enqueued, record + 2, sizeof(enqueued));
+
+        uint32_t latency = m_now - enqueued;
+        m_stats.frames++;
+        m_stats.bytes += size;
+        m_stats.totalLatency += latency;
+        if(latency > m_stats.maxLatency)
+            m_stats.maxLatency = latency;
+
+        if(m_rate != 0)
+            m_tokens -= int64_t(size) << FRAC_BITS;
+
+        m_head += RECORD_HEADER_SIZE + size;
+        m_size -= RECORD_HEADER_SIZE + size;
+        if(m_size == 0)
+            m_head = 0;
+    }
+}
+
+}
+
+#endif
@@ -0,0 +1,327 @@
+// Reed-Solomon error correction over GF(256)
+// Author: Max Schwarz <max@x-quadraht.de>
+
+#ifndef LIBUCOMM_REED_SOLOMON_H
+#define LIBUCOMM_REED_SOLOMON_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/*
+ * Systematic Reed-Solomon code over GF(2^8) with the primitive polynomial
+ * x^8 + x^4 + x^3 + x^2 + 1 (0x11D) and generator roots alpha^0 ...
+ * alpha^(Parity-1). A codeword is at most 255 bytes long: the data bytes
+ * followed by Parity parity bytes. Shorter (shortened) codewords are allowed.
+ * Up to Parity/2 byte errors per codeword can be corrected.
+ *
+ * All tables are computed at compile time and can be placed in flash.
+ */
+
+namespace uc
+{
+
+struct GF256
+{
+    uint8_t exp[512];
+    uint8_t log[256];
+
+    constexpr GF256()
+     : exp(), log()
+    {
+        unsigned int x = 1;
+        for(int i = 0; i < 255; ++i)
+        {
+            exp[i] = x;
+            exp[i + 255] = x;
+            log[x] = i;
+
+            x <<= 1;
+            if(x & 0x100)
+                x ^= 0x11D;
+        }
+        exp[510] = exp[0];
+        exp[511] = exp[1];
+    }
+
+    constexpr uint8_t mul(uint8_t a, uint8_t b) const
+    {
+        if(a == 0 || b == 0)
+            return 0;
+        return exp[log[a] + log[b]];
+    }
+
+    constexpr uint8_t div(uint8_t a, uint8_t b) const
+    {
+        if(a == 0)
+            return 0;
+        return exp[log[a] + 255 - log[b]];
+    }
+
+    constexpr uint8_t inv(uint8_t a) const
+    {
+        return exp[255 - log[a]];
+    }
+
+    //! alpha^n
+    constexpr uint8_t pow(int n) const
+    {
+        n %= 255;
+        if(n < 0)
+            n += 255;
+        return exp[n];
+    }
+};
+
+inline constexpr GF256 gf256{};
+
+/**
+ * @brief Reed-Solomon encoder / decoder with @a Parity parity bytes
+ **/
+template<int Parity>
+class ReedSolomon
+{
+public:
+    static_assert(Parity >= 2 && Parity <= 64 && Parity % 2 == 0,
+        "Parity must be an even number between 2 and 64");
+
+    enum
+    {
+        PARITY = Parity,
+        MAX_CORRECTABLE = Parity / 2,
+        MAX_DATA = 255 - Parity
+    };
+
+    /**
+     * Compute the parity bytes for @a size data bytes
+     * (size <= MAX_DATA).
+     **/
+    static void encode(const uint8_t* data, size_t size, uint8_t* parity);
+
+    /**
+     * Correct errors in the codeword consisting of @a size data bytes and
+     * the Parity bytes at @a parity (both are corrected in place).
+     *
+     * @return Number of corrected bytes, or -1 if the errors cannot be
+     *   corrected.
+     **/
+    static int decode(uint8_t* data, size_t size, uint8_t* parity);
+private:
+    // Row stride of the multiplication table (padded for SIMD)
+    enum { STRIDE = (Parity <= 16) ? 16 : Parity };
+
+    struct Tables
+    {
+        // Generator polynomial, gen[i] is the coefficient of x^i
+        uint8_t gen[Parity + 1];
+
+        // genMul[f][j] = f * gen[Parity-1-j], the LFSR feedback terms
+        uint8_t genMul[256][STRIDE];
+
+        constexpr Tables()
+         : gen(), genMul()
+        {
+            gen[0] = 1;
+            for(int i = 0; i < Parity; ++i)
+            {
+                // Multiply by (x + alpha^i)
+                uint8_t root = gf256.pow(i);
+                for(int j = i + 1; j > 0; --j)
+                    gen[j] = gen[j-1] ^ gf256.mul(gen[j], root);
+                gen[0] = gf256.mul(gen[0], root);
+            }
+
+            for(int f = 0; f < 256; ++f)
+            {
+                for(int j = 0; j < Parity; ++j)
+                    genMul[f][j] = gf256.mul(f, gen[Parity-1-j]);
+            }
+        }
+    };
+
+    static constexpr Tables s_tables{};
+
+    //! Byte at codeword position @a i (data followed by parity)
+    static inline uint8_t& symbol(uint8_t* data, size_t size, uint8_t* parity, size_t i)
+    { return (i < size) ? data[i] : parity[i - size]; }
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// IMPLEMENTATION
+
+template<int Parity>
+void ReedSolomon<Parity>::encode(const uint8_t* data, size_t size, uint8_t* parity)
+{
+#if defined(__SSE2__)
+    if constexpr(Parity <= 16)
+    {
+        // The whole LFSR state fits into one register. Lanes above Parity stay
+        // zero since the table rows are zero-padded.
+        __m128i state = _mm_setzero_si128();
+        for(size_t i = 0; i < size; ++i)
+        {
+            uint8_t f = data[i] ^ uint8_t(_mm_cvtsi128_si32(state));
+            state = _mm_srli_si128(state, 1);
+            state = _mm_xor_si128(state,
+                _mm_loadu_si128(reinterpret_cast<const __m128i*>(s_tables.genMul[f]))
+            );
+        }
+
+        uint8_t out[16];
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out), state);
+        memcpy(parity, out, Parity);
+        return;
+    }
+#endif
+
+    uint8_t state[Parity] = {};
+    for(size_t i = 0; i < size; ++i)
+    {
+        uint8_t f = data[i] ^ state[0];
+        const uint8_t* row = s_tables.genMul[f];
+
+        for(int j = 0; j < Parity - 1; ++j)
+            state[j] = state[j+1] ^ row[j];
+        state[Parity-1] = row[Parity-1];
+    }
+
+    memcpy(parity, state, Parity);
+}
+
+template<int Parity>
+int ReedSolomon<Parity>::decode(uint8_t* data, size_t size, uint8_t* parity)
+{
+    const size_t n = size + Parity;
+
+    // Fast path: recompute the parity
+    uint8_t check[Parity];
+    encode(data, size, check);
+    if(memcmp(check, parity, Parity) == 0)
+        return 0;
+
+    // Syndromes S_i = r(alpha^i)
+    uint8_t S[Parity];
+    for(int i = 0; i < Parity; ++i)
+    {
+        uint8_t a = gf256.pow(i);
+        uint8_t s = 0;
+        for(size_t j = 0; j < n; ++j)
+            s = gf256.mul(s, a) ^ symbol(data, size, parity, j);
+        S[i] = s;
+    }
+
+    // Berlekamp-Massey: error locator polynomial C
+    uint8_t C[Parity + 1] = {1};
+    uint8_t B[Parity + 1] = {1};
+    int L = 0;
+    int m = 1;
+    uint8_t b = 1;
+
+    for(int k = 0; k < Parity; ++k)
+    {
+        uint8_t d = S[k];
+        for(int i = 1; i <= L; ++i)
+            d ^= gf256.mul(C[i], S[k-i]);
+
+        if(d == 0)
+        {
+            m++;
+            continue;
+        }
+
+        uint8_t coef = gf256.div(d, b);
+
+        if(2*L <= k)
+        {
+            uint8_t T[Parity + 1];
+            memcpy(T, C, sizeof(T));
+
+            for(int i = 0; i + m <= Parity; ++i)
+                C[i + m] ^= gf256.mul(coef, B[i]);
+
+            L = k + 1 - L;
+            memcpy(B, T, sizeof(B));
+            b = d;
+            m = 1;
+        }
+        else
+        {
+            for(int i = 0; i + m <= Parity; ++i)
+                C[i + m] ^= gf256.mul(coef, B[i]);
+            m++;
+        }
+    }
+
+    if(L > MAX_CORRECTABLE)
+        return -1;
+
+    // Error evaluator Omega(x) = S(x) C(x) mod x^Parity
+    uint8_t Omega[Parity] = {};
+    for(int i = 0; i < Parity; ++i)
+    {
+        for(int j = 0; j <= L && j <= i; ++j)
+            Omega[i] ^= gf256.mul(S[i-j], C[j]);
+    }
+
+    // Chien search + Forney
+    int found = 0;
+    for(size_t j = 0; j < n; ++j)
+    {
+        // Position j has degree n-1-j, locator X = alpha^(n-1-j)
+        int degree = n - 1 - j;
+        uint8_t Xinv = gf256.pow(-degree);
+
+        uint8_t value = 0;
+        uint8_t xpow = 1;
+        for(int i = 0; i <= L; ++i)
+        {
+            value ^= gf256.mul(C[i], xpow);
+            xpow = gf256.mul(xpow, Xinv);
+        }
+
+        if(value != 0)
+            continue;
+
+        // Formal derivative C'(x) only has odd terms
+        uint8_t deriv = 0;
+        xpow = 1;
+        uint8_t Xinv2 = gf256.mul(Xinv, Xinv);
+        for(int i = 1; i <= L; i += 2)
+        {
+            deriv ^= gf256.mul(C[i], xpow);
+            xpow = gf256.mul(xpow, Xinv2);
+        }
+
+        if(deriv == 0)
+            return -1;
+
+        uint8_t omega = 0;
+        xpow = 1;
+        for(int i = 0; i < Parity; ++i)
+        {
+            omega ^= gf256.mul(Omega[i], xpow);
+            xpow = gf256.mul(xpow, Xinv);
+        }
+
+        // e = X * Omega(X^-1) / C'(X^-1) for first consecutive root alpha^0
+        uint8_t X = gf256.pow(degree);
+        uint8_t e = gf256.div(gf256.mul(X, omega), deriv);
+
+        symbol(data, size, parity, j) ^= e;
+        found++;
+    }
+
+    // All roots of the locator need to be inside the (shortened) codeword
+    if(found != L)
+        return -1;
+
+    return found;
+}
+
+}
+
+#endif
@@ -0,0 +1,377 @@
+// COBS envelope writer which can be suspended when the output is full
+// Author: Max Schwarz <max@x-quadraht.de>
+
+#ifndef LIBUCOMM_RESUMABLE_H
+#define LIBUCOMM_RESUMABLE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "writer.h"
+#include "util/byteorder.h"
+
+/*
+ * COBSWriter needs space for the whole frame in the BufferedWriter region.
+ * If the output is full, send() fails and the frame is lost. With
+ * non-blocking sockets or small TX buffers, this means either large buffers
+ * or blocking until there is space.
+ *
+ * ResumableCOBSWriter produces the same frames, but writes them in pieces of
+ * whatever size the output offers. If the output is full, send() returns
+ * SUSPENDED, and resume() continues the frame once there is space again:
+ *
+ * @code
+ *   typedef uc::ResumableCOBSWriter<uc::Fletcher16Generator, SocketBuffer> Writer;
+ *   typedef Proto< uc::IO<Writer, uc::IO_W> > WProto;
+ *
+ *   if(writer.send(msg) == Writer::SUSPENDED)
+ *       waitForSpace();             // e.g. EPOLLOUT
+ *
+ *   // later
+ *   if(writer.resume() == Writer::DONE)
+ *       sendNextMessage();
+ * @endcode
+ *
+ * The encoder keeps its COBS state (the current block of up to 254 bytes
+ * and the checksum) between calls. The position in the message is kept as
+ * the number of payload bytes already encoded. On resume(), the message is
+ * serialized again and the bytes up to that position are skipped, which
+ * brings the serializer back to the same member and list element. The
+ * message therefore must stay valid and unchanged until the frame is done.
+ *
+ * Only complete COBS blocks are passed to the output, each call to
+ * packetComplete() on the output carries a part of the frame.
+ */
+
+namespace uc
+{
+
+/**
+ * @brief Resumable COBS envelope writer
+ *
+ * Writes plain COBS frames (compatible with COBSReader) to an output with
+ * the BufferedWriter interface. The output may offer less space than a
+ * frame needs (down to a single byte).
+ **/
+template<class ChecksumGenerator, class WriterType = BufferedWriter>
+class ResumableCOBSWriter
+{
+public:
+    class Reader
+    {
+    };
+
+    //! send() / resume() results
+    enum Status
+    {
+        DONE,      //!< Frame completely passed to the output
+        SUSPENDED, //!< Output full, call resume() later
+        FAILED     //!< Serialization failed or a frame is still in progress
+    };
+
+    explicit ResumableCOBSWriter(WriterType* writer)
+     : m_writer(writer)
+     , m_phase(PHASE_IDLE)
+    {}
+
+    /**
+     * Start sending @a msg. If the result is SUSPENDED, @a msg needs to stay
+     * valid and unchanged until resume() returns DONE.
+     **/
+    template<class MSG>
+    Status send(const MSG& msg)
+    {
+        if(m_phase != PHASE_IDLE)
+            return FAILED;
+
+        if(MSG::MSG_CODE >= 255)
+            return FAILED;
+
+        m_msg = &msg;
+        m_serialize = &serializeMessage<MSG>;
+
+        begin(MSG::MSG_CODE);
+
+        return run();
+    }
+
+    //! Continue the current frame
+    Status resume()
+    {
+        if(m_phase == PHASE_IDLE)
+            return DONE;
+
+        return run();
+    }
+
+    //! Is a frame in progress?
+    inline bool busy() const
+    { return m_phase != PHASE_IDLE; }
+
+    /**
+     * Drop the current frame. The receiver discards the partial frame when
+     * the next one starts.
+     **/
+    void abort()
+    { m_phase = PHASE_IDLE; }
+
+    //! Implement the IO writer interface (used during serialization)
+    bool write(const void* data, size_t size);
+private:
+    enum Phase
+    {
+        PHASE_IDLE,
+        PHASE_PAYLOAD,
+        PHASE_CHECKSUM,
+        PHASE_FINISH,
+        PHASE_LAST_BLOCK,
+        PHASE_DELIMITER
+    };
+
+    enum { MAX_BLOCK = 254 };
+
+    template<class MSG>
+    static bool serializeMessage(ResumableCOBSWriter* writer, const void* msg)
+    { return reinterpret_cast<const MSG*>(msg)->serialize(writer); }
+
+    void begin(uint8_t msg_code);
+    Status run();
+
+    //! Pass pending output on, @return true if everything was written
+    bool flush();
+
+    //! Encode a payload byte, @return false if the encoder is stalled
+    bool encode(uint8_t c);
+
+    //! Move the finished block to the pending output
+    bool emitBlock();
+
+    WriterType* m_writer;
+
+    const void* m_msg;
+    bool (*m_serialize)(ResumableCOBSWriter* writer, const void* msg);
+
+    Phase m_phase;
+
+    // Position in the serialized message
+    size_t m_consumed;
+    size_t m_pos;
+    bool m_stalled;
+
+    ChecksumGenerator m_checksum;
+    uint8_t m_sum[sizeof(typename ChecksumGenerator::SumType)];
+    size_t m_sumIdx;
+
+    // COBS block under construction (code byte first)
+    uint8_t m_block[MAX_BLOCK + 1];
+    size_t m_blockSize;
+    bool m_blockDone;
+
+    // Output not yet accepted by the writer
+    uint8_t m_pending[MAX_BLOCK + 3];
+    size_t m_pendingPos;
+    size_t m_pendingSize;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// IMPLEMENTATION
+
+template<class ChecksumGenerator, class WriterType>
+void ResumableCOBSWriter<ChecksumGenerator, WriterType>::begin(uint8_t msg_code)
+{
+    m_phase = PHASE_PAYLOAD;
+    m_consumed = 0;
+    m_sumIdx = 0;
+
+    m_checksum.reset();
+    m_checksum.add(msg_code + 1);
+
+    // Start delimiter and message code are not stuffed
+    m_pending[0] = 0x00;
+    m_pending[1] = msg_code + 1;
+    m_pendingPos = 0;
+    m_pendingSize = 2;
+
+    m_blockSize = 0;
+    m_blockDone = false;
+}
+
+template<class ChecksumGenerator, class WriterType>
+typename ResumableCOBSWriter<ChecksumGenerator, WriterType>::Status
+ResumableCOBSWriter<ChecksumGenerator, WriterType>::run()
+{
+    if(m_phase == PHASE_PAYLOAD)
+    {
+        m_pos = 0;
+        m_stalled = false;
+
+        bool ok = m_serialize(this, m_msg);
+        if(m_stalled)
+        {
+            flush();
+            return SUSPENDED;
+        }
+
+        if(!ok)
+        {
+            m_phase = PHASE_IDLE;
+            return FAILED;
+        }
+
+        // The checksum is always transmitted in little endian byte order
+        typename ChecksumGenerator::SumType sum = toWire<BYTE_ORDER_LITTLE>(m_checksum.value());
+        memcpy(m_sum, &sum, sizeof(m_sum));
+
+        m_phase = PHASE_CHECKSUM;
+    }
+
+    if(m_phase == PHASE_CHECKSUM)
+    {
+        for(; m_sumIdx != sizeof(m_sum); ++m_sumIdx)
+        {
+            if(!encode(m_sum[m_sumIdx]))
+                return SUSPENDED;
+        }
+
+        m_phase = PHASE_FINISH;
+    }
+
+    if(m_phase == PHASE_FINISH)
+    {
+        // A block finished by a zero or by its length is followed by
+        // another one, which ends with the implicit zero at the end of the
+        // packet.
+        if(m_blockDone && !emitBlock())
+            return SUSPENDED;
+
+        m_block[0] = m_blockSize + 1;
+        m_blockDone = true;
+
+        m_phase = PHASE_LAST_BLOCK;
+    }
+
+    if(m_phase == PHASE_LAST_BLOCK)
+    {
+        if(!emitBlock())
+            return SUSPENDED;
+
+        // Append the end delimiter
+        m_pending[m_pendingPos + m_pendingSize++] = 0x00;
+
+        m_phase = PHASE_DELIMITER;
+    }
+
+    if(m_phase == PHASE_DELIMITER)
+    {
+        if(!flush())
+            return SUSPENDED;
+
+        m_phase = PHASE_IDLE;
+    }
+
+    return DONE;
+}
+
+template<class ChecksumGenerator, class WriterType>
+bool ResumableCOBSWriter<ChecksumGenerator, WriterType>::write(const void* data, size_t size)
+{
+    const uint8_t* ptr = reinterpret_cast<const uint8_t*>(data);
+
+    // Skip the part which was encoded before
+    if(m_pos < m_consumed)
+    {
+        size_t skip = m_consumed - m_pos;
+        if(skip > size)
+            skip = size;
+
+        ptr += skip;
+        size -= skip;
+        m_pos += skip;
+    }
+
+    for(size_t i = 0; i < size; ++i)
+    {
+        if(!encode(ptr[i]))
+        {
+            m_stalled = true;
+            return false;
+        }
+
+        m_pos++;
+        m_consumed++;
+    }
+
+    return true;
+}
+
+template<class ChecksumGenerator, class WriterType>
+bool ResumableCOBSWriter<ChecksumGenerator, WriterType>::encode(uint8_t c)
+{
+    if(m_blockDone && !emitBlock())
+        return false;
+
+    m_checksum.add(c);
+
+    if(c == 0x00)
+    {
+        m_block[0] = m_blockSize + 1;
+        m_blockDone = true;
+    }
+    else
+    {
+        m_block[1 + m_blockSize++] = c;
+        if(m_blockSize == MAX_BLOCK)
+        {
+            m_block[0] = 0xFF;
+            m_blockDone = true;
+        }
+    }
+
+    return true;
+}
+
+template<class ChecksumGenerator, class WriterType>
+bool ResumableCOBSWriter<ChecksumGenerator, WriterType>::emitBlock()
+{
+    if(!flush())
+        return false;
+
+    memcpy(m_pending, m_block, m_blockSize + 1);
+    m_pendingPos = 0;
+    m_pendingSize = m_blockSize + 1;
+
+    m_blockSize = 0;
+    m_blockDone = false;
+
+    // Pass the block on right away if there is space
+    flush();
+
+    return true;
+}
+
+template<class ChecksumGenerator, class WriterType>
+bool ResumableCOBSWriter<ChecksumGenerator, WriterType>::flush()
+{
+    while(m_pendingSize != 0)
+    {
+        size_t size = m_writer->dataSize();
+        if(size == 0)
+            return false;
+
+        if(size > m_pendingSize)
+            size = m_pendingSize;
+
+        memcpy(m_writer->dataPointer(), m_pending + m_pendingPos, size);
+        m_writer->packetComplete(size);
+
+        m_pendingPos += size;
+        m_pendingSize -= size;
+    }
+
+    return true;
+}
+
+}
+
+#endif
@@ -0,0 +1,358 @@
+// Deadline-aware scheduling of outgoing messages
+// Author: Max Schwarz <max@x-quadraht.de>
+
+#ifndef LIBUCOMM_SCHEDULER_H
+#define LIBUCOMM_SCHEDULER_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * The TX scheduler decides which message goes out next when the link is
+ * saturated. Messages are submitted with a priority and a deadline and kept
+ * in a fixed-capacity priority queue. Only a pointer to the message is
+ * stored, and the message is serialized when it is sent, so it has to stay
+ * valid until then. A message updated in place is therefore always sent with
+ * its latest content.
+ *
+ * poll() sends the most important queued message: highest priority first,
+ * then earliest deadline, then submission order. Messages whose deadline
+ * has passed are dropped without being sent.
+ *
+ * Submitting a message with the same message code and key as a queued one
+ * supersedes the queued copy, which keeps its place in the queue. Periodic
+ * messages thus never pile up, and the receiver gets fresh data instead of a
+ * backlog:
+ *
+ * @code
+ *   typedef uc::TxScheduler<EnvelopeWriter, 16> Scheduler;
+ *   Scheduler scheduler(&envelopeWriter);
+ *
+ *   // Control loop
+ *   scheduler.submit(servoCommand, 2, now + 5, servoId);
+ *   scheduler.submit(status, 0, now + 100);
+ *
+ *   // Whenever the link can take the next frame
+ *   scheduler.poll(now);
+ * @endcode
+ *
+ * Time is given in arbitrary ticks and may wrap around.
+ */
+
+namespace uc
+{
+
+//! Statistics of a TxScheduler
+struct TxSchedulerStatistics
+{
+    uint32_t submitted;  //!< Accepted messages
+    uint32_t sent;       //!< Messages serialized into the envelope
+    uint32_t superseded; //!< Queued messages replaced by a newer copy
+    uint32_t expired;    //!< Messages dropped after their deadline
+    uint32_t rejected;   //!< Messages not accepted or evicted (queue full)
+    uint32_t errors;     //!< Envelope errors while sending
+};
+
+/**
+ * @brief Priority queue for outgoing messages
+ *
+ * Wraps an envelope writer (not owned), which needs to provide send(msg).
+ * At most @a Capacity messages are queued. If the queue is full, a new
+ * message evicts the least important queued one if it is more important,
+ * and is rejected otherwise.
+ **/
+template<class EnvelopeWriterType, int Capacity = 16>
+class TxScheduler
+{
+public:
+    static_assert(Capacity >= 1 && Capacity <= 255, "invalid capacity");
+
+    explicit TxScheduler(EnvelopeWriterType* envelope)
+     : m_envelope(envelope)
+     , m_size(0)
+     , m_counter(0)
+    {
+        resetStatistics();
+    }
+
+    /**
+     * Queue @a msg with @a priority (higher is more important). @a msg is
+     * dropped if it cannot be sent before @a deadline. @a key distinguishes
+     * independent instances of the same message type (e.g. per servo).
+     *
+     * @return false if the queue is full of more important messages
+     **/
+    template<class MSG>
+    bool submit(const MSG& msg, uint8_t priority, uint32_t deadline, uint32_t key = 0)
+    {
+        Entry entry;
+        entry.msg = &msg;
+        entry.sendFunc = &sendMessage<MSG>;
+        entry.msgCode = MSG::MSG_CODE;
+        entry.key = key;
+        entry.priority = priority;
+        entry.hasDeadline = true;
+        entry.deadline = deadline;
+
+        return submitEntry(entry);
+    }
+
+    //! Queue @a msg without deadline
+    template<class MSG>
+    bool submit(const MSG& msg, uint8_t priority)
+    {
+        Entry entry;
+        entry.msg = &msg;
+        entry.sendFunc = &sendMessage<MSG>;
+        entry.msgCode = MSG::MSG_CODE;
+        entry.key = 0;
+        entry.priority = priority;
+        entry.hasDeadline = false;
+        entry.deadline = 0;
+
+        return submitEntry(entry);
+    }
+
+    /**
+     * Send the most important queued message and drop expired ones. A
+     * message that cannot be sent stays queued.
+     *
+     * @return true if a message was sent
+     **/
+    bool poll(uint32_t now);
+
+    //! Drop queued messages with a deadline before @a now
+    void expire(uint32_t now);
+
+    //! Remove all queued messages
+    void clear()
+    { m_size = 0; }
+
+    inline size_t size() const
+    { return m_size; }
+
+    inline bool empty() const
+    { return m_size == 0; }
+
+    inline const TxSchedulerStatistics& statistics() const
+    { return m_stats; }
+
+    void resetStatistics()
+    {
+        m_stats.submitted = 0;
+        m_stats.sent = 0;
+        m_stats.superseded = 0;
+        m_stats.expired = 0;
+        m_stats.rejected = 0;
+        m_stats.errors = 0;
+    }
+private:
+    struct Entry
+    {
+        const void* msg;
+        bool (*sendFunc)(EnvelopeWriterType* envelope, const void* msg);
+
+        uint8_t msgCode;
+        uint32_t key;
+        uint8_t priority;
+        bool hasDeadline;
+        uint32_t deadline;
+        uint32_t order;
+    };
+
+    template<class MSG>
+    static bool sendMessage(EnvelopeWriterType* envelope, const void* msg)
+    { return envelope->send(*reinterpret_cast<const MSG*>(msg)); }
+
+    static bool before(uint32_t a, uint32_t b)
+    { return int32_t(a - b) < 0; }
+
+    //! Is @a a more important than @a b?
+    static bool higher(const Entry& a, const Entry& b)
+    {
+        if(a.priority != b.priority)
+            return a.priority > b.priority;
+
+        if(a.hasDeadline != b.hasDeadline)
+            return a.hasDeadline;
+
+        if(a.hasDeadline && a.deadline != b.deadline)
+            return before(a.deadline, b.deadline);
+
+        return before(a.order, b.order);
+    }
+
+    bool submitEntry(Entry entry);
+
+    void siftUp(size_t idx);
+    void siftDown(size_t idx);
+    void remove(size_t idx);
+
+    EnvelopeWriterType* m_envelope;
+
+    // Binary heap, most important entry first
+    Entry m_heap[Capacity];
+    size_t m_size;
+    uint32_t m_counter;
+
+    TxSchedulerStatistics m_stats;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// IMPLEMENTATION
+
+template<class EnvelopeWriterType, int Capacity>
+bool TxScheduler<EnvelopeWriterType, Capacity>::submitEntry(Entry entry)
+{
+    // Supersede a queued copy
+    for(size_t i = 0; i < m_size; ++i)
+    {
+        Entry& queued = m_heap[i];
+        if(queued.msgCode != entry.msgCode || queued.key != entry.key)
+            continue;
+
+        entry.order = queued.order;
+        queued = entry;
+
+        siftUp(i);
+        siftDown(i);
+
+        m_stats.superseded++;
+        m_stats.submitted++;
+        return true;
+    }
+
+    entry.order = m_counter++;
+
+    if(m_size == Capacity)
+    {
+        // The least important entry is one of the leaves
+        size_t worst = m_size / 2;
+        for(size_t i = worst + 1; i < m_size; ++i)
+        {
+            if(higher(m_heap[worst], m_heap[i]))
+                worst = i;
+        }
+
+        if(!higher(entry, m_heap[worst]))
+        {
+            m_stats.rejected++;
+            return false;
+        }
+
+        remove(worst);
+        m_stats.rejected++;
+    }
+
+    m_heap[m_size] = entry;
+    siftUp(m_size);
+    m_size++;
+
+    m_stats.submitted++;
+    return true;
+}
+
+template<class EnvelopeWriterType, int Capacity>
+bool TxScheduler<EnvelopeWriterType, Capacity>::poll(uint32_t now)
+{
+    while(m_size != 0)
+    {
+        const Entry& entry = m_heap[0];
+
+        if(entry.hasDeadline && before(entry.deadline, now))
+        {
+            remove(0);
+            m_stats.expired++;
+            continue;
+        }
+
+        // On errors, the message stays queued for the next attempt
+        if(!entry.sendFunc(m_envelope, entry.msg))
+        {
+            m_stats.errors++;
+            return false;
+        }
+
+        remove(0);
+        m_stats.sent++;
+        return true;
+    }
+
+    return false;
+}
+
+template<class EnvelopeWriterType, int Capacity>
+void TxScheduler<EnvelopeWriterType, Capacity>::expire(uint32_t now)
+{
+    size_t size = 0;
+    for(size_t i = 0; i < m_size; ++i)
+    {
+        if(m_heap[i].hasDeadline && before(m_heap[i].deadline, now))
+            m_stats.expired++;
+        else
+            m_heap[size++] = m_heap[i];
+    }
+
+    // Restore the heap property
+    m_size = size;
+    for(size_t i = m_size / 2; i-- != 0;)
+        siftDown(i);
+}
+
+template<class EnvelopeWriterType, int Capacity>
+void TxScheduler<EnvelopeWriterType, Capacity>::siftUp(size_t idx)
+{
+    while(idx != 0)
+    {
+        size_t parent = (idx - 1) / 2;
+        if(!higher(m_heap[idx], m_heap[parent]))
+            break;
+
+        Entry tmp = m_heap[parent];
+        m_heap[parent] = m_heap[idx];
+        m_heap[idx] = tmp;
+
+        idx = parent;
+    }
+}
+
+template<class EnvelopeWriterType, int Capacity>
+void TxScheduler<EnvelopeWriterType, Capacity>::siftDown(size_t idx)
+{
+    while(true)
+    {
+        size_t best = idx;
+        size_t left = 2*idx + 1;
+        size_t right = 2*idx + 2;
+
+        if(left < m_size && higher(m_heap[left], m_heap[best]))
+            best = left;
+        if(right < m_size && higher(m_heap[right], m_heap[best]))
+            best = right;
+
+        if(best == idx)
+            break;
+
+        Entry tmp = m_heap[best];
+        m_heap[best] = m_heap[idx];
+        m_heap[idx] = tmp;
+
+        idx = best;
+    }
+}
+
+template<class EnvelopeWriterType, int Capacity>
+void TxScheduler<EnvelopeWriterType, Capacity>::remove(size_t idx)
+{
+    m_size--;
+    if(idx == m_size)
+        return;
+
+    m_heap[idx] = m_heap[m_size];
+    siftUp(idx);
+    siftDown(idx);
+}
+
+}
+
+#endif
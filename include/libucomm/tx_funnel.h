@@ -0,0 +1,362 @@
+// Lock-free multi-producer transmit path
+// Author: Max Schwarz <max@x-quadraht.de>
+
+#ifndef LIBUCOMM_TX_FUNNEL_H
+#define LIBUCOMM_TX_FUNNEL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <sys/uio.h>
+
+#include <atomic>
+
+#include "cobs_envelope.h"
+
+/*
+ * If several threads send on the same link, a shared COBSWriter needs a
+ * mutex around send(), and the threads queue up on it at high message
+ * rates. TxFunnel lets each producer encode its frame on its own, into a
+ * slot of a shared frame ring. A single consumer (e.g. the thread owning the
+ * fd) writes the finished frames in order:
+ *
+ * @code
+ *   typedef uc::TxFunnel<uc::Fletcher16Generator> Funnel;
+ *   typedef Proto< uc::IO<Funnel::EnvelopeWriter, uc::IO_W> > WProto;
+ *
+ *   // any thread
+ *   if(!funnel.send(msg))
+ *       ...;   // ring full or serialization error
+ *
+ *   // consumer thread
+ *   funnel.drain(fd);
+ * @endcode
+ *
+ * Each slot is a BufferedWriter region for the COBSWriter, exactly like the
+ * output buffer of a plain COBSWriter. A producer reserves the next slot
+ * with a compare-and-swap on the ring head, encodes into it without
+ * synchronization and commits it by publishing the slot's sequence number.
+ * The consumer passes slots on in reservation order as soon as they are
+ * committed and hands them back by advancing their sequence number by the
+ * ring size (the bounded queue scheme by D. Vyukov). No locks are taken. A
+ * full ring makes send() fail immediately instead of blocking.
+ *
+ * Frames are written in the order the slots were reserved. A producer that
+ * is preempted between reservation and commit holds back the frames after
+ * it until it continues.
+ */
+
+namespace uc
+{
+
+//! Counters of a TxFunnel
+struct TxFunnelStatistics
+{
+    uint64_t frames;     //!< Frames committed by the producers
+    uint64_t full;       //!< send() calls rejected because the ring was full
+    uint64_t errors;     //!< Frames that failed to serialize
+    uint64_t bytes;      //!< Bytes written by drain()
+};
+
+/**
+ * @brief Multi-producer, single-consumer frame ring for COBS frames
+ *
+ * The ring has @a Slots slots (a power of two) of @a MaxFrameSize bytes each,
+ * which limits the encoded frame size. send() may be called from any number
+ * of threads, front() / pop() / drain() only from one consumer thread.
+ **/
+template<class ChecksumGenerator, int Slots = 256, int MaxFrameSize = 1024>
+class TxFunnel
+{
+public:
+    //! Slot of the frame ring (BufferedWriter interface for the envelope)
+    class Slot
+    {
+    public:
+        typedef size_t SizeType;
+
+        uint8_t* dataPointer()
+        { return m_data; }
+
+        SizeType dataSize() const
+        { return sizeof(m_data); }
+
+        void packetComplete(SizeType n)
+        { m_size = n; }
+    private:
+        friend class TxFunnel;
+
+        std::atomic<uint64_t> m_sequence;
+        size_t m_size;
+        uint8_t m_data[MaxFrameSize];
+    };
+
+    typedef COBSWriter<ChecksumGenerator, Slot> EnvelopeWriter;
+
+    TxFunnel();
+
+    TxFunnel(const TxFunnel&) = delete;
+    TxFunnel& operator=(const TxFunnel&) = delete;
+
+    /**
+     * Encode @a msg into the next free slot. Thread-safe and lock-free.
+     *
+     * @return false if the ring is full or @a msg could not be serialized
+     **/
+    template<class MSG>
+    bool send(const MSG& msg);
+
+    /**
+     * Oldest committed frame (consumer only).
+     *
+     * @return false if the next frame is not committed yet
+     **/
+    bool front(const uint8_t** data, size_t* size);
+
+    //! Release the frame returned by front() (consumer only)
+    void pop();
+
+    /**
+     * Write committed frames to @a fd with writev() (consumer only). Stops
+     * at the first uncommitted slot or when the fd does not accept more
+     * data (partial frames are continued in the next call).
+     *
+     * @return bytes written, or -1 on write errors
+     **/
+    ssize_t drain(int fd);
+
+    //! Is a committed frame waiting for the consumer? (consumer only)
+    inline bool pending()
+    {
+        const uint8_t* data;
+        size_t size;
+        return front(&data, &size);
+    }
+
+    TxFunnelStatistics statistics() const;
+private:
+    static_assert((Slots & (Slots - 1)) == 0, "Slots must be a power of two");
+
+    enum { MAX_IOV = 64 };
+
+    // Slots are padded to keep producers from sharing cache lines
+    struct alignas(64) PaddedSlot
+    {
+        Slot slot;
+    };
+
+    inline Slot& slot(uint64_t pos)
+    { return m_slots[pos & (Slots - 1)].slot; }
+
+    //! Is the slot at the consumer position committed?
+    inline bool committed(uint64_t pos)
+    { return slot(pos).m_sequence.load(std::memory_order_acquire) == pos + 1; }
+
+    //! Hand the slot at the consumer position back to the producers
+    inline void release()
+    {
+        slot(m_tail).m_sequence.store(m_tail + Slots, std::memory_order_release);
+        m_tail++;
+        m_offset = 0;
+    }
+
+    PaddedSlot m_slots[Slots];
+
+    // Producer side
+    alignas(64) std::atomic<uint64_t> m_head;
+    std::atomic<uint64_t> m_frames;
+    std::atomic<uint64_t> m_full;
+    std::atomic<uint64_t> m_errors;
+
+    // Consumer side
+    alignas(64) uint64_t m_tail;
+    size_t m_offset;
+    std::atomic<uint64_t> m_bytes;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// IMPLEMENTATION
+
+template<class ChecksumGenerator, int Slots, int MaxFrameSize>
+TxFunnel<ChecksumGenerator, Slots, MaxFrameSize>::TxFunnel()
+ : m_head(0)
+ , m_frames(0)
+ , m_full(0)
+ , m_errors(0)
+ , m_tail(0)
+ , m_offset(0)
+ , m_bytes(0)
+{
+    for(int i = 0; i < Slots; ++i)
+    {
+        m_slots[i].slot.m_sequence.store(i, std::memory_order_relaxed);
+        m_slots[i].slot.m_size = 0;
+    }
+}
+
+template<class ChecksumGenerator, int Slots, int MaxFrameSize>
+template<class MSG>
+bool TxFunnel<ChecksumGenerator, Slots, MaxFrameSize>::send(const MSG& msg)
+{
+    // Reserve a slot
+    uint64_t pos = m_head.load(std::memory_order_relaxed);
+    Slot* s;
+    while(true)
+    {
+        s = &slot(pos);
+        uint64_t seq = s->m_sequence.load(std::memory_order_acquire);
+        int64_t diff = int64_t(seq - pos);
+
+        if(diff == 0)
+        {
+            if(m_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                break;
+        }
+        else if(diff < 0)
+        {
+            // The consumer did not release this slot yet
+            m_full.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        else
+            pos = m_head.load(std::memory_order_relaxed);
+    }
+
+    // Encode without synchronization, the slot belongs to us
+    s->m_size = 0;
+
+    EnvelopeWriter writer(s);
+    bool ok = writer.send(msg);
+    if(!ok)
+    {
+        // Commit an empty frame, the consumer skips it
+        s->m_size = 0;
+        m_errors.fetch_add(1, std::memory_order_relaxed);
+    }
+    else
+        m_frames.fetch_add(1, std::memory_order_relaxed);
+
+    s->m_sequence.store(pos + 1, std::memory_order_release);
+
+    return ok;
+}
+
+template<class ChecksumGenerator, int Slots, int MaxFrameSize>
+bool TxFunnel<ChecksumGenerator, Slots, MaxFrameSize>::front(const uint8_t** data, size_t* size)
+{
+    while(committed(m_tail))
+    {
+        Slot& s = slot(m_tail);
+        if(s.m_size == 0)
+        {
+            release();
+            continue;
+        }
+
+        *data = s.m_data + m_offset;
+        *size = s.m_size - m_offset;
+        return true;
+    }
+
+    return false;
+}
+
+template<class ChecksumGenerator, int Slots, int MaxFrameSize>
+void TxFunnel<ChecksumGenerator, Slots, MaxFrameSize>::pop()
+{
+    if(committed(m_tail))
+        release();
+}
+
+template<class ChecksumGenerator, int Slots, int MaxFrameSize>
+ssize_t TxFunnel<ChecksumGenerator, Slots, MaxFrameSize>::drain(int fd)
+{
+    ssize_t total = 0;
+
+    while(true)
+    {
+        // Collect consecutive committed frames
+        iovec iov[MAX_IOV];
+        int count = 0;
+        size_t offset = m_offset;
+
+        for(uint64_t pos = m_tail; count < MAX_IOV && committed(pos); ++pos)
+        {
+            Slot& s = slot(pos);
+            if(s.m_size == 0)
+            {
+                // Skip empty frames at the front right away
+                if(count == 0)
+                {
+                    release();
+                    offset = 0;
+                }
+                continue;
+            }
+
+            iov[count].iov_base = s.m_data + offset;
+            iov[count].iov_len = s.m_size - offset;
+            count++;
+            offset = 0;
+        }
+
+        if(count == 0)
+            return total;
+
+        ssize_t ret = writev(fd, iov, count);
+        if(ret < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+                return total;
+
+            return total ? total : -1;
+        }
+
+        total += ret;
+        m_bytes.fetch_add(ret, std::memory_order_relaxed);
+
+        // Release the written frames
+        size_t written = ret;
+        while(written != 0)
+        {
+            Slot& s = slot(m_tail);
+            if(s.m_size == 0)
+            {
+                release();
+                continue;
+            }
+
+            size_t left = s.m_size - m_offset;
+            if(written < left)
+            {
+                m_offset += written;
+                return total;
+            }
+
+            written -= left;
+            release();
+        }
+
+        // Everything written, look for more frames
+    }
+}
+
+template<class ChecksumGenerator, int Slots, int MaxFrameSize>
+TxFunnelStatistics TxFunnel<ChecksumGenerator, Slots, MaxFrameSize>::statistics() const
+{
+    TxFunnelStatistics stats;
+    stats.frames = m_frames.load(std::memory_order_relaxed);
+    stats.full = m_full.load(std::memory_order_relaxed);
+    stats.errors = m_errors.load(std::memory_order_relaxed);
+    stats.bytes = m_bytes.load(std::memory_order_relaxed);
+
+    return stats;
+}
+
+}
+
+#endif
@@ -0,0 +1,180 @@
+// Byte order conversion
+// Author: Max Schwarz <max@x-quadraht.de>
+
+#ifndef LIBUCOMM_BYTEORDER_H
+#define LIBUCOMM_BYTEORDER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+namespace uc
+{
+
+enum ByteOrder
+{
+    BYTE_ORDER_LITTLE,
+    BYTE_ORDER_BIG,
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    BYTE_ORDER_HOST = BYTE_ORDER_BIG
+#else
+    BYTE_ORDER_HOST = BYTE_ORDER_LITTLE
+#endif
+};
+
+/**
+ * @brief Reverse the byte order of a value
+ *
+ * Works for all trivially copyable types of size 1, 2, 4 or 8 (including
+ * floating point types).
+ **/
+template<class T>
+inline T byteSwap(T value)
+{
+    if constexpr(sizeof(T) == 2)
+    {
+        uint16_t v;
+        memcpy(&v, &value, 2);
+        v = __builtin_bswap16(v);
+        memcpy(&value, &v, 2);
+    }
+    else if constexpr(sizeof(T) == 4)
+    {
+        uint32_t v;
+        memcpy(&v, &value, 4);
+        v = __builtin_bswap32(v);
+        memcpy(&value, &v, 4);
+    }
+    else if constexpr(sizeof(T) == 8)
+    {
+        uint64_t v;
+        memcpy(&v, &value, 8);
+        v = __builtin_bswap64(v);
+        memcpy(&value, &v, 8);
+    }
+    else
+        static_assert(sizeof(T) == 1, "unsupported type size");
+
+    return value;
+}
+
+//! Convert a host value to wire byte order @a Order
+template<ByteOrder Order, class T>
+inline T toWire(T value)
+{
+    if constexpr(Order == BYTE_ORDER_HOST)
+        return value;
+    else
+        return byteSwap(value);
+}
+
+//! Convert a value in wire byte order @a Order to host byte order
+template<ByteOrder Order, class T>
+inline T fromWire(T value)
+{
+    return toWire<Order>(value);
+}
+
+//! Store @a value at the (possibly unaligned) address @a dst
+template<ByteOrder Order, class T>
+inline void storeWire(void* dst, T value)
+{
+    value = toWire<Order>(value);
+    memcpy(dst, &value, sizeof(T));
+}
+
+//! Load a value from the (possibly unaligned) address @a src
+template<ByteOrder Order, class T>
+inline T loadWire(const void* src)
+{
+    T value;
+    memcpy(&value, src, sizeof(T));
+    return fromWire<Order>(value);
+}
+
+/**
+ * @brief Copy @a count elements of type @a T, reversing the byte order of each
+ *
+ * Source and destination may be unaligned, but must not overlap. Uses SSSE3
+ * or NEON byte shuffles if available.
+ **/
+template<class T>
+inline void byteSwapArray(void* dst, const void* src, size_t count)
+{
+    uint8_t* d = reinterpret_cast<uint8_t*>(dst);
+    const uint8_t* s = reinterpret_cast<const uint8_t*>(src);
+
+    if constexpr(sizeof(T) == 1)
+    {
+        memcpy(d, s, count);
+        return;
+    }
+
+    size_t i = 0;
+
+#if defined(__SSSE3__)
+    if constexpr(sizeof(T) == 2 || sizeof(T) == 4)
+    {
+        const __m128i mask = (sizeof(T) == 2)
+            ? _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14)
+            : _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+
+        const size_t perVector = 16 / sizeof(T);
+        for(; i + perVector <= count; i += perVector)
+        {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i*sizeof(T)));
+            v = _mm_shuffle_epi8(v, mask);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(d + i*sizeof(T)), v);
+        }
+    }
+#elif defined(__ARM_NEON)
+    if constexpr(sizeof(T) == 2 || sizeof(T) == 4)
+    {
+        const size_t perVector = 16 / sizeof(T);
+        for(; i + perVector <= count; i += perVector)
+        {
+            uint8x16_t v = vld1q_u8(s + i*sizeof(T));
+            if constexpr(sizeof(T) == 2)
+                v = vrev16q_u8(v);
+            else
+                v = vrev32q_u8(v);
+            vst1q_u8(d + i*sizeof(T), v);
+        }
+    }
+#endif
+
+    for(; i < count; ++i)
+    {
+        T value;
+        memcpy(&value, s + i*sizeof(T), sizeof(T));
+        value = byteSwap(value);
+        memcpy(d + i*sizeof(T), &value, sizeof(T));
+    }
+}
+
+//! Store @a count elements from @a src in wire byte order @a Order
+template<ByteOrder Order, class T>
+inline void storeWireArray(void* dst, const void* src, size_t count)
+{
+    if constexpr(Order == BYTE_ORDER_HOST)
+        memcpy(dst, src, count * sizeof(T));
+    else
+        byteSwapArray<T>(dst, src, count);
+}
+
+//! Load @a count elements in wire byte order @a Order from @a src
+template<ByteOrder Order, class T>
+inline void loadWireArray(void* dst, const void* src, size_t count)
+{
+    storeWireArray<Order, T>(dst, src, count);
+}
+
+}
+
+#endif
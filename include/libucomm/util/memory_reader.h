@@ -0,0 +1,73 @@
+// Reader over a memory buffer
+// Author: Max Schwarz <max@x-quadraht.de>
+
+#ifndef LIBUCOMM_MEMORY_READER_H
+#define LIBUCOMM_MEMORY_READER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+namespace uc
+{
+
+/**
+ * @brief IO::Reader over a contiguous buffer (not owned)
+ *
+ * Reader type of the stages which keep complete payloads in memory.
+ **/
+class MemoryReader
+{
+public:
+    MemoryReader()
+     : m_data(0)
+     , m_size(0)
+     , m_idx(0)
+    {}
+
+    MemoryReader(const uint8_t* data, size_t size)
+     : m_data(data)
+     , m_size(size)
+     , m_idx(0)
+    {}
+
+    // Implement IO::Reader interface
+    bool read(void* data, size_t size)
+    {
+        if(m_size - m_idx < size)
+            return false;
+
+        if(size != 0)
+            memcpy(data, m_data + m_idx, size);
+        m_idx += size;
+
+        return true;
+    }
+
+    bool skip(size_t size)
+    {
+        return consume(size) != 0;
+    }
+
+    const uint8_t* consume(size_t size)
+    {
+        if(m_size - m_idx < size)
+            return 0;
+
+        const uint8_t* data = m_data + m_idx;
+        m_idx += size;
+
+        return data;
+    }
+
+    size_t remaining() const
+    { return m_size - m_idx; }
+private:
+    const uint8_t* m_data;
+    size_t m_size;
+    size_t m_idx;
+};
+
+}
+
+#endif
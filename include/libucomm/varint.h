@@ -0,0 +1,153 @@
+// Variable-length integer encodings
+// Author: Max Schwarz <max@x-quadraht.de>
+
+#ifndef LIBUCOMM_VARINT_H
+#define LIBUCOMM_VARINT_H
+
+#include <type_traits>
+
+#include <stdint.h>
+
+#include "util/error.h"
+
+/*
+ * Varints use the LEB128 encoding: 7 bits of payload per byte, least
+ * significant group first. The MSB of each byte is set if another byte
+ * follows.
+ *
+ * Zigzag maps signed integers to unsigned ones so that values of small
+ * magnitude get short encodings: 0, -1, 1, -2, 2, ... => 0, 1, 2, 3, 4, ...
+ */
+
+namespace uc
+{
+
+//! Maximum number of bytes needed to encode a value of type @a T
+template<class T>
+constexpr int varintMaxSize()
+{
+    return (sizeof(T)*8 + 6) / 7;
+}
+
+//! Number of bytes needed to encode @a value
+template<class T>
+inline int varintSize(T value)
+{
+    typedef typename std::make_unsigned<T>::type U;
+    U v = value;
+
+    int bits;
+    if constexpr(sizeof(U) <= sizeof(unsigned int))
+        bits = sizeof(unsigned int)*8 - __builtin_clz(v | 1);
+    else
+        bits = sizeof(unsigned long long)*8 - __builtin_clzll(v | 1);
+
+    return (bits + 6) / 7;
+}
+
+template<class T>
+inline typename std::make_unsigned<T>::type zigzagEncode(T value)
+{
+    typedef typename std::make_unsigned<T>::type U;
+    return (U(value) << 1) ^ U(value < 0 ? -1 : 0);
+}
+
+template<class U>
+inline typename std::make_signed<U>::type zigzagDecode(U value)
+{
+    typedef typename std::make_signed<U>::type S;
+    return S((value >> 1) ^ U(-(value & 1)));
+}
+
+/**
+ * @brief Encode @a value into @a dst
+ *
+ * The encoding is branch-free: All groups are computed unconditionally, only
+ * the continuation bit of the last used byte is cleared. @a dst needs room
+ * for varintMaxSize<T>() bytes.
+ *
+ * @return number of bytes used
+ **/
+template<class T>
+inline int encodeVarint(uint8_t* dst, T value)
+{
+    typedef typename std::make_unsigned<T>::type U;
+    U v = value;
+
+    for(int i = 0; i < varintMaxSize<T>(); ++i)
+        dst[i] = uint8_t(v >> (7*i)) | 0x80;
+
+    int n = varintSize(v);
+    dst[n-1] &= 0x7F;
+
+    return n;
+}
+
+//! Write an unsigned integer as varint
+template<class Writer, class T>
+inline bool writeVarint(Writer* writer, T value)
+{
+    static_assert(std::is_unsigned<T>::value, "varint needs an unsigned type");
+
+    uint8_t buf[varintMaxSize<T>()];
+    int n = encodeVarint(buf, value);
+
+    return writer->write(buf, n);
+}
+
+//! Write a signed integer with zigzag varint encoding
+template<class Writer, class T>
+inline bool writeZigzag(Writer* writer, T value)
+{
+    static_assert(std::is_signed<T>::value, "zigzag needs a signed type");
+    return writeVarint(writer, zigzagEncode(value));
+}
+
+/**
+ * @brief Read a varint
+ *
+ * @return false on truncated data or if the value does not fit into @a T
+ **/
+template<class Reader, class T>
+inline bool readVarint(Reader* reader, T* value)
+{
+    static_assert(std::is_unsigned<T>::value, "varint needs an unsigned type");
+
+    T result = 0;
+    for(int i = 0; i < varintMaxSize<T>(); ++i)
+    {
+        uint8_t c;
+        RETURN_IF_ERROR(reader->read(&c, 1));
+
+        // The last byte may only carry the remaining bits of T
+        if(i == varintMaxSize<T>() - 1 && ((c & 0x7F) >> (8*sizeof(T) - 7*i)) != 0)
+            return false;
+
+        result |= T(c & 0x7F) << (7*i);
+
+        if(!(c & 0x80))
+        {
+            *value = result;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+//! Read a signed integer with zigzag varint encoding
+template<class Reader, class T>
+inline bool readZigzag(Reader* reader, T* value)
+{
+    static_assert(std::is_signed<T>::value, "zigzag needs a signed type");
+
+    typename std::make_unsigned<T>::type encoded;
+    RETURN_IF_ERROR(readVarint(reader, &encoded));
+    *value = zigzagDecode(encoded);
+
+    return true;
+}
+
+}
+
+#endif
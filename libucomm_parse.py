@@ -2,6 +2,8 @@
 
 from pyparsing import *
 
+import copy
+
 BUILTIN_TYPES = {
     'uint8_t': 1,
     'int8_t': 1,
@@ -9,6 +11,16 @@ BUILTIN_TYPES = {
     'int16_t': 2,
     'uint32_t': 4,
     'int32_t': 4,
+    'float': 4,
+    'double': 8,
+}
+
+INTEGER_TYPES = [ t for t in BUILTIN_TYPES if t.endswith('_t') ]
+
+# Length-prefixed types, received as views into the envelope buffer
+BLOB_TYPES = {
+    'string': 'uc::String',
+    'bytes': 'uc::Bytes',
 }
 
 def registerParseAction(cls):
@@ -23,24 +35,108 @@ class UnknownTypeError(Exception):
 class Identifier:
     grammar = Word(alphas, alphanums + '_')
 
+class FixedType:
+    """Fixed-point quantized floating point type: fixed<int16_t, scale=0.01>"""
+
+    grammar = (
+          Suppress(Keyword('fixed'))
+        + Suppress('<')
+        + Identifier.grammar("wire")
+        + Suppress(',')
+        + Suppress(Keyword('scale'))
+        + Suppress('=')
+        + Regex(r'[0-9.]+([eE][-+]?[0-9]+)?')("scale")
+        + Optional(Suppress(',') + (Keyword('float') | Keyword('double'))("type"))
+        + Suppress('>')
+    )
+
+    def __init__(self, wire, scale, type='float'):
+        import fractions
+
+        if wire not in INTEGER_TYPES:
+            raise RuntimeError("Fixed-point wire type must be an integer type, got '%s'" % wire)
+
+        self.wire = wire
+        self.type = type
+        self.scale = fractions.Fraction(scale).limit_denominator(2**31 - 1)
+
+        if self.scale <= 0:
+            raise RuntimeError("Fixed-point scale must be positive")
+
+    def templateArgs(self):
+        return '%s, %d, %d' % (self.wire, self.scale.numerator, self.scale.denominator)
+
+    @classmethod
+    def parse(cls, parse_result):
+        return cls(parse_result.wire, parse_result.scale, parse_result.type or 'float')
+registerParseAction(FixedType)
+
+ENCODINGS = {
+    # encoding: (write function, read function, needs signed type)
+    'varint': ('uc::writeVarint', 'uc::readVarint', False),
+    'zigzag': ('uc::writeZigzag', 'uc::readZigzag', True),
+}
+
+# List codecs, see libucomm/codec.h
+LIST_CODECS = {
+    'delta': 'uc::DeltaCodec',
+    'dod': 'uc::DeltaOfDeltaCodec',
+    'rle': 'uc::RLECodec',
+}
+
 class Member:
     grammar = (
-          Identifier.grammar("type")
+          Optional(Keyword('optional'))("optional")
+        + Optional(Keyword('varint') | Keyword('zigzag'))("encoding")
+        + Optional(Keyword('delta') | Keyword('dod') | Keyword('rle'))("codec")
+        + (FixedType.grammar("fixed") | Identifier.grammar("type"))
         + Identifier.grammar("name")
-        + Optional(Literal('[') + Optional(CharsNotIn(']'))("size") + Literal(']'))("array")
+        + Optional(Suppress(':') + Word(nums)("bits"))
+        + Optional(
+              Literal('[')
+            + Optional(
+                  (Suppress('<') + CharsNotIn('>]')("bound") + Suppress('>'))
+                | CharsNotIn(']')("size")
+            )
+            + Literal(']')
+        )("array")
         + Suppress(';')
     )
 
-    def __init__(self, type, name, array=False, array_size=None):
+    def __init__(self, type, name, array=False, array_size=None, array_bound=None, encoding=None, bits=None, fixed=None, optional=False, codec=None):
         self.name = name
         self.type = type
+        self.fixed = fixed
         self.array = array
         self.array_size = array_size
+        self.array_bound = array_bound
+        self.encoding = encoding
+        self.bits = bits
+
+        # Optional members are sent only if set, announced by a presence
+        # bitmap. presenceBit is assigned by Struct.resolveTypes().
+        self.optional = optional
+        self.presenceBit = None
+
+        # List codec (delta, dod, rle) for dynamic arrays
+        self.codec = codec
 
     def isPOD(self):
+        if self.optional:
+            return False
+
+        if self.bits:
+            return True
+
         if self.array and not self.array_size:
             return False
 
+        if self.encoding:
+            return False
+
+        if self.type in BLOB_TYPES:
+            return False
+
         if self.type in BUILTIN_TYPES:
             return True
 
@@ -51,10 +147,25 @@ class Member:
         if self.array and self.array_size:
             c = "(" + self.array_size + ") * "
 
+        return c + self.elementSize()
+
+    def elementSize(self):
+        if self.fixed:
+            return str(BUILTIN_TYPES[self.fixed.wire])
+
         if self.type in BUILTIN_TYPES:
-            return c + str(BUILTIN_TYPES[self.type])
+            return str(BUILTIN_TYPES[self.type])
+
+        return "(" + self.type.podSize() + ")"
 
-        return c + "(" + self.type.podSize() + ")"
+    def deltaFields(self, offset):
+        # (offset, size) of the fields for delta encoding. Elements of
+        # fixed-size arrays are tracked separately if the size is a literal.
+        if self.array and self.array_size and self.array_size.strip().isdigit():
+            return [ ('%s + %d*%s' % (offset, i, self.elementSize()), self.elementSize())
+                for i in range(int(self.array_size)) ]
+
+        return [ (offset, self.size()) ]
 
     def __str__(self):
         s = self.type + " " + self.name
@@ -63,6 +174,20 @@ class Member:
         return s
 
     def definition(self, last=False):
+        if self.optional:
+            return "uc::Optional<%s> %s;" % (self.type, self.name)
+
+        if self.type == 'bool':
+            return "bool " + self.name + "{false};"
+
+        if self.encoding or self.bits:
+            return str(self.type) + " " + self.name + "{0};"
+
+        if self.type in BLOB_TYPES:
+            return "%s< uc::IOInstance<IO, %s, WIRE_BYTE_ORDER>, %s > %s;" % (
+                BLOB_TYPES[self.type], str(last).lower(), self.array_bound or '255', self.name
+            )
+
         if self.array:
             if self.type not in BUILTIN_TYPES and not self.type.isPOD():
                 raise RuntimeError("Arrays of non-POD structs are not allowed")
@@ -73,13 +198,217 @@ class Member:
             else:
                 # Dynamic array
                 last = str(last).lower()
-                return "uc::List< uc::IOInstance<IO, %s>, %s > %s;" % (
+                if self.fixed:
+                    return "uc::List< uc::IOInstance<IO, %s, WIRE_BYTE_ORDER>, %s, %s, uc::FixedCodec<%s> > %s;" % (
+                        last, self.type, self.array_bound or '255', self.fixed.templateArgs(), self.name
+                    )
+
+                if self.codec:
+                    return "uc::List< uc::IOInstance<IO, %s, WIRE_BYTE_ORDER>, %s, %s, %s<%s> > %s;" % (
+                        last, self.type, self.array_bound or '255', LIST_CODECS[self.codec], self.type, self.name
+                    )
+
+                if self.array_bound:
+                    # Bounded dynamic array, count width follows the bound
+                    return "uc::List< uc::IOInstance<IO, %s, WIRE_BYTE_ORDER>, %s, %s > %s;" % (
+                        last, self.type, self.array_bound, self.name
+                    )
+
+                return "uc::List< uc::IOInstance<IO, %s, WIRE_BYTE_ORDER>, %s > %s;" % (
                     last, self.type, self.name
                 )
         else:
             return str(self.type) + " " + self.name + "{0};"
 
+    def serializeCode(self):
+        if self.optional:
+            return self.optionalSerializeCode()
+
+        if self.encoding:
+            return ['RETURN_IF_ERROR(%s(output, %s));' % (ENCODINGS[self.encoding][0], self.name)]
+
+        return ['RETURN_IF_ERROR(%s.serialize(output));' % self.name]
+
+    def deserializeCode(self):
+        if self.optional:
+            return self.optionalDeserializeCode()
+
+        if self.encoding:
+            return ['RETURN_IF_ERROR(%s(input, &%s));' % (ENCODINGS[self.encoding][1], self.name)]
+
+        return ['RETURN_IF_ERROR(%s.deserialize(input));' % self.name]
+
+    def presenceTest(self):
+        return 'ucPresent[%d] & 0x%02X' % (self.presenceBit // 8, 1 << (self.presenceBit % 8))
+
+    def valueMember(self):
+        # Copy of this member that refers to the local value reference
+        value = copy.copy(self)
+        value.name = 'ucValue'
+        value.optional = False
+        return value
+
+    def optionalSerializeCode(self):
+        value = self.valueMember()
+
+        if self.encoding:
+            body = value.serializeCode()
+        elif self.type == 'bool':
+            body = [
+                'uint8_t ucByte = ucValue;',
+                'RETURN_IF_ERROR(output->write(&ucByte, 1));',
+            ]
+        else:
+            body = ['uint8_t dst[%s];' % self.size()]
+            body += value.packCode('')
+            body += ['RETURN_IF_ERROR(output->write(dst, sizeof(dst)));']
+
+        return [
+            'if(%s.has())' % self.name,
+            '{',
+            '\tconst auto& ucValue = %s.value();' % self.name,
+        ] + [ '\t' + line for line in body ] + [
+            '}',
+        ]
+
+    def optionalDeserializeCode(self):
+        value = self.valueMember()
+
+        if self.encoding:
+            body = value.deserializeCode()
+        elif self.type == 'bool':
+            body = [
+                'uint8_t ucByte;',
+                'RETURN_IF_ERROR(input->read(&ucByte, 1));',
+                'ucValue = (ucByte != 0);',
+            ]
+        else:
+            body = [
+                'uint8_t src[%s];' % self.size(),
+                'RETURN_IF_ERROR(input->read(src, sizeof(src)));',
+            ]
+            body += value.unpackCode('')
+
+        return [
+            'if(%s)' % self.presenceTest(),
+            '{',
+            '\tauto& ucValue = %s.emplace();' % self.name,
+        ] + [ '\t' + line for line in body ] + [
+            '}',
+            'else',
+            '\t%s.clear();' % self.name,
+        ]
+
+    def packCode(self, offset):
+        dst = 'dst' + offset
+
+        if self.fixed:
+            wire = self.fixed.wire
+            quantize = 'uc::quantize<%s>' % self.fixed.templateArgs()
+            if self.array:
+                return [
+                    'for(int i = 0; i < %s; ++i)' % self.array_size,
+                    '\tuc::storeWire<WIRE_BYTE_ORDER>(%s + i*%d, %s(%s[i]));' % (
+                        dst, BUILTIN_TYPES[wire], quantize, self.name),
+                ]
+            return ['uc::storeWire<WIRE_BYTE_ORDER>(%s, %s(%s));' % (dst, quantize, self.name)]
+
+        if self.type in BUILTIN_TYPES:
+            if self.array:
+                return ['uc::storeWireArray<WIRE_BYTE_ORDER, %s>(%s, %s, %s);' % (
+                    self.type, dst, self.name, self.array_size)]
+            return ['uc::storeWire<WIRE_BYTE_ORDER>(%s, %s);' % (dst, self.name)]
+
+        if self.array:
+            return [
+                'for(int i = 0; i < %s; ++i)' % self.array_size,
+                '\t%s[i].pack(%s + i*(%s));' % (self.name, dst, self.type.podSize()),
+            ]
+
+        return ['%s.pack(%s);' % (self.name, dst)]
+
+    def unpackCode(self, offset):
+        src = 'src' + offset
+
+        if self.fixed:
+            wire = self.fixed.wire
+            dequantize = 'uc::dequantize<%s, %s>' % (self.fixed.templateArgs(), self.type)
+            if self.array:
+                return [
+                    'for(int i = 0; i < %s; ++i)' % self.array_size,
+                    '\t%s[i] = %s(uc::loadWire<WIRE_BYTE_ORDER, %s>(%s + i*%d));' % (
+                        self.name, dequantize, wire, src, BUILTIN_TYPES[wire]),
+                ]
+            return ['%s = %s(uc::loadWire<WIRE_BYTE_ORDER, %s>(%s));' % (
+                self.name, dequantize, wire, src)]
+
+        if self.type in BUILTIN_TYPES:
+            if self.array:
+                return ['uc::loadWireArray<WIRE_BYTE_ORDER, %s>(%s, %s, %s);' % (
+                    self.type, self.name, src, self.array_size)]
+            return ['%s = uc::loadWire<WIRE_BYTE_ORDER, %s>(%s);' % (self.name, self.type, src)]
+
+        if self.array:
+            return [
+                'for(int i = 0; i < %s; ++i)' % self.array_size,
+                '\t%s[i].unpack(%s + i*(%s));' % (self.name, src, self.type.podSize()),
+            ]
+
+        return ['%s.unpack(%s);' % (self.name, src)]
+
     def resolveType(self, types):
+        if self.codec:
+            if not self.array or self.array_size or self.fixed:
+                raise RuntimeError("Codec '%s' can only be used for dynamic arrays ('%s')" % (self.codec, self.name))
+
+            allowed = INTEGER_TYPES if self.codec != 'rle' else BUILTIN_TYPES
+            if self.type not in allowed:
+                raise RuntimeError("Codec '%s' does not support type '%s' ('%s')" % (self.codec, self.type, self.name))
+
+        if self.optional:
+            if self.array or self.bits or self.type in BLOB_TYPES:
+                raise RuntimeError("Optional member '%s' cannot be an array, bit field, string or bytes" % self.name)
+
+            if self.type == 'bool':
+                return
+
+        if self.type in BLOB_TYPES:
+            if self.bits or self.encoding or (self.array and not self.array_bound):
+                raise RuntimeError("%s member '%s' can only have a length bound (name[<N>])"
+                    % (self.type, self.name))
+            return
+
+        if self.type == 'bool':
+            if self.bits not in (None, 1):
+                raise RuntimeError("bool member '%s' can only have one bit" % self.name)
+            self.bits = 1
+
+        if self.fixed and (self.bits or self.encoding):
+            raise RuntimeError("Fixed-point member '%s' cannot be a bit field or have an encoding" % self.name)
+
+        if self.bits:
+            if self.array or self.encoding:
+                raise RuntimeError("Bit field '%s' cannot be an array or have an encoding" % self.name)
+
+            if self.type != 'bool':
+                if self.type not in INTEGER_TYPES or not self.type.startswith('u'):
+                    raise RuntimeError("Bit field '%s' needs an unsigned integer type" % self.name)
+
+                if self.bits < 1 or self.bits > 8*BUILTIN_TYPES[self.type]:
+                    raise RuntimeError("Bit field '%s' has an invalid width" % self.name)
+
+            return
+
+        if self.encoding:
+            if self.type not in INTEGER_TYPES or self.array:
+                raise RuntimeError("Encoding '%s' is only supported for scalar integer members ('%s')"
+                    % (self.encoding, self.name))
+
+            signed = not self.type.startswith('u')
+            if signed != ENCODINGS[self.encoding][2]:
+                raise RuntimeError("Encoding '%s' needs a%s type ('%s')"
+                    % (self.encoding, ' signed' if not signed else 'n unsigned', self.name))
+
         if self.type in BUILTIN_TYPES:
             return
 
@@ -88,18 +417,120 @@ class Member:
         except KeyError:
             raise UnknownTypeError(self.type)
 
+        if self.optional and not self.type.isPOD():
+            raise RuntimeError("Optional member '%s' needs a struct with fixed size" % self.name)
+
     @classmethod
     def parse(cls, parse_result):
         array = False
         array_size = None
+        array_bound = None
 
         if parse_result.array:
             array = True
             array_size = parse_result.size
+            array_bound = parse_result.bound.strip()
+
+        bits = None
+        if parse_result.bits:
+            bits = int(parse_result.bits)
 
-        return cls(parse_result.type, parse_result.name, array, array_size)
+        type = parse_result.type
+        fixed = None
+        if parse_result.fixed:
+            fixed = parse_result.fixed
+            type = fixed.type
+
+        return cls(type, parse_result.name, array, array_size, array_bound,
+            parse_result.encoding or None, bits, fixed, bool(parse_result.optional),
+            parse_result.codec or None)
 registerParseAction(Member)
 
+class BitGroup:
+    """Run of consecutive bit field members, packed LSB first into whole bytes"""
+
+    MAX_BITS = 64
+
+    def __init__(self):
+        self.members = []
+        self.bits = 0
+
+    def fits(self, member):
+        return self.bits + member.bits <= BitGroup.MAX_BITS
+
+    def add(self, member):
+        self.members.append(member)
+        self.bits += member.bits
+
+    def isPOD(self):
+        return True
+
+    def bytes(self):
+        return (self.bits + 7) // 8
+
+    def size(self):
+        return str(self.bytes())
+
+    def accumulatorType(self):
+        for t in ('uint8_t', 'uint16_t', 'uint32_t'):
+            if self.bits <= 8*BUILTIN_TYPES[t]:
+                return t
+        return 'uint64_t'
+
+    def definitions(self):
+        return [ m.definition() for m in self.members ]
+
+    def deltaFields(self, offset):
+        return [ (offset, self.size()) ]
+
+    def packCode(self, offset):
+        dst = 'dst' + offset
+        acc = self.accumulatorType()
+
+        code = [
+            '{',
+            '\t%s ucBits = 0;' % acc,
+        ]
+
+        shift = 0
+        for m in self.members:
+            mask = hex((1 << m.bits) - 1)
+            if m.type == 'bool':
+                code.append('\tucBits |= %s(%s) << %d;' % (acc, m.name, shift))
+            else:
+                code.append('\tucBits |= %s(%s & %s) << %d;' % (acc, m.name, mask, shift))
+            shift += m.bits
+
+        for i in range(self.bytes()):
+            code.append('\t%s[%d] = uint8_t(ucBits >> %d);' % (
+                '(' + dst + ')' if offset else dst, i, 8*i))
+
+        code.append('}')
+        return code
+
+    def unpackCode(self, offset):
+        src = 'src' + offset
+        acc = self.accumulatorType()
+
+        code = [
+            '{',
+            '\t%s ucBits = %s;' % (acc, ' | '.join([
+                '(%s((%s)[%d]) << %d)' % (acc, src, i, 8*i) for i in range(self.bytes())
+            ])),
+        ]
+
+        shift = 0
+        for m in self.members:
+            mask = hex((1 << m.bits) - 1)
+            if m.type == 'bool':
+                code.append('\t%s = (ucBits >> %d) & 0x1;' % (m.name, shift))
+            else:
+                code.append('\t%s = (ucBits >> %d) & %s;' % (m.name, shift, mask))
+            shift += m.bits
+
+        code.append('}')
+        return code
+
 class Custom:
     content = Forward()
     content << (
@@ -127,7 +558,9 @@ registerParseAction(Custom)
 
 class Struct:
     grammar = (
-          (Literal('struct') | Literal('msg'))('type')
+          Optional(Literal('aligned'))('aligned')
+        + Optional(Keyword('delta'))('delta')
+        + (Literal('struct') | Literal('msg'))('type')
         + Identifier.grammar("name")
         + Suppress('{')
         + ZeroOrMore(Member.grammar)("members")
@@ -135,11 +568,22 @@ class Struct:
         + Suppress(';')
     )
 
-    def __init__(self, type, name, members):
+    def __init__(self, type, name, members, aligned=False, delta=False):
         self.type = type
         self.name = name
         self.members = list(members)
 
+        # Delta messages can be sent relative to the previous message
+        # (see libucomm/delta.h)
+        self.delta = delta
+
+        # Aligned structs use natural alignment in memory and are converted
+        # to the packed wire layout by pack() / unpack().
+        self.aligned = aligned
+
+        # Explicit wire byte order ('big' / 'little'), None means host order
+        self.wireOrder = None
+
     def __str__(self):
         return self.name
 
@@ -168,12 +612,15 @@ class Struct:
             ]
 
         if self.podMembers:
-            code += [
-                '\tstruct',
-                '\t{',
-                '\n'.join(['\t\t' + m.definition() for m in self.podMembers]),
-                '\t} __attribute__((packed));',
-            ]
+            if self.aligned:
+                code += ['\t' + d for d in self.podDefinitions()]
+            else:
+                code += [
+                    '\tstruct',
+                    '\t{',
+                    '\n'.join(['\t\t' + d for d in self.podDefinitions()]),
+                    '\t} __attribute__((packed));',
+                ]
 
         for i, m in enumerate(self.nonPODMembers):
             last = i == len(self.nonPODMembers)-1
@@ -181,13 +628,26 @@ class Struct:
                 '\t' + m.definition(last)
             ]
 
+        code += ['']
+
+        if self.podMembers:
+            code += [
+                self.def_pack(),
+                self.def_unpack(),
+            ]
+
         code += [
-            '',
             self.def_serialize(),
             self.def_deserialize(),
         ]
 
-        if self.isPOD():
+        if self.delta:
+            code.append(self.def_delta())
+
+        if self.type == 'struct' and self.hasSoA():
+            code.append(self.def_soa())
+
+        if self.isPOD() and not self.aligned:
             code.append('} __attribute__((packed));')
         else:
             code.append('};')
@@ -195,11 +655,33 @@ class Struct:
         return '\n'.join(code)
 
     def podSize(self):
-        podMembers = [ m for m in self.members if m.isPOD() ]
         if len(self.podMembers) == 0:
             return "0"
         else:
-            return ' + '.join([ "(" + m.size() + ")" for m in podMembers ])
+            return ' + '.join([ "(" + m.size() + ")" for m in self.podMembers ])
+
+    def podDefinitions(self):
+        defs = []
+        for m in self.podMembers:
+            if isinstance(m, BitGroup):
+                defs += m.definitions()
+            else:
+                defs.append(m.definition())
+        return defs
+
+    def needsPack(self):
+        # Whether the in-memory layout of the fixed-size members differs from
+        # the wire layout even if the byte order matches
+        if self.aligned:
+            return True
+
+        for m in self.podMembers:
+            if isinstance(m, BitGroup) or m.fixed:
+                return True
+            if isinstance(m.type, Struct) and m.type.needsPack():
+                return True
+
+        return False
 
     def isPOD(self):
         for m in self.members:
@@ -214,11 +696,31 @@ class Struct:
         ]
 
         if self.podSize() != "0":
-            code += [
-                '\tRETURN_IF_ERROR(output->write(this, %s));' % self.podSize(),
-            ]
+            if self.needsPack():
+                code += [
+                    '\tuint8_t buf[POD_SIZE];',
+                    '\tpack(buf);',
+                    '\tRETURN_IF_ERROR(output->write(buf, POD_SIZE));',
+                ]
+            elif self.wireOrder:
+                code += [
+                    '\tif constexpr(WIRE_BYTE_ORDER == uc::BYTE_ORDER_HOST)',
+                    '\t{',
+                    '\t\tRETURN_IF_ERROR(output->write(this, %s));' % self.podSize(),
+                    '\t}',
+                    '\telse',
+                    '\t{',
+                    '\t\tuint8_t buf[POD_SIZE];',
+                    '\t\tpack(buf);',
+                    '\t\tRETURN_IF_ERROR(output->write(buf, POD_SIZE));',
+                    '\t}',
+                ]
+            else:
+                code += [
+                    '\tRETURN_IF_ERROR(output->write(this, %s));' % self.podSize(),
+                ]
 
-        code += ['\tRETURN_IF_ERROR(%s.serialize(output));' % m.name for m in self.nonPODMembers]
+        code += [ '\t' + line for line in self.nonPODSerializeCode() ]
 
         code += [
             '\treturn true;',
@@ -234,49 +736,293 @@ class Struct:
         ]
 
         if self.podSize() != "0":
+            if self.needsPack():
+                code += [
+                    '\tuint8_t buf[POD_SIZE];',
+                    '\tRETURN_IF_ERROR(input->read(buf, POD_SIZE));',
+                    '\tunpack(buf);',
+                ]
+            elif self.wireOrder:
+                code += [
+                    '\tif constexpr(WIRE_BYTE_ORDER == uc::BYTE_ORDER_HOST)',
+                    '\t{',
+                    '\t\tRETURN_IF_ERROR(input->read(this, %s));' % self.podSize(),
+                    '\t}',
+                    '\telse',
+                    '\t{',
+                    '\t\tuint8_t buf[POD_SIZE];',
+                    '\t\tRETURN_IF_ERROR(input->read(buf, POD_SIZE));',
+                    '\t\tunpack(buf);',
+                    '\t}',
+                ]
+            else:
+                code += [
+                    '\tRETURN_IF_ERROR(input->read(this, %s));' % self.podSize(),
+                ]
+
+        code += [ '\t' + line for line in self.nonPODDeserializeCode() ]
+
+        code += [
+            '\treturn true;',
+            '}',
+        ]
+
+        return ''.join([ '\t' + i + '\n' for i in code])
+
+    def optionalMembers(self):
+        return [ m for m in self.nonPODMembers if m.optional ]
+
+    def presenceBytes(self):
+        return (len(self.optionalMembers()) + 7) // 8
+
+    def nonPODSerializeCode(self):
+        code = []
+
+        if self.optionalMembers():
+            code.append('uint8_t ucPresent[%d] = {};' % self.presenceBytes())
+            for m in self.optionalMembers():
+                code.append('ucPresent[%d] |= uint8_t(%s.has()) << %d;' % (
+                    m.presenceBit // 8, m.name, m.presenceBit % 8))
+            code.append('RETURN_IF_ERROR(output->write(ucPresent, sizeof(ucPresent)));')
+
+        for m in self.nonPODMembers:
+            code += m.serializeCode()
+
+        return code
+
+    def nonPODDeserializeCode(self):
+        code = []
+
+        if self.optionalMembers():
             code += [
-                '\tRETURN_IF_ERROR(input->read(this, %s));' % self.podSize(),
+                'uint8_t ucPresent[%d];' % self.presenceBytes(),
+                'RETURN_IF_ERROR(input->read(ucPresent, sizeof(ucPresent)));',
             ]
 
-        for i, m in enumerate(self.nonPODMembers):
-            last = 'false'
-            if i == len(self.nonPODMembers)-1:
-                last = 'true'
+        for m in self.nonPODMembers:
+            code += m.deserializeCode()
+
+        return code
 
-            code.append('\tRETURN_IF_ERROR(%s.deserialize(input));' % m.name)
+    def def_delta(self):
+        fields = []
+        offset = '0'
+        for m in self.podMembers:
+            fields += m.deltaFields(offset)
+            offset += ' + (%s)' % m.size()
+
+        code = [
+            '//! Fields for delta encoding (offset and size in the wire image)',
+            'static constexpr uc::DeltaField DELTA_FIELDS[] = {',
+        ]
+        code += [ '\t{%s, %s},' % f for f in fields ]
+        code += [
+            '};',
+            '',
+            'typedef uc::DeltaState<POD_SIZE> DeltaState;',
+            '',
+            'inline bool serializeDelta(typename IO::Handler* output, DeltaState* state) const',
+            '{',
+            '\tuint8_t buf[POD_SIZE];',
+            '\tpack(buf);',
+            '\tRETURN_IF_ERROR(state->write(output, buf, DELTA_FIELDS));',
+        ]
+
+        code += [ '\t' + line for line in self.nonPODSerializeCode() ]
 
         code += [
             '\treturn true;',
             '}',
+            '',
+            'inline bool deserializeDelta(typename IO::Reader* input, DeltaState* state)',
+            '{',
+            '\tRETURN_IF_ERROR(state->read(input, DELTA_FIELDS));',
+            '\tunpack(state->image());',
+        ]
+
+        code += [ '\t' + line for line in self.nonPODDeserializeCode() ]
+
+        code += [
+            '\treturn true;',
+            '}',
+        ]
+
+        return ''.join([ ('\t' + i if i else i) + '\n' for i in code])
+
+    def def_pack(self):
+        code = [
+            '//! Convert the fixed-size members to the packed wire layout',
+            'inline void pack(uint8_t* dst) const',
+            '{',
+        ]
+
+        offset = ''
+        for m in self.podMembers:
+            code += [ '\t' + line for line in m.packCode(offset) ]
+            offset += ' + (%s)' % m.size()
+
+        code += [
+            '}',
         ]
 
         return ''.join([ '\t' + i + '\n' for i in code])
 
+    def def_unpack(self):
+        code = [
+            '//! Convert the fixed-size members from the packed wire layout',
+            'inline void unpack(const uint8_t* src)',
+            '{',
+        ]
+
+        offset = ''
+        for m in self.podMembers:
+            code += [ '\t' + line for line in m.unpackCode(offset) ]
+            offset += ' + (%s)' % m.size()
+
+        code += [
+            '}',
+        ]
+
+        return ''.join([ '\t' + i + '\n' for i in code])
+
+    def hasSoA(self):
+        # Structure-of-arrays sinks are only generated for flat structs
+        if not self.isPOD():
+            return False
+
+        for m in self.members:
+            if m.type not in BUILTIN_TYPES or m.bits or m.fixed:
+                return False
+            if m.array and not m.array_size:
+                return False
+        return True
+
+    def def_soa(self):
+        code = [
+            'template<int Capacity>',
+            'struct SoA',
+            '{',
+            '\tenum { CAPACITY = Capacity };',
+            '',
+        ]
+
+        for m in self.members:
+            if m.array:
+                code.append('\t%s %s[Capacity][%s];' % (m.type, m.name, m.array_size))
+            else:
+                code.append('\t%s %s[Capacity];' % (m.type, m.name))
+
+        code += [
+            '\tint count = 0;',
+            '',
+            '\tinline bool deserializeElement(typename IO::Reader* input)',
+            '\t{',
+            '\t\tif(count == Capacity)',
+            '\t\t\treturn false;',
+            '',
+        ]
+
+        for m in self.members:
+            if m.array:
+                code.append('\t\tRETURN_IF_ERROR(input->read(%s[count], %s));' % (m.name, m.size()))
+            else:
+                code.append('\t\tRETURN_IF_ERROR(input->read(&%s[count], %s));' % (m.name, m.size()))
+
+        if self.wireOrder:
+            code.append('')
+            for m in self.members:
+                if m.array:
+                    code += [
+                        '\t\tfor(int i = 0; i < %s; ++i)' % m.array_size,
+                        '\t\t\t%s[count][i] = uc::fromWire<WIRE_BYTE_ORDER>(%s[count][i]);' % (m.name, m.name),
+                    ]
+                else:
+                    code.append('\t\t%s[count] = uc::fromWire<WIRE_BYTE_ORDER>(%s[count]);' % (m.name, m.name))
+
+        code += [
+            '',
+            '\t\tcount++;',
+            '\t\treturn true;',
+            '\t}',
+            '};',
+        ]
+
+        return ''.join([ ('\t' + i if i else i) + '\n' for i in code])
+
     def resolveTypes(self, types):
         self.podMembers = []
         self.nonPODMembers = []
 
+        group = None
+
         for m in self.members:
             m.resolveType(types)
 
+            if m.bits:
+                # Consecutive bit fields share their bytes on the wire
+                if not group or not group.fits(m):
+                    group = BitGroup()
+                    self.podMembers.append(group)
+                group.add(m)
+                continue
+
+            group = None
+
             if m.isPOD():
                 self.podMembers.append(m)
             else:
                 self.nonPODMembers.append(m)
 
+        for i, m in enumerate(self.optionalMembers()):
+            m.presenceBit = i
+
+        if self.delta:
+            if self.type != 'msg':
+                raise RuntimeError("Only messages can use delta encoding ('%s')" % self.name)
+            if not self.podMembers:
+                raise RuntimeError("Delta message '%s' has no fixed-size members" % self.name)
+
+        if not self.aligned:
+            for m in self.podMembers:
+                if isinstance(m, Member) and isinstance(m.type, Struct) and m.type.aligned:
+                    raise RuntimeError(
+                        "Aligned struct '%s' cannot be embedded in packed struct '%s'"
+                        % (m.type.name, self.name)
+                    )
+
     @classmethod
     def parse(cls, parse_result):
-        return cls(parse_result.type, parse_result.name, parse_result.members)
+        return cls(parse_result.type, parse_result.name, parse_result.members,
+            bool(parse_result.aligned), bool(parse_result.delta))
 registerParseAction(Struct)
 
 
+class WireByteOrder:
+    grammar = (
+          Suppress('byteorder')
+        + (Literal('big') | Literal('little'))("order")
+        + Suppress(';')
+    )
+
+    def __init__(self, order):
+        self.order = order
+
+    def constant(self):
+        return 'uc::BYTE_ORDER_%s' % self.order.upper()
+
+    @classmethod
+    def parse(cls, parse_result):
+        return cls(parse_result.order)
+registerParseAction(WireByteOrder)
+
 class Grammar:
     def __init__(self):
-        self.document = ZeroOrMore(Struct.grammar | Custom.grammar)
+        self.document = ZeroOrMore(WireByteOrder.grammar | Struct.grammar | Custom.grammar)
 
 class Parser:
-    def __init__(self, grammar):
+    def __init__(self, grammar, name='Proto'):
         self.grammar = grammar
+        self.name = name
 
     def parse(self, string):
         # Strip comments
@@ -294,6 +1040,14 @@ class Parser:
 
         structs = [ s for s in ret if isinstance(s, Struct) ]
         custom_areas = [ s for s in ret if isinstance(s, Custom) ]
+        byte_orders = [ s for s in ret if isinstance(s, WireByteOrder) ]
+
+        if len(byte_orders) > 1:
+            raise RuntimeError("byteorder may only be specified once")
+
+        wire_order = None
+        if byte_orders:
+            wire_order = byte_orders[0].order
 
         for struct in structs:
             if struct.name in types:
@@ -303,7 +1057,23 @@ class Parser:
 
         print('#include <stdint.h>')
         print('#include <stdlib.h>')
+        print('#include <string.h>')
         print('#include <libucomm/list.h>')
+
+        if any([ m.encoding for s in structs for m in s.members ]):
+            print('#include <libucomm/varint.h>')
+
+        if any([ m.fixed for s in structs for m in s.members ]):
+            print('#include <libucomm/fixed.h>')
+
+        if any([ m.type in BLOB_TYPES for s in structs for m in s.members ]):
+            print('#include <libucomm/blob.h>')
+
+        if any([ s.delta for s in structs ]):
+            print('#include <libucomm/delta.h>')
+
+        if any([ m.optional for s in structs for m in s.members ]):
+            print('#include <libucomm/optional.h>')
         print
 
         print('// Start custom area')
@@ -313,13 +1083,20 @@ class Parser:
         print
 
         print('template<class IO>')
-        print('class Proto')
+        print('class %s' % self.name)
         print('{')
         print('public:')
 
+        if wire_order:
+            print('static constexpr uc::ByteOrder WIRE_BYTE_ORDER = %s;' % byte_orders[0].constant())
+        else:
+            print('static constexpr uc::ByteOrder WIRE_BYTE_ORDER = uc::BYTE_ORDER_HOST;')
+        print('')
+
         msg_counter = 0
 
         for struct in structs:
+            struct.wireOrder = wire_order
             struct.resolveTypes(types)
 
             if struct.type == 'msg':
@@ -335,7 +1112,12 @@ class Generator:
         pass
 
 if __name__ == "__main__":
-    import sys
+    import argparse
+    argparser = argparse.ArgumentParser(description='Generate C++ code from a libucomm protocol definition')
+    argparser.add_argument('--name', default='Proto', help='name of the generated protocol class')
+    argparser.add_argument('msg', help='protocol definition (.msg)')
+    args = argparser.parse_args()
+
     grammar = Grammar()
-    parser = Parser(grammar)
-    parser.parse(open(sys.argv[1]).read())
+    parser = Parser(grammar, args.name)
+    parser.parse(open(args.msg).read())
@@ -0,0 +1,113 @@
+// Tests for naturally aligned structs
+// Author: Max Schwarz <max@x-quadraht.de>
+
+#include <libucomm/cobs_envelope.h>
+#include <libucomm/checksum.h>
+#include <libucomm/io.h>
+
+#include "catch.hpp"
+
+#include "simple.h"
+
+#include "bufferio.h"
+
+#include <stddef.h>
+
+typedef uc::Fletcher16Generator ChecksumGenerator;
+
+typedef uc::COBSWriter<ChecksumGenerator, BufferIO> EnvelopeWriter;
+
+typedef uc::IO<EnvelopeWriter, uc::IO_W> SimpleWriter;
+typedef Proto<SimpleWriter> WProto;
+
+typedef uc::COBSReader<ChecksumGenerator, 1024> EnvelopeReader;
+typedef uc::IO<EnvelopeReader, uc::IO_R> SimpleReader;
+typedef Proto<SimpleReader> RProto;
+
+static_assert(offsetof(WProto::AlignedSample, timestamp) % alignof(uint32_t) == 0,
+    "aligned structs should use natural member alignment"
+);
+static_assert(WProto::AlignedSample::POD_SIZE == 11,
+    "wire layout of aligned structs should stay packed"
+);
+
+static bool fillAlignedSample(WProto::AlignedSample* data, uint8_t idx)
+{
+    data->flags = idx;
+    data->timestamp = 100000 + idx;
+    for(int i = 0; i < 3; ++i)
+        data->values[i] = 10*idx + i;
+
+    return true;
+}
+
+TEST_CASE("aligned_pack", "[aligned]")
+{
+    WProto::AlignedSample sample;
+    fillAlignedSample(&sample, 3);
+
+    uint8_t buf[WProto::AlignedSample::POD_SIZE];
+    sample.pack(buf);
+
+    uint32_t timestamp;
+    memcpy(&timestamp, buf + 1, 4);
+    uint16_t value;
+    memcpy(&value, buf + 5 + 2*2, 2);
+
+    CHECK(buf[0] == 3);
+    CHECK(timestamp == 100003);
+    CHECK(value == 32);
+
+    WProto::AlignedSample sample2;
+    sample2.unpack(buf);
+
+    CHECK(sample2.flags == sample.flags);
+    CHECK(sample2.timestamp == sample.timestamp);
+    CHECK(sample2.values[2] == sample.values[2]);
+}
+
+TEST_CASE("aligned_cobs", "[aligned]")
+{
+    WProto::AlignedMessage pkt;
+    pkt.id = 42;
+    fillAlignedSample(&pkt.first, 7);
+    pkt.samples.setCallback(fillAlignedSample, 5);
+
+    BufferIO dbg;
+    EnvelopeWriter output(&dbg);
+    REQUIRE(output.send(pkt));
+
+    EnvelopeReader input;
+    int packetCount = 0;
+
+    while(dbg.isCharAvailable())
+    {
+        if(input.take(dbg.getChar()) != EnvelopeReader::NEW_MESSAGE)
+            continue;
+
+        REQUIRE(input.msgCode() == RProto::AlignedMessage::MSG_CODE);
+
+        RProto::AlignedMessage pkt2;
+        REQUIRE(input.read(&pkt2));
+
+        CHECK(pkt2.id == 42);
+        CHECK(pkt2.first.flags == 7);
+        CHECK(pkt2.first.timestamp == 100007);
+        CHECK(pkt2.first.values[1] == 71);
+
+        RProto::AlignedSample sample;
+        int i = 0;
+        while(pkt2.samples.next(&sample))
+        {
+            CHECK(sample.flags == i);
+            CHECK(sample.timestamp == uint32_t(100000 + i));
+            CHECK(sample.values[2] == 10*i + 2);
+            ++i;
+        }
+        REQUIRE(i == 5);
+
+        packetCount++;
+    }
+
+    REQUIRE(packetCount == 1);
+}
@@ -0,0 +1,337 @@
+// Selective-repeat ARQ tests
+// Author: Max Schwarz <max@x-quadraht.de>
+
+#include <libucomm/arq.h>
+#include <libucomm/cobs_envelope.h>
+#include <libucomm/checksum.h>
+
+#include "catch.hpp"
+
+#include "sinks.h"
+
+#include <stdint.h>
+
+#include <deque>
+#include <random>
+#include <vector>
+
+typedef uc::Fletcher16Generator ChecksumGenerator;
+
+namespace
+{
+
+/**
+ * Simulated lossy link with fixed latency. Whole frames are dropped with the
+ * given probability.
+ **/
+class LossyChannel
+{
+public:
+    LossyChannel(double loss, uint32_t latency, uint32_t seed)
+     : dropped(0)
+     , m_threshold(loss * 4294967295.0)
+     , m_latency(latency)
+     , m_rng(seed)
+    {}
+
+    void send(FrameQueue* queue, uint32_t now)
+    {
+        for(auto& frame : queue->frames)
+        {
+            if(m_rng() < m_threshold)
+            {
+                dropped++;
+                continue;
+            }
+
+            m_inFlight.push_back(Frame{now + m_latency, frame});
+        }
+        queue->frames.clear();
+    }
+
+    template<class Link, class Handler>
+    void deliver(Link* link, uint32_t now, Handler handler)
+    {
+        while(!m_inFlight.empty() && m_inFlight.front().arrival <= now)
+        {
+            for(uint8_t c : m_inFlight.front().data)
+            {
+                if(link->take(c) != Link::NEW_MESSAGE)
+                    continue;
+
+                do
+                    handler(link);
+                while(link->next());
+            }
+            m_inFlight.pop_front();
+        }
+    }
+
+    unsigned int dropped;
+private:
+    struct Frame
+    {
+        uint32_t arrival;
+        std::vector<uint8_t> data;
+    };
+
+    uint32_t m_threshold;
+    uint32_t m_latency;
+    std::mt19937 m_rng;
+    std::deque<Frame> m_inFlight;
+};
+
+struct Counter
+{
+    enum { MSG_CODE = 5 };
+
+    uint32_t index;
+
+    template<class Writer>
+    bool serialize(Writer* writer) const
+    { return writer->write(&index, sizeof(index)); }
+
+    template<class Reader>
+    bool deserialize(Reader* reader)
+    { return reader->read(&index, sizeof(index)); }
+};
+
+typedef uc::COBSWriter<ChecksumGenerator, FrameQueue> EnvelopeWriter;
+typedef uc::COBSReader<ChecksumGenerator, 256> EnvelopeReader;
+typedef uc::ARQLink<EnvelopeWriter, EnvelopeReader, 8, 64> Link;
+
+//! Envelope writer whose frames can be made to fail (like a full TX buffer)
+class FlakyEnvelope
+{
+public:
+    explicit FlakyEnvelope(FrameQueue* queue)
+     : fail(false)
+     , m_envelope(queue)
+    {}
+
+    bool startEnvelope(uint8_t msg_code)
+    { return m_envelope.startEnvelope(msg_code); }
+
+    bool write(const void* data, size_t size)
+    { return m_envelope.write(data, size); }
+
+    bool endEnvelope()
+    { return !fail && m_envelope.endEnvelope(); }
+
+    bool fail;
+private:
+    EnvelopeWriter m_envelope;
+};
+
+//! One end of the simulated connection
+struct Node
+{
+    Node()
+     : envelope(&queue)
+     , link(&envelope)
+     , received(0)
+     , outOfOrder(0)
+    {}
+
+    void handle(Link* l)
+    {
+        REQUIRE(l->msgCode() == Counter::MSG_CODE);
+
+        Counter msg;
+        REQUIRE(l->read(&msg));
+
+        if(msg.index != received)
+            outOfOrder++;
+        received++;
+    }
+
+    FrameQueue queue;
+    EnvelopeWriter envelope;
+    Link link;
+
+    uint32_t received;
+    uint32_t outOfOrder;
+};
+
+/**
+ * Send @a count messages from @a a to @a b (and @a backCount back) over lossy
+ * channels.
+ *
+ * @return Time until everything was acknowledged
+ **/
+uint32_t transfer(Node* a, Node* b, uint32_t count, uint32_t backCount,
+    double loss, uint32_t latency)
+{
+    LossyChannel ab(loss, latency, 1);
+    LossyChannel ba(loss, latency, 2);
+
+    a->link.setTimeout(3 * latency);
+    b->link.setTimeout(3 * latency);
+
+    uint32_t sentA = 0;
+    uint32_t sentB = 0;
+
+    for(uint32_t now = 0; now < 1000000; ++now)
+    {
+        a->link.update(now);
+        b->link.update(now);
+
+        while(sentA < count && a->link.canSend())
+        {
+            Counter msg{sentA};
+            REQUIRE(a->link.send(msg));
+            sentA++;
+        }
+
+        // Traffic in the other direction, one message every 10 ticks
+        if(sentB < backCount && now % 10 == 0 && b->link.canSend())
+        {
+            Counter msg{sentB};
+            REQUIRE(b->link.send(msg));
+            sentB++;
+        }
+
+        ab.send(&a->queue, now);
+        ba.send(&b->queue, now);
+
+        ab.deliver(&b->link, now, [&](Link* l) { b->handle(l); });
+        ba.deliver(&a->link, now, [&](Link* l) { a->handle(l); });
+
+        if(sentA == count && sentB == backCount
+            && a->link.inFlight() == 0 && b->link.inFlight() == 0)
+        {
+            return now;
+        }
+    }
+
+    FAIL("transfer did not finish");
+    return 0;
+}
+
+}
+
+TEST_CASE("ARQ lossless", "[arq]")
+{
+    Node a, b;
+
+    uint32_t duration = transfer(&a, &b, 100, 20, 0.0, 10);
+
+    CHECK(b.received == 100);
+    CHECK(a.received == 20);
+    CHECK(b.outOfOrder == 0);
+    CHECK(a.outOfOrder == 0);
+
+    CHECK(a.link.statistics().retransmitted == 0);
+    CHECK(b.link.statistics().duplicates == 0);
+
+    // Stop-and-wait would need 100 round trips of 20 ticks
+    CHECK(duration < 100 * 20 / 5);
+}
+
+TEST_CASE("ARQ piggybacked acks", "[arq]")
+{
+    Node a, b;
+    b.link.setAckDelay(50);
+
+    LossyChannel ab(0.0, 5, 1);
+    LossyChannel ba(0.0, 5, 2);
+
+    Counter msg{0};
+    REQUIRE(a.link.send(msg));
+    CHECK(a.link.inFlight() == 1);
+
+    ab.send(&a.queue, 0);
+    ab.deliver(&b.link, 5, [&](Link* l) { b.handle(l); });
+    CHECK(b.received == 1);
+
+    // b answers before the ack delay expires, so no standalone ack is needed
+    b.link.update(6);
+    REQUIRE(b.link.send(msg));
+    ba.send(&b.queue, 6);
+    ba.deliver(&a.link, 11, [&](Link* l) { a.handle(l); });
+
+    CHECK(a.link.inFlight() == 0);
+    CHECK(b.link.statistics().acksSent == 0);
+}
+
+TEST_CASE("ARQ ack after failed send", "[arq]")
+{
+    Node a;
+
+    FrameQueue queue;
+    FlakyEnvelope envelope(&queue);
+    uc::ARQLink<FlakyEnvelope, EnvelopeReader, 8, 64> link(&envelope);
+
+    LossyChannel ab(0.0, 5, 1);
+    LossyChannel ba(0.0, 5, 2);
+
+    Counter msg{0};
+    REQUIRE(a.link.send(msg));
+    ab.send(&a.queue, 0);
+    ab.deliver(&link, 5, [&](decltype(link)* l) {
+        Counter rx;
+        REQUIRE(l->read(&rx));
+    });
+
+    // Neither the data frame (queued for retransmission) nor the standalone
+    // ack make it out
+    envelope.fail = true;
+    REQUIRE(link.send(msg));
+    link.update(6);
+    CHECK(link.statistics().acksSent == 0);
+
+    // The ack is still pending and goes out once the envelope recovers
+    envelope.fail = false;
+    link.update(7);
+    CHECK(link.statistics().acksSent == 1);
+
+    ba.send(&queue, 7);
+    ba.deliver(&a.link, 12, [&](Link* l) { a.handle(l); });
+    CHECK(a.link.inFlight() == 0);
+}
+
+TEST_CASE("ARQ window limit", "[arq]")
+{
+    Node a;
+
+    Counter msg{0};
+    for(int i = 0; i < 8; ++i)
+        REQUIRE(a.link.send(msg));
+
+    CHECK(!a.link.canSend());
+    CHECK(!a.link.send(msg));
+    CHECK(a.link.inFlight() == 8);
+}
+
+TEST_CASE("ARQ over lossy channel", "[arq]")
+{
+    Node a, b;
+
+    const uint32_t COUNT = 1000;
+    const uint32_t LATENCY = 50;
+
+    uint32_t duration = transfer(&a, &b, COUNT, 200, 0.2, LATENCY);
+
+    CHECK(b.received == COUNT);
+    CHECK(a.received == 200);
+    CHECK(b.outOfOrder == 0);
+    CHECK(a.outOfOrder == 0);
+
+    const uc::ARQStatistics& stats = a.link.statistics();
+    CHECK(stats.sent == COUNT);
+    CHECK(stats.retransmitted > COUNT / 10);
+    CHECK(b.link.statistics().received == COUNT);
+
+    // Stop-and-wait would need at least one round trip per message
+    CHECK(duration < COUNT * 2 * LATENCY / 3);
+}
+
+TEST_CASE("ARQ sequence wrap-around", "[arq]")
+{
+    Node a, b;
+
+    transfer(&a, &b, 2000, 0, 0.05, 3);
+
+    CHECK(b.received == 2000);
+    CHECK(b.outOfOrder == 0);
+}
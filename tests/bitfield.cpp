@@ -0,0 +1,120 @@
+// Bit field tests
+// Author: Max Schwarz <max@x-quadraht.de>
+
+#include <libucomm/cobs_envelope.h>
+#include <libucomm/checksum.h>
+#include <libucomm/io.h>
+
+#include "catch.hpp"
+
+#include "simple.h"
+
+#include "bufferio.h"
+
+typedef uc::Fletcher16Generator ChecksumGenerator;
+
+typedef uc::COBSWriter<ChecksumGenerator, BufferIO> EnvelopeWriter;
+
+typedef uc::IO<EnvelopeWriter, uc::IO_W> SimpleWriter;
+typedef Proto<SimpleWriter> WProto;
+
+typedef uc::COBSReader<ChecksumGenerator, 1024> EnvelopeReader;
+typedef uc::IO<EnvelopeReader, uc::IO_R> SimpleReader;
+typedef Proto<SimpleReader> RProto;
+
+static_assert(WProto::ServoFlags::POD_SIZE == 3, "2+3+12 bits should fit in 3 bytes");
+static_assert(WProto::FlagMessage::POD_SIZE == 16, "bit groups should be packed");
+
+static bool fillServoFlags(WProto::ServoFlags* data, uint8_t idx)
+{
+    data->enabled = idx & 1;
+    data->fault = idx & 2;
+    data->mode = idx;
+    data->current = 1000 + idx;
+    return true;
+}
+
+TEST_CASE("bitfield_pack", "[bitfield]")
+{
+    WProto::ServoFlags flags;
+    flags.enabled = true;
+    flags.fault = false;
+    flags.mode = 5;
+    flags.current = 0xABC;
+
+    uint8_t buf[3];
+    flags.pack(buf);
+
+    CHECK(buf[0] == 0x95);
+    CHECK(buf[1] == 0x57);
+    CHECK(buf[2] == 0x01);
+
+    // Values are truncated to their bit width
+    flags.mode = 0xFF;
+    flags.pack(buf);
+
+    WProto::ServoFlags flags2;
+    flags2.unpack(buf);
+    CHECK(flags2.enabled);
+    CHECK(!flags2.fault);
+    CHECK(flags2.mode == 7);
+    CHECK(flags2.current == 0xABC);
+}
+
+TEST_CASE("bitfield_message", "[bitfield]")
+{
+    WProto::FlagMessage pkt;
+    pkt.id = 3;
+    pkt.alive = true;
+    pkt.level = 9;
+    pkt.dummy = 0xBEEF;
+    pkt.counter = 0xFFFFF;
+    pkt.other = 0x12345;
+    pkt.more = 0x3FFFFFF0;
+    fillServoFlags(&pkt.servo, 2);
+    pkt.servos.setCallback(fillServoFlags, 4);
+
+    BufferIO dbg;
+    EnvelopeWriter output(&dbg);
+    REQUIRE(output.send(pkt));
+
+    EnvelopeReader input;
+    int packetCount = 0;
+
+    while(dbg.isCharAvailable())
+    {
+        if(input.take(dbg.getChar()) != EnvelopeReader::NEW_MESSAGE)
+            continue;
+
+        RProto::FlagMessage pkt2;
+        REQUIRE(input.read(&pkt2));
+
+        CHECK(pkt2.id == 3);
+        CHECK(pkt2.alive);
+        CHECK(pkt2.level == 9);
+        CHECK(pkt2.dummy == 0xBEEF);
+        CHECK(pkt2.counter == 0xFFFFF);
+        CHECK(pkt2.other == 0x12345);
+        CHECK(pkt2.more == 0x3FFFFFF0);
+        CHECK(!pkt2.servo.enabled);
+        CHECK(pkt2.servo.fault);
+        CHECK(pkt2.servo.mode == 2);
+        CHECK(pkt2.servo.current == 1002);
+
+        RProto::ServoFlags flags;
+        int i = 0;
+        while(pkt2.servos.next(&flags))
+        {
+            CHECK(flags.enabled == bool(i & 1));
+            CHECK(flags.fault == bool(i & 2));
+            CHECK(flags.mode == i);
+            CHECK(flags.current == 1000 + i);
+            ++i;
+        }
+        CHECK(i == 4);
+
+        packetCount++;
+    }
+
+    REQUIRE(packetCount == 1);
+}
@@ -0,0 +1,120 @@
+// String / bytes member tests
+// Author: Max Schwarz <max@x-quadraht.de>
+
+#include <libucomm/cobs_envelope.h>
+#include <libucomm/checksum.h>
+#include <libucomm/io.h>
+
+#include "catch.hpp"
+
+#include "simple.h"
+
+#include "bufferio.h"
+
+#include <string>
+
+typedef uc::Fletcher16Generator ChecksumGenerator;
+
+typedef uc::COBSWriter<ChecksumGenerator, BufferIO> EnvelopeWriter;
+
+typedef uc::IO<EnvelopeWriter, uc::IO_W> SimpleWriter;
+typedef Proto<SimpleWriter> WProto;
+
+typedef uc::COBSReader<ChecksumGenerator, 2048> EnvelopeReader;
+typedef uc::IO<EnvelopeReader, uc::IO_R> SimpleReader;
+typedef Proto<SimpleReader> RProto;
+
+TEST_CASE("blob_message", "[blob]")
+{
+    uint8_t payload[300];
+    for(int i = 0; i < 300; ++i)
+        payload[i] = i;
+
+    std::string text = "Hello, world!";
+
+    WProto::LogMessage msg;
+    msg.level = 3;
+    msg.source.set("motor");
+    msg.payload.set(payload, sizeof(payload));
+    msg.text.set(text);
+
+    BufferIO dbg(4096);
+    EnvelopeWriter output(&dbg);
+    REQUIRE(output.send(msg));
+
+    EnvelopeReader input;
+    int packetCount = 0;
+
+    while(dbg.isCharAvailable())
+    {
+        if(input.take(dbg.getChar()) != EnvelopeReader::NEW_MESSAGE)
+            continue;
+
+        REQUIRE(input.msgCode() == RProto::LogMessage::MSG_CODE);
+
+        RProto::LogMessage msg2;
+        REQUIRE(input.read(&msg2));
+
+        CHECK(msg2.level == 3);
+        CHECK(msg2.source.view() == "motor");
+        CHECK(msg2.text.view() == text);
+
+        REQUIRE(msg2.payload.size() == 300);
+        int i = 0;
+        for(uint8_t c : msg2.payload.view())
+        {
+            CHECK(c == payload[i]);
+            ++i;
+        }
+        CHECK(i == 300);
+
+        packetCount++;
+    }
+
+    REQUIRE(packetCount == 1);
+}
+
+TEST_CASE("blob_empty", "[blob]")
+{
+    WProto::LogMessage msg;
+    msg.level = 1;
+
+    BufferIO dbg;
+    EnvelopeWriter output(&dbg);
+    REQUIRE(output.send(msg));
+
+    EnvelopeReader input;
+    int packetCount = 0;
+
+    while(dbg.isCharAvailable())
+    {
+        if(input.take(dbg.getChar()) != EnvelopeReader::NEW_MESSAGE)
+            continue;
+
+        RProto::LogMessage msg2;
+        REQUIRE(input.read(&msg2));
+
+        CHECK(msg2.source.size() == 0);
+        CHECK(msg2.payload.view().empty());
+        CHECK(msg2.text.view() == "");
+
+        packetCount++;
+    }
+
+    REQUIRE(packetCount == 1);
+}
+
+TEST_CASE("blob_bound", "[blob]")
+{
+    static uint8_t payload[1025];
+
+    WProto::LogMessage msg;
+    msg.payload.set(payload, sizeof(payload));
+
+    BufferIO dbg(4096);
+    EnvelopeWriter output(&dbg);
+    CHECK(!output.send(msg));
+
+    msg.payload.set(payload, 1024);
+    CHECK(output.send(msg));
+}
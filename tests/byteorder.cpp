@@ -0,0 +1,214 @@
+// Wire byte order tests
+// Author: Max Schwarz <max@x-quadraht.de>
+
+#include <libucomm/cobs_envelope.h>
+#include <libucomm/checksum.h>
+#include <libucomm/io.h>
+
+#include "catch.hpp"
+
+#include "bigendian.h"
+
+#include "bufferio.h"
+
+typedef uc::Fletcher16Generator ChecksumGenerator;
+
+typedef uc::COBSWriter<ChecksumGenerator, BufferIO> EnvelopeWriter;
+
+typedef uc::IO<EnvelopeWriter, uc::IO_W> SimpleWriter;
+typedef BigEndianProto<SimpleWriter> WProto;
+
+typedef uc::COBSReader<ChecksumGenerator, 1024> EnvelopeReader;
+typedef uc::IO<EnvelopeReader, uc::IO_R> SimpleReader;
+typedef BigEndianProto<SimpleReader> RProto;
+
+namespace
+{
+
+struct RawMessage
+{
+    uint8_t data[22];
+
+    bool deserialize(EnvelopeReader::Reader* reader)
+    {
+        return reader->read(data, sizeof(data));
+    }
+};
+
+bool fillBESample(WProto::BESample* data, uint8_t idx)
+{
+    data->id = idx;
+    data->value = 0x1000 + idx;
+    data->values[0] = 0x20000000 + idx;
+    data->values[1] = 0x30000000 + idx;
+    return true;
+}
+
+}
+
+TEST_CASE("byteswap", "[byteorder]")
+{
+    CHECK(uc::byteSwap<uint16_t>(0x0102) == 0x0201);
+    CHECK(uc::byteSwap<uint32_t>(0x01020304) == 0x04030201);
+    CHECK(uc::byteSwap<int16_t>(-2) == int16_t(0xFEFF));
+
+    uint32_t src[37];
+    uint32_t dst[37];
+    for(int i = 0; i < 37; ++i)
+        src[i] = 0x01020304 * (i+1);
+
+    uc::byteSwapArray<uint32_t>(dst, src, 37);
+    for(int i = 0; i < 37; ++i)
+        CHECK(dst[i] == __builtin_bswap32(src[i]));
+
+    uint8_t be[2] = {0x12, 0x34};
+    CHECK((uc::loadWire<uc::BYTE_ORDER_BIG, uint16_t>(be)) == 0x1234);
+    CHECK((uc::loadWire<uc::BYTE_ORDER_LITTLE, uint16_t>(be)) == 0x3412);
+}
+
+TEST_CASE("bigendian_wire", "[byteorder]")
+{
+    static uint16_t samples[2] = {0x1112, 0x1314};
+
+    WProto::BEMessage pkt;
+    pkt.stamp = 0x01020304;
+    pkt.sample.id = 5;
+    pkt.sample.value = 0x0607;
+    pkt.sample.values[0] = 0x08090A0B;
+    pkt.sample.values[1] = 0x0C0D0E0F;
+    pkt.samples.setData(samples, 2);
+
+    BufferIO dbg;
+    EnvelopeWriter output(&dbg);
+    REQUIRE(output.send(pkt));
+
+    const uint8_t expected[] = {
+        0x01, 0x02, 0x03, 0x04,             // stamp
+        0x05, 0x06, 0x07,                   // sample.id, sample.value
+        0x08, 0x09, 0x0A, 0x0B,             // sample.values
+        0x0C, 0x0D, 0x0E, 0x0F,
+        0x00, 0x02,                         // samples count
+        0x11, 0x12, 0x13, 0x14,             // samples
+        0x00                                // list count
+    };
+    static_assert(sizeof(expected) == sizeof(RawMessage::data), "size mismatch");
+
+    EnvelopeReader input;
+    int packetCount = 0;
+
+    while(dbg.isCharAvailable())
+    {
+        if(input.take(dbg.getChar()) != EnvelopeReader::NEW_MESSAGE)
+            continue;
+
+        RawMessage raw;
+        REQUIRE(input.read(&raw));
+        for(size_t i = 0; i < sizeof(expected); ++i)
+            CHECK(raw.data[i] == expected[i]);
+
+        packetCount++;
+    }
+
+    REQUIRE(packetCount == 1);
+}
+
+TEST_CASE("bigendian_roundtrip", "[byteorder]")
+{
+    static uint16_t samples[300];
+    for(int i = 0; i < 300; ++i)
+        samples[i] = 0x0100 * i + 7;
+
+    WProto::BEMessage pkt;
+    pkt.stamp = 123456789;
+    fillBESample(&pkt.sample, 9);
+    pkt.samples.setData(samples, 300);
+    pkt.list.setCallback(fillBESample, 3);
+
+    BufferIO dbg(2048);
+    EnvelopeWriter output(&dbg);
+    REQUIRE(output.send(pkt));
+
+    EnvelopeReader input;
+    int packetCount = 0;
+
+    while(dbg.isCharAvailable())
+    {
+        if(input.take(dbg.getChar()) != EnvelopeReader::NEW_MESSAGE)
+            continue;
+
+        RProto::BEMessage pkt2;
+        REQUIRE(input.read(&pkt2));
+
+        CHECK(pkt2.stamp == 123456789);
+        CHECK(pkt2.sample.id == 9);
+        CHECK(pkt2.sample.value == 0x1009);
+        CHECK(pkt2.sample.values[1] == 0x30000009);
+
+        uint16_t sample;
+        int i = 0;
+        while(pkt2.samples.next(&sample))
+        {
+            REQUIRE(sample == uint16_t(0x0100 * i + 7));
+            ++i;
+        }
+        REQUIRE(i == 300);
+
+        RProto::BESample s;
+        i = 0;
+        while(pkt2.list.next(&s))
+        {
+            CHECK(s.id == i);
+            CHECK(s.values[0] == uint32_t(0x20000000 + i));
+            ++i;
+        }
+        REQUIRE(i == 3);
+
+        packetCount++;
+    }
+
+    REQUIRE(packetCount == 1);
+}
+
+TEST_CASE("bigendian_bulk", "[byteorder]")
+{
+    static uint16_t samples[300];
+    for(int i = 0; i < 300; ++i)
+        samples[i] = 0x0100 * i + 7;
+
+    WProto::BEMessage pkt;
+    pkt.stamp = 0;
+    fillBESample(&pkt.sample, 0);
+    pkt.samples.setData(samples, 300);
+    pkt.list.setCallback(fillBESample, 0);
+
+    BufferIO dbg(2048);
+    EnvelopeWriter output(&dbg);
+    REQUIRE(output.send(pkt));
+
+    EnvelopeReader input;
+    int packetCount = 0;
+
+    while(dbg.isCharAvailable())
+    {
+        if(input.take(dbg.getChar()) != EnvelopeReader::NEW_MESSAGE)
+            continue;
+
+        RProto::BEMessage pkt2;
+        REQUIRE(input.read(&pkt2));
+
+        // Mix single and bulk access, the bulk part does not end on a chunk
+        static uint16_t decoded[300];
+        for(int i = 0; i < 3; ++i)
+            REQUIRE(pkt2.samples.next(&decoded[i]));
+        REQUIRE(pkt2.samples.next(decoded + 3, 297));
+        CHECK(pkt2.samples.remaining() == 0);
+        CHECK(!pkt2.samples.next(decoded, 1));
+
+        for(int i = 0; i < 300; ++i)
+            REQUIRE(decoded[i] == samples[i]);
+
+        packetCount++;
+    }
+
+    REQUIRE(packetCount == 1);
+}
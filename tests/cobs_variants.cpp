@@ -0,0 +1,161 @@
+// COBS/R and COBS/ZPE envelope tests
+// Author: Max Schwarz <max@x-quadraht.de>
+
+#include <libucomm/cobs_envelope.h>
+#include <libucomm/checksum.h>
+
+#include "catch.hpp"
+
+#include "sinks.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <vector>
+
+typedef uc::Fletcher16Generator ChecksumGenerator;
+
+namespace
+{
+
+struct RawMessage
+{
+    enum { MSG_CODE = 3 };
+
+    std::vector<uint8_t> payload;
+
+    template<class Writer>
+    bool serialize(Writer* writer) const
+    { return writer->write(payload.data(), payload.size()); }
+
+    template<class Reader>
+    bool deserialize(Reader* reader)
+    {
+        payload.resize(reader->remaining());
+        return reader->read(payload.data(), payload.size());
+    }
+};
+
+/**
+ * Send @a payload and decode it again.
+ *
+ * @return wire size
+ **/
+template<uc::COBSVariant Variant>
+size_t roundtrip(const std::vector<uint8_t>& payload)
+{
+    FrameBuffer buffer;
+    uc::COBSWriter<ChecksumGenerator, FrameBuffer, Variant> writer(&buffer);
+
+    RawMessage msg;
+    msg.payload = payload;
+    REQUIRE(writer.send(msg));
+
+    // No zeros inside the frame
+    for(size_t i = 1; i < buffer.size() - 1; ++i)
+        REQUIRE(buffer.data()[i] != 0x00);
+
+    uc::COBSReader<ChecksumGenerator, 2048, Variant> reader;
+    int count = 0;
+
+    for(size_t i = 0; i < buffer.size(); ++i)
+    {
+        auto ret = reader.take(buffer.data()[i]);
+        REQUIRE(ret != decltype(reader)::CHECKSUM_ERROR);
+        REQUIRE(ret != decltype(reader)::FRAME_ERROR);
+
+        if(ret == decltype(reader)::NEW_MESSAGE)
+        {
+            CHECK(reader.msgCode() == RawMessage::MSG_CODE);
+
+            RawMessage msg2;
+            REQUIRE(reader.read(&msg2));
+            REQUIRE(msg2.payload == payload);
+            count++;
+        }
+    }
+
+    REQUIRE(count == 1);
+
+    return buffer.size();
+}
+
+std::vector< std::vector<uint8_t> > testPayloads()
+{
+    std::vector< std::vector<uint8_t> > payloads;
+
+    srand(3);
+    for(size_t len : {0, 1, 2, 3, 30, 31, 32, 221, 222, 223, 224, 225, 253, 254, 255, 256, 600})
+    {
+        std::vector<uint8_t> p(len);
+
+        // Random without zeros
+        for(auto& c : p)
+            c = 1 + rand() % 255;
+        payloads.push_back(p);
+
+        // Sparse data with single zeros and zero pairs
+        for(auto& c : p)
+            c = (rand() % 3 == 0) ? 0 : rand();
+        payloads.push_back(p);
+
+        // All zeros
+        std::fill(p.begin(), p.end(), 0);
+        payloads.push_back(p);
+
+        // Zero runs of different lengths
+        for(size_t i = 0; i < len; ++i)
+            p[i] = (i % 7 < 3) ? 0 : 0xFF;
+        payloads.push_back(p);
+    }
+
+    return payloads;
+}
+
+}
+
+TEST_CASE("cobs_variants_roundtrip", "[cobs]")
+{
+    for(const auto& payload : testPayloads())
+    {
+        size_t plain = roundtrip<uc::COBS_PLAIN>(payload);
+        size_t reduced = roundtrip<uc::COBS_REDUCED>(payload);
+        roundtrip<uc::COBS_ZPE>(payload);
+
+        CHECK(reduced <= plain);
+    }
+}
+
+TEST_CASE("cobs_variants_overhead", "[cobs]")
+{
+    // Small integers: lots of zero pairs in the high bytes
+    std::vector<uint8_t> payload;
+    for(uint32_t i = 0; i < 100; ++i)
+    {
+        uint32_t v = 1 + i;
+        const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&v);
+        payload.insert(payload.end(), bytes, bytes + 4);
+    }
+
+    size_t plain = roundtrip<uc::COBS_PLAIN>(payload);
+    size_t zpe = roundtrip<uc::COBS_ZPE>(payload);
+
+    CHECK(zpe < plain - 50);
+
+    // COBS/R saves the final code byte if the last byte is large enough
+    std::vector<uint8_t> payload2 = {1, 2, 3};
+    for(int sumByte = 0; sumByte < 256; ++sumByte)
+    {
+        // Find a payload where the high checksum byte is large
+        payload2[2] = sumByte;
+        ChecksumGenerator gen;
+        gen.reset();
+        gen.add(RawMessage::MSG_CODE + 1);
+        for(uint8_t c : payload2)
+            gen.add(c);
+        if((gen.value() >> 8) >= 0x10 && (gen.value() & 0xFF) != 0 && sumByte != 0)
+            break;
+    }
+
+    CHECK(roundtrip<uc::COBS_REDUCED>(payload2) == roundtrip<uc::COBS_PLAIN>(payload2) - 1);
+}
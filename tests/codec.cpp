@@ -0,0 +1,189 @@
+// List codec tests
+// Author: Max Schwarz <max@x-quadraht.de>
+
+#include <libucomm/cobs_envelope.h>
+#include <libucomm/checksum.h>
+#include <libucomm/io.h>
+
+#include "catch.hpp"
+
+#include "simple.h"
+
+#include "bufferio.h"
+
+typedef uc::Fletcher16Generator ChecksumGenerator;
+
+typedef uc::COBSWriter<ChecksumGenerator, BufferIO> EnvelopeWriter;
+
+typedef uc::IO<EnvelopeWriter, uc::IO_W> SimpleWriter;
+typedef Proto<SimpleWriter> WProto;
+
+typedef uc::COBSReader<ChecksumGenerator, 8192> EnvelopeReader;
+typedef uc::IO<EnvelopeReader, uc::IO_R> SimpleReader;
+typedef Proto<SimpleReader> RProto;
+
+namespace
+{
+
+uint32_t g_timestamps[1000];
+int16_t g_samples[1000];
+uint8_t g_states[1000];
+
+void fillSeries()
+{
+    for(int i = 0; i < 1000; ++i)
+    {
+        g_timestamps[i] = 0xFFFFF000 + 1000*i + (i % 7 == 0 ? 3 : 0); // wraps
+        g_samples[i] = (i < 500) ? 2*i - 300 : 32767 - i;
+        g_states[i] = (i / 100) % 3;
+    }
+}
+
+bool fillRaw(uint16_t* dest, uint8_t idx)
+{
+    *dest = (idx == 3) ? 0xFFFF : 100 + idx;
+    return true;
+}
+
+}
+
+TEST_CASE("codec_message", "[codec]")
+{
+    fillSeries();
+
+    WProto::SampleStream msg;
+    msg.channel = 2;
+    msg.timestamps.setData(g_timestamps, 1000);
+    msg.samples.setData(g_samples, 1000);
+    msg.states.setData(g_states, 1000);
+    msg.raw.setCallback(fillRaw, 10);
+
+    BufferIO dbg(16384);
+    EnvelopeWriter output(&dbg);
+    REQUIRE(output.send(msg));
+
+    EnvelopeReader input;
+    int packetCount = 0;
+    int size = 0;
+
+    while(dbg.isCharAvailable())
+    {
+        size++;
+        if(input.take(dbg.getChar()) != EnvelopeReader::NEW_MESSAGE)
+            continue;
+
+        RProto::SampleStream msg2;
+        REQUIRE(input.read(&msg2));
+
+        CHECK(msg2.channel == 2);
+
+        int i = 0;
+        uint32_t t;
+        while(msg2.timestamps.next(&t))
+        {
+            CHECK(t == g_timestamps[i]);
+            ++i;
+        }
+        CHECK(i == 1000);
+
+        i = 0;
+        int16_t sample;
+        while(msg2.samples.next(&sample))
+        {
+            CHECK(sample == g_samples[i]);
+            ++i;
+        }
+        CHECK(i == 1000);
+
+        i = 0;
+        uint8_t state;
+        while(msg2.states.next(&state))
+        {
+            CHECK(state == g_states[i]);
+            ++i;
+        }
+        CHECK(i == 1000);
+
+        i = 0;
+        uint16_t raw;
+        while(msg2.raw.next(&raw))
+        {
+            uint16_t expected;
+            fillRaw(&expected, i);
+            CHECK(raw == expected);
+            ++i;
+        }
+        CHECK(i == 10);
+
+        packetCount++;
+    }
+
+    REQUIRE(packetCount == 1);
+
+    // Raw encoding would need 7000 bytes for the three series
+    CHECK(size < 7000 / 2);
+}
+
+TEST_CASE("codec_rle_skip", "[codec]")
+{
+    uc::RLECodec<uint8_t> codec;
+
+    // Two runs (3x 5, 2x 7) encoded as varint + value
+    const uint8_t data[] = {5, 5, 5, 7, 7};
+
+    struct Buffer
+    {
+        uint8_t data[16];
+        size_t size = 0;
+        size_t pos = 0;
+
+        bool write(const void* src, size_t n)
+        {
+            memcpy(data + size, src, n);
+            size += n;
+            return true;
+        }
+
+        bool read(void* dst, size_t n)
+        {
+            if(pos + n > size)
+                return false;
+            memcpy(dst, data + pos, n);
+            pos += n;
+            return true;
+        }
+
+        bool skip(size_t n)
+        {
+            if(pos + n > size)
+                return false;
+            pos += n;
+            return true;
+        }
+    } buffer;
+
+    codec.reset();
+    REQUIRE(codec.encode<uc::BYTE_ORDER_LITTLE>(&buffer, data, 5));
+    REQUIRE(codec.finish<uc::BYTE_ORDER_LITTLE>(&buffer));
+    CHECK(buffer.size == 4);
+
+    codec.reset();
+    REQUIRE(codec.skip<uc::BYTE_ORDER_LITTLE>(&buffer, 5));
+    CHECK(buffer.pos == 4);
+
+    // Runs must not exceed the element count
+    buffer.pos = 0;
+    codec.reset();
+    CHECK(!codec.skip<uc::BYTE_ORDER_LITTLE>(&buffer, 4));
+
+    // Same for decoding: the second run is one element too long
+    buffer.pos = 0;
+    codec.reset();
+    uint8_t value;
+    for(size_t remaining = 4; remaining != 1; --remaining)
+    {
+        REQUIRE(codec.decode<uc::BYTE_ORDER_LITTLE>(&buffer, &value, remaining));
+        CHECK(value == 5);
+    }
+    CHECK(!codec.decode<uc::BYTE_ORDER_LITTLE>(&buffer, &value, 1));
+}
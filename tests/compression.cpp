@@ -0,0 +1,226 @@
+// Compression stage tests
+// Author: Max Schwarz <max@x-quadraht.de>
+
+#include <libucomm/cobs_envelope.h>
+#include <libucomm/compression.h>
+#include <libucomm/checksum.h>
+#include <libucomm/io.h>
+
+#include "catch.hpp"
+
+#include "simple.h"
+
+#include "bufferio.h"
+
+#include <stdlib.h>
+#include <string>
+
+typedef uc::Fletcher16Generator ChecksumGenerator;
+
+typedef uc::COBSWriter<ChecksumGenerator, BufferIO> EnvelopeWriter;
+typedef uc::COBSReader<ChecksumGenerator, 2048> EnvelopeReader;
+
+typedef uc::DecompressingReader<EnvelopeReader, 2048> Decompressor;
+typedef uc::IO<Decompressor, uc::IO_R> SimpleReader;
+typedef Proto<SimpleReader> RProto;
+
+namespace
+{
+
+template<class Compressor>
+void checkBlock(const uint8_t* data, size_t size, bool compressible)
+{
+    static Compressor compressor;
+    static uint8_t compressed[4096];
+    static uint8_t decompressed[4096];
+
+    size_t n = compressor.compress(data, size, compressed, sizeof(compressed));
+    REQUIRE(n != 0);
+
+    if(compressible)
+        CHECK(n < size / 2);
+
+    size_t outSize = 0;
+    REQUIRE(uc::lzDecompress(compressed, n, decompressed, sizeof(decompressed), &outSize));
+    REQUIRE(outSize == size);
+    CHECK(memcmp(data, decompressed, size) == 0);
+
+    // Output that does not fit is refused
+    if(n > 1)
+        CHECK(compressor.compress(data, size, compressed, n - 1) == 0);
+}
+
+template<class Compressor>
+void checkCodec()
+{
+    uint8_t text[1500];
+    const char* phrase = "servo 3: position 1200, current 0.42 A; ";
+    for(size_t i = 0; i < sizeof(text); ++i)
+        text[i] = phrase[i % strlen(phrase)];
+
+    uint8_t zeros[300] = {};
+
+    uint8_t random[700];
+    srand(1);
+    for(size_t i = 0; i < sizeof(random); ++i)
+        random[i] = rand();
+
+    checkBlock<Compressor>(text, sizeof(text), true);
+    checkBlock<Compressor>(zeros, sizeof(zeros), true);
+    checkBlock<Compressor>(random, sizeof(random), false);
+    checkBlock<Compressor>(text, 3, false);
+    checkBlock<Compressor>(text, 0, false);
+}
+
+//! Captures the raw bytes of a (small) message
+struct RawPayload
+{
+    uint8_t data[16];
+    size_t size;
+
+    template<class Reader>
+    bool deserialize(Reader* reader)
+    {
+        size = reader->remaining();
+        return size <= sizeof(data) && reader->read(data, size);
+    }
+};
+
+template<class Compressor>
+void checkMessage()
+{
+    typedef uc::CompressingWriter<Compressor, EnvelopeWriter, 2048> Writer;
+    typedef uc::IO<Writer, uc::IO_W> SimpleWriter;
+    typedef Proto<SimpleWriter> WProto;
+
+    std::string text;
+    while(text.size() < 200)
+        text += "temperature nominal, ";
+
+    uint8_t payload[1024];
+    for(size_t i = 0; i < sizeof(payload); ++i)
+        payload[i] = (i / 16) % 4;
+
+    typename WProto::LogMessage msg;
+    msg.level = 2;
+    msg.source.set("logger");
+    msg.text.set(text);
+    msg.payload.set(payload, sizeof(payload));
+
+    static Writer writer(0);
+
+    for(int compress = 0; compress < 2; ++compress)
+    {
+        BufferIO dbg(4096);
+        EnvelopeWriter envelope(&dbg);
+        writer = Writer(&envelope);
+        REQUIRE(writer.send(msg, compress));
+
+        Decompressor input;
+        int packetCount = 0;
+        int size = 0;
+
+        while(dbg.isCharAvailable())
+        {
+            size++;
+            if(input.take(dbg.getChar()) != Decompressor::NEW_MESSAGE)
+                continue;
+
+            CHECK(input.msgCode() == RProto::LogMessage::MSG_CODE);
+            CHECK(input.wasCompressed() == bool(compress));
+
+            RProto::LogMessage msg2;
+            REQUIRE(input.read(&msg2));
+
+            CHECK(msg2.level == 2);
+            CHECK(msg2.source.view() == "logger");
+            CHECK(msg2.text.view() == text);
+            REQUIRE(msg2.payload.size() == sizeof(payload));
+            CHECK(memcmp(msg2.payload.data(), payload, sizeof(payload)) == 0);
+
+            packetCount++;
+        }
+
+        REQUIRE(packetCount == 1);
+
+        if(compress)
+            CHECK(size < 400);
+        else
+            CHECK(size > 1200);
+    }
+}
+
+}
+
+TEST_CASE("lz_codec", "[compression]")
+{
+    checkCodec< uc::LZCompressor<8> >();
+    checkCodec< uc::LZCompressor<12> >();
+    checkCodec< uc::LZHashCompressor<12, 12> >();
+    checkCodec< uc::LZHashCompressor<16, 14, 64> >();
+}
+
+TEST_CASE("lz_malformed", "[compression]")
+{
+    uint8_t out[64];
+    size_t size;
+
+    // Match offset pointing before the start of the output
+    const uint8_t badOffset[] = {0x10, 'a', 0x02, 0x00};
+    CHECK(!uc::lzDecompress(badOffset, sizeof(badOffset), out, sizeof(out), &size));
+
+    // Truncated literals
+    const uint8_t truncated[] = {0x50, 'a', 'b'};
+    CHECK(!uc::lzDecompress(truncated, sizeof(truncated), out, sizeof(out), &size));
+
+    // Output overflow
+    const uint8_t overflow[] = {0x1F, 'a', 0x01, 0x00, 0xFF, 0x00};
+    CHECK(!uc::lzDecompress(overflow, sizeof(overflow), out, sizeof(out), &size));
+}
+
+TEST_CASE("compression_message", "[compression]")
+{
+    checkMessage< uc::LZCompressor<8> >();
+    checkMessage< uc::LZHashCompressor<> >();
+}
+
+TEST_CASE("compression_empty", "[compression]")
+{
+    typedef uc::CompressingWriter<uc::LZCompressor<8>, EnvelopeWriter, 2048> Writer;
+
+    BufferIO dbg(4096);
+    EnvelopeWriter envelope(&dbg);
+    Writer writer(&envelope);
+    writer.setMinSize(0);
+
+    // Empty and single-byte messages cannot shrink, so they are sent raw
+    const uint8_t byte = 0x42;
+    for(size_t size = 0; size < 2; ++size)
+    {
+        REQUIRE(writer.startEnvelope(3));
+        REQUIRE(writer.write(&byte, size));
+        REQUIRE(writer.endEnvelope());
+    }
+
+    Decompressor input;
+    int packetCount = 0;
+
+    while(dbg.isCharAvailable())
+    {
+        if(input.take(dbg.getChar()) != Decompressor::NEW_MESSAGE)
+            continue;
+
+        CHECK(input.msgCode() == 3);
+        CHECK(!input.wasCompressed());
+
+        RawPayload payload;
+        REQUIRE(input.read(&payload));
+        REQUIRE(payload.size == size_t(packetCount));
+        if(payload.size != 0)
+            CHECK(payload.data[0] == byte);
+
+        packetCount++;
+    }
+
+    CHECK(packetCount == 2);
+}
@@ -0,0 +1,305 @@
+// Coroutine interface tests
+// Author: Max Schwarz <max@x-quadraht.de>
+
+#include <libucomm/coroutine.h>
+#include <libucomm/resumable.h>
+#include <libucomm/cobs_envelope.h>
+#include <libucomm/checksum.h>
+
+#include "catch.hpp"
+
+#include "sinks.h"
+
+#include <vector>
+
+typedef uc::Fletcher16Generator ChecksumGenerator;
+
+namespace
+{
+
+struct Value
+{
+    enum { MSG_CODE = 4 };
+
+    uint32_t value;
+
+    template<class Writer>
+    bool serialize(Writer* writer) const
+    { return writer->write(&value, sizeof(value)); }
+
+    template<class Reader>
+    bool deserialize(Reader* reader)
+    { return reader->read(&value, sizeof(value)); }
+};
+
+struct Blob
+{
+    enum { MSG_CODE = 5 };
+
+    std::vector<uint8_t> data;
+
+    template<class Writer>
+    bool serialize(Writer* writer) const
+    { return writer->write(data.data(), data.size()); }
+};
+
+}
+
+typedef uc::COBSWriter<ChecksumGenerator, ByteSink> EnvelopeWriter;
+typedef uc::COBSReader<ChecksumGenerator, 1024> EnvelopeReader;
+typedef uc::ResumableCOBSWriter<ChecksumGenerator, SmallBuffer> Writer;
+
+namespace
+{
+
+uc::Detached receive(uc::AsyncReader<EnvelopeReader>* input, std::vector<uint32_t>* values, bool* closed)
+{
+    while(true)
+    {
+        auto msg = co_await input->nextMessage();
+        if(!msg)
+            break;
+
+        if(msg.msgCode() != Value::MSG_CODE)
+            continue;
+
+        if(msg.reader().remaining() != sizeof(uint32_t))
+            continue;
+
+        Value value;
+        if(msg.read(&value))
+            values->push_back(value.value);
+    }
+
+    *closed = true;
+}
+
+uc::Detached receiveOne(uc::AsyncReader<EnvelopeReader>* input, uint32_t* value)
+{
+    auto msg = co_await input->nextMessage();
+
+    Value v;
+    if(msg && msg.read(&v))
+        *value = v.value;
+}
+
+//! Awaitable resumed by the test
+struct Event
+{
+    bool await_ready() const noexcept
+    { return false; }
+
+    void await_suspend(std::coroutine_handle<> handle) noexcept
+    { waiter = handle; }
+
+    void await_resume() const noexcept
+    {}
+
+    void trigger()
+    {
+        std::coroutine_handle<> handle = waiter;
+        waiter = nullptr;
+        handle.resume();
+    }
+
+    std::coroutine_handle<> waiter = nullptr;
+};
+
+//! Waits for @a event between receiving and reading each message
+uc::Detached receiveDelayed(uc::AsyncReader<EnvelopeReader>* input, Event* event, std::vector<uint32_t>* values)
+{
+    while(auto msg = co_await input->nextMessage())
+    {
+        co_await *event;
+
+        Value value;
+        if(msg.read(&value))
+            values->push_back(value.value);
+    }
+}
+
+uc::Detached sendAll(uc::AsyncWriter<Writer>* output, int first, int count, int* done)
+{
+    for(int i = 0; i < count; ++i)
+    {
+        Blob msg{std::vector<uint8_t>(40, uint8_t(first + i))};
+        if(co_await output->send(msg))
+            (*done)++;
+    }
+}
+
+}
+
+TEST_CASE("coroutine reader", "[coroutine]")
+{
+    ByteSink sink;
+    EnvelopeWriter writer(&sink);
+
+    for(uint32_t i = 0; i < 100; ++i)
+    {
+        Value value{i * 1000};
+        REQUIRE(writer.send(value));
+    }
+
+    EnvelopeReader envelope;
+    uc::AsyncReader<EnvelopeReader> input(&envelope);
+
+    std::vector<uint32_t> values;
+    bool closed = false;
+    receive(&input, &values, &closed);
+
+    // Odd chunk sizes
+    size_t pos = 0;
+    size_t chunk = 1;
+    while(pos != sink.bytes.size())
+    {
+        size_t size = std::min(chunk, sink.bytes.size() - pos);
+        CHECK(input.feed(sink.bytes.data() + pos, size) == size);
+        pos += size;
+        chunk = chunk * 3 % 97 + 1;
+    }
+
+    REQUIRE(values.size() == 100);
+    for(uint32_t i = 0; i < 100; ++i)
+        CHECK(values[i] == i * 1000);
+
+    CHECK(!closed);
+    input.close();
+    CHECK(closed);
+}
+
+TEST_CASE("coroutine reader without waiting coroutine", "[coroutine]")
+{
+    ByteSink sink;
+    EnvelopeWriter writer(&sink);
+
+    Value first{1};
+    Value second{2};
+    REQUIRE(writer.send(first));
+    size_t firstSize = sink.bytes.size();
+    REQUIRE(writer.send(second));
+
+    // Corrupted frame in between
+    std::vector<uint8_t> bytes = sink.bytes;
+    bytes.insert(bytes.begin() + firstSize, {0x00, 0x05, 0x03, 0x11, 0x22, 0x00});
+
+    EnvelopeReader envelope;
+    uc::AsyncReader<EnvelopeReader> input(&envelope);
+
+    // Processing stops after the first message
+    size_t consumed = input.feed(bytes.data(), bytes.size());
+    CHECK(consumed == firstSize);
+    CHECK(input.pending());
+    CHECK(input.feed(bytes.data() + consumed, bytes.size() - consumed) == 0);
+
+    // Already received, no suspension
+    uint32_t value = 0;
+    receiveOne(&input, &value);
+    CHECK(value == 1);
+    CHECK(!input.pending());
+
+    receiveOne(&input, &value);
+    CHECK(input.feed(bytes.data() + consumed, bytes.size() - consumed) == bytes.size() - consumed);
+    CHECK(value == 2);
+    CHECK(input.errors() == 1);
+}
+
+TEST_CASE("coroutine reader suspending before read", "[coroutine]")
+{
+    ByteSink sink;
+    EnvelopeWriter writer(&sink);
+
+    Value first{1};
+    Value second{2};
+    REQUIRE(writer.send(first));
+    size_t firstSize = sink.bytes.size();
+    REQUIRE(writer.send(second));
+
+    EnvelopeReader envelope;
+    uc::AsyncReader<EnvelopeReader> input(&envelope);
+
+    Event event;
+    std::vector<uint32_t> values;
+    receiveDelayed(&input, &event, &values);
+
+    // The second frame must not overwrite the first one
+    size_t consumed = input.feed(sink.bytes.data(), sink.bytes.size());
+    CHECK(consumed == firstSize);
+    CHECK(input.feed(sink.bytes.data() + consumed, sink.bytes.size() - consumed) == 0);
+
+    event.trigger();
+    REQUIRE(values.size() == 1);
+    CHECK(values[0] == 1);
+
+    CHECK(input.feed(sink.bytes.data() + consumed, sink.bytes.size() - consumed) == sink.bytes.size() - consumed);
+    event.trigger();
+    REQUIRE(values.size() == 2);
+    CHECK(values[1] == 2);
+
+    input.close();
+}
+
+TEST_CASE("coroutine writer", "[coroutine]")
+{
+    SmallBuffer buffer(16);
+    Writer writer(&buffer);
+    uc::AsyncWriter<Writer> output(&writer);
+
+    // Two coroutines share the output
+    int doneA = 0;
+    int doneB = 0;
+    sendAll(&output, 1, 5, &doneA);
+    sendAll(&output, 101, 5, &doneB);
+
+    CHECK(output.busy());
+
+    int iterations = 0;
+    while(output.busy())
+    {
+        buffer.drain();
+        output.writable();
+        REQUIRE(++iterations < 1000);
+    }
+    buffer.drain();
+
+    CHECK(doneA == 5);
+    CHECK(doneB == 5);
+
+    // Frames are complete and not interleaved
+    EnvelopeReader reader;
+    std::vector<uint8_t> order;
+    for(uint8_t c : buffer.bytes)
+    {
+        EnvelopeReader::TakeResult ret = reader.take(c);
+        REQUIRE(ret != EnvelopeReader::CHECKSUM_ERROR);
+        if(ret != EnvelopeReader::NEW_MESSAGE)
+            continue;
+
+        REQUIRE(reader.msgCode() == Blob::MSG_CODE);
+
+        EnvelopeReader::Reader payload(&reader);
+        REQUIRE(payload.remaining() == 40);
+
+        uint8_t data[40];
+        REQUIRE(payload.read(data, sizeof(data)));
+        order.push_back(data[0]);
+    }
+
+    // Each sender queues up again behind the other one
+    std::vector<uint8_t> expected = {1, 101, 2, 102, 3, 103, 4, 104, 5, 105};
+    CHECK(order == expected);
+}
+
+TEST_CASE("coroutine writer without suspension", "[coroutine]")
+{
+    SmallBuffer buffer(1024);
+    Writer writer(&buffer);
+    uc::AsyncWriter<Writer> output(&writer);
+
+    int done = 0;
+    sendAll(&output, 1, 10, &done);
+
+    // Everything fit into the output right away
+    CHECK(done == 10);
+    CHECK(!output.busy());
+}
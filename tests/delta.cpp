@@ -0,0 +1,200 @@
+// Delta message tests
+// Author: Max Schwarz <max@x-quadraht.de>
+
+#include <libucomm/cobs_envelope.h>
+#include <libucomm/checksum.h>
+#include <libucomm/io.h>
+
+#include "catch.hpp"
+
+#include "simple.h"
+
+#include "bufferio.h"
+
+typedef uc::Fletcher16Generator ChecksumGenerator;
+
+typedef uc::COBSWriter<ChecksumGenerator, BufferIO> EnvelopeWriter;
+
+typedef uc::IO<EnvelopeWriter, uc::IO_W> SimpleWriter;
+typedef Proto<SimpleWriter> WProto;
+
+typedef uc::COBSReader<ChecksumGenerator, 1024> EnvelopeReader;
+typedef uc::IO<EnvelopeReader, uc::IO_R> SimpleReader;
+typedef Proto<SimpleReader> RProto;
+
+namespace
+{
+
+struct Link
+{
+    WProto::ServoState::DeltaState txState;
+    RProto::ServoState::DeltaState rxState;
+    EnvelopeReader input;
+
+    explicit Link(uint16_t keyframeInterval = 0)
+     : txState(keyframeInterval)
+    {}
+
+    /**
+     * Send @a msg in delta mode and decode it into @a out.
+     *
+     * @return wire size of the frame, or -1 if it was not decoded.
+     **/
+    int transfer(const WProto::ServoState& msg, RProto::ServoState* out, bool drop = false)
+    {
+        BufferIO dbg;
+        EnvelopeWriter output(&dbg);
+        REQUIRE(output.send(uc::deltaFrame(&msg, &txState)));
+
+        int size = 0;
+        bool decoded = false;
+        while(dbg.isCharAvailable())
+        {
+            uint8_t c = dbg.getChar();
+            size++;
+
+            if(drop)
+                continue;
+
+            if(input.take(c) == EnvelopeReader::NEW_MESSAGE)
+            {
+                auto frame = uc::deltaFrame(out, &rxState);
+                decoded = input.read(&frame);
+            }
+        }
+
+        return decoded ? size : -1;
+    }
+};
+
+void fillServoState(WProto::ServoState* msg)
+{
+    msg->timestamp = 1000;
+    msg->position = -1200;
+    msg->velocity = 30;
+    msg->currents[0] = 100;
+    msg->currents[1] = 200;
+    msg->currents[2] = 300;
+    msg->enabled = true;
+    msg->mode = 5;
+    msg->flags.enabled = true;
+    msg->flags.mode = 2;
+    msg->flags.current = 1000;
+}
+
+void checkServoState(const WProto::ServoState& a, const RProto::ServoState& b)
+{
+    CHECK(a.timestamp == b.timestamp);
+    CHECK(a.position == b.position);
+    CHECK(a.velocity == b.velocity);
+    for(int i = 0; i < 3; ++i)
+        CHECK(a.currents[i] == b.currents[i]);
+    CHECK(a.enabled == b.enabled);
+    CHECK(a.mode == b.mode);
+    CHECK(a.flags.enabled == b.flags.enabled);
+    CHECK(a.flags.mode == b.flags.mode);
+    CHECK(a.flags.current == b.flags.current);
+}
+
+}
+
+TEST_CASE("delta_roundtrip", "[delta]")
+{
+    Link link;
+
+    WProto::ServoState msg;
+    fillServoState(&msg);
+
+    RProto::ServoState rx;
+
+    int keyframeSize = link.transfer(msg, &rx);
+    REQUIRE(keyframeSize > 0);
+    checkServoState(msg, rx);
+
+    // Unchanged message: header + bitmap + list count
+    int emptySize = link.transfer(msg, &rx);
+    REQUIRE(emptySize > 0);
+    CHECK(emptySize < keyframeSize - 10);
+    checkServoState(msg, rx);
+
+    // Change some fields
+    for(int i = 0; i < 10; ++i)
+    {
+        msg.timestamp += 1;
+        msg.currents[1] = 200 + i;
+        msg.flags.fault = (i % 2);
+
+        int size = link.transfer(msg, &rx);
+        REQUIRE(size > 0);
+        CHECK(size < keyframeSize);
+        checkServoState(msg, rx);
+        CHECK(rx.flags.fault == msg.flags.fault);
+    }
+}
+
+TEST_CASE("delta_resync", "[delta]")
+{
+    Link link(5);
+
+    WProto::ServoState msg;
+    fillServoState(&msg);
+
+    RProto::ServoState rx;
+
+    REQUIRE(link.transfer(msg, &rx) > 0);
+
+    // Lose a frame
+    msg.position = 17;
+    link.transfer(msg, &rx, true);
+
+    // The receiver must not apply deltas against a stale reference
+    msg.velocity = -3;
+    CHECK(link.transfer(msg, &rx) == -1);
+    CHECK(link.transfer(msg, &rx) == -1);
+    CHECK(link.transfer(msg, &rx) == -1);
+
+    // Keyframe (every 5 messages) resynchronizes
+    REQUIRE(link.transfer(msg, &rx) > 0);
+    checkServoState(msg, rx);
+
+    msg.position = 18;
+    REQUIRE(link.transfer(msg, &rx) > 0);
+    checkServoState(msg, rx);
+
+    // Keyframe on request
+    link.txState.requestKeyframe();
+    link.rxState.reset();
+    REQUIRE(link.transfer(msg, &rx) > 0);
+    checkServoState(msg, rx);
+}
+
+TEST_CASE("delta_send_failure", "[delta]")
+{
+    // No periodic keyframes
+    Link link;
+
+    WProto::ServoState msg;
+    fillServoState(&msg);
+
+    RProto::ServoState rx;
+    REQUIRE(link.transfer(msg, &rx) > 0);
+
+    // The output is full, the frame is lost before it reaches the wire
+    msg.position = 17;
+    msg.currents[0] = 7;
+    msg.currents[2] = 9;
+    {
+        BufferIO small(8);
+        EnvelopeWriter output(&small);
+        CHECK(!output.send(uc::deltaFrame(&msg, &link.txState)));
+    }
+
+    // The next frame is a keyframe and resynchronizes the receiver
+    msg.velocity = -3;
+    REQUIRE(link.transfer(msg, &rx) > 0);
+    checkServoState(msg, rx);
+
+    msg.position = 18;
+    REQUIRE(link.transfer(msg, &rx) > 0);
+    checkServoState(msg, rx);
+}
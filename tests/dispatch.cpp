@@ -0,0 +1,235 @@
+// Parallel dispatch tests
+// Author: Max Schwarz <max@x-quadraht.de>
+
+#include <libucomm/dispatch.h>
+#include <libucomm/cobs_envelope.h>
+#include <libucomm/checksum.h>
+#include <libucomm/io.h>
+
+#include "catch.hpp"
+
+#include "simple.h"
+#include "sinks.h"
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+typedef uc::Fletcher16Generator ChecksumGenerator;
+typedef uc::Dispatcher<256, 64> Dispatcher;
+
+typedef uc::COBSWriter<ChecksumGenerator, ByteSink> EnvelopeWriter;
+typedef uc::COBSReader<ChecksumGenerator, 256> EnvelopeReader;
+
+typedef Proto< uc::IO<EnvelopeWriter, uc::IO_W> > WProto;
+typedef Proto< uc::IO<Dispatcher, uc::IO_R> > DProto;
+
+namespace
+{
+
+struct Received
+{
+    uint32_t endpoint;
+    uint8_t id;
+    uint32_t ticks;
+    uint32_t valueSum;
+};
+
+void onCounters(uint32_t endpoint, DProto::Counters& msg, void* userData)
+{
+    std::vector<Received>* received = reinterpret_cast<std::vector<Received>*>(userData);
+
+    Received r;
+    r.endpoint = endpoint;
+    r.id = msg.id;
+    r.ticks = msg.ticks;
+    r.valueSum = 0;
+
+    uint8_t value;
+    while(msg.values.next(&value))
+        r.valueSum += value;
+
+    received->push_back(r);
+}
+
+struct OrderCheck
+{
+    enum { ENDPOINTS = 16, CODES = 4 };
+
+    // Written by the handlers, one key is never handled concurrently
+    uint32_t last[ENDPOINTS][CODES];
+    uint32_t count[ENDPOINTS][CODES];
+    std::atomic<int> violations;
+    std::atomic<int> active[ENDPOINTS][CODES];
+};
+
+void onSequence(uint32_t endpoint, uint8_t msgCode, Dispatcher::Reader* reader, void* userData)
+{
+    OrderCheck* check = reinterpret_cast<OrderCheck*>(userData);
+
+    uint32_t seq;
+    if(!reader->read(&seq, sizeof(seq)))
+    {
+        check->violations++;
+        return;
+    }
+
+    if(check->active[endpoint][msgCode].fetch_add(1) != 0)
+        check->violations++;
+
+    if(check->count[endpoint][msgCode] != 0 && seq != check->last[endpoint][msgCode] + 1)
+        check->violations++;
+
+    // Some work
+    volatile uint32_t x = seq;
+    for(int i = 0; i < 200; ++i)
+        x = x * 1664525 + 1013904223;
+
+    check->last[endpoint][msgCode] = seq;
+    check->count[endpoint][msgCode]++;
+
+    check->active[endpoint][msgCode].fetch_sub(1);
+}
+
+}
+
+TEST_CASE("dispatch typed messages", "[dispatch]")
+{
+    static uint8_t values[4] = {1, 2, 3, 4};
+
+    ByteSink sink;
+    EnvelopeWriter writer(&sink);
+    for(int i = 0; i < 50; ++i)
+    {
+        WProto::Counters msg;
+        msg.id = i;
+        msg.ticks = 1000 * i;
+        msg.values.setData(values, 1 + i % 4);
+        msg.offset = -i;
+        msg.small = i;
+        REQUIRE(writer.send(msg));
+    }
+
+    std::vector<Received> received;
+
+    Dispatcher dispatcher(2, 16);
+    REQUIRE(dispatcher.setHandler<DProto::Counters>(&onCounters, &received));
+    REQUIRE(dispatcher.start());
+
+    EnvelopeReader reader;
+    for(uint8_t c : sink.bytes)
+    {
+        if(reader.take(c) != EnvelopeReader::NEW_MESSAGE)
+            continue;
+
+        // Wait for free frames instead of dropping
+        while(!dispatcher.post(7, &reader))
+            dispatcher.drain();
+    }
+
+    dispatcher.drain();
+
+    // Same key: handled in order
+    REQUIRE(received.size() == 50);
+    for(int i = 0; i < 50; ++i)
+    {
+        CHECK(received[i].endpoint == 7);
+        CHECK(received[i].id == i);
+        CHECK(received[i].ticks == 1000u * i);
+        CHECK(received[i].valueSum == (i % 4 + 1) * (i % 4 + 2) / 2);
+    }
+
+    dispatcher.stop();
+    CHECK(dispatcher.inFlight() == 0);
+    CHECK(dispatcher.statistics().handled == 50);
+    CHECK(dispatcher.statistics().errors == 0);
+}
+
+TEST_CASE("dispatch keeps order per key", "[dispatch]")
+{
+    const uint32_t MESSAGES = 500;
+
+    std::unique_ptr<OrderCheck> check(new OrderCheck);
+    for(int e = 0; e < OrderCheck::ENDPOINTS; ++e)
+    {
+        for(int c = 0; c < OrderCheck::CODES; ++c)
+        {
+            check->last[e][c] = 0;
+            check->count[e][c] = 0;
+            check->active[e][c] = 0;
+        }
+    }
+    check->violations = 0;
+
+    Dispatcher dispatcher(4, 256);
+    for(int c = 0; c < OrderCheck::CODES; ++c)
+        REQUIRE(dispatcher.setRawHandler(c, &onSequence, check.get()));
+    REQUIRE(dispatcher.start());
+
+    // Two producers with separate endpoints
+    auto produce = [&](uint32_t firstEndpoint) {
+        for(uint32_t seq = 0; seq < MESSAGES; ++seq)
+        {
+            for(uint32_t e = firstEndpoint; e < firstEndpoint + OrderCheck::ENDPOINTS/2; ++e)
+            {
+                for(uint8_t c = 0; c < OrderCheck::CODES; ++c)
+                {
+                    while(!dispatcher.post(e, c, reinterpret_cast<const uint8_t*>(&seq), sizeof(seq)))
+                        std::this_thread::yield();
+                }
+            }
+        }
+    };
+
+    std::thread producerA(produce, 0);
+    std::thread producerB(produce, OrderCheck::ENDPOINTS/2);
+    producerA.join();
+    producerB.join();
+
+    dispatcher.stop();
+
+    CHECK(check->violations == 0);
+    for(int e = 0; e < OrderCheck::ENDPOINTS; ++e)
+    {
+        for(int c = 0; c < OrderCheck::CODES; ++c)
+        {
+            CHECK(check->count[e][c] == MESSAGES);
+            CHECK(check->last[e][c] == MESSAGES - 1);
+        }
+    }
+
+    uc::DispatchStatistics stats = dispatcher.statistics();
+    CHECK(stats.handled == MESSAGES * OrderCheck::ENDPOINTS * OrderCheck::CODES);
+    CHECK(stats.posted == stats.handled);
+}
+
+TEST_CASE("dispatch frame pool", "[dispatch]")
+{
+    Dispatcher dispatcher(1, 4);
+
+    uint8_t data[300] = {};
+
+    // Queued until start()
+    for(int i = 0; i < 4; ++i)
+        CHECK(dispatcher.post(0, 1, data, 10));
+
+    // Pool exhausted, frame too large
+    CHECK(!dispatcher.post(0, 1, data, 10));
+    CHECK(!dispatcher.post(0, 1, data, sizeof(data)));
+    CHECK(dispatcher.inFlight() == 4);
+
+    REQUIRE(dispatcher.start());
+    dispatcher.drain();
+    CHECK(dispatcher.inFlight() == 0);
+
+    // The frames are back in the pool
+    for(int i = 0; i < 4; ++i)
+        CHECK(dispatcher.post(1, 2, data, 10));
+    dispatcher.stop();
+
+    uc::DispatchStatistics stats = dispatcher.statistics();
+    CHECK(stats.posted == 8);
+    CHECK(stats.dropped == 2);
+    CHECK(stats.unhandled == 8);
+    CHECK(stats.handled == 0);
+}
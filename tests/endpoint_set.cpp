@@ -0,0 +1,260 @@
+// Endpoint set tests
+// Author: Max Schwarz <max@x-quadraht.de>
+
+#include <libucomm/endpoint_set.h>
+#include <libucomm/checksum.h>
+
+#include "catch.hpp"
+
+#include "sinks.h"
+
+#include <sys/socket.h>
+#include <fcntl.h>
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+typedef uc::Fletcher16Generator ChecksumGenerator;
+typedef uc::EndpointSet<ChecksumGenerator, 256> Endpoints;
+
+namespace
+{
+
+struct Value
+{
+    enum { MSG_CODE = 6 };
+
+    uint32_t value;
+
+    template<class Writer>
+    bool serialize(Writer* writer) const
+    { return writer->write(&value, sizeof(value)); }
+
+    template<class Reader>
+    bool deserialize(Reader* reader)
+    { return reader->read(&value, sizeof(value)); }
+};
+
+struct Device
+{
+    int fd;                        // our side of the socket pair
+    std::atomic<uint32_t> count;
+    std::atomic<uint32_t> sum;
+    bool echo;
+    std::thread::id thread;
+};
+
+void handle(Endpoints::Endpoint* endpoint, void* userData)
+{
+    Device* device = reinterpret_cast<Device*>(userData);
+
+    Value msg;
+    if(endpoint->reader().msgCode() != Value::MSG_CODE || !endpoint->reader().read(&msg))
+        return;
+
+    device->thread = std::this_thread::get_id();
+    device->sum += msg.value;
+    device->count++;
+
+    if(device->echo)
+    {
+        msg.value *= 2;
+        endpoint->send(msg);
+    }
+}
+
+std::vector<uint8_t> encode(uint32_t first, uint32_t count)
+{
+    ByteSink sink;
+    uc::COBSWriter<ChecksumGenerator, ByteSink> writer(&sink);
+
+    for(uint32_t i = 0; i < count; ++i)
+    {
+        Value msg{first + i};
+        writer.send(msg);
+    }
+
+    return sink.bytes;
+}
+
+void writeAll(int fd, const std::vector<uint8_t>& bytes)
+{
+    size_t pos = 0;
+    while(pos != bytes.size())
+    {
+        ssize_t ret = write(fd, bytes.data() + pos, bytes.size() - pos);
+        REQUIRE(ret > 0);
+        pos += ret;
+    }
+}
+
+template<class Predicate>
+bool waitFor(Predicate predicate)
+{
+    for(int i = 0; i < 5000; ++i)
+    {
+        if(predicate())
+            return true;
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    return false;
+}
+
+}
+
+TEST_CASE("endpoint set across worker threads", "[endpoint_set]")
+{
+    const int DEVICES = 64;
+    const uint32_t MESSAGES = 200;
+
+    Endpoints endpoints(4);
+    REQUIRE(endpoints.threads() == 4);
+
+    std::vector<Device> devices(DEVICES);
+    for(int i = 0; i < DEVICES; ++i)
+    {
+        int fds[2];
+        REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+
+        devices[i].fd = fds[0];
+        devices[i].count = 0;
+        devices[i].sum = 0;
+        devices[i].echo = false;
+
+        Endpoints::Endpoint* endpoint = endpoints.add(fds[1], &handle, &devices[i]);
+        REQUIRE(endpoint);
+        CHECK(endpoint->shard() == unsigned(i % 4));
+    }
+    CHECK(endpoints.size() == DEVICES);
+
+    REQUIRE(endpoints.start());
+    CHECK(!endpoints.add(0, &handle));
+
+    for(int i = 0; i < DEVICES; ++i)
+        writeAll(devices[i].fd, encode(1000 * i, MESSAGES));
+
+    bool done = waitFor([&]() {
+        for(auto& device : devices)
+        {
+            if(device.count != MESSAGES)
+                return false;
+        }
+        return true;
+    });
+    REQUIRE(done);
+
+    endpoints.stop();
+    CHECK(!endpoints.running());
+
+    for(int i = 0; i < DEVICES; ++i)
+    {
+        uint32_t expected = 1000 * i * MESSAGES + MESSAGES * (MESSAGES - 1) / 2;
+        CHECK(devices[i].sum == expected);
+
+        const uc::EndpointStatistics& stats = endpoints.endpoint(i)->statistics();
+        CHECK(stats.messages == MESSAGES);
+        CHECK(stats.errors == 0);
+
+        // Many frames per read()
+        CHECK(stats.reads < MESSAGES);
+
+        close(devices[i].fd);
+    }
+
+    // Endpoints of one shard share a thread
+    for(int i = 4; i < DEVICES; ++i)
+        CHECK(devices[i].thread == devices[i % 4].thread);
+    CHECK(devices[0].thread != devices[1].thread);
+}
+
+TEST_CASE("endpoint set replies from the handler", "[endpoint_set]")
+{
+    Endpoints endpoints(2);
+
+    Device devices[2];
+    for(int i = 0; i < 2; ++i)
+    {
+        int fds[2];
+        REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+
+        devices[i].fd = fds[0];
+        devices[i].count = 0;
+        devices[i].sum = 0;
+        devices[i].echo = true;
+        REQUIRE(endpoints.add(fds[1], &handle, &devices[i]));
+    }
+
+    REQUIRE(endpoints.start());
+
+    writeAll(devices[1].fd, encode(10, 5));
+
+    // Read the replies
+    uc::COBSReader<ChecksumGenerator, 256> reader;
+    std::vector<uint32_t> replies;
+    while(replies.size() != 5)
+    {
+        uint8_t buffer[256];
+        ssize_t size = read(devices[1].fd, buffer, sizeof(buffer));
+        REQUIRE(size > 0);
+
+        for(ssize_t i = 0; i < size; ++i)
+        {
+            if(reader.take(buffer[i]) != decltype(reader)::NEW_MESSAGE)
+                continue;
+
+            Value msg;
+            REQUIRE(reader.read(&msg));
+            replies.push_back(msg.value);
+        }
+    }
+
+    endpoints.stop();
+
+    CHECK(replies == std::vector<uint32_t>({20, 22, 24, 26, 28}));
+    CHECK(devices[0].count == 0u);
+
+    for(auto& device : devices)
+        close(device.fd);
+}
+
+TEST_CASE("endpoint set without worker threads", "[endpoint_set]")
+{
+    Endpoints endpoints(1);
+
+    int fds[2];
+    REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+
+    Device device;
+    device.fd = fds[0];
+    device.count = 0;
+    device.sum = 0;
+    device.echo = false;
+
+    Endpoints::Endpoint* endpoint = endpoints.add(fds[1], &handle, &device);
+    REQUIRE(endpoint);
+
+    // Garbage and a valid frame
+    std::vector<uint8_t> bytes = {0x00, 0x07, 0x03, 0x01, 0x02, 0x00};
+    std::vector<uint8_t> frame = encode(42, 1);
+    bytes.insert(bytes.end(), frame.begin(), frame.end());
+    writeAll(device.fd, bytes);
+
+    REQUIRE(endpoints.poll(0, 1000));
+    CHECK(device.count == 1u);
+    CHECK(device.sum == 42u);
+    CHECK(endpoint->statistics().errors == 1);
+    CHECK(endpoints.wakeups(0) == 1);
+
+    // Nothing to do
+    REQUIRE(endpoints.poll(0, 0));
+    CHECK(device.count == 1u);
+
+    // EOF removes the endpoint from the loop
+    close(device.fd);
+    REQUIRE(endpoints.poll(0, 1000));
+    CHECK(endpoint->closed());
+    REQUIRE(endpoints.poll(0, 0));
+}
@@ -0,0 +1,306 @@
+// Reed-Solomon FEC envelope tests
+// Author: Max Schwarz <max@x-quadraht.de>
+
+#include <libucomm/fec_envelope.h>
+#include <libucomm/checksum.h>
+#include <libucomm/io.h>
+
+#include "catch.hpp"
+
+#include "simple.h"
+#include "sinks.h"
+
+#include <string.h>
+
+#include <random>
+#include <vector>
+
+typedef uc::Fletcher16Generator ChecksumGenerator;
+
+typedef uc::FECWriter<ChecksumGenerator, FrameBuffer, 16> EnvelopeWriter;
+typedef uc::FECReader<ChecksumGenerator, 2048, 16> EnvelopeReader;
+
+typedef uc::IO<EnvelopeWriter, uc::IO_W> SimpleWriter;
+typedef uc::IO<EnvelopeReader, uc::IO_R> SimpleReader;
+
+typedef Proto<SimpleWriter> WProto;
+typedef Proto<SimpleReader> RProto;
+
+namespace
+{
+
+/**
+ * Simulated noisy channel. Each byte is corrupted with the given probability.
+ * Frame delimiters are left intact and no new zeros are introduced, since
+ * framing errors cannot be corrected by the FEC.
+ **/
+class NoisyChannel
+{
+public:
+    NoisyChannel(double errorRate, uint32_t seed)
+     : m_threshold(errorRate * 4294967295.0)
+     , m_rng(seed)
+     , m_errors(0)
+    {}
+
+    std::vector<uint8_t> transmit(FrameBuffer* input)
+    {
+        std::vector<uint8_t> out = input->take();
+        for(uint8_t& c : out)
+        {
+            if(c == 0x00 || m_rng() >= m_threshold)
+                continue;
+
+            uint8_t noise = m_rng() % 255 + 1;
+            if((c ^ noise) != 0x00)
+            {
+                c ^= noise;
+                m_errors++;
+            }
+        }
+        return out;
+    }
+
+    inline unsigned int errors() const
+    { return m_errors; }
+private:
+    uint32_t m_threshold;
+    std::mt19937 m_rng;
+    unsigned int m_errors;
+};
+
+template<int Parity>
+void checkCodec()
+{
+    typedef uc::ReedSolomon<Parity> RS;
+
+    std::mt19937 rng(Parity);
+
+    for(int iteration = 0; iteration < 200; ++iteration)
+    {
+        size_t size = rng() % RS::MAX_DATA + 1;
+
+        uint8_t data[255];
+        for(size_t i = 0; i < size; ++i)
+            data[i] = rng();
+
+        uint8_t parity[Parity];
+        RS::encode(data, size, parity);
+
+        uint8_t rxData[255];
+        uint8_t rxParity[Parity];
+        memcpy(rxData, data, size);
+        memcpy(rxParity, parity, Parity);
+
+        CHECK(RS::decode(rxData, size, rxParity) == 0);
+
+        // Corrupt up to MAX_CORRECTABLE distinct positions
+        int errors = iteration % (RS::MAX_CORRECTABLE + 1);
+        std::vector<size_t> positions;
+        while(int(positions.size()) < errors)
+        {
+            size_t pos = rng() % (size + Parity);
+            bool dup = false;
+            for(size_t p : positions)
+                dup |= (p == pos);
+            if(dup)
+                continue;
+
+            positions.push_back(pos);
+            uint8_t noise = rng() % 255 + 1;
+            if(pos < size)
+                rxData[pos] ^= noise;
+            else
+                rxParity[pos - size] ^= noise;
+        }
+
+        REQUIRE(RS::decode(rxData, size, rxParity) == errors);
+        CHECK(memcmp(rxData, data, size) == 0);
+        CHECK(memcmp(rxParity, parity, Parity) == 0);
+    }
+}
+
+uint16_t samples[300];
+
+template<class MSG>
+void fillSamples(MSG* msg, int count)
+{
+    for(int i = 0; i < count; ++i)
+        samples[i] = i * 37;
+
+    msg->channel = 7;
+    msg->samples.setData(samples, count);
+}
+
+bool checkSamples(RProto::SampleBlock* msg, int count)
+{
+    if(msg->channel != 7 || (int)msg->samples.remaining() != count)
+        return false;
+
+    uint16_t sample;
+    for(int i = 0; i < count; ++i)
+    {
+        if(!msg->samples.next(&sample) || sample != uint16_t(i * 37))
+            return false;
+    }
+
+    return true;
+}
+
+}
+
+TEST_CASE("Reed-Solomon codec", "[fec]")
+{
+    checkCodec<2>();
+    checkCodec<8>();
+    checkCodec<16>();
+    checkCodec<32>();
+}
+
+TEST_CASE("FEC envelope", "[fec]")
+{
+    FrameBuffer wire;
+    EnvelopeWriter output(&wire);
+
+    WProto::SampleBlock msg;
+    fillSamples(&msg, 300);
+    REQUIRE(output.send(msg));
+
+    EnvelopeReader input;
+    int packetCount = 0;
+    int size = 0;
+
+    for(uint8_t c : wire.take())
+    {
+        size++;
+        if(input.take(c) != EnvelopeReader::NEW_MESSAGE)
+            continue;
+
+        REQUIRE(input.msgCode() == RProto::SampleBlock::MSG_CODE);
+
+        RProto::SampleBlock msg2;
+        REQUIRE(input.read(&msg2));
+        CHECK(checkSamples(&msg2, 300));
+
+        packetCount++;
+    }
+
+    REQUIRE(packetCount == 1);
+
+    // 603 payload bytes need three chunks
+    CHECK(size > 603 + 3*16);
+    CHECK(size < 603 + 3*16 + 16);
+
+    CHECK(input.statistics().frames == 1);
+    CHECK(input.statistics().correctedSymbols == 0);
+}
+
+TEST_CASE("FEC envelope under noise", "[fec]")
+{
+    typedef uc::COBSWriter<ChecksumGenerator, FrameBuffer> PlainWriter;
+    typedef uc::COBSReader<ChecksumGenerator, 2048> PlainReader;
+    typedef Proto< uc::IO<PlainWriter, uc::IO_W> > PlainWProto;
+
+    const int MESSAGES = 200;
+
+    FrameBuffer wire;
+    EnvelopeWriter output(&wire);
+    PlainWriter plainOutput(&wire);
+
+    EnvelopeReader input;
+    PlainReader plainInput;
+
+    NoisyChannel channel(0.004, 42);
+
+    WProto::SampleBlock msg;
+    fillSamples(&msg, 300);
+
+    PlainWProto::SampleBlock plainMsg;
+    fillSamples(&plainMsg, 300);
+
+    int received = 0;
+    int plainReceived = 0;
+
+    for(int i = 0; i < MESSAGES; ++i)
+    {
+        REQUIRE(output.send(msg));
+        for(uint8_t c : channel.transmit(&wire))
+        {
+            if(input.take(c) != EnvelopeReader::NEW_MESSAGE)
+                continue;
+
+            RProto::SampleBlock msg2;
+            if(input.read(&msg2) && checkSamples(&msg2, 300))
+                received++;
+        }
+
+        REQUIRE(plainOutput.send(plainMsg));
+        for(uint8_t c : channel.transmit(&wire))
+        {
+            if(plainInput.take(c) != PlainReader::NEW_MESSAGE)
+                continue;
+
+            RProto::SampleBlock msg2;
+            if(plainInput.read(&msg2) && checkSamples(&msg2, 300))
+                plainReceived++;
+        }
+    }
+
+    const uc::FECStatistics& stats = input.statistics();
+
+    CHECK(channel.errors() > 800);
+    CHECK(stats.frames == MESSAGES);
+    CHECK(stats.correctedFrames > MESSAGES / 2);
+    CHECK(stats.correctedSymbols > 400);
+    CHECK(received == MESSAGES - int(stats.uncorrectableFrames));
+    CHECK(received >= MESSAGES - 2);
+
+    // Without FEC, most frames are lost
+    CHECK(plainReceived < MESSAGES / 4);
+}
+
+TEST_CASE("FEC envelope uncorrectable frames", "[fec]")
+{
+    FrameBuffer buffer;
+    EnvelopeWriter output(&buffer);
+
+    WProto::SampleBlock msg;
+    fillSamples(&msg, 20);
+    REQUIRE(output.send(msg));
+
+    std::vector<uint8_t> wire = buffer.take();
+
+    EnvelopeReader input;
+
+    // Exactly the correctable number of errors
+    std::vector<uint8_t> corrupted = wire;
+    for(int i = 0; i < 8; ++i)
+        corrupted[2 + 3*i] ^= 0x5A;
+
+    int packetCount = 0;
+    for(uint8_t c : corrupted)
+    {
+        if(input.take(c) == EnvelopeReader::NEW_MESSAGE)
+            packetCount++;
+    }
+    CHECK(packetCount == 1);
+    CHECK(input.statistics().correctedSymbols == 8);
+
+    // Too many errors
+    corrupted = wire;
+    for(int i = 0; i < 16; ++i)
+        corrupted[2 + 2*i] ^= 0x5A;
+
+    packetCount = 0;
+    int errorCount = 0;
+    for(uint8_t c : corrupted)
+    {
+        EnvelopeReader::TakeResult ret = input.take(c);
+        if(ret == EnvelopeReader::NEW_MESSAGE)
+            packetCount++;
+        else if(ret != EnvelopeReader::NEED_MORE_DATA)
+            errorCount++;
+    }
+    CHECK(packetCount == 0);
+    CHECK(errorCount == 1);
+}
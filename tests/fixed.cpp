@@ -0,0 +1,137 @@
+// Floating point and fixed-point member tests
+// Author: Max Schwarz <max@x-quadraht.de>
+
+#include <libucomm/cobs_envelope.h>
+#include <libucomm/checksum.h>
+#include <libucomm/io.h>
+
+#include "catch.hpp"
+
+#include "simple.h"
+
+#include "bufferio.h"
+
+#include <math.h>
+
+typedef uc::Fletcher16Generator ChecksumGenerator;
+
+typedef uc::COBSWriter<ChecksumGenerator, BufferIO> EnvelopeWriter;
+
+typedef uc::IO<EnvelopeWriter, uc::IO_W> SimpleWriter;
+typedef Proto<SimpleWriter> WProto;
+
+typedef uc::COBSReader<ChecksumGenerator, 4096> EnvelopeReader;
+typedef uc::IO<EnvelopeReader, uc::IO_R> SimpleReader;
+typedef Proto<SimpleReader> RProto;
+
+static_assert(WProto::Pose::POD_SIZE == 4 + 8 + 2 + 4 + 2,
+    "fixed-point members should use their wire size"
+);
+
+static bool fillPose(WProto::Pose* pose, uint8_t idx)
+{
+    pose->x = 0.25f * idx;
+    pose->y = -1.5 * idx;
+    pose->angle = 0.5f * idx;
+    pose->latitude = 48.1234567 + idx;
+    pose->gains[0] = idx;
+    pose->gains[1] = 2.5f;
+    return true;
+}
+
+TEST_CASE("fixed_quantize", "[fixed]")
+{
+    CHECK((uc::quantize<int16_t, 1, 100>(1.234f)) == 123);
+    CHECK((uc::quantize<int16_t, 1, 100>(1.235001f)) == 124);
+    CHECK((uc::quantize<int16_t, 1, 100>(-1.236f)) == -124);
+    CHECK((uc::quantize<int16_t, 1, 100>(1000.0f)) == 32767);
+    CHECK((uc::quantize<int16_t, 1, 100>(-1000.0f)) == -32768);
+    CHECK((uc::quantize<uint8_t, 1, 2>(-3.0f)) == 0);
+    CHECK((uc::quantize<uint8_t, 1, 2>(3.2f)) == 6);
+
+    // 32-bit wire types saturate with float
+    const float nan = std::numeric_limits<float>::quiet_NaN();
+    CHECK((uc::quantize<int32_t, 1, 1>(3e9f)) == 2147483520);
+    CHECK((uc::quantize<int32_t, 1, 1>(-3e9f)) == INT32_MIN);
+    CHECK((uc::quantize<int32_t, 1, 1>(2147483520.0f)) == 2147483520);
+    CHECK((uc::quantize<uint32_t, 1, 1>(6e9f)) == 4294967040u);
+    CHECK((uc::quantize<uint32_t, 1, 1>(-6e9f)) == 0u);
+    CHECK((uc::quantize<int32_t, 1, 1>(nan)) == 0);
+    CHECK((uc::quantize<uint32_t, 1, 1>(nan)) == 0u);
+    CHECK((uc::quantize<int16_t, 1, 100>(nan)) == 0);
+
+    // ... and with double
+    CHECK((uc::quantize<int32_t, 1, 1>(3e9)) == INT32_MAX);
+    CHECK((uc::quantize<uint32_t, 1, 1>(6e9)) == UINT32_MAX);
+    CHECK((uc::quantize<int64_t, 1, 1>(1e19)) == INT64_MAX - 1023);
+    CHECK((uc::quantize<int32_t, 1, 1>(double(nan))) == 0);
+
+    CHECK((uc::dequantize<int16_t, 1, 100, float>(-123)) == Approx(-1.23f));
+}
+
+TEST_CASE("fixed_message", "[fixed]")
+{
+    static float raw[3] = {1.5f, -2.25f, 1e6f};
+    static float currents[100];
+    for(int i = 0; i < 100; ++i)
+        currents[i] = 0.0123f * i - 0.5f;
+
+    WProto::Telemetry pkt;
+    fillPose(&pkt.pose, 3);
+    pkt.raw.setData(raw, 3);
+    pkt.currents.setData(currents, 100);
+    pkt.history.setCallback(fillPose, 2);
+
+    BufferIO dbg;
+    EnvelopeWriter output(&dbg);
+    REQUIRE(output.send(pkt));
+
+    EnvelopeReader input;
+    int packetCount = 0;
+
+    while(dbg.isCharAvailable())
+    {
+        if(input.take(dbg.getChar()) != EnvelopeReader::NEW_MESSAGE)
+            continue;
+
+        RProto::Telemetry pkt2;
+        REQUIRE(input.read(&pkt2));
+
+        CHECK(pkt2.pose.x == 0.75f);
+        CHECK(pkt2.pose.y == -4.5);
+        CHECK(pkt2.pose.angle == Approx(1.5f));
+        CHECK(fabs(pkt2.pose.latitude - 51.1234567) < 1e-7);
+        CHECK(pkt2.pose.gains[0] == 3.0f);
+        CHECK(pkt2.pose.gains[1] == 2.5f);
+
+        float value;
+        int i = 0;
+        while(pkt2.raw.next(&value))
+        {
+            CHECK(value == raw[i]);
+            ++i;
+        }
+        CHECK(i == 3);
+
+        i = 0;
+        while(pkt2.currents.next(&value))
+        {
+            CHECK(fabs(value - currents[i]) <= 0.0006f);
+            ++i;
+        }
+        CHECK(i == 100);
+
+        RProto::Pose pose;
+        i = 0;
+        while(pkt2.history.next(&pose))
+        {
+            CHECK(pose.angle == Approx(0.5f * i));
+            ++i;
+        }
+        CHECK(i == 2);
+
+        packetCount++;
+    }
+
+    REQUIRE(packetCount == 1);
+}
@@ -0,0 +1,219 @@
+// Fragmentation tests
+// Author: Max Schwarz <max@x-quadraht.de>
+
+#include <libucomm/fragment.h>
+#include <libucomm/cobs_envelope.h>
+#include <libucomm/checksum.h>
+#include <libucomm/io.h>
+
+#include "catch.hpp"
+
+#include "simple.h"
+#include "sinks.h"
+
+#include <vector>
+
+typedef uc::Fletcher16Generator ChecksumGenerator;
+
+// Small devices: 32 byte fragments, 40 byte envelope buffer
+typedef uc::COBSWriter<ChecksumGenerator, FrameQueue> EnvelopeWriter;
+typedef uc::COBSReader<ChecksumGenerator, 40> EnvelopeReader;
+
+typedef uc::FragmentWriter<EnvelopeWriter, 32> Writer;
+typedef uc::FragmentReader<EnvelopeReader> Reader;
+
+typedef Proto< uc::IO<Writer, uc::IO_W> > WProto;
+typedef Proto< uc::IO<Reader, uc::IO_R> > RProto;
+
+namespace
+{
+
+const int SAMPLES = 1000;
+uint16_t samples[SAMPLES];
+
+void sendSamples(FrameQueue* queue, int count = SAMPLES)
+{
+    EnvelopeWriter envelope(queue);
+    Writer output(&envelope);
+
+    for(int i = 0; i < count; ++i)
+        samples[i] = 3*i + 1;
+
+    WProto::SampleBlock msg;
+    msg.channel = 4;
+    msg.samples.setData(samples, count);
+    REQUIRE(output.send(msg));
+}
+
+}
+
+TEST_CASE("fragmentation with reassembly", "[fragment]")
+{
+    FrameQueue queue;
+    sendSamples(&queue);
+
+    // 2003 bytes of message in fragments of 29 bytes
+    CHECK(queue.frames.size() == 70);
+    for(auto& frame : queue.frames)
+        CHECK(frame.size() <= 32 + 8);
+
+    static uint8_t buffer[4096];
+    Reader input(buffer, sizeof(buffer));
+
+    int packetCount = 0;
+    for(auto& frame : queue.frames)
+    {
+        for(uint8_t c : frame)
+        {
+            Reader::TakeResult ret = input.take(c);
+            REQUIRE(ret != Reader::FRAGMENT_ERROR);
+            if(ret != Reader::NEW_MESSAGE)
+                continue;
+
+            REQUIRE(input.msgCode() == RProto::SampleBlock::MSG_CODE);
+
+            RProto::SampleBlock msg;
+            REQUIRE(input.read(&msg));
+            CHECK(msg.channel == 4);
+            REQUIRE(msg.samples.remaining() == SAMPLES);
+
+            uint16_t sample;
+            for(int i = 0; i < SAMPLES; ++i)
+            {
+                REQUIRE(msg.samples.next(&sample));
+                CHECK(sample == 3*i + 1);
+            }
+
+            packetCount++;
+        }
+    }
+
+    CHECK(packetCount == 1);
+}
+
+TEST_CASE("fragmentation with streaming lists", "[fragment]")
+{
+    FrameQueue queue;
+    sendSamples(&queue);
+
+    Reader input;
+    RProto::SampleBlock msg;
+
+    int received = 0;
+    int fragments = 0;
+    bool complete = false;
+
+    for(auto& frame : queue.frames)
+    {
+        for(uint8_t c : frame)
+        {
+            Reader::TakeResult ret = input.take(c);
+            REQUIRE(ret != Reader::FRAGMENT_ERROR);
+
+            if(ret == Reader::NEW_MESSAGE)
+            {
+                REQUIRE(input.read(&msg));
+                CHECK(msg.channel == 4);
+                CHECK(msg.samples.remaining() == SAMPLES);
+            }
+            else if(ret != Reader::MORE_DATA)
+                continue;
+
+            fragments++;
+
+            // Samples may be split across fragments
+            uint16_t sample;
+            while(msg.samples.next(&sample))
+            {
+                REQUIRE(sample == 3*received + 1);
+                received++;
+            }
+
+            complete = input.complete();
+        }
+    }
+
+    CHECK(fragments == 70);
+    CHECK(complete);
+    CHECK(received == SAMPLES);
+}
+
+TEST_CASE("fragmentation with lost fragments", "[fragment]")
+{
+    FrameQueue queue;
+    sendSamples(&queue, 100);
+    sendSamples(&queue, 100);
+
+    size_t perMessage = queue.frames.size() / 2;
+    REQUIRE(perMessage > 2);
+
+    // Lose the second fragment of the first message
+    queue.frames.erase(queue.frames.begin() + 1);
+
+    static uint8_t buffer[4096];
+    Reader input(buffer, sizeof(buffer));
+
+    int packetCount = 0;
+    int errorCount = 0;
+    for(auto& frame : queue.frames)
+    {
+        for(uint8_t c : frame)
+        {
+            Reader::TakeResult ret = input.take(c);
+            if(ret == Reader::FRAGMENT_ERROR)
+                errorCount++;
+            else if(ret == Reader::NEW_MESSAGE)
+            {
+                RProto::SampleBlock msg;
+                REQUIRE(input.read(&msg));
+                CHECK(msg.samples.remaining() == 100);
+                packetCount++;
+            }
+        }
+    }
+
+    CHECK(packetCount == 1);
+    CHECK(errorCount == 1);
+}
+
+TEST_CASE("fragmentation buffer overflow", "[fragment]")
+{
+    FrameQueue queue;
+    sendSamples(&queue);
+
+    static uint8_t buffer[1024];
+    Reader input(buffer, sizeof(buffer));
+
+    int errorCount = 0;
+    for(auto& frame : queue.frames)
+    {
+        for(uint8_t c : frame)
+        {
+            Reader::TakeResult ret = input.take(c);
+            REQUIRE(ret != Reader::NEW_MESSAGE);
+            if(ret == Reader::FRAGMENT_ERROR)
+                errorCount++;
+        }
+    }
+
+    // The rest of the message is dropped silently
+    CHECK(errorCount == 1);
+}
+
+TEST_CASE("fragmentation MTU", "[fragment]")
+{
+    FrameQueue queue;
+    EnvelopeWriter envelope(&queue);
+    Writer output(&envelope);
+
+    CHECK(!output.setMTU(3));
+    CHECK(!output.setMTU(33));
+    REQUIRE(output.setMTU(13));
+
+    uint8_t data[100] = {};
+    REQUIRE(output.startEnvelope(1));
+    REQUIRE(output.write(data, sizeof(data)));
+    REQUIRE(output.endEnvelope());
+
+    CHECK(queue.frames.size() == 10);
+}
@@ -0,0 +1,163 @@
+// List tests
+// Author: Max Schwarz <max@x-quadraht.de>
+
+#include <libucomm/cobs_envelope.h>
+#include <libucomm/checksum.h>
+#include <libucomm/io.h>
+
+#include "catch.hpp"
+
+#include "simple.h"
+
+#include "bufferio.h"
+
+#include <type_traits>
+
+typedef uc::Fletcher16Generator ChecksumGenerator;
+
+typedef uc::COBSWriter<ChecksumGenerator, BufferIO> EnvelopeWriter;
+
+typedef uc::IO<EnvelopeWriter, uc::IO_W> SimpleWriter;
+typedef Proto<SimpleWriter> WProto;
+
+typedef uc::COBSReader<ChecksumGenerator, 16384> EnvelopeReader;
+typedef uc::IO<EnvelopeReader, uc::IO_R> SimpleReader;
+typedef Proto<SimpleReader> RProto;
+
+static_assert(std::is_same<
+    decltype(WProto::SampleBlock::samples)::SizeType, uint16_t>::value,
+    "count width should follow the list bound"
+);
+static_assert(decltype(RProto::SampleBlock::samples)::MAX_COUNT == 4096,
+    "list bound should be passed through"
+);
+
+TEST_CASE("bounded_list", "[list]")
+{
+    static uint16_t samples[4096];
+    for(int i = 0; i < 4096; ++i)
+        samples[i] = 3*i;
+
+    WProto::SampleBlock pkt;
+    pkt.channel = 7;
+    pkt.samples.setData(samples, 4096);
+
+    BufferIO dbg(16384);
+    EnvelopeWriter output(&dbg);
+    REQUIRE(output.send(pkt));
+
+    static EnvelopeReader input;
+    int packetCount = 0;
+
+    while(dbg.isCharAvailable())
+    {
+        if(input.take(dbg.getChar()) != EnvelopeReader::NEW_MESSAGE)
+            continue;
+
+        REQUIRE(input.msgCode() == RProto::SampleBlock::MSG_CODE);
+
+        RProto::SampleBlock pkt2;
+        REQUIRE(input.read(&pkt2));
+
+        CHECK(pkt2.channel == 7);
+        REQUIRE(pkt2.samples.remaining() == 4096);
+
+        uint16_t sample;
+        int i = 0;
+        while(pkt2.samples.next(&sample))
+        {
+            REQUIRE(sample == uint16_t(3*i));
+            ++i;
+        }
+        REQUIRE(i == 4096);
+
+        packetCount++;
+    }
+
+    REQUIRE(packetCount == 1);
+}
+
+TEST_CASE("bounded_list_overflow", "[list]")
+{
+    static uint16_t samples[4097];
+
+    WProto::SampleBlock pkt;
+    pkt.channel = 0;
+    pkt.samples.setData(samples, 4097);
+
+    BufferIO dbg(16384);
+    EnvelopeWriter output(&dbg);
+    REQUIRE(!output.send(pkt));
+}
+
+template<class SizeType>
+static bool fillCountingStruct(WProto::Struct* data, SizeType idx)
+{
+    data->index = idx;
+    data->some_value = 1000 + idx;
+
+    return true;
+}
+
+TEST_CASE("list_soa", "[list]")
+{
+    WProto::Message pkt;
+    pkt.flags = 0;
+    pkt.list.setCallback(fillCountingStruct, 20);
+
+    BufferIO dbg;
+    EnvelopeWriter output(&dbg);
+    REQUIRE(output.send(pkt));
+
+    static EnvelopeReader input;
+    int packetCount = 0;
+
+    while(dbg.isCharAvailable())
+    {
+        if(input.take(dbg.getChar()) != EnvelopeReader::NEW_MESSAGE)
+            continue;
+
+        RProto::Message pkt2;
+        REQUIRE(input.read(&pkt2));
+
+        RProto::Struct::SoA<32> soa;
+        REQUIRE(pkt2.list.deserializeInto(&soa));
+        REQUIRE(soa.count == 20);
+        REQUIRE(pkt2.list.remaining() == 0);
+
+        for(int i = 0; i < 20; ++i)
+        {
+            CHECK(soa.index[i] == i);
+            CHECK(soa.some_value[i] == 1000 + i);
+        }
+
+        packetCount++;
+    }
+
+    REQUIRE(packetCount == 1);
+}
+
+TEST_CASE("list_soa_overflow", "[list]")
+{
+    WProto::Message pkt;
+    pkt.flags = 0;
+    pkt.list.setCallback(fillCountingStruct, 20);
+
+    BufferIO dbg;
+    EnvelopeWriter output(&dbg);
+    REQUIRE(output.send(pkt));
+
+    static EnvelopeReader input;
+    while(dbg.isCharAvailable())
+    {
+        if(input.take(dbg.getChar()) != EnvelopeReader::NEW_MESSAGE)
+            continue;
+
+        RProto::Message pkt2;
+        REQUIRE(input.read(&pkt2));
+
+        RProto::Struct::SoA<16> soa;
+        REQUIRE(!pkt2.list.deserializeInto(&soa));
+        REQUIRE(soa.count == 16);
+    }
+}
@@ -0,0 +1,280 @@
+// Channel multiplexing tests
+// Author: Max Schwarz <max@x-quadraht.de>
+
+#include <libucomm/multiplex.h>
+#include <libucomm/cobs_envelope.h>
+#include <libucomm/checksum.h>
+#include <libucomm/io.h>
+
+#include "catch.hpp"
+
+#include "simple.h"
+#include "sinks.h"
+
+#include <vector>
+
+typedef uc::Fletcher16Generator ChecksumGenerator;
+
+namespace
+{
+
+struct Stop
+{
+    enum { MSG_CODE = 7 };
+
+    uint8_t reason;
+
+    template<class Writer>
+    bool serialize(Writer* writer) const
+    { return writer->write(&reason, sizeof(reason)); }
+
+    template<class Reader>
+    bool deserialize(Reader* reader)
+    { return reader->read(&reason, sizeof(reason)); }
+};
+
+}
+
+typedef uc::COBSWriter<ChecksumGenerator, FrameQueue> EnvelopeWriter;
+typedef uc::COBSReader<ChecksumGenerator, 40> EnvelopeReader;
+
+typedef uc::Multiplexer<EnvelopeWriter, 4, 32> Writer;
+typedef uc::Demultiplexer<EnvelopeReader, 4> Reader;
+
+typedef Proto< uc::IO<Writer, uc::IO_W> > WProto;
+typedef Proto< uc::IO<Reader, uc::IO_R> > RProto;
+
+namespace
+{
+
+const int SAMPLES = 500;
+uint16_t samples[SAMPLES];
+
+uint8_t txBuffers[4][2048];
+uint8_t rxBuffers[4][2048];
+
+struct Link
+{
+    Link()
+     : envelope(&queue)
+     , output(&envelope)
+    {
+        for(int i = 0; i < 4; ++i)
+        {
+            output.setBuffer(i, txBuffers[i], sizeof(txBuffers[i]));
+            input.setBuffer(i, rxBuffers[i], sizeof(rxBuffers[i]));
+        }
+    }
+
+    bool sendSamples(uint8_t channel)
+    {
+        for(int i = 0; i < SAMPLES; ++i)
+            samples[i] = 3*i + 1;
+
+        WProto::SampleBlock msg;
+        msg.channel = channel;
+        msg.samples.setData(samples, SAMPLES);
+        return output.send(channel, msg);
+    }
+
+    FrameQueue queue;
+    EnvelopeWriter envelope;
+    Writer output;
+    Reader input;
+};
+
+//! Record of a received message
+struct Received
+{
+    uint8_t channel;
+    uint8_t msgCode;
+};
+
+template<class Callback>
+void receive(Link* link, Callback cb, int* errors = 0)
+{
+    for(auto& frame : link->queue.frames)
+    {
+        for(uint8_t c : frame)
+        {
+            Reader::TakeResult ret = link->input.take(c);
+            if(ret == Reader::FRAGMENT_ERROR && errors)
+                (*errors)++;
+            if(ret == Reader::NEW_MESSAGE)
+                cb(link->input.channel(), link->input.msgCode());
+        }
+    }
+
+    link->queue.frames.clear();
+}
+
+void checkSamples(Reader* input, uint8_t channel)
+{
+    RProto::SampleBlock msg;
+    REQUIRE(input->read(&msg));
+    CHECK(msg.channel == channel);
+    REQUIRE(msg.samples.remaining() == SAMPLES);
+
+    uint16_t sample;
+    for(int i = 0; i < SAMPLES; ++i)
+    {
+        REQUIRE(msg.samples.next(&sample));
+        CHECK(sample == 3*i + 1);
+    }
+}
+
+}
+
+TEST_CASE("multiplexer preemption", "[multiplex]")
+{
+    Link link;
+
+    REQUIRE(link.sendSamples(3));
+    CHECK(link.output.queued(3) == 3 + 1 + 2 + 2*SAMPLES);
+
+    // Start sending the large message
+    for(int i = 0; i < 5; ++i)
+        REQUIRE(link.output.poll());
+    CHECK(link.queue.frames.size() == 5);
+
+    // The urgent message goes out with the next fragment
+    Stop stop{42};
+    REQUIRE(link.output.send(0, stop));
+    REQUIRE(link.output.poll());
+    CHECK(link.output.queued(0) == 0);
+
+    while(!link.output.idle())
+        REQUIRE(link.output.poll());
+
+    // 1003 bytes of message in fragments of 28 bytes, plus one
+    CHECK(link.queue.frames.size() == 36 + 1);
+    for(auto& frame : link.queue.frames)
+        CHECK(frame.size() <= 32 + 8);
+
+    std::vector<Received> received;
+    receive(&link, [&](uint8_t channel, uint8_t code) {
+        received.push_back(Received{channel, code});
+
+        if(channel == 0)
+        {
+            Stop msg;
+            REQUIRE(link.input.read(&msg));
+            CHECK(msg.reason == 42);
+        }
+        else
+            checkSamples(&link.input, channel);
+    });
+
+    REQUIRE(received.size() == 2);
+    CHECK(received[0].channel == 0);
+    CHECK(received[0].msgCode == Stop::MSG_CODE);
+    CHECK(received[1].channel == 3);
+    CHECK(received[1].msgCode == RProto::SampleBlock::MSG_CODE);
+}
+
+TEST_CASE("multiplexer channel priorities", "[multiplex]")
+{
+    Link link;
+
+    REQUIRE(link.sendSamples(2));
+    REQUIRE(link.sendSamples(1));
+    REQUIRE(link.sendSamples(3));
+
+    Stop stop{1};
+    REQUIRE(link.output.send(0, stop));
+    REQUIRE(link.output.send(0, stop));
+
+    while(!link.output.idle())
+        REQUIRE(link.output.poll());
+
+    std::vector<uint8_t> channels;
+    receive(&link, [&](uint8_t channel, uint8_t) {
+        channels.push_back(channel);
+        if(channel != 0)
+            checkSamples(&link.input, channel);
+    });
+
+    CHECK(channels == std::vector<uint8_t>({0, 0, 1, 2, 3}));
+}
+
+TEST_CASE("multiplexer queue overflow", "[multiplex]")
+{
+    Link link;
+
+    // Two messages of 1006 bytes fit, the third does not
+    REQUIRE(link.sendSamples(1));
+    REQUIRE(link.sendSamples(1));
+
+    size_t queued = link.output.queued(1);
+    CHECK(!link.sendSamples(1));
+    CHECK(link.output.queued(1) == queued);
+
+    // Invalid channel
+    Stop stop{0};
+    CHECK(!link.output.send(4, stop));
+
+    while(!link.output.idle())
+        REQUIRE(link.output.poll());
+
+    int count = 0;
+    receive(&link, [&](uint8_t channel, uint8_t) {
+        CHECK(channel == 1);
+        checkSamples(&link.input, 1);
+        count++;
+    });
+    CHECK(count == 2);
+}
+
+TEST_CASE("multiplexer with lost fragments", "[multiplex]")
+{
+    Link link;
+
+    REQUIRE(link.sendSamples(2));
+    REQUIRE(link.sendSamples(2));
+
+    for(int i = 0; i < 3; ++i)
+        REQUIRE(link.output.poll());
+
+    Stop stop{7};
+    REQUIRE(link.output.send(0, stop));
+
+    while(!link.output.idle())
+        REQUIRE(link.output.poll());
+
+    // Lose the second fragment of the first large message
+    link.queue.frames.erase(link.queue.frames.begin() + 1);
+
+    int errors = 0;
+    std::vector<uint8_t> channels;
+    receive(&link, [&](uint8_t channel, uint8_t) {
+        channels.push_back(channel);
+        if(channel != 0)
+            checkSamples(&link.input, channel);
+    }, &errors);
+
+    // Other channels are not affected
+    CHECK(channels == std::vector<uint8_t>({0, 2}));
+    CHECK(errors == 1);
+}
+
+TEST_CASE("demultiplexer without channel buffer", "[multiplex]")
+{
+    Link link;
+    link.input.setBuffer(1, 0, 0);
+
+    Stop stop{3};
+    REQUIRE(link.output.send(1, stop));
+    REQUIRE(link.output.send(2, stop));
+
+    while(!link.output.idle())
+        REQUIRE(link.output.poll());
+
+    int errors = 0;
+    std::vector<uint8_t> channels;
+    receive(&link, [&](uint8_t channel, uint8_t) {
+        channels.push_back(channel);
+    }, &errors);
+
+    CHECK(channels == std::vector<uint8_t>({2}));
+    CHECK(errors == 1);
+}
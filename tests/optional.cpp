@@ -0,0 +1,107 @@
+// Optional member tests
+// Author: Max Schwarz <max@x-quadraht.de>
+
+#include <libucomm/cobs_envelope.h>
+#include <libucomm/checksum.h>
+#include <libucomm/io.h>
+
+#include "catch.hpp"
+
+#include "simple.h"
+
+#include "bufferio.h"
+
+typedef uc::Fletcher16Generator ChecksumGenerator;
+
+typedef uc::COBSWriter<ChecksumGenerator, BufferIO> EnvelopeWriter;
+
+typedef uc::IO<EnvelopeWriter, uc::IO_W> SimpleWriter;
+typedef Proto<SimpleWriter> WProto;
+
+typedef uc::COBSReader<ChecksumGenerator, 1024> EnvelopeReader;
+typedef uc::IO<EnvelopeReader, uc::IO_R> SimpleReader;
+typedef Proto<SimpleReader> RProto;
+
+static_assert(WProto::ServoFlags::IS_POD,
+    "structs without optional members should keep the POD fast path"
+);
+
+TEST_CASE("optional_members", "[optional]")
+{
+    static uint8_t names[] = {'a', 'b'};
+
+    WProto::ServoConfig cfg;
+    cfg.id = 7;
+    cfg.offset = -100000;
+    cfg.inverted = true;
+    cfg.trim = -3;
+    cfg.flags.emplace().current = 123;
+    cfg.o3 = 42;
+    cfg.names.setData(names, 2);
+
+    CHECK(!cfg.maxCurrent.has());
+    CHECK(cfg.offset.has());
+
+    BufferIO dbg;
+    EnvelopeWriter output(&dbg);
+    REQUIRE(output.send(cfg));
+
+    EnvelopeReader input;
+    int packetCount = 0;
+
+    while(dbg.isCharAvailable())
+    {
+        if(input.take(dbg.getChar()) != EnvelopeReader::NEW_MESSAGE)
+            continue;
+
+        RProto::ServoConfig cfg2;
+        cfg2.gain = 1.0f; // should be cleared by deserialization
+        REQUIRE(input.read(&cfg2));
+
+        CHECK(cfg2.id == 7);
+        CHECK(!cfg2.maxCurrent.has());
+        CHECK(cfg2.maxCurrent.valueOr(500) == 500);
+        REQUIRE(cfg2.offset.has());
+        CHECK(cfg2.offset.value() == -100000);
+        REQUIRE(cfg2.inverted.has());
+        CHECK(cfg2.inverted.value());
+        REQUIRE(cfg2.trim.has());
+        CHECK(cfg2.trim.value() == -3);
+        CHECK(!cfg2.gain.has());
+        REQUIRE(cfg2.flags.has());
+        CHECK(cfg2.flags->current == 123);
+        CHECK(!cfg2.o1.has());
+        CHECK(!cfg2.o2.has());
+        REQUIRE(cfg2.o3.has());
+        CHECK(cfg2.o3.value() == 42);
+
+        uint8_t c;
+        REQUIRE(cfg2.names.next(&c));
+        CHECK(c == 'a');
+        REQUIRE(cfg2.names.next(&c));
+        CHECK(c == 'b');
+
+        packetCount++;
+    }
+
+    REQUIRE(packetCount == 1);
+}
+
+TEST_CASE("optional_empty", "[optional]")
+{
+    WProto::ServoConfig cfg;
+    cfg.id = 1;
+
+    BufferIO dbg;
+    EnvelopeWriter output(&dbg);
+    REQUIRE(output.send(cfg));
+
+    // start, code, COBS code, id, 2 bytes bitmap, list count, checksum, end
+    int size = 0;
+    while(dbg.isCharAvailable())
+    {
+        dbg.getChar();
+        size++;
+    }
+    CHECK(size <= 11);
+}
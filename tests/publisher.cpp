@@ -0,0 +1,280 @@
+// Periodic publisher tests
+// Author: Max Schwarz <max@x-quadraht.de>
+
+#include <libucomm/publisher.h>
+#include <libucomm/cobs_envelope.h>
+#include <libucomm/checksum.h>
+
+#include "catch.hpp"
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <vector>
+
+typedef uc::Fletcher16Generator ChecksumGenerator;
+
+namespace
+{
+
+//! BufferedWriter counting packets and bytes
+class FrameCounter
+{
+public:
+    uint8_t* dataPointer()
+    { return m_data; }
+
+    size_t dataSize() const
+    { return sizeof(m_data); }
+
+    void packetComplete(size_t n)
+    {
+        frames++;
+        bytes += n;
+
+        EnvelopeReader reader;
+        for(size_t i = 0; i < n; ++i)
+        {
+            if(reader.take(m_data[i]) == EnvelopeReader::NEW_MESSAGE)
+                codes.push_back(reader.msgCode());
+        }
+    }
+
+    unsigned int frames = 0;
+    size_t bytes = 0;
+    std::vector<uint8_t> codes;
+private:
+    typedef uc::COBSReader<ChecksumGenerator, 64> EnvelopeReader;
+
+    uint8_t m_data[128];
+};
+
+//! Message with @a Size bytes of payload
+template<int Code, int Size>
+struct Payload
+{
+    enum { MSG_CODE = Code };
+
+    uint8_t data[Size] = {};
+    uint32_t counter = 0;
+
+    template<class Writer>
+    bool serialize(Writer* writer) const
+    { return writer->write(data, sizeof(data)); }
+};
+
+// 14 and 46 bytes on the wire (code, checksum, COBS and delimiters)
+typedef Payload<1, 8> Small;
+typedef Payload<2, 40> Large;
+
+template<class MSG>
+bool fill(MSG* msg)
+{
+    msg->counter++;
+    return true;
+}
+
+bool fillEverySecond(Small* msg)
+{
+    return (++msg->counter % 2) == 0;
+}
+
+typedef uc::COBSWriter<ChecksumGenerator, FrameCounter> EnvelopeWriter;
+typedef uc::PeriodicPublisher<EnvelopeWriter, 32> Publisher;
+
+// 1 Mbaud, ticks in us
+const uint32_t BYTES_PER_SECOND = 100000;
+const uint32_t TICKS_PER_SECOND = 1000000;
+
+//! Sources from 10 Hz to 1 kHz, about 70% link load
+struct Sources
+{
+    Small fast[2];   // 1 kHz
+    Small medium[8]; // 200 Hz
+    Large slow[8];   // 50 Hz
+    Large status[4]; // 10 Hz
+
+    void add(Publisher* publisher)
+    {
+        for(auto& msg : fast)
+            REQUIRE(publisher->addSource(&msg, 1000, &fill<Small>, 14) >= 0);
+        for(auto& msg : medium)
+            REQUIRE(publisher->addSource(&msg, 5000, &fill<Small>, 14) >= 0);
+        for(auto& msg : slow)
+            REQUIRE(publisher->addSource(&msg, 20000, &fill<Large>, 46) >= 0);
+        for(auto& msg : status)
+            REQUIRE(publisher->addSource(&msg, 100000, &fill<Large>, 46) >= 0);
+    }
+};
+
+void run(Publisher* publisher, uint32_t start, uint32_t duration)
+{
+    publisher->start(start);
+    for(uint32_t t = 0; t < duration; t += 10)
+        publisher->update(start + t);
+}
+
+}
+
+TEST_CASE("publisher hyperperiod", "[publisher]")
+{
+    FrameCounter counter;
+    EnvelopeWriter envelope(&counter);
+    Publisher publisher(&envelope);
+
+    Small a, b, c;
+    REQUIRE(publisher.addSource(&a, 20, &fill<Small>, 14) == 0);
+    REQUIRE(publisher.addSource(&b, 30, &fill<Small>, 14) == 1);
+    REQUIRE(publisher.addSource(&c, 40, &fill<Small>, 14) == 2);
+
+    CHECK(publisher.addSource(&c, 0, &fill<Small>, 14) == -1);
+
+    REQUIRE(publisher.schedule());
+    CHECK(publisher.hyperperiod() == 120);
+
+    for(int i = 0; i < 3; ++i)
+        CHECK(publisher.offset(i) < (i + 2) * 10);
+
+    // Two messages collide once per hyperperiod at most
+    CHECK(publisher.peakLoad() <= 2 * 14);
+
+    Small d;
+    REQUIRE(publisher.addSource(&d, 0x7FFFFFFF, &fill<Small>, 14) >= 0);
+    CHECK(!publisher.schedule());
+}
+
+TEST_CASE("publisher phase offsets", "[publisher]")
+{
+    FrameCounter counter;
+    EnvelopeWriter envelope(&counter);
+    Publisher publisher(&envelope);
+
+    Small msgs[4];
+    for(auto& msg : msgs)
+        REQUIRE(publisher.addSource(&msg, 10000, &fill<Small>, 14) >= 0);
+
+    REQUIRE(publisher.schedule());
+
+    // Evenly spread over the period
+    std::vector<uint32_t> offsets;
+    for(int i = 0; i < 4; ++i)
+        offsets.push_back(publisher.offset(i));
+    std::sort(offsets.begin(), offsets.end());
+
+    for(int i = 1; i < 4; ++i)
+        CHECK(offsets[i] >= offsets[i-1] + 2000);
+    CHECK(publisher.peakLoad() == 14);
+
+    run(&publisher, 0, 100000);
+
+    CHECK(counter.frames == 40);
+    for(int i = 0; i < 4; ++i)
+        CHECK(publisher.statistics(i).published == 10);
+}
+
+TEST_CASE("publisher jitter", "[publisher]")
+{
+    // All sources start together
+    FrameCounter burstCounter;
+    EnvelopeWriter burstEnvelope(&burstCounter);
+    Publisher burst(&burstEnvelope);
+    burst.setLinkRate(BYTES_PER_SECOND, TICKS_PER_SECOND);
+
+    Sources burstSources;
+    burstSources.add(&burst);
+    run(&burst, 0, 1000000);
+
+    // Phase offsets
+    FrameCounter counter;
+    EnvelopeWriter envelope(&counter);
+    Publisher publisher(&envelope);
+    publisher.setLinkRate(BYTES_PER_SECOND, TICKS_PER_SECOND);
+
+    Sources sources;
+    sources.add(&publisher);
+    REQUIRE(publisher.schedule());
+    CHECK(publisher.hyperperiod() == 100000);
+
+    // Start close to the time wrap-around
+    run(&publisher, 0xFFFF0000, 1000000);
+
+    // Same messages in both cases
+    CHECK(counter.frames == 2000 + 8*200 + 8*50 + 4*10);
+    CHECK(counter.frames == burstCounter.frames);
+    CHECK(counter.bytes == burstCounter.bytes);
+    CHECK(counter.codes.size() == counter.frames);
+
+    // Wire size estimates are exact here
+    float load = float(counter.bytes) / BYTES_PER_SECOND;
+    CHECK(load == Approx(0.7064));
+    CHECK(publisher.utilization() == Approx(load).epsilon(0.01));
+    CHECK(burst.utilization() == Approx(load).epsilon(0.01));
+
+    // A burst of all messages takes 6.9 ms, spreading them avoids queueing
+    CHECK(burst.maxJitter() > 5000);
+    CHECK(publisher.maxJitter() < burst.maxJitter() / 10);
+
+    CHECK(sources.fast[0].counter == 1000);
+    CHECK(sources.status[3].counter == 10);
+}
+
+TEST_CASE("publisher skipped periods", "[publisher]")
+{
+    FrameCounter counter;
+    EnvelopeWriter envelope(&counter);
+    Publisher publisher(&envelope);
+
+    Small msg;
+    REQUIRE(publisher.addSource(&msg, 100, &fillEverySecond, 14) >= 0);
+
+    run(&publisher, 0, 1000);
+    CHECK(publisher.statistics(0).published == 5);
+    CHECK(publisher.statistics(0).skipped == 5);
+
+    // Updates too late for several periods
+    publisher.start(0);
+    publisher.update(0);
+    publisher.update(350);
+    const uc::PublisherStatistics& stats = publisher.statistics(0);
+    CHECK(stats.published == 1);
+    CHECK(stats.skipped == 3);
+}
+
+TEST_CASE("publisher without link rate", "[publisher]")
+{
+    FrameCounter counter;
+    EnvelopeWriter envelope(&counter);
+    Publisher publisher(&envelope);
+
+    Small msg;
+    REQUIRE(publisher.addSource(&msg, 100, &fill<Small>, 14) >= 0);
+
+    // Nothing is measured, so there is no jitter either
+    run(&publisher, 0, 1000);
+    const uc::PublisherStatistics& stats = publisher.statistics(0);
+    CHECK(stats.published == 10);
+    CHECK(stats.measured == 0);
+    CHECK(stats.jitter() == 0);
+    CHECK(publisher.maxJitter() == 0);
+}
+
+TEST_CASE("publisher link rate", "[publisher]")
+{
+    FrameCounter counter;
+    EnvelopeWriter envelope(&counter);
+    Publisher publisher(&envelope);
+
+    CHECK(!publisher.setLinkRate(0, TICKS_PER_SECOND));
+    CHECK(!publisher.setLinkRate(BYTES_PER_SECOND, 0));
+
+    // 115200 baud with ns ticks: 86806 ticks per byte
+    REQUIRE(publisher.setLinkRate(11520, 1000000000));
+
+    Small msg;
+    REQUIRE(publisher.addSource(&msg, 10000000, &fill<Small>, 10) >= 0);
+
+    publisher.start(0);
+    publisher.update(0);
+    REQUIRE(publisher.statistics(0).published == 1);
+    CHECK(publisher.statistics(0).maxLatency == 868056);
+}
@@ -0,0 +1,245 @@
+// Rate limiting tests
+// Author: Max Schwarz <max@x-quadraht.de>
+
+#include <libucomm/rate_limit.h>
+#include <libucomm/scheduler.h>
+#include <libucomm/cobs_envelope.h>
+#include <libucomm/checksum.h>
+
+#include "catch.hpp"
+
+#include "sinks.h"
+
+#include <stdint.h>
+
+#include <vector>
+
+typedef uc::Fletcher16Generator ChecksumGenerator;
+
+namespace
+{
+
+/**
+ * Simulated tty: accepts everything and drains at the line rate
+ * (CharWriter interface)
+ **/
+class SerialPort
+{
+public:
+    explicit SerialPort(uint32_t usPerByte)
+     : m_usPerByte(usPerByte)
+    {}
+
+    bool writeChar(uint8_t c)
+    {
+        bytes.push_back(c);
+        backlog++;
+        return true;
+    }
+
+    void flush()
+    {
+        flushes++;
+        if(backlog > maxBacklog)
+            maxBacklog = backlog;
+    }
+
+    void update(uint32_t now)
+    {
+        while(backlog != 0 && now - m_lastByte >= m_usPerByte)
+        {
+            backlog--;
+            m_lastByte += m_usPerByte;
+        }
+
+        if(backlog == 0)
+            m_lastByte = now;
+    }
+
+    std::vector<uint8_t> bytes;
+    size_t backlog = 0;
+    size_t maxBacklog = 0;
+    unsigned int flushes = 0;
+private:
+    uint32_t m_usPerByte;
+    uint32_t m_lastByte = 0;
+};
+
+struct Sample
+{
+    enum { MSG_CODE = 3 };
+
+    uint8_t data[24];
+
+    template<class Writer>
+    bool serialize(Writer* writer) const
+    { return writer->write(data, sizeof(data)); }
+};
+
+}
+
+typedef uc::RateLimitedWriter<FrameQueue, 256> Shaper;
+typedef uc::COBSWriter<ChecksumGenerator, Shaper> EnvelopeWriter;
+
+typedef uc::RateLimitedWriter<SerialPort, 256> PortShaper;
+typedef uc::COBSWriter<ChecksumGenerator, PortShaper> PortEnvelopeWriter;
+
+TEST_CASE("rate limiting without link rate", "[rate_limit]")
+{
+    FrameQueue queue;
+    Shaper shaper(&queue);
+    EnvelopeWriter envelope(&shaper);
+
+    Sample msg = {};
+    for(int i = 0; i < 100; ++i)
+    {
+        REQUIRE(shaper.ready(30));
+        REQUIRE(envelope.send(msg));
+    }
+
+    CHECK(queue.frames.size() == 100);
+    CHECK(shaper.statistics().frames == 100);
+    CHECK(shaper.statistics().maxLatency == 0);
+}
+
+TEST_CASE("rate limiting token bucket", "[rate_limit]")
+{
+    FrameQueue queue;
+    Shaper shaper(&queue);
+    EnvelopeWriter envelope(&shaper);
+
+    // 115200 baud 8N1, ticks in us
+    shaper.setBaudRate(115200, 10, 1000000);
+    shaper.setBurst(64);
+    shaper.update(0);
+
+    // 30 bytes per frame on the wire
+    Sample msg = {};
+    REQUIRE(envelope.send(msg));
+    REQUIRE(envelope.send(msg));
+    CHECK(queue.frames.size() == 2);
+    REQUIRE(queue.frames[0].size() == 30);
+
+    CHECK(shaper.ready(4));
+    CHECK(!shaper.ready(30));
+
+    // Eight frames fit into the queue (8 * 36 bytes > 256)
+    int accepted = 2;
+    while(envelope.send(msg))
+        accepted++;
+    CHECK(accepted == 9);
+    CHECK(shaper.queued() == 7 * 36);
+
+    // One frame every 2.6 ms, the bucket holds 4 bytes now
+    shaper.update(2000);
+    CHECK(queue.frames.size() == 2);
+    shaper.update(2300);
+    CHECK(queue.frames.size() == 3);
+
+    uint32_t now = 2300;
+    while(shaper.queued() != 0)
+    {
+        now += 100;
+        shaper.update(now);
+
+        // Never more than the burst ahead of the line
+        size_t sent = queue.frames.size() * 30;
+        CHECK(sent <= 64 + 11.52 * now);
+    }
+
+    CHECK(queue.frames.size() == 9);
+    CHECK(now == Approx((9*30 - 64) / 0.01152).epsilon(0.02));
+
+    const uc::RateLimitStatistics& stats = shaper.statistics();
+    CHECK(stats.frames == 9);
+    CHECK(stats.bytes == 9*30);
+    CHECK(stats.maxLatency == now);
+    CHECK(stats.meanLatency() > now / 3);
+    CHECK(stats.meanLatency() < now / 2);
+}
+
+TEST_CASE("rate limiting large frames", "[rate_limit]")
+{
+    FrameQueue queue;
+    Shaper shaper(&queue);
+    EnvelopeWriter envelope(&shaper);
+
+    shaper.setBaudRate(115200, 10, 1000000);
+    shaper.setBurst(16);
+    shaper.update(0);
+
+    // Frames larger than the burst size go out when the bucket is full
+    Sample msg = {};
+    REQUIRE(envelope.send(msg));
+    REQUIRE(envelope.send(msg));
+    CHECK(queue.frames.size() == 1);
+
+    shaper.update(2600);
+    CHECK(queue.frames.size() == 1);
+    shaper.update(2600 + 1400);
+    CHECK(queue.frames.size() == 2);
+}
+
+TEST_CASE("rate limiting with fine ticks", "[rate_limit]")
+{
+    FrameQueue queue;
+    Shaper shaper(&queue);
+    EnvelopeWriter envelope(&shaper);
+
+    // Far below one byte per tick
+    REQUIRE(shaper.setBaudRate(115200, 10, 1000000000));
+    shaper.setBurst(16);
+    shaper.update(0);
+
+    Sample msg = {};
+    REQUIRE(envelope.send(msg));
+    REQUIRE(envelope.send(msg));
+    CHECK(queue.frames.size() == 1);
+
+    shaper.update(2600000);
+    CHECK(queue.frames.size() == 1);
+    shaper.update(2600000 + 1400000);
+    CHECK(queue.frames.size() == 2);
+
+    // Not representable, the link rate is kept
+    CHECK(!shaper.setBaudRate(1, 10, 1000000000));
+    REQUIRE(envelope.send(msg));
+    CHECK(queue.frames.size() == 2);
+}
+
+TEST_CASE("rate limiting keeps the tty buffer short", "[rate_limit]")
+{
+    // 115200 baud, 87 us per byte
+    SerialPort port(87);
+    PortShaper shaper(&port);
+    PortEnvelopeWriter envelope(&shaper);
+    uc::TxScheduler<PortEnvelopeWriter, 8> scheduler(&envelope);
+
+    shaper.setBaudRate(115200, 10, 1000000);
+    shaper.setBurst(32);
+
+    // Four sensors produce a sample every ms, ten times the line rate
+    Sample samples[4] = {};
+
+    for(uint32_t now = 0; now < 1000000; now += 10)
+    {
+        if(now % 1000 == 0)
+        {
+            for(uint32_t i = 0; i < 4; ++i)
+                REQUIRE(scheduler.submit(samples[i], 0, now + 5000, i));
+        }
+
+        port.update(now);
+        shaper.update(now);
+
+        while(shaper.ready(30) && scheduler.poll(now))
+            ;
+    }
+
+    // Frames are kept out of the tty buffer, the scheduler drops stale ones
+    CHECK(port.maxBacklog <= 32 + 30);
+    CHECK(port.flushes > 370);
+    CHECK(scheduler.statistics().superseded > 3000);
+    CHECK(shaper.statistics().maxLatency == 0);
+    CHECK(port.bytes.size() == port.flushes * 30);
+}
@@ -0,0 +1,224 @@
+// Resumable serialization tests
+// Author: Max Schwarz <max@x-quadraht.de>
+
+#include <libucomm/resumable.h>
+#include <libucomm/cobs_envelope.h>
+#include <libucomm/checksum.h>
+#include <libucomm/io.h>
+
+#include "catch.hpp"
+
+#include "simple.h"
+#include "sinks.h"
+
+#include <vector>
+
+typedef uc::Fletcher16Generator ChecksumGenerator;
+
+namespace
+{
+
+struct RawMessage
+{
+    enum { MSG_CODE = 9 };
+
+    std::vector<uint8_t> payload;
+
+    template<class Writer>
+    bool serialize(Writer* writer) const
+    { return writer->write(payload.data(), payload.size()); }
+};
+
+}
+
+typedef uc::ResumableCOBSWriter<ChecksumGenerator, SmallBuffer> Writer;
+typedef uc::COBSWriter<ChecksumGenerator, FrameBuffer> ReferenceWriter;
+typedef uc::COBSReader<ChecksumGenerator, 4096> EnvelopeReader;
+
+typedef Proto< uc::IO<Writer, uc::IO_W> > WProto;
+typedef Proto< uc::IO<ReferenceWriter, uc::IO_W> > RefProto;
+typedef Proto< uc::IO<EnvelopeReader, uc::IO_R> > RProto;
+
+namespace
+{
+
+//! Send @a msg through a buffer of @a capacity bytes
+template<class MSG>
+std::vector<uint8_t> sendResumable(const MSG& msg, size_t capacity, int* suspensions = 0)
+{
+    SmallBuffer buffer(capacity);
+    Writer writer(&buffer);
+
+    Writer::Status status = writer.send(msg);
+    int count = 0;
+    while(status == Writer::SUSPENDED)
+    {
+        REQUIRE(writer.busy());
+        buffer.drain();
+        status = writer.resume();
+        count++;
+    }
+
+    REQUIRE(status == Writer::DONE);
+    CHECK(!writer.busy());
+
+    buffer.drain();
+
+    if(suspensions)
+        *suspensions = count;
+
+    return buffer.bytes;
+}
+
+template<class MSG>
+std::vector<uint8_t> sendReference(const MSG& msg)
+{
+    FrameBuffer buffer;
+    ReferenceWriter writer(&buffer);
+    REQUIRE(writer.send(msg));
+
+    return buffer.take();
+}
+
+}
+
+TEST_CASE("resumable COBS matches COBSWriter", "[resumable]")
+{
+    std::vector<std::vector<uint8_t>> payloads;
+
+    payloads.push_back({});
+    payloads.push_back({0x00});
+    payloads.push_back({0x00, 0x00, 0x00});
+    payloads.push_back({0x01, 0x02, 0x00, 0x03});
+
+    // Block length edge cases
+    for(size_t size : {253, 254, 255, 508, 509, 1000})
+    {
+        std::vector<uint8_t> data(size);
+        for(size_t i = 0; i < size; ++i)
+            data[i] = 1 + i % 200;
+        payloads.push_back(data);
+
+        data.push_back(0x00);
+        payloads.push_back(data);
+    }
+
+    for(auto& payload : payloads)
+    {
+        RawMessage msg{payload};
+        std::vector<uint8_t> reference = sendReference(msg);
+
+        for(size_t capacity : {1, 2, 7, 64, 300, 1024})
+        {
+            INFO("payload size " << payload.size() << ", capacity " << capacity);
+            CHECK(sendResumable(msg, capacity) == reference);
+        }
+    }
+}
+
+TEST_CASE("resumable serialization of generated messages", "[resumable]")
+{
+    uint16_t samples[1000];
+    for(int i = 0; i < 1000; ++i)
+        samples[i] = 7*i;
+
+    WProto::SampleBlock msg;
+    msg.channel = 3;
+    msg.samples.setData(samples, 1000);
+
+    RefProto::SampleBlock refMsg;
+    refMsg.channel = 3;
+    refMsg.samples.setData(samples, 1000);
+
+    // Suspended inside the sample list many times
+    int suspensions = 0;
+    std::vector<uint8_t> bytes = sendResumable(msg, 16, &suspensions);
+    CHECK(suspensions > 100);
+    CHECK(bytes == sendReference(refMsg));
+
+    EnvelopeReader reader;
+    int received = 0;
+    for(uint8_t c : bytes)
+    {
+        if(reader.take(c) != EnvelopeReader::NEW_MESSAGE)
+            continue;
+
+        REQUIRE(reader.msgCode() == RProto::SampleBlock::MSG_CODE);
+
+        RProto::SampleBlock rmsg;
+        REQUIRE(reader.read(&rmsg));
+        CHECK(rmsg.channel == 3);
+        REQUIRE(rmsg.samples.remaining() == 1000);
+
+        uint16_t sample;
+        for(int i = 0; i < 1000; ++i)
+        {
+            REQUIRE(rmsg.samples.next(&sample));
+            CHECK(sample == 7*i);
+        }
+        received++;
+    }
+
+    CHECK(received == 1);
+}
+
+TEST_CASE("resumable writer busy and abort", "[resumable]")
+{
+    SmallBuffer buffer(8);
+    Writer writer(&buffer);
+
+    RawMessage big{std::vector<uint8_t>(100, 0x55)};
+    RawMessage small{{0x01, 0x02}};
+
+    REQUIRE(writer.send(big) == Writer::SUSPENDED);
+    CHECK(writer.send(small) == Writer::FAILED);
+
+    // Drop the partial frame and send another one
+    writer.abort();
+    CHECK(!writer.busy());
+    buffer.drain();
+
+    Writer::Status status = writer.send(small);
+    while(status == Writer::SUSPENDED)
+    {
+        buffer.drain();
+        status = writer.resume();
+    }
+    REQUIRE(status == Writer::DONE);
+    buffer.drain();
+
+    // The receiver only sees the complete frame
+    EnvelopeReader reader;
+    int received = 0;
+    int errors = 0;
+    for(uint8_t c : buffer.bytes)
+    {
+        EnvelopeReader::TakeResult ret = reader.take(c);
+        if(ret == EnvelopeReader::NEW_MESSAGE)
+        {
+            CHECK(reader.msgCode() == RawMessage::MSG_CODE);
+            received++;
+        }
+        else if(ret != EnvelopeReader::NEED_MORE_DATA)
+            errors++;
+    }
+
+    CHECK(received == 1);
+    CHECK(errors == 1);
+}
+
+TEST_CASE("resumable writer serialization errors", "[resumable]")
+{
+    SmallBuffer buffer(1024);
+    Writer writer(&buffer);
+
+    uint16_t samples[10];
+
+    // More elements than the list allows
+    WProto::SampleBlock msg;
+    msg.channel = 0;
+    msg.samples.setData(samples, 5000);
+
+    CHECK(writer.send(msg) == Writer::FAILED);
+    CHECK(!writer.busy());
+}
@@ -0,0 +1,299 @@
+// TX scheduler tests
+// Author: Max Schwarz <max@x-quadraht.de>
+
+#include <libucomm/scheduler.h>
+#include <libucomm/cobs_envelope.h>
+#include <libucomm/checksum.h>
+
+#include "catch.hpp"
+
+#include "sinks.h"
+
+#include <stdint.h>
+
+#include <vector>
+
+typedef uc::Fletcher16Generator ChecksumGenerator;
+
+namespace
+{
+
+template<int Code>
+struct Value
+{
+    enum { MSG_CODE = Code };
+
+    uint32_t value;
+
+    template<class Writer>
+    bool serialize(Writer* writer) const
+    { return writer->write(&value, sizeof(value)); }
+
+    template<class Reader>
+    bool deserialize(Reader* reader)
+    { return reader->read(&value, sizeof(value)); }
+};
+
+//! Message whose serialization fails on request
+struct Flaky
+{
+    enum { MSG_CODE = 1 };
+
+    uint32_t value;
+    bool fail;
+
+    template<class Writer>
+    bool serialize(Writer* writer) const
+    { return !fail && writer->write(&value, sizeof(value)); }
+};
+
+typedef Value<1> Command;
+typedef Value<2> Status;
+typedef Value<3> Log;
+
+typedef uc::COBSWriter<ChecksumGenerator, FrameQueue> EnvelopeWriter;
+typedef uc::COBSReader<ChecksumGenerator, 64> EnvelopeReader;
+typedef uc::TxScheduler<EnvelopeWriter, 8> Scheduler;
+
+struct Received
+{
+    uint8_t msgCode;
+    uint32_t value;
+
+    bool operator==(const Received& other) const
+    { return msgCode == other.msgCode && value == other.value; }
+};
+
+//! Decode all frames in @a queue
+std::vector<Received> receive(FrameQueue* queue)
+{
+    EnvelopeReader reader;
+    std::vector<Received> received;
+
+    for(auto& frame : queue->frames)
+    {
+        for(uint8_t c : frame)
+        {
+            if(reader.take(c) != EnvelopeReader::NEW_MESSAGE)
+                continue;
+
+            Command msg;
+            REQUIRE(reader.read(&msg));
+            received.push_back(Received{reader.msgCode(), msg.value});
+        }
+    }
+
+    queue->frames.clear();
+    return received;
+}
+
+}
+
+TEST_CASE("scheduler ordering", "[scheduler]")
+{
+    FrameQueue queue;
+    EnvelopeWriter envelope(&queue);
+    Scheduler scheduler(&envelope);
+
+    Log log1{1}, log2{2};
+    Status status{3};
+    Command late{4}, early{5};
+
+    REQUIRE(scheduler.submit(log1, 0));
+    REQUIRE(scheduler.submit(log2, 0, 0, 1));
+    REQUIRE(scheduler.submit(status, 1, 1000));
+    REQUIRE(scheduler.submit(late, 2, 50, 1));
+    REQUIRE(scheduler.submit(early, 2, 20, 2));
+    CHECK(scheduler.size() == 5);
+
+    // Deadline 0 of log2 is in the past
+    while(scheduler.poll(10))
+        ;
+
+    CHECK(scheduler.empty());
+
+    // Priority, then earliest deadline, then submission order
+    std::vector<Received> expected = {
+        {Command::MSG_CODE, 5}, {Command::MSG_CODE, 4},
+        {Status::MSG_CODE, 3}, {Log::MSG_CODE, 1}
+    };
+    CHECK(receive(&queue) == expected);
+
+    CHECK(scheduler.statistics().sent == 4);
+    CHECK(scheduler.statistics().expired == 1);
+}
+
+TEST_CASE("scheduler superseding", "[scheduler]")
+{
+    FrameQueue queue;
+    EnvelopeWriter envelope(&queue);
+    Scheduler scheduler(&envelope);
+
+    Status first{1}, second{2};
+    Command command{3};
+
+    REQUIRE(scheduler.submit(first, 1, 100));
+    REQUIRE(scheduler.submit(command, 1, 100));
+    REQUIRE(scheduler.submit(second, 1, 100));
+
+    // The newer status replaces the queued one and keeps its place
+    CHECK(scheduler.size() == 2);
+    CHECK(scheduler.statistics().superseded == 1);
+
+    while(scheduler.poll(0))
+        ;
+
+    std::vector<Received> expected = {
+        {Status::MSG_CODE, 2}, {Command::MSG_CODE, 3}
+    };
+    CHECK(receive(&queue) == expected);
+}
+
+TEST_CASE("scheduler lazy serialization", "[scheduler]")
+{
+    FrameQueue queue;
+    EnvelopeWriter envelope(&queue);
+    Scheduler scheduler(&envelope);
+
+    Status status{1};
+    REQUIRE(scheduler.submit(status, 0, 100));
+
+    // Updates in place are picked up until the message is sent
+    status.value = 7;
+    REQUIRE(scheduler.poll(0));
+
+    std::vector<Received> expected = {{Status::MSG_CODE, 7}};
+    CHECK(receive(&queue) == expected);
+}
+
+TEST_CASE("scheduler full queue", "[scheduler]")
+{
+    FrameQueue queue;
+    EnvelopeWriter envelope(&queue);
+    Scheduler scheduler(&envelope);
+
+    Log logs[8];
+    for(int i = 0; i < 8; ++i)
+    {
+        logs[i].value = i;
+        REQUIRE(scheduler.submit(logs[i], 1, 100, i));
+    }
+
+    // Not more important than the queued messages
+    Log extra{8};
+    CHECK(!scheduler.submit(extra, 1, 100, 8));
+
+    // Evicts the least important message (latest submission)
+    Command command{9};
+    REQUIRE(scheduler.submit(command, 2, 100));
+    CHECK(scheduler.size() == 8);
+    CHECK(scheduler.statistics().rejected == 2);
+
+    while(scheduler.poll(0))
+        ;
+
+    std::vector<Received> received = receive(&queue);
+    REQUIRE(received.size() == 8);
+    CHECK(received[0] == (Received{Command::MSG_CODE, 9}));
+    for(int i = 0; i < 7; ++i)
+        CHECK(received[i+1] == (Received{Log::MSG_CODE, uint32_t(i)}));
+}
+
+TEST_CASE("scheduler send failure", "[scheduler]")
+{
+    FrameQueue queue;
+    EnvelopeWriter envelope(&queue);
+    Scheduler scheduler(&envelope);
+
+    Flaky flaky{1, true};
+    Status status{2};
+    REQUIRE(scheduler.submit(flaky, 1, 100));
+    REQUIRE(scheduler.submit(status, 0, 100));
+
+    // The failed message is kept at the head of the queue
+    CHECK(!scheduler.poll(0));
+    CHECK(scheduler.size() == 2);
+    CHECK(scheduler.statistics().errors == 1);
+
+    flaky.fail = false;
+    while(scheduler.poll(0))
+        ;
+
+    std::vector<Received> expected = {
+        {Flaky::MSG_CODE, 1}, {Status::MSG_CODE, 2}
+    };
+    CHECK(receive(&queue) == expected);
+    CHECK(scheduler.size() == 0);
+}
+
+TEST_CASE("scheduler expiry with time wrap-around", "[scheduler]")
+{
+    FrameQueue queue;
+    EnvelopeWriter envelope(&queue);
+    Scheduler scheduler(&envelope);
+
+    Status status{1};
+    Command command{2};
+    Log log{3};
+
+    uint32_t now = 0xFFFFFFF0;
+    REQUIRE(scheduler.submit(status, 0, now + 10));
+    REQUIRE(scheduler.submit(command, 0, now + 30));
+    REQUIRE(scheduler.submit(log, 0));
+
+    scheduler.expire(now + 20);
+    CHECK(scheduler.size() == 2);
+    CHECK(scheduler.statistics().expired == 1);
+
+    while(scheduler.poll(now + 20))
+        ;
+
+    std::vector<Received> expected = {
+        {Command::MSG_CODE, 2}, {Log::MSG_CODE, 3}
+    };
+    CHECK(receive(&queue) == expected);
+}
+
+TEST_CASE("scheduler under link saturation", "[scheduler]")
+{
+    FrameQueue queue;
+    EnvelopeWriter envelope(&queue);
+    Scheduler scheduler(&envelope);
+
+    // Four control loops publish every tick, the link carries one message
+    // every two ticks.
+    Command commands[4];
+    Log log{0};
+
+    uint32_t maxAge = 0;
+
+    for(uint32_t now = 0; now < 1000; ++now)
+    {
+        for(uint32_t i = 0; i < 4; ++i)
+        {
+            commands[i].value = now;
+            REQUIRE(scheduler.submit(commands[i], 1, now + 10, i));
+        }
+
+        log.value = now;
+        scheduler.submit(log, 0);
+
+        if(now % 2 == 0)
+            scheduler.poll(now);
+
+        for(auto& msg : receive(&queue))
+        {
+            if(msg.msgCode != Command::MSG_CODE)
+                continue;
+
+            uint32_t age = now - msg.value;
+            if(age > maxAge)
+                maxAge = age;
+        }
+    }
+
+    // No backlog builds up
+    CHECK(scheduler.size() <= 5);
+    CHECK(maxAge <= 10);
+    CHECK(scheduler.statistics().superseded > 1000);
+}
@@ -0,0 +1,110 @@
+// BufferedWriter implementations for the tests
+// Author: Max Schwarz <max@x-quadraht.de>
+
+#ifndef SINKS_H
+#define SINKS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <vector>
+
+//! BufferedWriter collecting the wire bytes of all frames
+class FrameBuffer
+{
+public:
+    uint8_t* dataPointer()
+    { return m_data + m_size; }
+
+    size_t dataSize() const
+    { return sizeof(m_data) - m_size; }
+
+    void packetComplete(size_t n)
+    { m_size += n; }
+
+    const uint8_t* data() const
+    { return m_data; }
+
+    size_t size() const
+    { return m_size; }
+
+    //! Return the collected bytes and clear the buffer
+    std::vector<uint8_t> take()
+    {
+        std::vector<uint8_t> ret(m_data, m_data + m_size);
+        m_size = 0;
+        return ret;
+    }
+private:
+    uint8_t m_data[4096];
+    size_t m_size = 0;
+};
+
+//! BufferedWriter keeping each packet as a separate frame
+class FrameQueue
+{
+public:
+    uint8_t* dataPointer()
+    { return m_data; }
+
+    size_t dataSize() const
+    { return sizeof(m_data); }
+
+    void packetComplete(size_t n)
+    { frames.emplace_back(m_data, m_data + n); }
+
+    std::vector<std::vector<uint8_t>> frames;
+private:
+    uint8_t m_data[512];
+};
+
+//! Small output buffer, drained by the test (like a non-blocking socket)
+class SmallBuffer
+{
+public:
+    explicit SmallBuffer(size_t capacity)
+     : m_capacity(capacity)
+     , m_size(0)
+    {}
+
+    uint8_t* dataPointer()
+    { return m_data + m_size; }
+
+    size_t dataSize() const
+    { return m_capacity - m_size; }
+
+    void packetComplete(size_t n)
+    { m_size += n; }
+
+    void drain()
+    {
+        bytes.insert(bytes.end(), m_data, m_data + m_size);
+        m_size = 0;
+    }
+
+    std::vector<uint8_t> bytes;
+private:
+    uint8_t m_data[1024];
+    size_t m_capacity;
+    size_t m_size;
+};
+
+//! BufferedWriter appending everything to a byte vector
+class ByteSink
+{
+public:
+    uint8_t* dataPointer()
+    { return m_data; }
+
+    size_t dataSize() const
+    { return sizeof(m_data); }
+
+    void packetComplete(size_t n)
+    { bytes.insert(bytes.end(), m_data, m_data + n); }
+
+    std::vector<uint8_t> bytes;
+private:
+    uint8_t m_data[1024];
+};
+
+#endif
@@ -0,0 +1,242 @@
+// Multi-producer TX funnel tests
+// Author: Max Schwarz <max@x-quadraht.de>
+
+#include <libucomm/tx_funnel.h>
+#include <libucomm/checksum.h>
+
+#include "catch.hpp"
+
+#include <sys/socket.h>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+typedef uc::Fletcher16Generator ChecksumGenerator;
+typedef uc::COBSReader<ChecksumGenerator, 256> EnvelopeReader;
+
+namespace
+{
+
+struct Tagged
+{
+    enum { MSG_CODE = 8 };
+
+    uint32_t producer;
+    uint32_t seq;
+
+    template<class Writer>
+    bool serialize(Writer* writer) const
+    {
+        return writer->write(&producer, sizeof(producer))
+            && writer->write(&seq, sizeof(seq));
+    }
+
+    template<class Reader>
+    bool deserialize(Reader* reader)
+    {
+        return reader->read(&producer, sizeof(producer))
+            && reader->read(&seq, sizeof(seq));
+    }
+};
+
+struct Raw
+{
+    enum { MSG_CODE = 9 };
+
+    std::vector<uint8_t> data;
+
+    template<class Writer>
+    bool serialize(Writer* writer) const
+    { return writer->write(data.data(), data.size()); }
+};
+
+//! Decode frames from the consumer side
+std::vector<Tagged> decode(EnvelopeReader* reader, const uint8_t* data, size_t size)
+{
+    std::vector<Tagged> msgs;
+    for(size_t i = 0; i < size; ++i)
+    {
+        if(reader->take(data[i]) != EnvelopeReader::NEW_MESSAGE)
+            continue;
+
+        Tagged msg;
+        if(reader->msgCode() == Tagged::MSG_CODE && reader->read(&msg))
+            msgs.push_back(msg);
+    }
+
+    return msgs;
+}
+
+}
+
+TEST_CASE("tx funnel single producer", "[tx_funnel]")
+{
+    typedef uc::TxFunnel<ChecksumGenerator, 8, 64> Funnel;
+    Funnel funnel;
+
+    const uint8_t* data;
+    size_t size;
+    CHECK(!funnel.front(&data, &size));
+
+    for(uint32_t i = 0; i < 8; ++i)
+    {
+        Tagged msg{0, i};
+        REQUIRE(funnel.send(msg));
+    }
+
+    // Ring full
+    Tagged extra{0, 8};
+    CHECK(!funnel.send(extra));
+    CHECK(funnel.statistics().full == 1);
+
+    EnvelopeReader reader;
+    REQUIRE(funnel.front(&data, &size));
+    std::vector<Tagged> msgs = decode(&reader, data, size);
+    REQUIRE(msgs.size() == 1);
+    CHECK(msgs[0].seq == 0);
+    funnel.pop();
+
+    // The slot is free again
+    CHECK(funnel.send(extra));
+    CHECK(!funnel.send(extra));
+
+    REQUIRE(funnel.front(&data, &size));
+    msgs = decode(&reader, data, size);
+    REQUIRE(msgs.size() == 1);
+    CHECK(msgs[0].seq == 1);
+    funnel.pop();
+
+    // Too large for a slot: skipped by the consumer
+    Raw big{std::vector<uint8_t>(100, 0x42)};
+    CHECK(!funnel.send(big));
+    CHECK(funnel.statistics().errors == 1);
+
+    uint32_t expected = 2;
+    while(funnel.front(&data, &size))
+    {
+        msgs = decode(&reader, data, size);
+        REQUIRE(msgs.size() == 1);
+        CHECK(msgs[0].seq == expected++);
+        funnel.pop();
+    }
+
+    CHECK(expected == 9);
+    CHECK(!funnel.pending());
+
+    uc::TxFunnelStatistics stats = funnel.statistics();
+    CHECK(stats.frames == 9);
+    CHECK(stats.full == 2);
+}
+
+TEST_CASE("tx funnel drains to an fd", "[tx_funnel]")
+{
+    typedef uc::TxFunnel<ChecksumGenerator, 256, 64> Funnel;
+    Funnel funnel;
+
+    int fds[2];
+    REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+
+    for(uint32_t i = 0; i < 200; ++i)
+    {
+        Tagged msg{1, i};
+        REQUIRE(funnel.send(msg));
+    }
+
+    // More than one writev() batch
+    ssize_t written = funnel.drain(fds[0]);
+    CHECK(written == ssize_t(funnel.statistics().bytes));
+    CHECK(!funnel.pending());
+    CHECK(funnel.drain(fds[0]) == 0);
+
+    std::vector<uint8_t> bytes(written);
+    size_t received = 0;
+    while(received != bytes.size())
+    {
+        ssize_t ret = read(fds[1], bytes.data() + received, bytes.size() - received);
+        REQUIRE(ret > 0);
+        received += ret;
+    }
+
+    EnvelopeReader reader;
+    std::vector<Tagged> msgs = decode(&reader, bytes.data(), bytes.size());
+    REQUIRE(msgs.size() == 200);
+    for(uint32_t i = 0; i < 200; ++i)
+        CHECK(msgs[i].seq == i);
+
+    close(fds[0]);
+    close(fds[1]);
+}
+
+TEST_CASE("tx funnel with concurrent producers", "[tx_funnel]")
+{
+    typedef uc::TxFunnel<ChecksumGenerator, 64, 64> Funnel;
+    Funnel funnel;
+
+    const uint32_t PRODUCERS = 4;
+    const uint32_t MESSAGES = 5000;
+
+    int fds[2];
+    REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+
+    std::atomic<uint32_t> running(PRODUCERS);
+    std::vector<std::thread> producers;
+    for(uint32_t p = 0; p < PRODUCERS; ++p)
+    {
+        producers.emplace_back([&, p]() {
+            for(uint32_t i = 0; i < MESSAGES; ++i)
+            {
+                Tagged msg{p, i};
+                while(!funnel.send(msg))
+                    std::this_thread::yield();
+            }
+            running--;
+        });
+    }
+
+    // Consumer
+    std::thread consumer([&]() {
+        while(running != 0 || funnel.pending())
+        {
+            if(funnel.drain(fds[0]) == 0)
+                std::this_thread::yield();
+        }
+        shutdown(fds[0], SHUT_WR);
+    });
+
+    EnvelopeReader reader;
+    std::vector<uint32_t> next(PRODUCERS, 0);
+    uint32_t count = 0;
+    int violations = 0;
+
+    uint8_t buffer[4096];
+    while(true)
+    {
+        ssize_t ret = read(fds[1], buffer, sizeof(buffer));
+        if(ret <= 0)
+            break;
+
+        for(const Tagged& msg : decode(&reader, buffer, ret))
+        {
+            if(msg.producer >= PRODUCERS || msg.seq != next[msg.producer])
+                violations++;
+            else
+                next[msg.producer]++;
+            count++;
+        }
+    }
+
+    for(auto& producer : producers)
+        producer.join();
+    consumer.join();
+
+    CHECK(violations == 0);
+    CHECK(count == PRODUCERS * MESSAGES);
+    for(uint32_t p = 0; p < PRODUCERS; ++p)
+        CHECK(next[p] == MESSAGES);
+
+    CHECK(funnel.statistics().frames == PRODUCERS * MESSAGES);
+
+    close(fds[0]);
+    close(fds[1]);
+}
@@ -0,0 +1,171 @@
+// Varint / zigzag encoding tests
+// Author: Max Schwarz <max@x-quadraht.de>
+
+#include <libucomm/cobs_envelope.h>
+#include <libucomm/checksum.h>
+#include <libucomm/io.h>
+#include <libucomm/varint.h>
+
+#include "catch.hpp"
+
+#include "simple.h"
+
+#include "bufferio.h"
+
+#include <string.h>
+
+#include <initializer_list>
+#include <vector>
+
+typedef uc::Fletcher16Generator ChecksumGenerator;
+
+typedef uc::COBSWriter<ChecksumGenerator, BufferIO> EnvelopeWriter;
+
+typedef uc::IO<EnvelopeWriter, uc::IO_W> SimpleWriter;
+typedef Proto<SimpleWriter> WProto;
+
+typedef uc::COBSReader<ChecksumGenerator, 1024> EnvelopeReader;
+typedef uc::IO<EnvelopeReader, uc::IO_R> SimpleReader;
+typedef Proto<SimpleReader> RProto;
+
+namespace
+{
+
+//! Reads from a byte list
+class ByteReader
+{
+public:
+    ByteReader(std::initializer_list<uint8_t> bytes)
+     : m_bytes(bytes)
+     , m_idx(0)
+    {}
+
+    bool read(void* data, size_t size)
+    {
+        if(m_bytes.size() - m_idx < size)
+            return false;
+
+        memcpy(data, m_bytes.data() + m_idx, size);
+        m_idx += size;
+        return true;
+    }
+private:
+    std::vector<uint8_t> m_bytes;
+    size_t m_idx;
+};
+
+template<class T>
+bool decode(std::initializer_list<uint8_t> bytes, T* value)
+{
+    ByteReader reader(bytes);
+    return uc::readVarint(&reader, value);
+}
+
+}
+
+TEST_CASE("varint_encoding", "[varint]")
+{
+    uint8_t buf[5];
+
+    CHECK(uc::encodeVarint(buf, uint32_t(0)) == 1);
+    CHECK(buf[0] == 0x00);
+
+    CHECK(uc::encodeVarint(buf, uint32_t(127)) == 1);
+    CHECK(buf[0] == 0x7F);
+
+    CHECK(uc::encodeVarint(buf, uint32_t(300)) == 2);
+    CHECK(buf[0] == 0xAC);
+    CHECK(buf[1] == 0x02);
+
+    CHECK(uc::encodeVarint(buf, uint32_t(0xFFFFFFFF)) == 5);
+    CHECK(buf[4] == 0x0F);
+
+    CHECK(uc::encodeVarint(buf, uint16_t(0xFFFF)) == 3);
+
+    CHECK(uc::zigzagEncode(int16_t(0)) == 0);
+    CHECK(uc::zigzagEncode(int16_t(-1)) == 1);
+    CHECK(uc::zigzagEncode(int16_t(1)) == 2);
+    CHECK(uc::zigzagEncode(int16_t(-32768)) == 0xFFFF);
+    CHECK(uc::zigzagDecode(uint16_t(0xFFFF)) == -32768);
+    CHECK(uc::zigzagDecode(uint32_t(3)) == -2);
+}
+
+TEST_CASE("varint_overflow", "[varint]")
+{
+    uint8_t u8;
+    CHECK(decode({0xFF, 0x01}, &u8));
+    CHECK(u8 == 0xFF);
+    CHECK(!decode({0xFF, 0x02}, &u8));
+    CHECK(!decode({0x80, 0x7F}, &u8));
+
+    uint16_t u16;
+    CHECK(decode({0xFF, 0xFF, 0x03}, &u16));
+    CHECK(u16 == 0xFFFF);
+    CHECK(!decode({0xFF, 0xFF, 0x04}, &u16));
+
+    uint32_t u32;
+    CHECK(decode({0xFF, 0xFF, 0xFF, 0xFF, 0x0F}, &u32));
+    CHECK(u32 == 0xFFFFFFFF);
+    CHECK(!decode({0xFF, 0xFF, 0xFF, 0xFF, 0x10}, &u32));
+
+    uint64_t u64;
+    CHECK(decode({0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x01}, &u64));
+    CHECK(u64 == 0xFFFFFFFFFFFFFFFFull);
+    CHECK(!decode({0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x02}, &u64));
+
+    // Too long
+    CHECK(!decode({0x80, 0x80, 0x00}, &u8));
+}
+
+TEST_CASE("varint_message", "[varint]")
+{
+    const uint32_t ticks[] = {0, 1, 127, 128, 16383, 16384, 0xFFFFFFFF};
+    const int16_t offsets[] = {0, -1, 1, -64, 64, -32768, 32767};
+
+    static uint8_t values[3] = {1, 2, 3};
+
+    BufferIO dbg(4096);
+    EnvelopeWriter output(&dbg);
+
+    for(int i = 0; i < 7; ++i)
+    {
+        WProto::Counters pkt;
+        pkt.id = i;
+        pkt.ticks = ticks[i];
+        pkt.values.setData(values, 3);
+        pkt.offset = offsets[i];
+        pkt.small = 1000*i;
+
+        REQUIRE(output.send(pkt));
+    }
+
+    EnvelopeReader input;
+    int packetCount = 0;
+
+    while(dbg.isCharAvailable())
+    {
+        if(input.take(dbg.getChar()) != EnvelopeReader::NEW_MESSAGE)
+            continue;
+
+        REQUIRE(input.msgCode() == RProto::Counters::MSG_CODE);
+
+        RProto::Counters pkt;
+        REQUIRE(input.read(&pkt));
+
+        int i = pkt.id;
+        REQUIRE(i == packetCount);
+        CHECK(pkt.ticks == ticks[i]);
+        CHECK(pkt.offset == offsets[i]);
+        CHECK(pkt.small == 1000*i);
+
+        uint8_t value;
+        int n = 0;
+        while(pkt.values.next(&value))
+            CHECK(value == ++n);
+        CHECK(n == 3);
+
+        packetCount++;
+    }
+
+    REQUIRE(packetCount == 7);
+}